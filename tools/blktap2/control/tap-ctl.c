@@ -582,6 +582,112 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_coalesce_usage(FILE *stream)
+{
+	fprintf(stream, "usage: coalesce <-p pid> <-m minor> [-r MB/s]\n");
+}
+
+static int
+tap_cli_coalesce(int argc, char **argv)
+{
+	int c, pid, minor, rate;
+
+	pid   = -1;
+	minor = -1;
+	rate  = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:r:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_coalesce_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || rate < 0)
+		goto usage;
+
+	return tap_ctl_coalesce(pid, minor, rate);
+
+usage:
+	tap_cli_coalesce_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_io_usage(FILE *stream)
+{
+	fprintf(stream, "usage: io <-p pid> [-s max merge KB] "
+		"[-d hold us -q hold depth]\n");
+}
+
+static int
+tap_cli_io(int argc, char **argv)
+{
+	int c, err, pid;
+	tapdisk_message_io_t io;
+
+	pid = -1;
+	memset(&io, 0, sizeof(io));
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:s:d:q:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 's':
+			io.max_merge = atoi(optarg);
+			io.flags    |= TAPDISK_MESSAGE_IO_SET_MERGE;
+			break;
+		case 'd':
+			io.hold_us   = atoi(optarg);
+			io.flags    |= TAPDISK_MESSAGE_IO_SET_HOLD;
+			break;
+		case 'q':
+			io.hold_depth = atoi(optarg);
+			io.flags     |= TAPDISK_MESSAGE_IO_SET_HOLD;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_io_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1)
+		goto usage;
+
+	err = tap_ctl_io(pid, &io);
+	if (err)
+		return err;
+
+	printf("max-merge=%uKB hold=%uus hold-depth=%u "
+	       "submitted=%"PRIu64" issued=%"PRIu64" merged=%"PRIu64" "
+	       "holds=%"PRIu64"\n", io.max_merge, io.hold_us, io.hold_depth,
+	       io.submitted, io.issued, io.submitted - io.issued, io.holds);
+
+	return 0;
+
+usage:
+	tap_cli_io_usage(stderr);
+	return EINVAL;
+}
+
 static void
 tap_cli_major_usage(FILE *stream)
 {
@@ -715,6 +821,8 @@ struct command commands[] = {
 	{ .name = "close",        .func = tap_cli_close         },
 	{ .name = "pause",        .func = tap_cli_pause         },
 	{ .name = "unpause",      .func = tap_cli_unpause       },
+	{ .name = "coalesce",     .func = tap_cli_coalesce      },
+	{ .name = "io",           .func = tap_cli_io            },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
 };
@@ -96,6 +96,15 @@ int tap_ctl_close(const int id, const int minor, const int force);
 int tap_ctl_pause(const int id, const int minor);
 int tap_ctl_unpause(const int id, const int minor, const char *params);
 
+int tap_ctl_connect_xenblkif(const int id, const int minor,
+			     const int domid, const int devid,
+			     const uint32_t gref, const uint32_t port,
+			     const char *proto);
+int tap_ctl_disconnect_xenblkif(const int id, const int minor);
+
+int tap_ctl_coalesce(const int id, const int minor, const int rate);
+int tap_ctl_io(const int id, tapdisk_message_io_t *io);
+
 int tap_ctl_blk_major(void);
 
 #endif
@@ -0,0 +1,973 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Persistent read cache for shared parent images.
+ *
+ * Chunks of the parent are kept in a file on local storage (typically an
+ * SSD), one file per parent, so that they survive tapdisk restarts and
+ * host reboots.  The file holds a header, a set-associative index and the
+ * data slots; the header and index are mapped shared, so every tapdisk
+ * using the same parent sees the same index.
+ *
+ * Only the tapdisk holding the exclusive flock on the file (the owner)
+ * fills slots; the others serve hits and forward misses, and periodically
+ * try to take over ownership.  A hit is only returned if its index entry
+ * is unchanged once the slot has been read.  The owner marks the header
+ * clean on close, after flushing data and index; a header left dirty by a
+ * dead owner has its index invalidated by the next one.
+ *
+ * A cache is only valid for the parent file it was filled from, as told
+ * by its path, size and mtime; parents on block devices are not cached.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tapdisk.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "md5.h"
+
+#ifdef DEBUG
+#define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
+#else
+#define DBG(_f, _a...) ((void)0)
+#endif
+
+#define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
+
+#define MIN(a, b)                       ((a) <= (b) ? (a) : (b))
+
+#define PCACHE_MAGIC                    "tdpcache"
+#define PCACHE_VERSION                  1
+
+#define PCACHE_DIR_DEFAULT              "/var/lib/xen/pcache"
+#define PCACHE_SIZE_ENV                 "TAPDISK_PCACHE_SIZE" /* MB */
+#define PCACHE_SIZE_DEFAULT             1024
+
+#define PCACHE_HEADER_SIZE              4096
+#define PCACHE_NAME_MAX                 1024
+
+#define PCACHE_CHUNK_SHIFT              16 /* 64K chunks */
+#define PCACHE_CHUNK_SIZE               (1 << PCACHE_CHUNK_SHIFT)
+#define PCACHE_CHUNK_SECS               (PCACHE_CHUNK_SIZE >> SECTOR_SHIFT)
+#define PCACHE_WAYS                     8
+
+#define PCACHE_REQUESTS                 (TAPDISK_DATA_REQUESTS << 1)
+#define PCACHE_OWNER_RETRY              30 /* seconds */
+
+#define PCACHE_ENTRY_EMPTY              0
+#define PCACHE_ENTRY_FILLING            1
+#define PCACHE_ENTRY_VALID              2
+
+typedef struct pcache                   pcache_t;
+typedef struct pcache_header            pcache_header_t;
+typedef struct pcache_entry             pcache_entry_t;
+typedef struct pcache_request           pcache_request_t;
+typedef struct pcache_stats             pcache_stats_t;
+
+struct pcache_header {
+	char                            magic[8];
+	uint32_t                        version;
+	uint32_t                        chunk_shift;
+	uint32_t                        ways;
+	uint32_t                        clean;
+	uint32_t                        owner;        /* pid */
+	uint32_t                        pad;
+	uint64_t                        slots;
+	uint64_t                        index_offset;
+	uint64_t                        data_offset;
+
+	/* identity of the cached parent */
+	uint64_t                        parent_sectors;
+	uint64_t                        parent_size;
+	uint64_t                        parent_mtime;
+	char                            parent[PCACHE_NAME_MAX];
+};
+
+struct pcache_entry {
+	uint64_t                        chunk;
+	uint32_t                        seq;          /* bumped on reuse */
+	uint32_t                        state;
+	uint32_t                        atime;
+	uint32_t                        pad;
+};
+
+struct pcache_request {
+	int                             err;
+	char                           *buf;
+	uint64_t                        secs;
+	uint32_t                        seq;
+	pcache_entry_t                 *entry;
+	td_request_t                    treq;
+	struct tiocb                    tiocb;
+	pcache_t                       *cache;
+};
+
+struct pcache_stats {
+	uint64_t                        reads;
+	uint64_t                        hits;
+	uint64_t                        misses;
+	uint64_t                        fills;
+	uint64_t                        stale;
+	uint64_t                        errors;
+};
+
+struct pcache {
+	char                           *name;
+	char                           *path;
+	int                             fd;
+	int                             owner;
+
+	uint64_t                        sectors;
+	uint64_t                        size;   /* configured, in bytes */
+
+	pcache_header_t                 ident;  /* expected identity */
+
+	void                           *map;
+	size_t                          map_size;
+	pcache_header_t                *header;
+	pcache_entry_t                 *entries;
+	uint64_t                        sets;
+
+	pcache_request_t                requests[PCACHE_REQUESTS];
+	pcache_request_t               *request_free_list[PCACHE_REQUESTS];
+	int                             requests_free;
+
+	event_id_t                      timeout_id;
+
+	pcache_stats_t                  stats;
+};
+
+static inline pcache_request_t *
+pcache_get_request(pcache_t *cache)
+{
+	if (!cache->requests_free)
+		return NULL;
+
+	return cache->request_free_list[--cache->requests_free];
+}
+
+static inline void
+pcache_put_request(pcache_t *cache, pcache_request_t *preq)
+{
+	memset(preq, 0, sizeof(pcache_request_t));
+	cache->request_free_list[cache->requests_free++] = preq;
+}
+
+static inline uint64_t
+pcache_slot(pcache_t *cache, pcache_entry_t *entry)
+{
+	return entry - cache->entries;
+}
+
+static inline off_t
+pcache_slot_offset(pcache_t *cache, pcache_entry_t *entry)
+{
+	return cache->header->data_offset +
+		(pcache_slot(cache, entry) << PCACHE_CHUNK_SHIFT);
+}
+
+static inline pcache_entry_t *
+pcache_set(pcache_t *cache, uint64_t chunk)
+{
+	uint64_t hash;
+
+	hash = chunk * 0x9e3779b97f4a7c15ULL;
+	return cache->entries + ((hash >> 32) % cache->sets) * PCACHE_WAYS;
+}
+
+static inline uint32_t
+pcache_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec;
+}
+
+static pcache_entry_t *
+pcache_lookup(pcache_t *cache, uint64_t chunk)
+{
+	int i;
+	pcache_entry_t *set;
+
+	set = pcache_set(cache, chunk);
+
+	for (i = 0; i < PCACHE_WAYS; i++)
+		if (set[i].state != PCACHE_ENTRY_EMPTY &&
+		    set[i].chunk == chunk)
+			return set + i;
+
+	return NULL;
+}
+
+/*
+ * an empty way if there is one, else the least recently used valid one.
+ * ways being filled are left alone.
+ */
+static pcache_entry_t *
+pcache_victim(pcache_t *cache, uint64_t chunk)
+{
+	int i;
+	pcache_entry_t *set, *victim;
+
+	set    = pcache_set(cache, chunk);
+	victim = NULL;
+
+	for (i = 0; i < PCACHE_WAYS; i++) {
+		if (set[i].state == PCACHE_ENTRY_EMPTY)
+			return set + i;
+
+		if (set[i].state != PCACHE_ENTRY_VALID)
+			continue;
+
+		if (!victim || (int32_t)(set[i].atime - victim->atime) < 0)
+			victim = set + i;
+	}
+
+	return victim;
+}
+
+static void
+pcache_invalidate(pcache_t *cache)
+{
+	uint64_t i;
+
+	for (i = 0; i < cache->header->slots; i++) {
+		cache->entries[i].state = PCACHE_ENTRY_EMPTY;
+		cache->entries[i].seq++;
+	}
+}
+
+static int
+pcache_identify(pcache_t *cache)
+{
+	int err;
+	struct stat st;
+	pcache_header_t *ident;
+
+	ident = &cache->ident;
+	memset(ident, 0, sizeof(*ident));
+
+	memcpy(ident->magic, PCACHE_MAGIC, sizeof(ident->magic));
+	ident->version        = PCACHE_VERSION;
+	ident->chunk_shift    = PCACHE_CHUNK_SHIFT;
+	ident->ways           = PCACHE_WAYS;
+	ident->parent_sectors = cache->sectors;
+	snprintf(ident->parent, sizeof(ident->parent), "%s", cache->name);
+
+	err = stat(cache->name, &st);
+	if (err)
+		return -errno;
+
+	/*
+	 * size and mtime are all that tells a rewritten parent from the one
+	 * cached, and block devices have neither: don't cache those.
+	 */
+	if (!S_ISREG(st.st_mode)) {
+		DPRINTF("%s: not a regular file, not cached\n", cache->name);
+		return -EOPNOTSUPP;
+	}
+
+	ident->parent_size  = st.st_size;
+	ident->parent_mtime = st.st_mtime;
+
+	return 0;
+}
+
+static int
+pcache_header_valid(pcache_t *cache, pcache_header_t *hdr)
+{
+	pcache_header_t *ident = &cache->ident;
+
+	if (memcmp(hdr->magic, ident->magic, sizeof(hdr->magic)) ||
+	    hdr->version != ident->version ||
+	    hdr->chunk_shift != ident->chunk_shift ||
+	    hdr->ways != ident->ways)
+		return 0;
+
+	if (hdr->parent_sectors != ident->parent_sectors ||
+	    hdr->parent_size != ident->parent_size ||
+	    hdr->parent_mtime != ident->parent_mtime ||
+	    strncmp(hdr->parent, ident->parent, sizeof(hdr->parent)))
+		return 0;
+
+	if (!hdr->slots || hdr->slots % hdr->ways ||
+	    hdr->index_offset != PCACHE_HEADER_SIZE ||
+	    hdr->data_offset < hdr->index_offset +
+	    hdr->slots * sizeof(pcache_entry_t))
+		return 0;
+
+	return 1;
+}
+
+static int
+pcache_read_header(pcache_t *cache, pcache_header_t *hdr)
+{
+	int err;
+	void *buf;
+	ssize_t ret;
+
+	err = posix_memalign(&buf, PCACHE_HEADER_SIZE, PCACHE_HEADER_SIZE);
+	if (err)
+		return -err;
+
+	ret = pread(cache->fd, buf, PCACHE_HEADER_SIZE, 0);
+	if (ret == PCACHE_HEADER_SIZE)
+		memcpy(hdr, buf, sizeof(*hdr));
+	else
+		err = (ret < 0 ? -errno : -EIO);
+
+	free(buf);
+	return err;
+}
+
+static int
+pcache_map(pcache_t *cache, pcache_header_t *hdr)
+{
+	void *map;
+	size_t size;
+
+	size = hdr->data_offset;
+	map  = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, cache->fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	cache->map      = map;
+	cache->map_size = size;
+	cache->header   = map;
+	cache->entries  = map + hdr->index_offset;
+	cache->sets     = hdr->slots / hdr->ways;
+
+	return 0;
+}
+
+static void
+pcache_unmap(pcache_t *cache)
+{
+	if (!cache->map)
+		return;
+
+	munmap(cache->map, cache->map_size);
+	cache->map     = NULL;
+	cache->header  = NULL;
+	cache->entries = NULL;
+	cache->sets    = 0;
+}
+
+static int
+pcache_format(pcache_t *cache)
+{
+	int err;
+	uint64_t slots;
+	pcache_header_t hdr;
+
+	slots = cache->size >> PCACHE_CHUNK_SHIFT;
+	slots = slots - slots % PCACHE_WAYS;
+
+	hdr              = cache->ident;
+	hdr.slots        = slots;
+	hdr.index_offset = PCACHE_HEADER_SIZE;
+	hdr.data_offset  = hdr.index_offset + slots * sizeof(pcache_entry_t);
+	hdr.data_offset  = (hdr.data_offset + PCACHE_CHUNK_SIZE - 1) &
+		~((uint64_t)PCACHE_CHUNK_SIZE - 1);
+
+	DPRINTF("formatting %s: %"PRIu64" slots\n", cache->path, slots);
+
+	err = ftruncate(cache->fd, 0);
+	if (!err)
+		err = ftruncate(cache->fd, hdr.data_offset +
+				(slots << PCACHE_CHUNK_SHIFT));
+	if (err)
+		return -errno;
+
+	err = pcache_map(cache, &hdr);
+	if (err)
+		return err;
+
+	memset(cache->map, 0, cache->map_size);
+	*cache->header = hdr;
+
+	return 0;
+}
+
+/*
+ * called with the lock held.  an existing index for the same parent is
+ * kept, whatever its size, unless its last owner did not close it.
+ */
+static int
+pcache_claim(pcache_t *cache)
+{
+	int err;
+	pcache_header_t hdr;
+
+	err = pcache_read_header(cache, &hdr);
+	if (err || !pcache_header_valid(cache, &hdr)) {
+		err = pcache_format(cache);
+		if (err)
+			return err;
+	} else {
+		err = pcache_map(cache, &hdr);
+		if (err)
+			return err;
+
+		if (!hdr.clean) {
+			DPRINTF("%s: not closed cleanly, invalidating\n",
+				cache->path);
+			pcache_invalidate(cache);
+		}
+	}
+
+	cache->header->clean = 0;
+	cache->header->owner = getpid();
+
+	err = msync(cache->map, cache->map_size, MS_SYNC);
+	if (err) {
+		err = -errno;
+		pcache_unmap(cache);
+		return err;
+	}
+
+	cache->owner = 1;
+	return 0;
+}
+
+/*
+ * an index is only trusted without the lock if its owner is alive (or it
+ * was closed cleanly): one left by a dead owner is about to be invalidated.
+ */
+static int
+pcache_attach(pcache_t *cache)
+{
+	int err;
+	pcache_header_t hdr;
+
+	err = pcache_read_header(cache, &hdr);
+	if (err)
+		return err;
+
+	if (!pcache_header_valid(cache, &hdr))
+		return -EINVAL;
+
+	if (!hdr.clean && (!hdr.owner || kill(hdr.owner, 0)))
+		return -ESTALE;
+
+	return pcache_map(cache, &hdr);
+}
+
+static int
+pcache_lock(pcache_t *cache)
+{
+	if (flock(cache->fd, LOCK_EX | LOCK_NB))
+		return -errno;
+
+	return 0;
+}
+
+static void
+pcache_owner_event(event_id_t id, char mode, void *private)
+{
+	int err;
+	pcache_t *cache;
+
+	cache = (pcache_t *)private;
+
+	if (cache->owner)
+		return;
+
+	/* don't pull the index from under reads in flight */
+	if (cache->requests_free != PCACHE_REQUESTS)
+		return;
+
+	if (pcache_lock(cache)) {
+		if (!cache->map)
+			pcache_attach(cache);
+		return;
+	}
+
+	pcache_unmap(cache);
+
+	err = pcache_claim(cache);
+	if (err) {
+		EPRINTF("%s: failed to claim cache: %d\n", cache->path, err);
+		flock(cache->fd, LOCK_UN);
+		return;
+	}
+
+	DPRINTF("%s: now owned by %d\n", cache->path, getpid());
+}
+
+static uint64_t
+pcache_configured_size(void)
+{
+	char *env, *end;
+	unsigned long mb;
+
+	mb  = PCACHE_SIZE_DEFAULT;
+	env = getenv(PCACHE_SIZE_ENV);
+	if (env) {
+		mb = strtoul(env, &end, 10);
+		if (*end || !mb)
+			mb = PCACHE_SIZE_DEFAULT;
+	}
+
+	return (uint64_t)mb << 20;
+}
+
+static int
+pcache_path(pcache_t *cache)
+{
+	int i, err;
+	const char *dir;
+	uint8_t mac[16];
+	char hex[sizeof(mac) * 2 + 1];
+
+	dir = getenv(TAPDISK_PCACHE_DIR_ENV);
+	if (!dir || !*dir)
+		dir = PCACHE_DIR_DEFAULT;
+
+	if (mkdir(dir, 0700) && errno != EEXIST)
+		return -errno;
+
+	md5_sum((uint8_t *)cache->name, strlen(cache->name), mac);
+	for (i = 0; i < sizeof(mac); i++)
+		sprintf(hex + (i << 1), "%02x", mac[i]);
+
+	err = asprintf(&cache->path, "%s/%s.pcache", dir, hex);
+	if (err == -1) {
+		cache->path = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int
+pcache_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	int i, err;
+	pcache_t *cache;
+
+	if (!td_flag_test(flags, TD_OPEN_RDONLY))
+		return -EINVAL;
+
+	if (driver->info.sector_size != (1 << SECTOR_SHIFT))
+		return -EINVAL;
+
+	cache = (pcache_t *)driver->data;
+	cache->fd = -1;
+	cache->timeout_id = -1;
+
+	err = tapdisk_namedup(&cache->name, (char *)name);
+	if (err)
+		return -ENOMEM;
+
+	cache->sectors = driver->info.size;
+	cache->size    = pcache_configured_size();
+
+	err = pcache_identify(cache);
+	if (err)
+		goto fail;
+
+	err = pcache_path(cache);
+	if (err)
+		goto fail;
+
+	cache->fd = open(cache->path, O_RDWR | O_CREAT | O_DIRECT, 0600);
+	if (cache->fd == -1 && errno == EINVAL)
+		cache->fd = open(cache->path, O_RDWR | O_CREAT, 0600);
+	if (cache->fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	cache->requests_free = PCACHE_REQUESTS;
+	for (i = 0; i < PCACHE_REQUESTS; i++)
+		cache->request_free_list[i] = cache->requests + i;
+
+	if (!pcache_lock(cache)) {
+		err = pcache_claim(cache);
+		if (err)
+			goto fail;
+	} else {
+		err = pcache_attach(cache);
+		if (err)
+			DPRINTF("%s: not using cache until owned: %d\n",
+				cache->path, err);
+
+		cache->timeout_id =
+			tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						      -1, /* dummy fd */
+						      PCACHE_OWNER_RETRY,
+						      pcache_owner_event,
+						      cache);
+		if (cache->timeout_id < 0) {
+			err = cache->timeout_id;
+			goto fail;
+		}
+	}
+
+	DPRINTF("opening persistent cache %s for %s, owner: %d, "
+		"slots: %"PRIu64"\n", cache->path, cache->name, cache->owner,
+		cache->header ? cache->header->slots : 0);
+
+	return 0;
+
+fail:
+	pcache_unmap(cache);
+	if (cache->fd != -1)
+		close(cache->fd);
+	free(cache->path);
+	free(cache->name);
+	return err;
+}
+
+static int
+pcache_close(td_driver_t *driver)
+{
+	pcache_t *cache;
+
+	cache = (pcache_t *)driver->data;
+
+	DPRINTF("closing persistent cache %s for %s\n",
+		cache->path, cache->name);
+
+	if (cache->timeout_id >= 0)
+		tapdisk_server_unregister_event(cache->timeout_id);
+
+	if (cache->owner) {
+		/* data and index must be stable before the header says so */
+		if (!fdatasync(cache->fd) &&
+		    !msync(cache->map, cache->map_size, MS_SYNC)) {
+			cache->header->clean = 1;
+			cache->header->owner = 0;
+			msync(cache->map, cache->map_size, MS_SYNC);
+		}
+		flock(cache->fd, LOCK_UN);
+	}
+
+	pcache_unmap(cache);
+	close(cache->fd);
+	free(cache->path);
+	free(cache->name);
+
+	return 0;
+}
+
+static void
+pcache_fill_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	pcache_t *cache;
+	pcache_request_t *preq;
+
+	preq  = (pcache_request_t *)arg;
+	cache = preq->cache;
+
+	__sync_synchronize();
+
+	if (err) {
+		cache->stats.errors++;
+		preq->entry->state = PCACHE_ENTRY_EMPTY;
+	} else {
+		cache->stats.fills++;
+		preq->entry->state = PCACHE_ENTRY_VALID;
+	}
+
+	free(preq->buf);
+	pcache_put_request(cache, preq);
+}
+
+static void
+pcache_fill(td_request_t clone, int err)
+{
+	int off;
+	size_t size;
+	pcache_t *cache;
+	td_driver_t *driver;
+	pcache_request_t *preq;
+
+	preq       = (pcache_request_t *)clone.cb_data;
+	cache      = preq->cache;
+	preq->secs -= clone.secs;
+	preq->err   = (preq->err ? preq->err : err);
+
+	if (preq->secs)
+		return;
+
+	if (!preq->err) {
+		off = (preq->treq.sec & (PCACHE_CHUNK_SECS - 1)) << SECTOR_SHIFT;
+		memcpy(preq->treq.buf, preq->buf + off,
+		       preq->treq.secs << SECTOR_SHIFT);
+	}
+
+	td_complete_request(preq->treq, preq->err);
+
+	if (preq->err) {
+		preq->entry->state = PCACHE_ENTRY_EMPTY;
+		goto out;
+	}
+
+	driver = preq->treq.image->driver;
+	size   = MIN(cache->sectors - (preq->entry->chunk * PCACHE_CHUNK_SECS),
+		     PCACHE_CHUNK_SECS) << SECTOR_SHIFT;
+
+	td_prep_write(&preq->tiocb, cache->fd, preq->buf, size,
+		      pcache_slot_offset(cache, preq->entry),
+		      pcache_fill_complete, preq);
+	td_queue_tiocb(driver, &preq->tiocb);
+	return;
+
+out:
+	free(preq->buf);
+	pcache_put_request(cache, preq);
+}
+
+/*
+ * read the whole chunk from the parent, complete @treq from it and then
+ * write it to the slot it was given.
+ */
+static void
+pcache_miss(pcache_t *cache, td_request_t treq)
+{
+	char *buf;
+	uint64_t chunk;
+	td_request_t clone;
+	pcache_entry_t *entry;
+	pcache_request_t *preq;
+
+	clone = treq;
+	chunk = treq.sec >> (PCACHE_CHUNK_SHIFT - SECTOR_SHIFT);
+
+	cache->stats.misses += treq.secs;
+
+	if (!cache->owner || !cache->map)
+		goto out;
+
+	if (pcache_lookup(cache, chunk))
+		goto out; /* already being filled */
+
+	entry = pcache_victim(cache, chunk);
+	if (!entry)
+		goto out;
+
+	preq = pcache_get_request(cache);
+	if (!preq)
+		goto out;
+
+	if (posix_memalign((void **)&buf, PCACHE_CHUNK_SIZE,
+			   PCACHE_CHUNK_SIZE)) {
+		pcache_put_request(cache, preq);
+		goto out;
+	}
+
+	entry->state = PCACHE_ENTRY_FILLING;
+	__sync_synchronize();
+	entry->seq++;
+	entry->chunk = chunk;
+	entry->atime = pcache_now();
+
+	preq->treq   = treq;
+	preq->err    = 0;
+	preq->buf    = buf;
+	preq->entry  = entry;
+	preq->cache  = cache;
+
+	clone.sec     = chunk * PCACHE_CHUNK_SECS;
+	clone.secs    = MIN(cache->sectors - clone.sec, PCACHE_CHUNK_SECS);
+	clone.buf     = buf;
+	clone.cb      = pcache_fill;
+	clone.cb_data = preq;
+	preq->secs    = clone.secs;
+
+	DBG("%s: filling chunk 0x%"PRIx64" into slot %"PRIu64"\n",
+	    cache->name, chunk, pcache_slot(cache, entry));
+
+out:
+	td_forward_request(clone);
+}
+
+static void
+pcache_hit_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	pcache_t *cache;
+	td_request_t treq;
+	pcache_entry_t *entry;
+	pcache_request_t *preq;
+
+	preq  = (pcache_request_t *)arg;
+	cache = preq->cache;
+	entry = preq->entry;
+	treq  = preq->treq;
+
+	__sync_synchronize();
+
+	/* the slot may have been reassigned while we read it */
+	if (!err &&
+	    entry->state == PCACHE_ENTRY_VALID &&
+	    entry->seq == preq->seq &&
+	    entry->chunk == treq.sec >> (PCACHE_CHUNK_SHIFT - SECTOR_SHIFT)) {
+		cache->stats.hits += treq.secs;
+		td_complete_request(treq, 0);
+	} else {
+		if (err)
+			cache->stats.errors++;
+		else
+			cache->stats.stale++;
+		td_forward_request(treq);
+	}
+
+	pcache_put_request(cache, preq);
+}
+
+static void
+pcache_hit(pcache_t *cache, pcache_entry_t *entry, td_request_t treq)
+{
+	off_t off;
+	pcache_request_t *preq;
+
+	preq = pcache_get_request(cache);
+	if (!preq)
+		return td_forward_request(treq);
+
+	preq->seq   = entry->seq;
+	__sync_synchronize();
+	preq->treq  = treq;
+	preq->entry = entry;
+	preq->cache = cache;
+
+	entry->atime = pcache_now();
+
+	off = pcache_slot_offset(cache, entry) +
+		((treq.sec & (PCACHE_CHUNK_SECS - 1)) << SECTOR_SHIFT);
+
+	td_prep_read(&preq->tiocb, cache->fd, treq.buf,
+		     treq.secs << SECTOR_SHIFT, off,
+		     pcache_hit_complete, preq);
+	td_queue_tiocb(treq.image->driver, &preq->tiocb);
+}
+
+static void
+pcache_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	int secs;
+	pcache_t *cache;
+	td_request_t clone;
+	pcache_entry_t *entry;
+
+	cache = (pcache_t *)driver->data;
+
+	cache->stats.reads += treq.secs;
+
+	if (!cache->map)
+		return td_forward_request(treq);
+
+	/* one request per chunk touched */
+	while (treq.secs) {
+		clone      = treq;
+		secs       = PCACHE_CHUNK_SECS -
+			(treq.sec & (PCACHE_CHUNK_SECS - 1));
+		clone.secs = MIN(secs, treq.secs);
+
+		entry = pcache_lookup(cache, clone.sec >>
+				      (PCACHE_CHUNK_SHIFT - SECTOR_SHIFT));
+		if (entry && entry->state == PCACHE_ENTRY_VALID)
+			pcache_hit(cache, entry, clone);
+		else
+			pcache_miss(cache, clone);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += clone.secs << SECTOR_SHIFT;
+	}
+}
+
+static void
+pcache_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_complete_request(treq, -EPERM);
+}
+
+static int
+pcache_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return -EINVAL;
+}
+
+static int
+pcache_validate_parent(td_driver_t *driver,
+		       td_driver_t *pdriver, td_flag_t flags)
+{
+	if (!td_flag_test(pdriver->state, TD_DRIVER_RDONLY))
+		return -EINVAL;
+
+	if (strcmp(driver->name, pdriver->name))
+		return -EINVAL;
+
+	return 0;
+}
+
+static void
+pcache_debug(td_driver_t *driver)
+{
+	pcache_t *cache;
+	pcache_stats_t *stats;
+
+	cache = (pcache_t *)driver->data;
+	stats = &cache->stats;
+
+	WARN("PERSISTENT CACHE %s (%s, %s)\n", cache->name, cache->path,
+	     cache->owner ? "owner" : (cache->map ? "reader" : "unused"));
+	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", "
+	     "fills: %"PRIu64", stale: %"PRIu64", errors: %"PRIu64"\n",
+	     stats->reads, stats->hits, stats->misses,
+	     stats->fills, stats->stale, stats->errors);
+}
+
+struct tap_disk tapdisk_pcache = {
+	.disk_type                  = "tapdisk_pcache",
+	.flags                      = 0,
+	.private_data_size          = sizeof(pcache_t),
+	.td_open                    = pcache_open,
+	.td_close                   = pcache_close,
+	.td_queue_read              = pcache_queue_read,
+	.td_queue_write             = pcache_queue_write,
+	.td_get_parent_id           = pcache_get_parent_id,
+	.td_validate_parent         = pcache_validate_parent,
+	.td_debug                   = pcache_debug,
+};
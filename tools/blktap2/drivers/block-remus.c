@@ -12,6 +12,12 @@
  *  4. At failover, the backup waits for the in-flight ramdisk (if any) to
  *     drain before letting the domain be activated.
  *
+ * The primary streams writes to the backup asynchronously from a send
+ * buffer, so replication overlaps with the next epoch. On the backup each
+ * ramdisk is a single arena with a sorted extent map; rewrites update it
+ * in place, adjacent extents are joined once the epoch is committed, and
+ * flushes go out as large sequential writes in commit order.
+ *
  * The driver determines whether it is the client or server by attempting
  * to bind to the replication address. If the address is not local,
  * the driver acts as client.
@@ -37,9 +43,6 @@
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
-#include "hashtable.h"
-#include "hashtable_itr.h"
-#include "hashtable_utility.h"
 
 #include <errno.h>
 #include <inttypes.h>
@@ -60,7 +63,19 @@
 
 /* timeout for reads and writes in ms */
 #define HEARTBEAT_MS 1000
-#define RAMDISK_HASHSIZE 128
+
+/* backup checkpoint buffer: initial arena, largest arena kept for reuse,
+ * arena alignment, largest single flush write and flush writes queued
+ * on the base driver at once */
+#define RAMDISK_ARENA_MIN    (1 << 20)
+#define RAMDISK_ARENA_KEEP   (64 << 20)
+#define RAMDISK_ARENA_ALIGN  4096
+#define RAMDISK_FLUSH_MAX    (1 << 20)
+#define RAMDISK_MAX_INFLIGHT 8
+
+/* primary replication send buffer, initial and most before blocking */
+#define REMUS_SENDBUF_MIN    (256 << 10)
+#define REMUS_SENDBUF_MAX    (16 << 20)
 
 /* connect retry timeout (seconds) */
 #define REMUS_CONNRETRY_TIMEOUT 10
@@ -99,28 +114,53 @@ td_vbd_t *device_vbd = NULL;
 td_image_t *remus_image = NULL;
 struct tap_disk tapdisk_remus;
 
+/* A checkpoint's writes are kept in one contiguous arena. Extents map
+ * sector runs to arena offsets, are sorted by sector and never overlap,
+ * though they may touch: a write overwrites the extents it overlaps in
+ * place and fills the gaps between them with new extents, growing the
+ * newest one in place where it can. Touching extents are joined when the
+ * epoch starts flushing (ramdisk_epoch_join), so runs still go out as a
+ * few large sequential writes.
+ */
+struct ramdisk_extent {
+	uint64_t sector;
+	uint32_t secs;
+	size_t   offset;	/* in bytes, into arena */
+};
+
+struct ramdisk_epoch {
+	char*                  arena;
+	size_t                 arena_size;
+	size_t                 arena_used;
+	struct ramdisk_extent* extents;
+	int                    nr_extents;
+	int                    max_extents;
+	/* flush progress: next extent to issue and sectors of it issued */
+	int                    next;
+	uint32_t               done;
+};
+
 struct ramdisk {
 	size_t sector_size;
-	struct hashtable* h;
-	/* when a ramdisk is flushed, h is given a new empty hash for writes
-	 * while the old ramdisk (prev) is drained asynchronously.
-	 */
-	struct hashtable* prev;
+	/* the epoch receiving writes for the open checkpoint */
+	struct ramdisk_epoch* cur;
+	/* a committed epoch waiting for the flushing one to drain. A
+	 * checkpoint committed while one is already pending is merged into
+	 * it; if you want the pending one to be consistent on disk, wait for
+	 * it to complete. */
+	struct ramdisk_epoch* pending;
+	/* the epoch being written to the base driver. Its extents are
+	 * disjoint, and pending is only started once every write of it has
+	 * completed, so no two overlapping writes are ever queued on the disk
+	 * at once (the disk may not order them). */
+	struct ramdisk_epoch* flushing;
+	/* a drained epoch kept for reuse, arena and all */
+	struct ramdisk_epoch* spare;
 	/* count of outstanding requests to the base driver */
 	size_t inflight;
-	/* prev holds the requests to be flushed, while inprogress holds
-	 * requests being flushed. When requests complete, they are removed
-	 * from inprogress.
-	 * Whenever a new flush is merged with ongoing flush (i.e, prev),
-	 * we have to make sure that none of the new requests overlap with
-	 * ones in "inprogress". If it does, keep it back in prev and dont issue
-	 * IO until the current one finishes. If we allow this IO to proceed,
-	 * we might end up with two "overlapping" requests in the disk's queue and
-	 * the disk may not offer any guarantee on which one is written first.
-	 * IOW, make sure we dont create a write-after-write time ordering constraint.
-	 * 
-	 */
-	struct hashtable* inprogress;
+	/* set while ramdisk_flush() issues requests, so completions
+	 * delivered from within td_forward_request() don't recurse */
+	int issuing;
 };
 
 /* the ramdisk intercepts the original callback for reads and writes.
@@ -150,6 +190,15 @@ typedef struct poll_fd {
 	event_id_t id;
 } poll_fd_t;
 
+/* replication stream output not yet taken by the socket */
+struct remus_sendbuf {
+	char*      buf;
+	size_t     size;
+	size_t     head;
+	size_t     tail;
+	event_id_t id;		/* write event, while armed */
+};
+
 struct tdremus_state {
 //  struct tap_disk* driver;
 	void* driver_data;
@@ -172,6 +221,9 @@ struct tdremus_state {
 	/* queue write requests, batch-replicate at submit */
 	struct req_ring write_ring;
 
+	/* primary: pending output on stream_fd */
+	struct remus_sendbuf send;
+
 	/* ramdisk data*/
 	struct ramdisk ramdisk;
 
@@ -239,8 +291,6 @@ replicated_write_callback(td_request_t treq, int err)
 {
 	struct tdremus_state *s = (struct tdremus_state *) treq.cb_data;
 	td_vbd_request_t *vreq;
-	int i;
-	uint64_t start;
 	vreq = (td_vbd_request_t *) treq.private;
 
 	/* the write failed for now, lets panic. this is very bad */
@@ -250,21 +300,15 @@ replicated_write_callback(td_request_t treq, int err)
 	}
 
 	/* The write succeeded. let's pull the vreq off whatever request list
-	 * it is on and free() it */
+	 * it is on and free() it. The buffer belongs to the epoch arena. */
 	list_del(&vreq->next);
 	free(vreq);
 
 	s->ramdisk.inflight--;
-	start = treq.sec;
-	for (i = 0; i < treq.secs; i++) {
-		hashtable_remove(s->ramdisk.inprogress, &start);
-		start++;
-	}
-	free(treq.buf);
 
-	if (!s->ramdisk.inflight && !s->ramdisk.prev) {
-		/* TODO: the ramdisk has been flushed */
-	}
+	/* queue the rest of the epoch, or start on the pending one */
+	if (!s->ramdisk.issuing)
+		ramdisk_flush(s->tdremus_driver, s);
 }
 
 static inline int
@@ -303,313 +347,396 @@ create_write_request(struct tdremus_state *state, td_sector_t sec, int secs, cha
 }
 
 
-/* http://www.concentric.net/~Ttwang/tech/inthash.htm */
-static unsigned int uint64_hash(void* k)
+static struct ramdisk_epoch* ramdisk_get_epoch(struct ramdisk* ramdisk)
 {
-	uint64_t key = *(uint64_t*)k;
+	struct ramdisk_epoch* e;
+
+	if ((e = ramdisk->spare)) {
+		ramdisk->spare = NULL;
+		return e;
+	}
 
-	key = (~key) + (key << 18);
-	key = key ^ (key >> 31);
-	key = key * 21;
-	key = key ^ (key >> 11);
-	key = key + (key << 6);
-	key = key ^ (key >> 22);
+	if (!(e = calloc(1, sizeof(*e))))
+		DPRINTF("ramdisk_get_epoch: allocation failed\n");
 
-	return (unsigned int)key;
+	return e;
 }
 
-static int rd_hash_equal(void* k1, void* k2)
+static void ramdisk_free_epoch(struct ramdisk_epoch* e)
 {
-	uint64_t key1, key2;
-
-	key1 = *(uint64_t*)k1;
-	key2 = *(uint64_t*)k2;
+	if (!e)
+		return;
 
-	return key1 == key2;
+	free(e->arena);
+	free(e->extents);
+	free(e);
 }
 
-static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
-			int nb_sectors, char* buf)
+/* recycle a drained epoch, dropping an arena grown by an unusually large
+ * checkpoint rather than keeping it around */
+static void ramdisk_put_epoch(struct ramdisk* ramdisk, struct ramdisk_epoch* e)
 {
-	int i;
-	char* v;
-	uint64_t key;
+	e->arena_used = 0;
+	e->nr_extents = 0;
+	e->next       = 0;
+	e->done       = 0;
 
-	for (i = 0; i < nb_sectors; i++) {
-		key = sector + i;
-		/* check whether it is queued in a previous flush request */
-		if (!(ramdisk->prev && (v = hashtable_search(ramdisk->prev, &key)))) {
-			/* check whether it is an ongoing flush */
-			if (!(ramdisk->inprogress && (v = hashtable_search(ramdisk->inprogress, &key))))
-				return -1;
-		}
-		memcpy(buf + i * ramdisk->sector_size, v, ramdisk->sector_size);
+	if (e->arena_size > RAMDISK_ARENA_KEEP) {
+		free(e->arena);
+		e->arena      = NULL;
+		e->arena_size = 0;
 	}
 
-	return 0;
+	if (ramdisk->spare)
+		ramdisk_free_epoch(e);
+	else
+		ramdisk->spare = e;
 }
 
-static int ramdisk_write_hash(struct hashtable* h, uint64_t sector, char* buf,
-			      size_t len)
+/* reserve len bytes at the end of the arena, returning their offset */
+static ssize_t ramdisk_arena_alloc(struct ramdisk_epoch* e, size_t len)
 {
-	char* v;
-	uint64_t* key;
-
-	if ((v = hashtable_search(h, &sector))) {
-		memcpy(v, buf, len);
-		return 0;
+	size_t size;
+	void* arena;
+	ssize_t offset;
+
+	if (e->arena_used + len > e->arena_size) {
+		size = e->arena_size ? e->arena_size : RAMDISK_ARENA_MIN;
+		while (size < e->arena_used + len)
+			size *= 2;
+
+		/* sector aligned, so extents can go straight to O_DIRECT I/O */
+		if (posix_memalign(&arena, RAMDISK_ARENA_ALIGN, size)) {
+			DPRINTF("ramdisk_arena_alloc: %zu byte arena failed\n",
+				size);
+			return -1;
+		}
+		if (e->arena) {
+			memcpy(arena, e->arena, e->arena_used);
+			free(e->arena);
+		}
+		e->arena      = arena;
+		e->arena_size = size;
 	}
 
-	if (!(v = malloc(len))) {
-		DPRINTF("ramdisk_write_hash: malloc failed\n");
-		return -1;
-	}
-	memcpy(v, buf, len);
-	if (!(key = malloc(sizeof(*key)))) {
-		DPRINTF("ramdisk_write_hash: error allocating key\n");
-		free(v);
-		return -1;
-	}
-	*key = sector;
-	if (!hashtable_insert(h, key, v)) {
-		DPRINTF("ramdisk_write_hash failed on sector %" PRIu64 "\n", sector);
-		free(key);
-		free(v);
-		return -1;
-	}
+	offset         = e->arena_used;
+	e->arena_used += len;
 
-	return 0;
+	return offset;
 }
 
-static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
-				int nb_sectors, char* buf)
+static inline uint64_t extent_end(struct ramdisk_extent* x)
 {
-	int i, rc;
+	return x->sector + x->secs;
+}
 
-	for (i = 0; i < nb_sectors; i++) {
-		rc = ramdisk_write_hash(ramdisk->h, sector + i,
-					buf + i * ramdisk->sector_size,
-					ramdisk->sector_size);
-		if (rc)
-			return rc;
+/* index of the first extent ending after sector */
+static int ramdisk_epoch_find(struct ramdisk_epoch* e, uint64_t sector)
+{
+	int lo = 0, hi = e->nr_extents, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (extent_end(&e->extents[mid]) <= sector)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	return 0;
+	return lo;
 }
 
-static int uint64_compare(const void* k1, const void* k2)
+static char* ramdisk_epoch_lookup(struct ramdisk* ramdisk,
+				  struct ramdisk_epoch* e, uint64_t sector)
 {
-	uint64_t u1 = *(uint64_t*)k1;
-	uint64_t u2 = *(uint64_t*)k2;
+	struct ramdisk_extent* x;
+	int i;
+
+	if (!e)
+		return NULL;
 
-	/* u1 - u2 is unsigned */
-	return u1 < u2 ? -1 : u1 > u2 ? 1 : 0;
+	i = ramdisk_epoch_find(e, sector);
+	if (i == e->nr_extents)
+		return NULL;
+
+	x = &e->extents[i];
+	if (sector < x->sector || sector >= extent_end(x))
+		return NULL;
+
+	return e->arena + x->offset +
+		(sector - x->sector) * ramdisk->sector_size;
 }
 
-/* set psectors to an array of the sector numbers in the hash, returning
- * the number of entries (or -1 on error) */
-static int ramdisk_get_sectors(struct hashtable* h, uint64_t** psectors)
+/* add an extent for [sector, sector + secs) at index i, holding buf */
+static int ramdisk_epoch_insert(struct ramdisk* ramdisk,
+				struct ramdisk_epoch* e, int i, uint64_t sector,
+				uint32_t secs, const char* buf)
 {
-	struct hashtable_itr* itr;
-	uint64_t* sectors;
-	int count;
-
-	if (!(count = hashtable_count(h)))
-		return 0;
+	size_t ss = ramdisk->sector_size;
+	struct ramdisk_extent* x;
+	ssize_t offset;
+
+	if (e->nr_extents == e->max_extents) {
+		int max = e->max_extents ? e->max_extents * 2 : 64;
+		x = realloc(e->extents, max * sizeof(*x));
+		if (!x) {
+			DPRINTF("ramdisk_epoch_insert: error growing "
+				"extent map\n");
+			return -1;
+		}
+		e->extents     = x;
+		e->max_extents = max;
+	}
 
-	if (!(*psectors = malloc(count * sizeof(uint64_t)))) {
-		DPRINTF("ramdisk_get_sectors: error allocating sector map\n");
+	if ((offset = ramdisk_arena_alloc(e, secs * ss)) < 0)
 		return -1;
-	}
-	sectors = *psectors;
+	memcpy(e->arena + offset, buf, secs * ss);
 
-	itr = hashtable_iterator(h);
-	count = 0;
-	do {
-		sectors[count++] = *(uint64_t*)hashtable_iterator_key(itr);
-	} while (hashtable_iterator_advance(itr));
-	free(itr);
+	x = &e->extents[i];
+	memmove(x + 1, x, (e->nr_extents - i) * sizeof(*x));
+	x->sector = sector;
+	x->secs   = secs;
+	x->offset = offset;
+	e->nr_extents++;
 
-	return count;
+	return 0;
 }
 
-/*
-  return -1 for OOM
-  return -2 for merge lookup failure
-  return -3 for WAW race
-  return 0 on success.
-*/
-static int merge_requests(struct ramdisk* ramdisk, uint64_t start,
-			size_t count, char **mergedbuf)
+/* Only the sectors written are copied: parts of existing extents are
+ * overwritten where they lie, and the gaps get new arena space. */
+static int ramdisk_epoch_write(struct ramdisk* ramdisk,
+			       struct ramdisk_epoch* e, uint64_t sector,
+			       uint32_t nb_sectors, const char* buf)
 {
-	char* buf;
-	char* sector;
+	size_t ss = ramdisk->sector_size;
+	uint64_t end = sector + nb_sectors, pos, next;
+	struct ramdisk_extent* x;
+	const char* src;
+	uint32_t n;
 	int i;
-	uint64_t *key;
-	int rc = 0;
 
-	if (!(buf = valloc(count * ramdisk->sector_size))) {
-		DPRINTF("merge_request: allocation failed\n");
-		return -1;
-	}
+	i = ramdisk_epoch_find(e, sector);
 
-	for (i = 0; i < count; i++) {
-		if (!(sector = hashtable_search(ramdisk->prev, &start))) {
-			DPRINTF("merge_request: lookup failed on %"PRIu64"\n", start);
-			free(buf);
-			rc = -2;
-			goto fail;
+	for (pos = sector; pos < end; pos += n) {
+		src = buf + (pos - sector) * ss;
+		x   = i < e->nr_extents ? &e->extents[i] : NULL;
+
+		/* a rewrite of data already in this epoch */
+		if (x && x->sector <= pos) {
+			n = MIN(end, extent_end(x)) - pos;
+			memcpy(e->arena + x->offset + (pos - x->sector) * ss,
+			       src, n * ss);
+			i++;
+			continue;
 		}
 
-		/* Check inprogress requests to avoid waw non-determinism */
-		if (hashtable_search(ramdisk->inprogress, &start)) {
-			DPRINTF("merge_request: WAR RACE on %"PRIu64"\n", start);
-			free(buf);
-			rc = -3;
-			goto fail;
+		next = x ? MIN(end, x->sector) : end;
+		n    = next - pos;
+
+		/* a sequential write growing the newest extent in place */
+		x = i ? &e->extents[i - 1] : NULL;
+		if (x && extent_end(x) == pos &&
+		    x->offset + x->secs * ss == e->arena_used) {
+			if (ramdisk_arena_alloc(e, n * ss) < 0)
+				return -1;
+			memcpy(e->arena + x->offset + x->secs * ss, src,
+			       n * ss);
+			x->secs += n;
+			continue;
 		}
-		/* Insert req into inprogress (brief period of duplication of hash entries until
-		 * they are removed from prev. Read tracking would not be reading wrong entries)
-		 */
-		if (!(key = malloc(sizeof(*key)))) {
-			DPRINTF("%s: error allocating key\n", __FUNCTION__);
-			free(buf);			
-			rc = -1;
-			goto fail;
+
+		if (ramdisk_epoch_insert(ramdisk, e, i, pos, n, src))
+			return -1;
+		i++;
+	}
+
+	return 0;
+}
+
+/* Join touching extents, so that each run is flushed with as few writes
+ * as possible. Runs not already laid out in order in the arena are first
+ * copied, all at once, to a new arena in sector order. If that fails the
+ * epoch is simply flushed with more, smaller writes. */
+static void ramdisk_epoch_join(struct ramdisk* ramdisk,
+			       struct ramdisk_epoch* e)
+{
+	size_t ss = ramdisk->sector_size, size;
+	struct ramdisk_extent *x, *y;
+	void* arena;
+	int i, j, copy;
+
+	copy = 0;
+	size = 0;
+	for (i = 0; i < e->nr_extents; i++) {
+		y     = &e->extents[i];
+		size += y->secs * ss;
+		if (!i)
+			continue;
+		x = y - 1;
+		if (extent_end(x) == y->sector &&
+		    x->offset + x->secs * ss != y->offset)
+			copy = 1;
+	}
+
+	if (copy && !posix_memalign(&arena, RAMDISK_ARENA_ALIGN, size)) {
+		size = 0;
+		for (i = 0; i < e->nr_extents; i++) {
+			x = &e->extents[i];
+			memcpy((char *)arena + size, e->arena + x->offset,
+			       x->secs * ss);
+			x->offset = size;
+			size     += x->secs * ss;
 		}
-		*key = start;
-		if (!hashtable_insert(ramdisk->inprogress, key, NULL)) {
-			DPRINTF("%s failed to insert sector %" PRIu64 " into inprogress hash\n", 
-				__FUNCTION__, start);
-			free(key);
-			free(buf);
-			rc = -1;
-			goto fail;
+		free(e->arena);
+		e->arena      = arena;
+		e->arena_size = size;
+		e->arena_used = size;
+	}
+
+	for (i = 0, j = 0; i < e->nr_extents; i++) {
+		y = &e->extents[i];
+		x = j ? &e->extents[j - 1] : NULL;
+		if (x && extent_end(x) == y->sector &&
+		    x->offset + x->secs * ss == y->offset)
+			x->secs += y->secs;
+		else
+			e->extents[j++] = *y;
+	}
+	e->nr_extents = j;
+}
+
+static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
+			int nb_sectors, char* buf)
+{
+	int i;
+	char* v;
+
+	for (i = 0; i < nb_sectors; i++) {
+		/* check whether it is queued in a previous flush request */
+		if (!(v = ramdisk_epoch_lookup(ramdisk, ramdisk->pending,
+					       sector + i))) {
+			/* check whether it is an ongoing flush */
+			if (!(v = ramdisk_epoch_lookup(ramdisk,
+						       ramdisk->flushing,
+						       sector + i)))
+				return -1;
 		}
-		memcpy(buf + i * ramdisk->sector_size, sector, ramdisk->sector_size);
-		start++;
+		memcpy(buf + i * ramdisk->sector_size, v, ramdisk->sector_size);
 	}
 
-	*mergedbuf = buf;
 	return 0;
-fail:
-	for (start--; i >0; i--, start--)
-		hashtable_remove(ramdisk->inprogress, &start);
-	return rc;
+}
+
+static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
+				int nb_sectors, char* buf)
+{
+	return ramdisk_epoch_write(ramdisk, ramdisk->cur, sector, nb_sectors,
+				   buf);
 }
 
 /* The underlying driver may not handle having the whole ramdisk queued at
- * once. We queue what we can and let the callbacks attempt to queue more. */
+ * once. We queue up to RAMDISK_MAX_INFLIGHT large sequential writes and let
+ * the callbacks queue more. Epochs drain in commit order. */
 /* NOTE: may be called from callback, while dd->private still belongs to
  * the underlying driver */
 static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 {
-	uint64_t* sectors;
-	char* buf = NULL;
-	uint64_t base, batchlen;
-	int i, j, count = 0;
-
-	// RPRINTF("ramdisk flush\n");
-
-	if ((count = ramdisk_get_sectors(s->ramdisk.prev, &sectors)) <= 0)
-		return count;
+	struct ramdisk* ramdisk = &s->ramdisk;
+	struct ramdisk_epoch* e;
+	struct ramdisk_extent* x;
+	uint32_t secs, max;
+	int rc = 0;
 
-	/* Create the inprogress table if empty */
-	if (!s->ramdisk.inprogress)
-		s->ramdisk.inprogress = create_hashtable(RAMDISK_HASHSIZE,
-							uint64_hash,
-							rd_hash_equal);
-	
-	/*
-	  RPRINTF("ramdisk: flushing %d sectors\n", count);
-	*/
+	if (ramdisk->issuing)
+		return 0;
+	ramdisk->issuing = 1;
 
-	/* sort and merge sectors to improve disk performance */
-	qsort(sectors, count, sizeof(*sectors), uint64_compare);
+	max = RAMDISK_FLUSH_MAX / ramdisk->sector_size;
 
-	for (i = 0; i < count;) {
-		base = sectors[i++];
-		while (i < count && sectors[i] == sectors[i-1] + 1)
-			i++;
-		batchlen = sectors[i-1] - base + 1;
-
-		j = merge_requests(&s->ramdisk, base, batchlen, &buf);
-			
-		if (j) {
-			RPRINTF("ramdisk_flush: merge_requests failed:%s\n",
-				j == -1? "OOM": (j==-2? "missing sector" : "WAW race"));
-			if (j == -3) continue;
-			free(sectors);
-			return -1;
+	for (;;) {
+		if (!ramdisk->flushing) {
+			if (!ramdisk->pending)
+				break;
+			ramdisk->flushing = ramdisk->pending;
+			ramdisk->pending  = NULL;
+			ramdisk_epoch_join(ramdisk, ramdisk->flushing);
 		}
+		e = ramdisk->flushing;
+
+		while (e->next < e->nr_extents &&
+		       ramdisk->inflight < RAMDISK_MAX_INFLIGHT) {
+			x    = &e->extents[e->next];
+			secs = MIN(x->secs - e->done, max);
+
+			/* NOTE: create_write_request() creates a treq AND
+			 * forwards it down the driver chain */
+			ramdisk->inflight++;
+			if (create_write_request(s, x->sector + e->done, secs,
+						 e->arena + x->offset +
+						 e->done * ramdisk->sector_size)) {
+				RPRINTF("ramdisk_flush: error queueing write\n");
+				ramdisk->inflight--;
+				rc = -1;
+				goto out;
+			}
 
-		/* NOTE: create_write_request() creates a treq AND forwards it down
-		 * the driver chain */
-		// RPRINTF("forwarding write request at %" PRIu64 ", length: %" PRIu64 "\n", base, batchlen);
-		create_write_request(s, base, batchlen, buf);
-		//RPRINTF("write request at %" PRIu64 ", length: %" PRIu64 " forwarded\n", base, batchlen);
-
-		s->ramdisk.inflight++;
-
-		for (j = 0; j < batchlen; j++) {
-			buf = hashtable_search(s->ramdisk.prev, &base);
-			free(buf);
-			hashtable_remove(s->ramdisk.prev, &base);
-			base++;
+			e->done += secs;
+			if (e->done == x->secs) {
+				e->next++;
+				e->done = 0;
+			}
 		}
-	}
 
-	if (!hashtable_count(s->ramdisk.prev)) {
-		/* everything is in flight */
-		hashtable_destroy(s->ramdisk.prev, 0);
-		s->ramdisk.prev = NULL;
-	}
+		if (e->next < e->nr_extents || ramdisk->inflight)
+			break;
 
-	free(sectors);
+		/* everything in this epoch is on disk */
+		ramdisk->flushing = NULL;
+		ramdisk_put_epoch(ramdisk, e);
+	}
 
-	// RPRINTF("ramdisk flush done\n");
-	return 0;
+out:
+	ramdisk->issuing = 0;
+	return rc;
 }
 
 /* flush ramdisk contents to disk */
 static int ramdisk_start_flush(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-	uint64_t* key;
-	char* buf;
-	int rc = 0;
-	int i, j, count, batchlen;
-	uint64_t* sectors;
+	struct ramdisk* ramdisk = &s->ramdisk;
+	struct ramdisk_epoch* e;
+	struct ramdisk_extent* x;
+	int i;
 
-	if (!hashtable_count(s->ramdisk.h)) {
+	if (!ramdisk->cur->nr_extents) {
 		/*
 		  RPRINTF("Nothing to flush\n");
 		*/
 		return 0;
 	}
 
-	if (s->ramdisk.prev) {
-		/* a flush request issued while a previous flush is still in progress
-		 * will merge with the previous request. If you want the previous
-		 * request to be consistent, wait for it to complete. */
-		if ((count = ramdisk_get_sectors(s->ramdisk.h, &sectors)) < 0)
-			return count;
-
-		for (i = 0; i < count; i++) {
-			buf = hashtable_search(s->ramdisk.h, sectors + i);
-			ramdisk_write_hash(s->ramdisk.prev, sectors[i], buf,
-					   s->ramdisk.sector_size);
+	if (ramdisk->pending) {
+		/* the previous checkpoint has not started draining yet:
+		 * fold this one into it */
+		e = ramdisk->cur;
+		for (i = 0; i < e->nr_extents; i++) {
+			x = &e->extents[i];
+			if (ramdisk_epoch_write(ramdisk, ramdisk->pending,
+						x->sector, x->secs,
+						e->arena + x->offset))
+				return -1;
 		}
-		free(sectors);
-
-		hashtable_destroy (s->ramdisk.h, 0);
-	} else
-		s->ramdisk.prev = s->ramdisk.h;
-
-	/* We create a new hashtable so that new writes can be performed before
-	 * the old hashtable is completely drained. */
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
+		e->arena_used = 0;
+		e->nr_extents = 0;
+	} else {
+		/* We take a new epoch so that new writes can be performed
+		 * before the old one is completely drained. */
+		if (!(e = ramdisk_get_epoch(ramdisk)))
+			return -1;
+		ramdisk->pending = ramdisk->cur;
+		ramdisk->cur     = e;
+	}
 
 	return ramdisk_flush(driver, s);
 }
@@ -619,20 +746,34 @@ static int ramdisk_start(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
 
-	if (s->ramdisk.h) {
+	if (s->ramdisk.cur) {
 		RPRINTF("ramdisk already allocated\n");
 		return 0;
 	}
 
 	s->ramdisk.sector_size = driver->info.sector_size;
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
+	if (!(s->ramdisk.cur = ramdisk_get_epoch(&s->ramdisk)))
+		return -1;
 
 	DPRINTF("Ramdisk started, %zu bytes/sector\n", s->ramdisk.sector_size);
 
 	return 0;
 }
 
+static void ramdisk_destroy(struct ramdisk* ramdisk)
+{
+	ramdisk_free_epoch(ramdisk->cur);
+	ramdisk_free_epoch(ramdisk->pending);
+	ramdisk_free_epoch(ramdisk->spare);
+	ramdisk->cur = ramdisk->pending = ramdisk->spare = NULL;
+
+	/* writes still in flight point into the flushing arena */
+	if (!ramdisk->inflight) {
+		ramdisk_free_epoch(ramdisk->flushing);
+		ramdisk->flushing = NULL;
+	}
+}
+
 /* common client/server functions */
 /* mayberead: Time out after a certain interval. */
 static int mread(int fd, void* buf, size_t len)
@@ -729,8 +870,111 @@ static int mwrite(int fd, void* buf, size_t len)
 }
 
 
+static void remus_send_event(event_id_t id, char mode, void *private);
+
+/* have the event loop push the buffer out. Writes queued in the same
+ * round then leave in one system call. */
+static int send_arm(struct tdremus_state *s)
+{
+	event_id_t id;
+
+	if (s->send.id >= 0)
+		return 0;
+
+	if ((id = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
+						s->stream_fd.fd, 0,
+						remus_send_event, s)) < 0) {
+		RPRINTF("error registering send event handler: %s\n",
+			strerror(-id));
+		return -1;
+	}
+	s->send.id = id;
+
+	return 0;
+}
+
+/* write out as much of the send buffer as the socket takes and poll for
+ * the rest */
+static int send_kick(struct tdremus_state *s)
+{
+	struct remus_sendbuf *sb = &s->send;
+	ssize_t rc;
+
+	while (sb->head < sb->tail) {
+		rc = write(s->stream_fd.fd, sb->buf + sb->head,
+			   sb->tail - sb->head);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			RPRINTF("error during write: %s\n", strerror(errno));
+			return -1;
+		}
+		sb->head += rc;
+	}
+
+	if (sb->head == sb->tail) {
+		sb->head = sb->tail = 0;
+		if (sb->id >= 0) {
+			tapdisk_server_unregister_event(sb->id);
+			sb->id = -1;
+		}
+		return 0;
+	}
+
+	return send_arm(s);
+}
+
+/* append to the replication stream. Past REMUS_SENDBUF_MAX the backup has
+ * fallen too far behind, and we wait for it as a synchronous stream would */
+static int send_queue(struct tdremus_state *s, const void *data, size_t len)
+{
+	struct remus_sendbuf *sb = &s->send;
+	size_t size;
+	char *buf;
+
+	if (s->stream_fd.fd < 0)
+		return -1;
+
+	if (sb->tail + len > sb->size && sb->head) {
+		memmove(sb->buf, sb->buf + sb->head, sb->tail - sb->head);
+		sb->tail -= sb->head;
+		sb->head  = 0;
+	}
+
+	if (sb->tail + len > REMUS_SENDBUF_MAX && sb->tail) {
+		if (mwrite(s->stream_fd.fd, sb->buf, sb->tail) < 0)
+			return -1;
+		sb->tail = 0;
+	}
+
+	if (sb->tail + len > sb->size) {
+		size = sb->size ? sb->size : REMUS_SENDBUF_MIN;
+		while (size < sb->tail + len)
+			size *= 2;
+		if (!(buf = realloc(sb->buf, size))) {
+			RPRINTF("error growing send buffer to %zu\n", size);
+			return -1;
+		}
+		sb->buf  = buf;
+		sb->size = size;
+	}
+
+	memcpy(sb->buf + sb->tail, data, len);
+	sb->tail += len;
+
+	return 0;
+}
+
 static void inline close_stream_fd(struct tdremus_state *s)
 {
+	if (s->send.id >= 0) {
+		tapdisk_server_unregister_event(s->send.id);
+		s->send.id = -1;
+	}
+	s->send.head = s->send.tail = 0;
+
 	/* XXX: -2 is magic. replace with macro perhaps? */
 	tapdisk_server_unregister_event(s->stream_fd.id);
 	close(s->stream_fd.fd);
@@ -835,12 +1079,12 @@ static void primary_queue_read(td_driver_t *driver, td_request_t treq)
 	td_forward_request(treq);
 }
 
-/* TODO:
- * The primary uses mwrite() to write the contents of a write request to the
- * backup. This effectively blocks until all data has been copied into a system
- * buffer or a timeout has occured. We may wish to instead use tapdisk's
- * nonblocking i/o interface, tapdisk_server_register_event(), to set timeouts
- * and write data in an asynchronous fashion.
+/* The primary appends the contents of a write request to the send buffer
+ * and forwards it at once; the event loop streams the buffer to the backup
+ * while the domain runs on, so replication of one epoch overlaps the next
+ * instead of blocking each write on the socket. Ordering is kept by the
+ * stream: the commit request follows every write of its epoch, and output
+ * is only released once the backup answers it.
  */
 static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -861,12 +1105,14 @@ static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 	*sectors = treq.secs;
 	*sector = treq.sec;
 
-	if (mwrite(s->stream_fd.fd, TDREMUS_WRITE, strlen(TDREMUS_WRITE)) < 0)
+	if (send_queue(s, TDREMUS_WRITE, strlen(TDREMUS_WRITE)) < 0)
 		goto fail;
-	if (mwrite(s->stream_fd.fd, header, sizeof(header)) < 0)
+	if (send_queue(s, header, sizeof(header)) < 0)
 		goto fail;
 
-	if (mwrite(s->stream_fd.fd, treq.buf, treq.secs * driver->info.sector_size) < 0)
+	if (send_queue(s, treq.buf, treq.secs * driver->info.sector_size) < 0)
+		goto fail;
+	if (send_arm(s) < 0)
 		goto fail;
 
 	td_forward_request(treq);
@@ -891,7 +1137,9 @@ static int client_flush(td_driver_t *driver)
 		/* connection not yet established, nothing to flush */
 		return 0;
 
-	if (mwrite(s->stream_fd.fd, TDREMUS_COMMIT, strlen(TDREMUS_COMMIT)) < 0) {
+	/* the checkpoint waits on this one, push it out now */
+	if (send_queue(s, TDREMUS_COMMIT, strlen(TDREMUS_COMMIT)) < 0 ||
+	    send_kick(s) < 0) {
 		RPRINTF("error flushing output");
 		close_stream_fd(s);
 		return -1;
@@ -903,13 +1151,10 @@ static int client_flush(td_driver_t *driver)
 static int server_flush(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-	/* 
-	 * Nothing to flush in beginning.
-	 */
-	if (!s->ramdisk.prev)
-		return 0;
-	/* Try to flush any remaining requests */
-	return ramdisk_flush(driver, s);	
+
+	/* Try to flush any remaining requests. Nothing is pending in the
+	 * beginning, and the open checkpoint is never applied. */
+	return ramdisk_flush(driver, s);
 }
 
 static int primary_start(td_driver_t *driver)
@@ -1022,6 +1267,18 @@ static void remus_connect_event(event_id_t id, char mode, void *private)
 }
 
 
+/* the backup is taking data again, continue the replication stream */
+static void remus_send_event(event_id_t id, char mode, void *private)
+{
+	struct tdremus_state *s = (struct tdremus_state *)private;
+
+	if (send_kick(s) < 0) {
+		/* replication stream broken, like a failed read below */
+		RPRINTF("error writing to backup\n");
+		close_stream_fd(s);
+	}
+}
+
 /* we install this event handler on the primary once we have connected to the backup */
 /* wait for "done" message to commit checkpoint */
 static void remus_client_event(event_id_t id, char mode, void *private)
@@ -1138,7 +1395,8 @@ static inline int server_writes_inflight(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
 
-	if (!s->ramdisk.inflight && !s->ramdisk.prev)
+	if (!s->ramdisk.inflight && !s->ramdisk.flushing &&
+	    !s->ramdisk.pending)
 		return 0;
 
 	return 1;
@@ -1310,7 +1568,7 @@ void unprotected_queue_read(td_driver_t *driver, td_request_t treq)
 		 * if there are any left-over requests in prev,
 		 * kick em again.
 		 */
-		if(!s->ramdisk.inflight) /* nothing in inprogress */
+		if(!s->ramdisk.inflight) /* nothing on the disk */
 			ramdisk_flush(driver, s);
 
 		td_complete_request(treq, -EBUSY);
@@ -1329,7 +1587,7 @@ void unprotected_queue_write(td_driver_t *driver, td_request_t treq)
 	/* wait for previous ramdisk to flush */
 	if (server_writes_inflight(driver)) {
 		RPRINTF("queue_write: waiting for queue to drain");
-		if(!s->ramdisk.inflight) /* nothing in inprogress. Kick prev */
+		if(!s->ramdisk.inflight) /* nothing on the disk. Kick pending */
 			ramdisk_flush(driver, s);
 		td_complete_request(treq, -EBUSY);
 	}
@@ -1651,6 +1909,7 @@ static int tdremus_open(td_driver_t *driver, const char *name,
 	s->stream_fd.fd = -1;
 	s->ctl_fd.fd = -1;
 	s->msg_fd.fd = -1;
+	s->send.id = -1;
 
 	/* TODO: this is only needed so that the server can send writes down
 	 * the driver stack from the stream_fd event handler */
@@ -1689,9 +1948,8 @@ static int tdremus_close(td_driver_t *driver)
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
 
 	RPRINTF("closing\n");
-	if (s->ramdisk.inprogress)
-		hashtable_destroy(s->ramdisk.inprogress, 0);
-	
+	ramdisk_destroy(&s->ramdisk);
+
 	if (s->driver_data) {
 		free(s->driver_data);
 		s->driver_data = NULL;
@@ -1702,6 +1960,9 @@ static int tdremus_close(td_driver_t *driver)
 	}
 	if (s->stream_fd.fd >= 0)
 		close_stream_fd(s);
+	free(s->send.buf);
+	s->send.buf  = NULL;
+	s->send.size = 0;
 
 	ctl_close(driver);
 
@@ -41,6 +41,22 @@
  *     writes and the zero-bitmap write complete, the BAT and bitmap writes
  *     are started in parallel.  The transaction is completed only after both
  *     the BAT and bitmap writes successfully return.
+ *
+ * A note on block allocation:
+ * Any number of blocks may be in the process of being allocated at once.
+ * Each reserves its space at the end of the file up front, and keeps the
+ * reservation in its bitmap (VHD_FLAG_BM_ALLOC) until its BAT entry is on
+ * disk.  Blocks whose space has been zeroed are queued for the BAT, which
+ * is written by a single request at a time: each write covers every queued
+ * entry within VHD_BAT_BATCH_SECS sectors of the first one, so allocations
+ * arriving while a BAT write is in flight are committed together.
+ *
+ * A note on zeroes and discards:
+ * A write of zeroes to an unallocated block of a disk without a parent
+ * changes nothing, so is completed without allocating the block.  Discards
+ * punch holes in the data of allocated blocks and, where the bitmap is
+ * cached, clear its bits in a bitmap transaction like any data write.
+ * Blocks are never freed.
  */
 
 #include <errno.h>
@@ -54,11 +70,13 @@
 #include <libaio.h>
 #include <sys/mman.h>
 
+#include "list.h"
 #include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
+#include "tapdisk-utils.h"
 
 unsigned int SPB;
 
@@ -72,10 +90,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%lu, BBLK: 0x%04x\n",				\
+		    "%lu, BAT_PENDING: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.pending);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -109,7 +127,13 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32        /* default, and minimum */
+#define VHD_CACHE_SIZE_MAX           16384
+#define VHD_CACHE_SIZE_ENV           "TAPDISK_VHD_BITMAP_CACHE"
+#define VHD_CACHE_PREFETCH           2         /* bitmaps read ahead */
+
+#define VHD_BAT_ENTRIES_PER_SEC      (VHD_SECTOR_SIZE / sizeof(u32))
+#define VHD_BAT_BATCH_SECS           8         /* max BAT write, in sectors */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -121,6 +145,8 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_READ           3
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
+#define VHD_OP_ZERO_BLOCK_WRITE      6
+#define VHD_OP_DISCARD               7
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -136,13 +162,13 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
 
-#define VHD_FLAG_BAT_LOCKED          1
-#define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_BAT_WRITE_STARTED   1
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_ALLOC            16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -150,7 +176,7 @@ unsigned int SPB;
 #define VHD_FLAG_REQ_FINISHED        8
 
 #define VHD_FLAG_TX_LIVE             1
-#define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_WAIT_BAT         2
 
 typedef uint8_t vhd_flag_t;
 
@@ -186,17 +212,21 @@ struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	int                       pending;     /* blocks being allocated */
+	struct vhd_bitmap        *queue;       /* allocations ready for the
+						* next bat write */
+	struct vhd_bitmap        *queue_tail;
+	struct vhd_bitmap        *batch;       /* allocations in the bat
+						* write in flight */
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
-	char                     *bat_buf;
+	char                     *bat_buf;     /* VHD_BAT_BATCH_SECS long */
 };
 
 struct vhd_bitmap {
 	u32                       blk;
-	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	u64                       alloc_offset; /* sector of block, while
+						 * VHD_FLAG_BM_ALLOC */
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -213,6 +243,11 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+	struct vhd_request        zero_req;    /* for initializing the block */
+
+	struct vhd_bitmap        *hash_next;
+	struct vhd_bitmap        *bat_next;    /* bat queue or batch */
+	struct list_head          lru;         /* lru or free list */
 };
 
 struct vhd_state {
@@ -227,13 +262,16 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
-
-	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	u32                       bm_cache_size;
+	u32                       bm_hash_size; /* power of two */
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps, by blk */
+	struct list_head          bm_lru;      /* cached bitmaps, least
+						* recently used first */
+	struct list_head          bm_free;
+	struct vhd_bitmap        *bitmap_list;
+	u32                       bm_last_miss; /* for spotting sequential
+						 * access */
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -248,6 +286,8 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+	uint64_t                  zero_size;   /* zeroes not written */
+	uint64_t                  discard_size;
 };
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
@@ -258,6 +298,8 @@ struct vhd_state {
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void finish_data_write(struct vhd_request *);
+static int __vhd_queue_request(struct vhd_state *, uint8_t, td_request_t);
 
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
@@ -392,7 +434,7 @@ vhd_free_bat(struct vhd_state *s)
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(struct vhd_bat_state));
 }
 
 static int
@@ -400,7 +442,7 @@ vhd_initialize_bat(struct vhd_state *s)
 {
 	int err, psize, batmap_required, i;
 
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(struct vhd_bat_state));
 
 	psize = getpagesize();
 
@@ -436,8 +478,8 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign((void **)&s->bat.bat_buf,
-			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign((void **)&s->bat.bat_buf, VHD_SECTOR_SIZE,
+			     VHD_BAT_BATCH_SECS * VHD_SECTOR_SIZE);
 	if (err) {
 		s->bat.bat_buf = NULL;
 		goto fail;
@@ -456,14 +498,46 @@ vhd_free_bitmap_cache(struct vhd_state *s)
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
+	if (s->bitmap_list) {
+		for (i = 0; i < s->bm_cache_size; i++) {
+			bm = s->bitmap_list + i;
+			free(bm->map);
+			free(bm->shadow);
+		}
+	}
+
+	free(s->bitmap_list);
+	free(s->bm_hash);
+
+	s->bitmap_list   = NULL;
+	s->bm_hash       = NULL;
+	s->bm_cache_size = 0;
+	s->bm_hash_size  = 0;
+}
+
+/*
+ * The cache holds VHD_CACHE_SIZE bitmaps unless VHD_CACHE_SIZE_ENV asks
+ * for more; there is no point in caching more bitmaps than there are
+ * blocks.
+ */
+static u32
+vhd_bitmap_cache_size(struct vhd_state *s)
+{
+	char *env, *end;
+	unsigned long size;
+
+	env = getenv(VHD_CACHE_SIZE_ENV);
+	if (!env)
+		return VHD_CACHE_SIZE;
+
+	size = strtoul(env, &end, 0);
+	if (*end || size < VHD_CACHE_SIZE || size > VHD_CACHE_SIZE_MAX) {
+		EPRINTF("%s: ignoring invalid %s=%s\n",
+			s->vhd.file, VHD_CACHE_SIZE_ENV, env);
+		return VHD_CACHE_SIZE;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	return MAX(MIN(size, s->bat.bat.entries), VHD_CACHE_SIZE);
 }
 
 static int
@@ -472,13 +546,21 @@ vhd_initialize_bitmap_cache(struct vhd_state *s)
 	int i, err, map_size;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	s->bm_cache_size = vhd_bitmap_cache_size(s);
+	for (s->bm_hash_size = 1;
+	     s->bm_hash_size < s->bm_cache_size; s->bm_hash_size <<= 1)
+		;
+
+	s->bitmap_list = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap));
+	s->bm_hash     = calloc(s->bm_hash_size, sizeof(struct vhd_bitmap *));
+	if (!s->bitmap_list || !s->bm_hash) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign((void **)&bm->map, 512, map_size);
@@ -495,7 +577,7 @@ vhd_initialize_bitmap_cache(struct vhd_state *s)
 
 		memset(bm->map, 0, map_size);
 		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+		list_add_tail(&bm->lru, &s->bm_free);
 	}
 
 	return 0;
@@ -608,6 +690,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	s->flags  = flags;
 	s->driver = driver;
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_free);
 
 	err = vhd_initialize(s);
 	if (err)
@@ -847,6 +931,34 @@ vhd_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 	return 0;
 }
 
+static int
+vhd_get_block_map(td_driver_t *driver, uint32_t *block_secs,
+		  uint64_t *blocks, uint8_t **map)
+{
+	uint8_t *m;
+	uint32_t i;
+	struct vhd_state *s;
+
+	s = (struct vhd_state *)driver->data;
+
+	if (!vhd_type_dynamic(&s->vhd) ||
+	    test_vhd_flag(s->flags, VHD_FLAG_OPEN_NO_CACHE))
+		return -EINVAL;
+
+	m = malloc(s->bat.bat.entries ? : 1);
+	if (!m)
+		return -ENOMEM;
+
+	for (i = 0; i < s->bat.bat.entries; i++)
+		m[i] = (bat_entry(s, i) != DD_BLK_UNUSED);
+
+	*block_secs = s->spb;
+	*blocks     = s->bat.bat.entries;
+	*map        = m;
+
+	return 0;
+}
+
 static inline void
 clear_req_list(struct vhd_req_list *list)
 {
@@ -925,60 +1037,36 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
-{
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
-}
-
-static inline void
-lock_bat(struct vhd_state *s)
-{
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline void
-unlock_bat(struct vhd_state *s)
-{
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline int
-bat_locked(struct vhd_state *s)
-{
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->blk    = 0;
-	bm->seqno  = 0;
-	bm->status = 0;
+	bm->blk          = 0;
+	bm->status       = 0;
+	bm->alloc_offset = 0;
+	bm->bat_next     = NULL;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
 	memset(bm->map, 0, vhd_sectors_to_bytes(s->bm_secs));
 	memset(bm->shadow, 0, vhd_sectors_to_bytes(s->bm_secs));
 	init_vhd_request(s, &bm->req);
+	init_vhd_request(s, &bm->zero_req);
+}
+
+static inline struct vhd_bitmap **
+bitmap_hash_head(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[block & (s->bm_hash_size - 1)];
 }
 
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = *bitmap_hash_head(s, block); bm; bm = bm->hash_next)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
@@ -1012,7 +1100,7 @@ bitmap_in_use(struct vhd_bitmap *bm)
 {
 	return (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING)  ||
 		test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING) ||
-		test_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT) ||
+		test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC)         ||
 		bm->waiting.head || bm->tx.requests.head || bm->queue.head);
 }
 
@@ -1030,28 +1118,35 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+static void
+uninstall_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = bitmap_hash_head(s, bm->blk); *pp != bm;
+	     pp = &(*pp)->hash_next)
+		ASSERT(*pp);
+
+	*pp           = bm->hash_next;
+	bm->hash_next = NULL;
+	list_del(&bm->lru);
+}
+
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (bitmap_locked(bm))
+			continue;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		ASSERT(!bitmap_in_use(bm));
+		uninstall_bitmap(s, bm);
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1061,8 +1156,9 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	
 	*bitmap = NULL;
 
-	if (s->bm_free_count > 0) {
-		bm = s->bitmap_free[--s->bm_free_count];
+	if (!list_empty(&s->bm_free)) {
+		bm = list_entry(s->bm_free.next, struct vhd_bitmap, lru);
+		list_del(&bm->lru);
 	} else {
 		bm = remove_lru_bitmap(s);
 		if (!bm)
@@ -1076,63 +1172,34 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_del(&bm->lru);
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **head = bitmap_hash_head(s, bm->blk);
+
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	bm->hash_next = *head;
+	*head         = bm;
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(get_bitmap(s, bm->blk) == bm);
 
-	s->bitmap[i] = NULL;
-	s->bitmap_free[s->bm_free_count++] = bm;
+	uninstall_bitmap(s, bm);
+	list_add(&bm->lru, &s->bm_free);
 }
 
 static int
@@ -1155,8 +1222,14 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
-		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		/*
+		 * writes join an allocation in progress, but must
+		 * wait for the remains of a failed one to drain
+		 */
+		bm = get_bitmap(s, blk);
+		if (op == VHD_OP_DATA_WRITE && bm &&
+		    !test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC) &&
+		    bitmap_in_use(bm))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1264,48 +1337,105 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
+/*
+ * reserve space for blk at the end of the file; returns the old end,
+ * from which the space up to the new block has to be zeroed.  space
+ * reserved for an allocation which later fails is not reused, since
+ * writes to it may still be in flight.
+ */
 static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+reserve_new_block(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int gap = 0;
+	uint64_t lb_end = s->next_db;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(!test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC));
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	bm->alloc_offset = s->next_db + gap;
+	s->next_db       = bm->alloc_offset + s->bm_secs + s->spb;
+
+	set_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC);
+	s->bat.pending++;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, offset: 0x%08"PRIx64", pending: %d\n",
+	    bm->blk, bm->alloc_offset, s->bat.pending);
 
-	return s->next_db;
+	return lb_end;
 }
 
-static int
+static inline void
+release_new_block(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	ASSERT(test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC));
+
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC);
+	s->bat.pending--;
+}
+
+/*
+ * write out the BAT sectors holding the first queued allocation and
+ * any others that fall within VHD_BAT_BATCH_SECS of it
+ */
+static void
 schedule_bat_write(struct vhd_state *s)
 {
-	int i;
-	u32 blk;
 	char *buf;
 	u64 offset;
+	u32 i, first, last, secs, idx;
 	struct vhd_request *req;
+	struct vhd_bitmap *bm, *next, **prev;
+
+	if (test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED) ||
+	    !s->bat.queue)
+		return;
 
-	ASSERT(bat_locked(s));
+	req  = &s->bat.req;
+	buf  = s->bat.bat_buf;
+	secs = vhd_bytes_padded(s->bat.bat.entries * sizeof(u32)) >>
+		VHD_SECTOR_SHIFT;
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	first = s->bat.queue->blk / VHD_BAT_ENTRIES_PER_SEC;
+	last  = MIN(first + VHD_BAT_BATCH_SECS, secs);
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, first * VHD_BAT_ENTRIES_PER_SEC),
+	       vhd_sectors_to_bytes(last - first));
+
+	ASSERT(!s->bat.batch);
+
+	prev = &s->bat.queue;
+	s->bat.queue_tail = NULL;
+
+	for (bm = s->bat.queue; bm; bm = next) {
+		next = bm->bat_next;
+		idx  = bm->blk / VHD_BAT_ENTRIES_PER_SEC;
+
+		if (idx < first || idx >= last) {
+			*prev = bm;
+			prev  = &bm->bat_next;
+			s->bat.queue_tail = bm;
+			continue;
+		}
 
-	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
+		((u32 *)buf)[bm->blk - first * VHD_BAT_ENTRIES_PER_SEC] =
+			bm->alloc_offset;
 
-	for (i = 0; i < 128; i++)
+		bm->bat_next = s->bat.batch;
+		s->bat.batch = bm;
+	}
+
+	*prev = NULL;
+
+	for (i = 0; i < (last - first) * VHD_BAT_ENTRIES_PER_SEC; i++)
 		BE32_OUT(&((u32 *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
-	req->treq.secs = 1;
+	offset         = s->vhd.header.table_offset +
+		vhd_sectors_to_bytes(first);
+	req->treq.secs = last - first;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
@@ -1313,10 +1443,23 @@ schedule_bat_write(struct vhd_state *s)
 	aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	DBG(TLOG_DBG, "bat sectors: 0x%x - 0x%x, table_offset: 0x%08"PRIx64"\n",
+	    first, last - 1, offset);
+}
 
-	return 0;
+static void
+queue_bat_write(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	ASSERT(test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC));
+
+	bm->bat_next = NULL;
+	if (s->bat.queue_tail)
+		s->bat.queue_tail->bat_next = bm;
+	else
+		s->bat.queue = bm;
+	s->bat.queue_tail = bm;
+
+	schedule_bat_write(s);
 }
 
 static void
@@ -1324,19 +1467,19 @@ schedule_zero_bm_write(struct vhd_state *s,
 		       struct vhd_bitmap *bm, uint64_t lb_end)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &bm->zero_req;
 
 	init_vhd_request(s, req);
 
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = bm->blk * s->spb;
+	req->treq.secs = (bm->alloc_offset - lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    bm->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1344,19 +1487,11 @@ schedule_zero_bm_write(struct vhd_state *s,
 }
 
 static int
-update_bat(struct vhd_state *s, uint32_t blk)
+get_new_bitmap(struct vhd_state *s, uint32_t blk, struct vhd_bitmap **bitmap)
 {
 	int err;
-	uint64_t lb_end;
 	struct vhd_bitmap *bm;
 
-	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
-
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
 	bm = get_bitmap(s, blk);
@@ -1369,75 +1504,72 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	schedule_zero_bm_write(s, bm, lb_end);
-	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	ASSERT(!bitmap_in_use(bm));
 
+	*bitmap = bm;
 	return 0;
 }
 
 static int
-allocate_block(struct vhd_state *s, uint32_t blk)
+update_bat(struct vhd_state *s, uint32_t blk)
 {
-	char *zeros;
-	int err, gap;
-	uint64_t offset, size;
+	int err;
+	uint64_t lb_end;
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
+	bm = get_bitmap(s, blk);
+	if (bm && test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC))
 		return 0;
-	}
 
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
+	err = get_new_bitmap(s, blk, &bm);
+	if (err)
+		return err;
 
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
-	}
+	lb_end = reserve_new_block(s, bm);
+	schedule_zero_bm_write(s, bm, lb_end);
+
+	return 0;
+}
 
-	s->bat.pbw_offset = s->next_db;
+/*
+ * zero the new block along with its bitmap.  the bitmap is not valid
+ * until that is done: writes to the block wait on it like they would
+ * on a bitmap read.
+ */
+static int
+allocate_block(struct vhd_state *s, uint32_t blk)
+{
+	int err;
+	uint64_t lb_end;
+	struct vhd_bitmap *bm;
+	struct vhd_request *req;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(errno, "lseek failed\n");
-		return -errno;
-	}
+	bm = get_bitmap(s, blk);
+	if (bm && test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC))
+		return 0;
 
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	err  = write(s->vhd.fd, vhd_zeros(size), size);
-	if (err != size) {
-		err = (err == -1 ? -errno : -EIO);
-		ERR(err, "write failed");
+	err = get_new_bitmap(s, blk, &bm);
+	if (err)
 		return err;
-	}
 
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
-	if (!bm) {
-		/* install empty bitmap in cache */
-		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
-			return err;
+	lb_end = reserve_new_block(s, bm);
 
-		install_bitmap(s, bm);
-	}
+	req = &bm->zero_req;
+	init_vhd_request(s, req);
 
-	lock_bat(s);
+	req->op        = VHD_OP_ZERO_BLOCK_WRITE;
+	req->treq.sec  = blk * s->spb;
+	req->treq.secs = (bm->alloc_offset - lb_end) + s->bm_secs + s->spb;
+	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
+	req->next      = NULL;
+
+	aio_write(s, req, vhd_sectors_to_bytes(lb_end));
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	set_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
 
 	return 0;
 }
@@ -1513,7 +1645,11 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		bm = get_bitmap(s, blk);
+		if (!bitmap_valid(bm))
+			return __vhd_queue_request(s, VHD_OP_DATA_WRITE, treq);
+
+		offset = bm->alloc_offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1550,6 +1686,69 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	return 0;
 }
 
+/* give the space behind sectors of the file back to the filesystem */
+static int
+vhd_punch_hole(struct vhd_state *s, uint64_t offset, uint32_t secs)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	int err;
+
+	err = fallocate(s->vhd.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			vhd_sectors_to_bytes(offset),
+			vhd_sectors_to_bytes(secs));
+	if (err && errno != EOPNOTSUPP && errno != ENOSYS)
+		return -errno;
+#endif
+	return 0;
+}
+
+/*
+ * clear the bitmap bits of a discarded range.  the request joins the
+ * bitmap transaction like a data write, but with the hole punched there
+ * is nothing left to wait for.
+ */
+static int
+schedule_discard(struct vhd_state *s, td_request_t treq)
+{
+	u64 offset;
+	u32 blk, sec;
+	struct vhd_bitmap  *bm;
+	struct vhd_request *req;
+
+	blk    = treq.sec / s->spb;
+	sec    = treq.sec % s->spb;
+	bm     = get_bitmap(s, blk);
+	offset = bat_entry(s, blk);
+
+	ASSERT(offset != DD_BLK_UNUSED);
+	ASSERT(bm && bitmap_valid(bm));
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq  = treq;
+	req->flags = VHD_FLAG_REQ_UPDATE_BITMAP;
+	req->op    = VHD_OP_DISCARD;
+	req->next  = NULL;
+
+	lock_bitmap(bm);
+
+	if (bm->tx.closed) {
+		add_to_tail(&bm->queue, req);
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
+	} else
+		add_to_transaction(&bm->tx, req);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
+	    "nr_secs: 0x%04x\n", s->vhd.file, treq.sec, blk, sec, treq.secs);
+
+	req->error = vhd_punch_hole(s, offset + s->bm_secs + sec, treq.secs);
+	finish_data_write(req);
+
+	return 0;
+}
+
 static int 
 schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 {
@@ -1593,6 +1792,38 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	return 0;
 }
 
+/*
+ * called on a bitmap cache miss: if it follows closely on the last one,
+ * read ahead the bitmaps of the next few allocated blocks.
+ */
+static void
+prefetch_bitmaps(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+	uint32_t next;
+
+	if (blk <= s->bm_last_miss ||
+	    blk - s->bm_last_miss > VHD_CACHE_PREFETCH + 1) {
+		s->bm_last_miss = blk;
+		return;
+	}
+
+	next = blk;
+	for (i = 0; i < VHD_CACHE_PREFETCH; i++) {
+		if (++next >= s->bat.bat.entries)
+			break;
+
+		if (bat_entry(s, next) == DD_BLK_UNUSED ||
+		    test_batmap(s, next) || get_bitmap(s, next))
+			continue;
+
+		if (schedule_bitmap_read(s, next))
+			break;
+	}
+
+	s->bm_last_miss = next;
+}
+
 static void
 schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 {
@@ -1608,8 +1839,8 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC));
+		offset = bm->alloc_offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1670,6 +1901,9 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+static void
+vhd_queue_discard(td_driver_t *driver, td_request_t treq);
+
 static void
 vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -1716,6 +1950,8 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 			err = __vhd_queue_request(s, VHD_OP_DATA_READ, clone);
 			if (err)
 				goto fail;
+
+			prefetch_bitmaps(s, clone.sec / s->spb);
 			break;
 
 		case VHD_BM_READ_PENDING:
@@ -1774,6 +2010,13 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
 				      VHD_FLAG_REQ_UPDATE_BITMAP);
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (s->vhd.footer.type == HD_TYPE_DYNAMIC &&
+			    tapdisk_buffer_is_zero(clone.buf,
+						   vhd_sectors_to_bytes(clone.secs))) {
+				s->zero_size += clone.secs;
+				td_complete_request(clone, 0);
+				break;
+			}
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -1803,6 +2046,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
 			if (err)
 				goto fail;
+
+			prefetch_bitmaps(s, clone.sec / s->spb);
 			break;
 
 		case VHD_BM_READ_PENDING:
@@ -1829,6 +2074,95 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * drop the contents of a range: blocks not allocated have none, and blocks
+ * marked full in the batmap keep their bits, since the batmap isn't
+ * rewritten; reads of them see the hole.
+ */
+static void
+vhd_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	s->discard_size += treq.secs;
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		td_complete_request(treq,
+				    vhd_punch_hole(s, treq.sec, treq.secs));
+		return;
+	}
+
+	while (treq.secs) {
+		int err;
+		u32 blk;
+		td_request_t clone;
+
+		err        = 0;
+		clone      = treq;
+		clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+		blk        = clone.sec / s->spb;
+
+		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DISCARD)) {
+		case -EINVAL:
+			err = -EINVAL;
+			goto fail;
+
+		case VHD_BM_BAT_CLEAR:
+			td_complete_request(clone, 0);
+			break;
+
+		case VHD_BM_BIT_CLEAR:
+		case VHD_BM_BIT_SET:
+			if (test_batmap(s, blk)) {
+				err = vhd_punch_hole(s, bat_entry(s, blk) +
+						     s->bm_secs +
+						     clone.sec % s->spb,
+						     clone.secs);
+				td_complete_request(clone, err);
+				break;
+			}
+
+			err = schedule_discard(s, clone);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_NOT_CACHED:
+			err = schedule_bitmap_read(s, blk);
+			if (err)
+				goto fail;
+
+			err = __vhd_queue_request(s, VHD_OP_DISCARD, clone);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_READ_PENDING:
+			err = __vhd_queue_request(s, VHD_OP_DISCARD, clone);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_BAT_LOCKED:
+		default:
+			ASSERT(0);
+			break;
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		continue;
+
+	fail:
+		clone.secs = treq.secs;
+		td_complete_request(clone, err);
+		break;
+	}
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -1857,10 +2191,25 @@ signal_completion(struct vhd_request *list, int error)
 	}
 }
 
+/* apply a finished write, or discard, to the shadow bitmap */
+static void
+update_shadow(struct vhd_state *s, struct vhd_bitmap *bm,
+	      struct vhd_request *req)
+{
+	int i;
+	u32 sec = req->treq.sec % s->spb;
+
+	for (i = 0; i < req->treq.secs; i++)
+		if (req->op == VHD_OP_DISCARD)
+			vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+		else
+			vhd_bitmap_set(&s->vhd, bm->shadow, sec + i);
+}
+
 static void
 start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i, error = 0;
+	int error = 0;
 	struct vhd_transaction *tx;
 	struct vhd_request *r, *next;
 
@@ -1873,7 +2222,8 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 	tx = &bm->tx;
 	clear_req_list(&bm->queue);
 
-	if (r && bat_entry(s, bm->blk) == DD_BLK_UNUSED)
+	if (r && bat_entry(s, bm->blk) == DD_BLK_UNUSED &&
+	    !test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC))
 		tx->error = -EIO;
 
 	while (r) {
@@ -1884,12 +2234,8 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		add_to_transaction(tx, r);
 		if (test_vhd_flag(r->flags, VHD_FLAG_REQ_FINISHED)) {
 			tx->finished++;
-			if (!r->error) {
-				u32 sec = r->treq.sec % s->spb;
-				for (i = 0; i < r->treq.secs; i++)
-					vhd_bitmap_set(&s->vhd,
-						       bm->shadow, sec + i);
-			}
+			if (!r->error)
+				update_shadow(s, bm, r);
 		}
 		r = next;
 	}
@@ -1899,32 +2245,6 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		finish_data_transaction(s, bm);
 }
 
-static void
-finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
-{
-	struct vhd_transaction *tx = &bm->tx;
-
-	if (!bat_locked(s))
-		return;
-
-	if (s->bat.pbw_blk != bm->blk)
-		return;
-
-	if (!s->bat.req.error)
-		goto release;
-
-	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
-		goto release;
-
-	tx->closed = 1;
-	return;
-
- release:
-	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
-}
-
 static void
 finish_bitmap_transaction(struct vhd_state *s,
 			  struct vhd_bitmap *bm, int error)
@@ -1936,15 +2256,10 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC)) {
+		/* still waiting for bat write */
+		set_vhd_flag(tx->status, VHD_FLAG_TX_WAIT_BAT);
+		return;
 	}
 
 	if (tx->error) {
@@ -1964,8 +2279,6 @@ finish_bitmap_transaction(struct vhd_state *s,
 
 	if (!bitmap_in_use(bm))
 		unlock_bitmap(bm);
-
-	finish_bat_transaction(s, bm);
 }
 
 static void
@@ -1986,42 +2299,43 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_write(struct vhd_request *req)
 {
-	struct vhd_bitmap *bm;
+	struct vhd_bitmap *bm, *next;
 	struct vhd_transaction *tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	ASSERT(test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	bm = s->bat.batch;
+	s->bat.batch = NULL;
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	for (; bm; bm = next) {
+		next = bm->bat_next;
+		tx   = &bm->tx;
+		bm->bat_next = NULL;
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+		DBG(TLOG_DBG, "blk 0x%04x, offset: 0x%08"PRIx64", err %d\n",
+		    bm->blk, bm->alloc_offset, req->error);
+		ASSERT(bitmap_valid(bm));
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
-		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
+		release_new_block(s, bm);
+
+		if (!req->error)
+			bat_entry(s, bm->blk) = bm->alloc_offset;
+		else if (test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
+			tx->error = req->error;
+
+		if (test_vhd_flag(tx->status, VHD_FLAG_TX_WAIT_BAT)) {
+			clear_vhd_flag(tx->status, VHD_FLAG_TX_WAIT_BAT);
 			finish_bitmap_transaction(s, bm, req->error);
+		} else if (!bitmap_in_use(bm))
+			unlock_bitmap(bm);
 	}
 
-	finish_bat_transaction(s, bm);
+	schedule_bat_write(s);
 }
 
 static void
@@ -2039,31 +2353,56 @@ finish_zero_bm_write(struct vhd_request *req)
 	bm  = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
+	ASSERT(test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		release_new_block(s, bm);
 		tx->error = req->error;
-		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
 	} else
-		schedule_bat_write(s);
+		queue_bat_write(s, bm);
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
 }
 
+/* resubmit requests which were waiting for a bitmap */
 static void
-finish_bitmap_read(struct vhd_request *req)
+requeue_waiting_requests(struct vhd_state *s, struct vhd_request *r)
+{
+	struct vhd_request *next;
+
+	while (r) {
+		struct vhd_request tmp;
+
+		tmp  = *r;
+		next =  r->next;
+		free_vhd_request(s, r);
+
+		ASSERT(tmp.op == VHD_OP_DATA_READ || 
+		       tmp.op == VHD_OP_DATA_WRITE ||
+		       tmp.op == VHD_OP_DISCARD);
+
+		if (tmp.op == VHD_OP_DATA_READ)
+			vhd_queue_read(s->driver, tmp.treq);
+		else if (tmp.op == VHD_OP_DATA_WRITE)
+			vhd_queue_write(s->driver, tmp.treq);
+		else if (tmp.op == VHD_OP_DISCARD)
+			vhd_queue_discard(s->driver, tmp.treq);
+
+		r = next;
+	}
+}
+
+static void
+finish_zero_block_write(struct vhd_request *req)
 {
 	u32 blk;
 	struct vhd_bitmap  *bm;
-	struct vhd_request *r, *next;
+	struct vhd_request *r;
 	struct vhd_state   *s = req->state;
 
 	s->returned++;
@@ -2072,33 +2411,53 @@ finish_bitmap_read(struct vhd_request *req)
 	blk = req->treq.sec / s->spb;
 	bm  = get_bitmap(s, blk);
 
-	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", blk, req->error);
 	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
+	ASSERT(test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC));
 
 	r = bm->waiting.head;
 	clear_req_list(&bm->waiting);
 	clear_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
 
-	if (!req->error) {
-		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
+	if (req->error) {
+		int err = req->error;
+		release_new_block(s, bm);
+		unlock_bitmap(bm);
+		free_vhd_bitmap(s, bm);
+		return signal_completion(r, err);
+	}
 
-		while (r) {
-			struct vhd_request tmp;
+	queue_bat_write(s, bm);
+	requeue_waiting_requests(s, r);
+
+	if (!bitmap_in_use(bm))
+		unlock_bitmap(bm);
+}
+
+static void
+finish_bitmap_read(struct vhd_request *req)
+{
+	u32 blk;
+	struct vhd_bitmap  *bm;
+	struct vhd_request *r;
+	struct vhd_state   *s = req->state;
 
-			tmp  = *r;
-			next =  r->next;
-			free_vhd_request(s, r);
+	s->returned++;
+	TRACE(s);
 
-			ASSERT(tmp.op == VHD_OP_DATA_READ || 
-			       tmp.op == VHD_OP_DATA_WRITE);
+	blk = req->treq.sec / s->spb;
+	bm  = get_bitmap(s, blk);
 
-			if (tmp.op == VHD_OP_DATA_READ)
-				vhd_queue_read(s->driver, tmp.treq);
-			else if (tmp.op == VHD_OP_DATA_WRITE)
-				vhd_queue_write(s->driver, tmp.treq);
+	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
+	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
 
-			r = next;
-		}
+	r = bm->waiting.head;
+	clear_req_list(&bm->waiting);
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
+
+	if (!req->error) {
+		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
+		requeue_waiting_requests(s, r);
 	} else {
 		int err = req->error;
 		unlock_bitmap(bm);
@@ -2149,18 +2508,16 @@ finish_data_read(struct vhd_request *req)
 static void
 finish_data_write(struct vhd_request *req)
 {
-	int i;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = (struct vhd_state *)req->state;
 
 	set_vhd_flag(req->flags, VHD_FLAG_REQ_FINISHED);
 
 	if (tx) {
-		u32 blk, sec;
+		u32 blk;
 		struct vhd_bitmap *bm;
 
 		blk = req->treq.sec / s->spb;
-		sec = req->treq.sec % s->spb;
 		bm  = get_bitmap(s, blk);
 
 		ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
@@ -2172,8 +2529,7 @@ finish_data_write(struct vhd_request *req)
 		    req->treq.sec / s->spb, tx->started, tx->finished);
 
 		if (!req->error)
-			for (i = 0; i < req->treq.secs; i++)
-				vhd_bitmap_set(&s->vhd, bm->shadow,  sec + i);
+			update_shadow(s, bm, req);
 
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
@@ -2226,6 +2582,10 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_zero_bm_write(req);
 		break;
 
+	case VHD_OP_ZERO_BLOCK_WRITE:
+		finish_zero_block_write(req);
+		break;
+
 	case VHD_OP_BAT_WRITE:
 		finish_bat_write(req);
 		break;
@@ -2240,6 +2600,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2249,6 +2610,8 @@ vhd_debug(td_driver_t *driver)
 	    s->writes, (s->writes ? ((float)s->write_size / s->writes) : 0.0));
 	DBG(TLOG_WARN, "READS: 0x%08"PRIx64", AVG_READ_SIZE: %f\n",
 	    s->reads, (s->reads ? ((float)s->read_size / s->reads) : 0.0));
+	DBG(TLOG_WARN, "ZEROES SKIPPED: 0x%08"PRIx64", DISCARDED: 0x%08"PRIx64"\n",
+	    s->zero_size, s->discard_size);
 
 	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%lu total)\n", VHD_REQS_DATA);
 	for (i = 0; i < VHD_REQS_DATA; i++) {
@@ -2261,16 +2624,13 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: (%u total)\n", s->bm_cache_size);
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2293,14 +2653,20 @@ vhd_debug(td_driver_t *driver)
 		DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%08x, q: %p, qnum: %d, w: %p, "
 		    "wnum: %d, locked: %d, in use: %d, tx: %p, tx_error: %d, "
 		    "started: %d, finished: %d, status: %u, reqs: %p, nreqs: %d\n",
-		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
-		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
-		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
+		    i++, bm->blk, bm->status, bm->queue.head, qnum,
+		    bm->waiting.head, wnum, bitmap_locked(bm), bitmap_in_use(bm),
+		    tx, tx->error, tx->started, tx->finished, tx->status,
+		    tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, pending: %d\n",
+	    s->bat.status, s->bat.pending);
+	for (bm = s->bat.batch; bm; bm = bm->bat_next)
+		DBG(TLOG_WARN, "  writing: blk: 0x%04x, offset: 0x%08"PRIx64"\n",
+		    bm->blk, bm->alloc_offset);
+	for (bm = s->bat.queue; bm; bm = bm->bat_next)
+		DBG(TLOG_WARN, "  queued: blk: 0x%04x, offset: 0x%08"PRIx64"\n",
+		    bm->blk, bm->alloc_offset);
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2319,4 +2685,6 @@ struct tap_disk tapdisk_vhd = {
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_get_block_map   = vhd_get_block_map,
+	.td_queue_discard   = vhd_queue_discard,
 };
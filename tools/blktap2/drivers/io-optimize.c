@@ -211,6 +211,10 @@ merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	if (!contiguous_iocbs(head, io))
 		return -EINVAL;
 
+	if (ctx->max_merge &&
+	    head->u.c.nbytes + io->u.c.nbytes > ctx->max_merge)
+		return -EINVAL;
+
 	return merge_tail(ctx, head, io);		
 }
 
@@ -51,6 +51,7 @@ struct opio {
 };
 
 struct opioctx {
+	unsigned long       max_merge;    /* bytes, 0: no limit */
 	int                 num_opios;
 	int                 free_opio_cnt;
 	struct opio        *opios;
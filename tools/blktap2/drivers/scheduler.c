@@ -25,7 +25,10 @@
  * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -34,6 +37,10 @@
 #include "scheduler.h"
 #include "tapdisk-log.h"
 
+#ifdef SCHEDULER_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #define DBG(_f, _a...)               tlog_write(TLOG_DBG, _f, ##_a)
 
 #define SCHEDULER_MAX_TIMEOUT        600
@@ -41,6 +48,11 @@
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
 
+/* Ready fds taken from the kernel per wait. */
+#define SCHEDULER_MAX_READY          64
+
+#define SCHEDULER_WHEEL_MASK        (SCHEDULER_WHEEL_SIZE - 1)
+
 #define MIN(a, b)                   ((a) <= (b) ? (a) : (b))
 #define MAX(a, b)                   ((a) >= (b) ? (a) : (b))
 
@@ -59,8 +71,372 @@ typedef struct event {
 	void                        *private;
 
 	struct list_head             next;
+#ifdef SCHEDULER_USE_EPOLL
+	struct list_head             fd_next;
+	struct list_head             timer_next;
+#endif
 } event_t;
 
+#ifdef SCHEDULER_USE_EPOLL
+
+/*
+ * epoll backend.  Fd events are grouped by fd, and the fd is watched
+ * for the union of their modes; a wakeup only visits the fds reported
+ * ready.  Timeouts sit on a wheel of one-second slots, so arming one is
+ * O(1) and a wakeup only visits the slots that have come due.
+ */
+
+static struct list_head *
+scheduler_fd_events(scheduler_t *s, int fd)
+{
+	struct list_head **fds;
+	int i, nr;
+
+	if (fd < s->nr_fds && s->fds[fd])
+		return s->fds[fd];
+
+	if (fd >= s->nr_fds) {
+		nr  = MAX(fd + 1, 2 * s->nr_fds);
+		fds = realloc(s->fds, nr * sizeof(*fds));
+		if (!fds)
+			return NULL;
+		for (i = s->nr_fds; i < nr; i++)
+			fds[i] = NULL;
+		s->fds    = fds;
+		s->nr_fds = nr;
+	}
+
+	s->fds[fd] = malloc(sizeof(struct list_head));
+	if (s->fds[fd])
+		INIT_LIST_HEAD(s->fds[fd]);
+
+	return s->fds[fd];
+}
+
+static int
+scheduler_update_fd(scheduler_t *s, int fd)
+{
+	event_t *event;
+	struct epoll_event ev;
+	int err;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+
+	list_for_each_entry(event, s->fds[fd], fd_next) {
+		if (event->mode & SCHEDULER_POLL_READ_FD)
+			ev.events |= EPOLLIN;
+		if (event->mode & SCHEDULER_POLL_WRITE_FD)
+			ev.events |= EPOLLOUT;
+		if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+			ev.events |= EPOLLPRI;
+	}
+
+	if (!ev.events) {
+		/* The fd may well be closed already. */
+		epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		return 0;
+	}
+
+	/* A closed and reused fd has silently left the epoll set. */
+	err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	if (err && errno == ENOENT)
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+	return err ? -errno : 0;
+}
+
+static void
+scheduler_arm_timer(scheduler_t *s, event_t *event)
+{
+	list_add_tail(&event->timer_next,
+		      &s->wheel[event->deadline & SCHEDULER_WHEEL_MASK]);
+}
+
+static int
+scheduler_add_event(scheduler_t *s, event_t *event)
+{
+	struct list_head *head;
+	int err;
+
+	INIT_LIST_HEAD(&event->fd_next);
+	INIT_LIST_HEAD(&event->timer_next);
+
+	if (event->mode & SCHEDULER_POLL_FD) {
+		if (event->fd < 0)
+			return -EBADF;
+
+		head = scheduler_fd_events(s, event->fd);
+		if (!head)
+			return -ENOMEM;
+
+		list_add_tail(&event->fd_next, head);
+		err = scheduler_update_fd(s, event->fd);
+		if (err) {
+			list_del_init(&event->fd_next);
+			scheduler_update_fd(s, event->fd);
+			return err;
+		}
+	}
+
+	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
+		scheduler_arm_timer(s, event);
+		s->nr_timers++;
+	}
+
+	return 0;
+}
+
+static void
+scheduler_remove_event(scheduler_t *s, event_t *event)
+{
+	if (event->mode & SCHEDULER_POLL_FD) {
+		list_del_init(&event->fd_next);
+		scheduler_update_fd(s, event->fd);
+	}
+
+	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
+		list_del_init(&event->timer_next);
+		s->nr_timers--;
+	}
+
+	/* Callbacks further up the stack may still hold it. */
+	if (s->depth) {
+		list_add_tail(&event->next, &s->dead);
+		return;
+	}
+
+	free(event);
+}
+
+static void
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
+{
+	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		event->deadline = now.tv_sec + event->timeout;
+
+		list_del(&event->timer_next);
+		scheduler_arm_timer(s, event);
+	}
+
+	event->cb(event->id, mode, event->private);
+}
+
+/* Seconds until the next timeout, or limit if none is due before. */
+static int
+scheduler_next_timeout(scheduler_t *s, int now, int limit)
+{
+	event_t *event;
+	int t;
+
+	if (!s->nr_timers)
+		return limit;
+
+	/* Anything left behind since the last run is due now. */
+	t = MAX(MIN(s->wheel_time, now), now - SCHEDULER_WHEEL_MASK);
+	for (; t <= now + limit; t++)
+		list_for_each_entry(event, &s->wheel[t & SCHEDULER_WHEEL_MASK],
+				    timer_next)
+			if (event->deadline <= t)
+				return MAX(t - now, 0);
+
+	return limit;
+}
+
+static void
+scheduler_run_fd(scheduler_t *s, int fd, uint32_t revents)
+{
+	event_t *event;
+	char mode;
+
+	/* As with select(), errors and hangups read and write. */
+	if (revents & (EPOLLERR | EPOLLHUP))
+		revents |= EPOLLIN | EPOLLOUT;
+
+	/*
+	 * Each ready mode goes to the first event wanting it.  The list
+	 * is walked again after every callback, which may change it.
+	 */
+again:
+	if (fd >= s->nr_fds || !s->fds[fd])
+		return;
+
+	list_for_each_entry(event, s->fds[fd], fd_next) {
+		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
+		    (revents & EPOLLIN)) {
+			revents &= ~EPOLLIN;
+			mode = SCHEDULER_POLL_READ_FD;
+		} else if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+			   (revents & EPOLLOUT)) {
+			revents &= ~EPOLLOUT;
+			mode = SCHEDULER_POLL_WRITE_FD;
+		} else if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+			   (revents & EPOLLPRI)) {
+			revents &= ~EPOLLPRI;
+			mode = SCHEDULER_POLL_EXCEPT_FD;
+		} else
+			continue;
+
+		scheduler_event_callback(s, event, mode);
+		goto again;
+	}
+}
+
+static void
+scheduler_run_timers(scheduler_t *s, int now)
+{
+	struct list_head expired, *slot;
+	event_t *event, *tmp;
+	int t, end;
+
+	INIT_LIST_HEAD(&expired);
+
+	if (now < s->wheel_time)
+		s->wheel_time = now;
+
+	/* A full turn visits every slot. */
+	end = MIN(now, s->wheel_time + SCHEDULER_WHEEL_SIZE - 1);
+
+	for (t = s->wheel_time; t <= end; t++) {
+		slot = &s->wheel[t & SCHEDULER_WHEEL_MASK];
+		list_for_each_entry_safe(event, tmp, slot, timer_next)
+			if (event->deadline <= now) {
+				list_del(&event->timer_next);
+				list_add_tail(&event->timer_next, &expired);
+			}
+	}
+
+	s->wheel_time = now;
+
+	/* Callbacks may unregister any of these: always take the head. */
+	while (!list_empty(&expired)) {
+		event = list_entry(expired.next, event_t, timer_next);
+		scheduler_event_callback(s, event, SCHEDULER_POLL_TIMEOUT);
+	}
+}
+
+static void
+scheduler_reap_events(scheduler_t *s)
+{
+	event_t *event, *tmp;
+
+	if (s->depth)
+		return;
+
+	list_for_each_entry_safe(event, tmp, &s->dead, next) {
+		list_del(&event->next);
+		free(event);
+	}
+}
+
+int
+scheduler_wait_for_events(scheduler_t *s)
+{
+	struct epoll_event ready[SCHEDULER_MAX_READY];
+	struct timeval now;
+	int i, ret, ms;
+
+	gettimeofday(&now, NULL);
+
+	s->timeout = MIN(SCHEDULER_MAX_TIMEOUT, s->max_timeout);
+	s->timeout = scheduler_next_timeout(s, now.tv_sec, s->timeout);
+
+	DBG("timeout: %d, max_timeout: %d\n",
+	    s->timeout, s->max_timeout);
+
+	ms = s->timeout * 1000;
+	if (s->max_timeout_us)
+		ms = MIN(ms, (s->max_timeout_us + 999) / 1000);
+
+	ret = epoll_wait(s->epoll_fd, ready, SCHEDULER_MAX_READY, ms);
+
+	s->restart        = 0;
+	s->timeout        = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout    = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout_us = 0;
+
+	if (ret < 0)
+		return ret;
+
+	s->depth++;
+
+	for (i = 0; i < ret; i++)
+		scheduler_run_fd(s, ready[i].data.fd, ready[i].events);
+
+	gettimeofday(&now, NULL);
+	scheduler_run_timers(s, now.tv_sec);
+
+	s->depth--;
+	scheduler_reap_events(s);
+
+	return ret;
+}
+
+int
+scheduler_initialize(scheduler_t *s)
+{
+	int i;
+
+	memset(s, 0, sizeof(scheduler_t));
+
+	s->uuid = 1;
+
+	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->dead);
+	for (i = 0; i < SCHEDULER_WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&s->wheel[i]);
+
+	s->wheel_time = time(NULL);
+
+	s->epoll_fd = epoll_create(SCHEDULER_MAX_READY);
+	if (s->epoll_fd == -1)
+		return -errno;
+
+	fcntl(s->epoll_fd, F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+void
+scheduler_close(scheduler_t *s)
+{
+	event_t *event, *tmp;
+	int i;
+
+	scheduler_for_each_event(s, event, tmp) {
+		list_del(&event->next);
+		free(event);
+	}
+
+	for (i = 0; i < s->nr_fds; i++)
+		free(s->fds[i]);
+	free(s->fds);
+	s->fds    = NULL;
+	s->nr_fds = 0;
+
+	if (s->epoll_fd != -1) {
+		close(s->epoll_fd);
+		s->epoll_fd = -1;
+	}
+}
+
+#else /* SCHEDULER_USE_EPOLL */
+
+static int
+scheduler_add_event(scheduler_t *s, event_t *event)
+{
+	return 0;
+}
+
+static void
+scheduler_remove_event(scheduler_t *s, event_t *event)
+{
+	free(event);
+	s->restart = 1;
+}
+
 static void
 scheduler_prepare_events(scheduler_t *s)
 {
@@ -160,12 +536,77 @@ scheduler_run_events(scheduler_t *s)
 	}
 }
 
+int
+scheduler_wait_for_events(scheduler_t *s)
+{
+	int ret;
+	struct timeval tv;
+
+	scheduler_prepare_events(s);
+
+	tv.tv_sec  = s->timeout;
+	tv.tv_usec = 0;
+	if (s->max_timeout_us &&
+	    s->max_timeout_us < (long long)s->timeout * 1000000) {
+		tv.tv_sec  = s->max_timeout_us / 1000000;
+		tv.tv_usec = s->max_timeout_us % 1000000;
+	}
+
+	DBG("timeout: %d, max_timeout: %d\n",
+	    s->timeout, s->max_timeout);
+
+	ret = select(s->max_fd + 1, &s->read_fds,
+		     &s->write_fds, &s->except_fds, &tv);
+
+	s->restart        = 0;
+	s->timeout        = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout    = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout_us = 0;
+
+	if (ret < 0)
+		return ret;
+
+	scheduler_run_events(s);
+
+	return ret;
+}
+
+int
+scheduler_initialize(scheduler_t *s)
+{
+	memset(s, 0, sizeof(scheduler_t));
+
+	s->uuid = 1;
+
+	FD_ZERO(&s->read_fds);
+	FD_ZERO(&s->write_fds);
+	FD_ZERO(&s->except_fds);
+
+	INIT_LIST_HEAD(&s->events);
+
+	return 0;
+}
+
+void
+scheduler_close(scheduler_t *s)
+{
+	event_t *event, *tmp;
+
+	scheduler_for_each_event(s, event, tmp) {
+		list_del(&event->next);
+		free(event);
+	}
+}
+
+#endif /* SCHEDULER_USE_EPOLL */
+
 int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
 	event_t *event;
 	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -187,10 +628,17 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	event->deadline = now.tv_sec + timeout;
 	event->cb       = cb;
 	event->private  = private;
+
+	err = scheduler_add_event(s, event);
+	if (err) {
+		free(event);
+		return err;
+	}
+
 	event->id       = s->uuid++;
 
-	if (!s->uuid)
-		s->uuid++;
+	if (s->uuid > SCHEDULER_EVENT_ID_MAX)
+		s->uuid = 1;
 
 	list_add_tail(&event->next, &s->events);
 
@@ -208,8 +656,7 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 	scheduler_for_each_event(s, event, tmp)
 		if (event->id == id) {
 			list_del(&event->next);
-			free(event);
-			s->restart = 1;
+			scheduler_remove_event(s, event);
 			break;
 		}
 }
@@ -221,45 +668,13 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 		s->max_timeout = MIN(s->max_timeout, timeout);
 }
 
-int
-scheduler_wait_for_events(scheduler_t *s)
-{
-	int ret;
-	struct timeval tv;
-
-	scheduler_prepare_events(s);
-
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
-
-	DBG("timeout: %d, max_timeout: %d\n",
-	    s->timeout, s->max_timeout);
-
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
-
-	s->restart     = 0;
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
-	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
-
-	if (ret < 0)
-		return ret;
-
-	scheduler_run_events(s);
-
-	return ret;
-}
-
+/* Like scheduler_set_max_timeout, for waits shorter than a second. */
 void
-scheduler_initialize(scheduler_t *s)
+scheduler_set_max_timeout_us(scheduler_t *s, int usecs)
 {
-	memset(s, 0, sizeof(scheduler_t));
-
-	s->uuid = 1;
-
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	if (usecs <= 0)
+		return;
 
-	INIT_LIST_HEAD(&s->events);
+	if (!s->max_timeout_us || usecs < s->max_timeout_us)
+		s->max_timeout_us = usecs;
 }
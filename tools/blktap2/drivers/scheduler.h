@@ -32,18 +32,46 @@
 
 #include "list.h"
 
+#if defined(__linux__)
+#define SCHEDULER_USE_EPOLL
+#endif
+
 #define SCHEDULER_POLL_READ_FD       0x1
 #define SCHEDULER_POLL_WRITE_FD      0x2
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+/* Event ids wrap within this many bits; callers may use the rest. */
+#define SCHEDULER_EVENT_ID_BITS      24
+#define SCHEDULER_EVENT_ID_MAX       ((1 << SCHEDULER_EVENT_ID_BITS) - 1)
+
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+/* Seconds covered by the timer wheel: a power of two. */
+#define SCHEDULER_WHEEL_SIZE         1024
+
 typedef struct scheduler {
+#ifdef SCHEDULER_USE_EPOLL
+	int                          epoll_fd;
+
+	/* Events by fd, nr_fds entries, allocated on demand. */
+	struct list_head           **fds;
+	int                          nr_fds;
+
+	/* Timeout events, by deadline modulo the wheel size. */
+	struct list_head             wheel[SCHEDULER_WHEEL_SIZE];
+	int                          wheel_time;
+	int                          nr_timers;
+
+	/* Events unregistered while running callbacks. */
+	struct list_head             dead;
+	int                          depth;
+#else
 	fd_set                       read_fds;
 	fd_set                       write_fds;
 	fd_set                       except_fds;
+#endif
 
 	struct list_head             events;
 
@@ -52,14 +80,17 @@ typedef struct scheduler {
 	int                          timeout;
 	int                          restart;
 	int                          max_timeout;
+	int                          max_timeout_us; /* 0: none */
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
+void scheduler_close(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
 void scheduler_unregister_event(scheduler_t *,  event_id_t);
 void scheduler_set_max_timeout(scheduler_t *, int);
+void scheduler_set_max_timeout_us(scheduler_t *, int);
 int scheduler_wait_for_events(scheduler_t *);
 
 #endif
@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <xenctrl.h>
+#include <xen/grant_table.h>
+#include <xen/io/protocols.h>
+
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-blkif.h"
+
+#define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#define blkif_page(_blkif, _idx, _seg)					\
+	((_blkif)->buf +						\
+	 ((_idx) * BLKIF_MAX_SEGMENTS_PER_REQUEST + (_seg)) * XC_PAGE_SIZE)
+
+static inline td_blkif_request_t *
+tapdisk_blkif_request(td_vbd_request_t *vreq)
+{
+	return (td_blkif_request_t *)vreq;
+}
+
+static inline void
+tapdisk_blkif_move_request(td_blkif_request_t *breq, struct list_head *dest)
+{
+	list_del(&breq->next);
+	list_add_tail(&breq->next, dest);
+}
+
+static int
+tapdisk_blkif_check_request(td_blkif_request_t *breq)
+{
+	int i;
+	blkif_request_t *req = &breq->req;
+
+	/*
+	 * no data to copy: the vbd checks the range.  Frontends only send
+	 * these if the toolstack advertised feature-discard for the vbd.
+	 */
+	if (req->operation == BLKIF_OP_DISCARD)
+		return BLKIF_RSP_OKAY;
+
+	if (req->operation != BLKIF_OP_READ &&
+	    req->operation != BLKIF_OP_WRITE)
+		return BLKIF_RSP_EOPNOTSUPP;
+
+	if (!req->nr_segments ||
+	    req->nr_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST)
+		return BLKIF_RSP_ERROR;
+
+	for (i = 0; i < req->nr_segments; i++)
+		if (req->seg[i].first_sect > req->seg[i].last_sect ||
+		    req->seg[i].last_sect >= XC_PAGE_SIZE >> SECTOR_SHIFT)
+			return BLKIF_RSP_ERROR;
+
+	return BLKIF_RSP_OKAY;
+}
+
+/*
+ * Queue a copy of each segment of @breq between the guest and the local
+ * buffer, in the direction given by @flags.  Returns the number queued.
+ */
+static int
+tapdisk_blkif_queue_copy(td_blkif_t *blkif, td_blkif_request_t *breq,
+			 int n, uint16_t flags)
+{
+	int i, offset;
+	char *page;
+	blkif_request_t *req = &breq->req;
+	xc_gnttab_grant_copy_segment_t *seg;
+
+	for (i = 0; i < req->nr_segments; i++) {
+		seg    = &blkif->segs[n + i];
+		offset = req->seg[i].first_sect << SECTOR_SHIFT;
+		page   = breq->buf + i * XC_PAGE_SIZE + offset;
+
+		memset(seg, 0, sizeof(*seg));
+		seg->len   = (req->seg[i].last_sect -
+			      req->seg[i].first_sect + 1) << SECTOR_SHIFT;
+		seg->flags = flags;
+
+		if (flags == GNTCOPY_source_gref) {
+			seg->source.foreign.ref    = req->seg[i].gref;
+			seg->source.foreign.offset = offset;
+			seg->source.foreign.domid  = blkif->domid;
+			seg->dest.virt             = page;
+		} else {
+			seg->source.virt           = page;
+			seg->dest.foreign.ref      = req->seg[i].gref;
+			seg->dest.foreign.offset   = offset;
+			seg->dest.foreign.domid    = blkif->domid;
+		}
+	}
+
+	return req->nr_segments;
+}
+
+/*
+ * Issue the copies queued for @list, all in one call, and fail each
+ * request any of whose segments did not make it.
+ */
+static void
+tapdisk_blkif_copy(td_blkif_t *blkif, struct list_head *list, int n)
+{
+	int i, err;
+	td_blkif_request_t *breq;
+
+	if (!n)
+		return;
+
+	err = xc_gnttab_grant_copy(blkif->xcg, n, blkif->segs);
+	if (err)
+		err = -errno;
+
+	blkif->copies++;
+	i = 0;
+
+	list_for_each_entry(breq, list, next) {
+		int j, nsegs = breq->req.nr_segments;
+
+		if (breq->status != BLKIF_RSP_OKAY)
+			continue;
+
+		for (j = 0; j < nsegs; j++)
+			if (err || blkif->segs[i + j].status != GNTST_okay)
+				breq->status = BLKIF_RSP_ERROR;
+
+		if (breq->status != BLKIF_RSP_OKAY) {
+			blkif->copy_errors++;
+			ERR(err ? : -EIO, "%s: grant copy for req %"PRIu64
+			    " failed\n", blkif->vbd->name, breq->req.id);
+		}
+
+		i += nsegs;
+	}
+}
+
+static void
+tapdisk_blkif_queue_vbd_request(td_blkif_t *blkif, td_blkif_request_t *breq)
+{
+	td_vbd_t *vbd = blkif->vbd;
+	td_vbd_request_t *vreq = &breq->vreq;
+
+	memset(vreq, 0, sizeof(*vreq));
+	memcpy(&vreq->req, &breq->req, sizeof(blkif_request_t));
+	vreq->vbd   = vbd;
+	vreq->buf   = breq->buf;
+	vreq->blkif = blkif;
+	INIT_LIST_HEAD(&vreq->next);
+
+	vbd->received++;
+	blkif->n_pending++;
+	list_add_tail(&vreq->next, &vbd->new_requests);
+}
+
+static void
+tapdisk_blkif_pull_requests(td_blkif_t *blkif)
+{
+	int n, more;
+	RING_IDX rp, rc;
+	td_blkif_request_t *breq, *tmp;
+	struct list_head reads, writes;
+
+	INIT_LIST_HEAD(&reads);
+	INIT_LIST_HEAD(&writes);
+	n = 0;
+
+	do {
+		rp = blkif->ring.sring->req_prod;
+		xen_rmb();
+
+		for (rc = blkif->ring.req_cons; rc != rp; rc++) {
+			/*
+			 * a slot is only freed once its response is on the
+			 * ring, so the frontend can't outrun the pool.
+			 */
+			if (list_empty(&blkif->free)) {
+				EPRINTF("%s: ring overflow\n",
+					blkif->vbd->name);
+				goto copy;
+			}
+
+			breq = list_entry(blkif->free.next,
+					  td_blkif_request_t, next);
+			memcpy(&breq->req,
+			       RING_GET_REQUEST(&blkif->ring, rc),
+			       sizeof(blkif_request_t));
+			blkif->ring.req_cons = rc + 1;
+			blkif->received++;
+
+			breq->status = tapdisk_blkif_check_request(breq);
+			if (breq->status != BLKIF_RSP_OKAY) {
+				tapdisk_blkif_move_request(breq,
+							   &blkif->completed);
+				continue;
+			}
+
+			if (breq->req.operation == BLKIF_OP_WRITE) {
+				n += tapdisk_blkif_queue_copy(blkif, breq, n,
+							      GNTCOPY_source_gref);
+				tapdisk_blkif_move_request(breq, &writes);
+			} else
+				tapdisk_blkif_move_request(breq, &reads);
+		}
+
+		RING_FINAL_CHECK_FOR_REQUESTS(&blkif->ring, more);
+	} while (more);
+
+copy:
+	/* write data is all copied in, in one go, before anything is issued */
+	tapdisk_blkif_copy(blkif, &writes, n);
+
+	list_for_each_entry_safe(breq, tmp, &writes, next) {
+		if (breq->status != BLKIF_RSP_OKAY) {
+			tapdisk_blkif_move_request(breq, &blkif->completed);
+			continue;
+		}
+
+		list_del(&breq->next);
+		tapdisk_blkif_queue_vbd_request(blkif, breq);
+	}
+
+	list_for_each_entry_safe(breq, tmp, &reads, next) {
+		list_del(&breq->next);
+		tapdisk_blkif_queue_vbd_request(blkif, breq);
+	}
+
+	tapdisk_vbd_issue_requests(blkif->vbd);
+}
+
+static void
+tapdisk_blkif_event(event_id_t id, char mode, void *private)
+{
+	evtchn_port_or_error_t port;
+	td_blkif_t *blkif = private;
+
+	port = xc_evtchn_pending(blkif->xce);
+	if (port < 0) {
+		EPRINTF("%s: reading event channel: %d\n",
+			blkif->vbd->name, -errno);
+		return;
+	}
+
+	xc_evtchn_unmask(blkif->xce, port);
+
+	tapdisk_blkif_pull_requests(blkif);
+}
+
+/*
+ * Called in place of the vbd callback: the vreq is reset as soon as this
+ * returns, so just note the result; responses go out on the next kick.
+ */
+void
+tapdisk_blkif_complete_request(td_blkif_t *blkif, td_vbd_request_t *vreq)
+{
+	td_blkif_request_t *breq = tapdisk_blkif_request(vreq);
+
+	breq->status = vreq->status;
+	list_add_tail(&breq->next, &blkif->completed);
+	blkif->n_pending--;
+}
+
+int
+tapdisk_blkif_kick(td_blkif_t *blkif)
+{
+	int n, notify;
+	td_blkif_request_t *breq, *tmp;
+	struct list_head reads;
+	blkif_response_t *rsp;
+
+	if (list_empty(&blkif->completed))
+		return 0;
+
+	/* read data is all copied out, in one go, before any response */
+	INIT_LIST_HEAD(&reads);
+	n = 0;
+
+	list_for_each_entry_safe(breq, tmp, &blkif->completed, next)
+		if (breq->status == BLKIF_RSP_OKAY &&
+		    breq->req.operation == BLKIF_OP_READ) {
+			n += tapdisk_blkif_queue_copy(blkif, breq, n,
+						      GNTCOPY_dest_gref);
+			tapdisk_blkif_move_request(breq, &reads);
+		}
+
+	tapdisk_blkif_copy(blkif, &reads, n);
+
+	list_for_each_entry_safe(breq, tmp, &reads, next)
+		tapdisk_blkif_move_request(breq, &blkif->completed);
+
+	n = 0;
+	list_for_each_entry_safe(breq, tmp, &blkif->completed, next) {
+		rsp = RING_GET_RESPONSE(&blkif->ring,
+					blkif->ring.rsp_prod_pvt);
+		rsp->id        = breq->req.id;
+		rsp->operation = breq->req.operation;
+		rsp->status    = breq->status;
+		blkif->ring.rsp_prod_pvt++;
+
+		tapdisk_blkif_move_request(breq, &blkif->free);
+		n++;
+	}
+
+	blkif->returned += n;
+
+	RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&blkif->ring, notify);
+	if (notify) {
+		blkif->kicked++;
+		xc_evtchn_notify(blkif->xce, blkif->port);
+	}
+
+	/* slots are free again: pick up anything left on the ring */
+	if (blkif->ring.req_cons != blkif->ring.sring->req_prod)
+		tapdisk_blkif_pull_requests(blkif);
+
+	return n;
+}
+
+static void
+tapdisk_blkif_free(td_blkif_t *blkif)
+{
+	if (blkif->event_id >= 0)
+		tapdisk_server_unregister_event(blkif->event_id);
+	if (blkif->port != (evtchn_port_t)-1)
+		xc_evtchn_unbind(blkif->xce, blkif->port);
+	if (blkif->sring)
+		xc_gnttab_munmap(blkif->xcg, blkif->sring, 1);
+	if (blkif->xcg)
+		xc_gnttab_close(blkif->xcg);
+	if (blkif->xce)
+		xc_evtchn_close(blkif->xce);
+	free(blkif->buf);
+	free(blkif);
+}
+
+int
+tapdisk_blkif_connect(td_vbd_t *vbd, int domid, int devid,
+		      uint32_t gref, evtchn_port_t port, const char *proto)
+{
+	int i, err;
+	size_t size;
+	td_blkif_t *blkif;
+	evtchn_port_or_error_t lport;
+
+	if (vbd->blkif)
+		return -EALREADY;
+
+	if (list_empty(&vbd->images))
+		return -EINVAL;
+
+	if (proto && proto[0] && strcmp(proto, XEN_IO_PROTO_ABI_NATIVE)) {
+		EPRINTF("%s: unsupported protocol %s\n", vbd->name, proto);
+		return -EPROTONOSUPPORT;
+	}
+
+	blkif = calloc(1, sizeof(*blkif));
+	if (!blkif)
+		return -ENOMEM;
+
+	blkif->vbd      = vbd;
+	blkif->domid    = domid;
+	blkif->devid    = devid;
+	blkif->port     = -1;
+	blkif->event_id = -1;
+	INIT_LIST_HEAD(&blkif->free);
+	INIT_LIST_HEAD(&blkif->completed);
+
+	size = (size_t)TD_BLKIF_SEGS * XC_PAGE_SIZE;
+	err  = posix_memalign((void **)&blkif->buf, XC_PAGE_SIZE, size);
+	if (err) {
+		blkif->buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	for (i = 0; i < MAX_REQUESTS; i++) {
+		blkif->reqs[i].buf = blkif_page(blkif, i, 0);
+		list_add_tail(&blkif->reqs[i].next, &blkif->free);
+	}
+
+	blkif->xce = xc_evtchn_open(NULL, 0);
+	blkif->xcg = xc_gnttab_open(NULL, 0);
+	if (!blkif->xce || !blkif->xcg) {
+		err = -errno;
+		goto fail;
+	}
+
+	blkif->sring = xc_gnttab_map_grant_ref(blkif->xcg, domid, gref,
+					       PROT_READ | PROT_WRITE);
+	if (!blkif->sring) {
+		err = -errno;
+		EPRINTF("%s: failed to map ring %u of domain %d: %d\n",
+			vbd->name, gref, domid, err);
+		goto fail;
+	}
+
+	BACK_RING_INIT(&blkif->ring, blkif->sring, XC_PAGE_SIZE);
+
+	lport = xc_evtchn_bind_interdomain(blkif->xce, domid, port);
+	if (lport < 0) {
+		err = -errno;
+		EPRINTF("%s: failed to bind port %u of domain %d: %d\n",
+			vbd->name, port, domid, err);
+		goto fail;
+	}
+	blkif->port = lport;
+
+	blkif->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      xc_evtchn_fd(blkif->xce), 0,
+					      tapdisk_blkif_event, blkif);
+	if (blkif->event_id < 0) {
+		err = blkif->event_id;
+		goto fail;
+	}
+
+	vbd->blkif = blkif;
+
+	DPRINTF("%s: connected to domain %d device %d, ring %u port %u\n",
+		vbd->name, domid, devid, gref, port);
+
+	tapdisk_blkif_pull_requests(blkif);
+
+	return 0;
+
+fail:
+	tapdisk_blkif_free(blkif);
+	return err;
+}
+
+int
+tapdisk_blkif_disconnect(td_vbd_t *vbd, int force)
+{
+	td_blkif_t *blkif = vbd->blkif;
+
+	if (!blkif)
+		return -ENODEV;
+
+	if (blkif->n_pending && !force)
+		return -EBUSY;
+
+	tapdisk_blkif_kick(blkif);
+
+	DPRINTF("%s: disconnected from domain %d device %d\n",
+		vbd->name, blkif->domid, blkif->devid);
+
+	vbd->blkif = NULL;
+	tapdisk_blkif_free(blkif);
+
+	return 0;
+}
+
+void
+tapdisk_blkif_debug(td_blkif_t *blkif)
+{
+	DBG(TLOG_WARN, "%s: blkif domain %d device %d, pending: %d, "
+	    "received: 0x%08"PRIx64", returned: 0x%08"PRIx64", "
+	    "kicked: 0x%08"PRIx64", copies: 0x%08"PRIx64", "
+	    "copy errors: 0x%08"PRIx64"\n",
+	    blkif->vbd->name, blkif->domid, blkif->devid, blkif->n_pending,
+	    blkif->received, blkif->returned, blkif->kicked,
+	    blkif->copies, blkif->copy_errors);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_BLKIF_H_
+#define _TAPDISK_BLKIF_H_
+
+#include <xenctrl.h>
+#include <xen/io/blkif.h>
+
+#include "list.h"
+#include "scheduler.h"
+#include "tapdisk-vbd.h"
+
+/*
+ * A blkfront ring served directly by tapdisk, bypassing the blktap
+ * kernel device.  Data moves between the guest's grants and a fixed set
+ * of local buffers, one page per segment of each ring slot, by batched
+ * grant copies: nothing is ever mapped, so the buffers are reused for
+ * the lifetime of the connection.
+ */
+
+#define TD_BLKIF_SEGS  (MAX_REQUESTS * BLKIF_MAX_SEGMENTS_PER_REQUEST)
+
+typedef struct td_blkif          td_blkif_t;
+typedef struct td_blkif_request  td_blkif_request_t;
+
+struct td_blkif_request {
+	td_vbd_request_t            vreq;     /* must be first */
+	blkif_request_t             req;      /* as the frontend sent it */
+	int16_t                     status;
+	char                       *buf;
+	struct list_head            next;
+};
+
+struct td_blkif {
+	td_vbd_t                   *vbd;
+	int                         domid;
+	int                         devid;
+
+	xc_evtchn                  *xce;
+	xc_gnttab                  *xcg;
+	evtchn_port_t               port;
+	event_id_t                  event_id;
+
+	blkif_sring_t              *sring;
+	blkif_back_ring_t           ring;
+
+	char                       *buf;
+	td_blkif_request_t          reqs[MAX_REQUESTS];
+	struct list_head            free;
+	struct list_head            completed;
+	int                         n_pending;
+
+	xc_gnttab_grant_copy_segment_t segs[TD_BLKIF_SEGS];
+
+	uint64_t                    received;
+	uint64_t                    returned;
+	uint64_t                    kicked;
+	uint64_t                    copies;
+	uint64_t                    copy_errors;
+};
+
+int tapdisk_blkif_connect(td_vbd_t *, int domid, int devid,
+			  uint32_t gref, evtchn_port_t port,
+			  const char *proto);
+/* fails with -EBUSY while requests are outstanding, unless forced */
+int tapdisk_blkif_disconnect(td_vbd_t *, int force);
+void tapdisk_blkif_complete_request(td_blkif_t *, td_vbd_request_t *);
+int tapdisk_blkif_kick(td_blkif_t *);
+void tapdisk_blkif_debug(td_blkif_t *);
+
+#endif
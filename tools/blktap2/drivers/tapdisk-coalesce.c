@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "libvhd.h"
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-coalesce.h"
+
+#define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+struct td_coalesce {
+	td_vbd_t                   *vbd;
+	char                       *name;        /* the leaf */
+	char                       *pname;       /* its parent */
+
+	vhd_context_t               child;
+	vhd_context_t               parent;
+	uint64_t                    blocks;
+	char                       *buf;
+
+	/*
+	 * blocks written since the current pass began, set as writes
+	 * complete, so anything the copy may have missed is copied again.
+	 */
+	pthread_mutex_t             lock;
+	uint8_t                    *dirty;
+	uint64_t                    nr_dirty;
+
+	/* the copy thread's own: blocks to copy in this pass */
+	uint8_t                    *todo;
+
+	pthread_t                   thread;
+	int                         running;
+	volatile int                stop;
+	int                         err;
+	int                         switching;
+
+	/* the thread is done: wakes up the vbd's event loop */
+	int                         pipe[2];
+	event_id_t                  event_id;
+
+	uint64_t                    rate;        /* bytes per second */
+	struct timeval              started;
+	uint64_t                    bytes;
+
+	int                         passes;
+	uint64_t                    copied;
+};
+
+static inline int
+test_bit(uint8_t *map, uint64_t bit)
+{
+	return map[bit >> 3] & (1 << (bit & 7));
+}
+
+static inline void
+set_bit(uint8_t *map, uint64_t bit)
+{
+	map[bit >> 3] |= (1 << (bit & 7));
+}
+
+static inline size_t
+map_size(uint64_t bits)
+{
+	return (bits + 7) >> 3;
+}
+
+void
+tapdisk_coalesce_mark_dirty(struct td_coalesce *c, uint64_t sec, uint32_t secs)
+{
+	uint64_t blk, end;
+
+	blk = sec / c->child.spb;
+	end = (sec + secs - 1) / c->child.spb;
+
+	pthread_mutex_lock(&c->lock);
+	for (; blk <= end && blk < c->blocks; blk++)
+		if (!test_bit(c->dirty, blk)) {
+			set_bit(c->dirty, blk);
+			c->nr_dirty++;
+		}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* sleep off whatever was copied ahead of the rate */
+static void
+tapdisk_coalesce_throttle(struct td_coalesce *c, uint64_t bytes)
+{
+	struct timeval now;
+	int64_t due, elapsed;
+
+	if (!c->rate)
+		return;
+
+	c->bytes += bytes;
+	due = c->bytes * 1000000 / c->rate;
+
+	while (!c->stop) {
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - c->started.tv_sec) * 1000000LL +
+			(now.tv_usec - c->started.tv_usec);
+		if (elapsed >= due)
+			break;
+
+		usleep(due - elapsed > 100000 ? 100000 : due - elapsed);
+	}
+}
+
+/* as vhd-util coalesce: only the sectors the leaf has go to the parent */
+static int
+tapdisk_coalesce_block(struct td_coalesce *c, uint64_t block)
+{
+	int err;
+	char *map;
+	uint32_t i, secs;
+	uint64_t sec;
+	vhd_context_t *vhd = &c->child;
+
+	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
+		return 0;
+
+	sec = block * vhd->spb;
+
+	err = vhd_io_read(vhd, c->buf, sec, vhd->spb);
+	if (err)
+		return err;
+
+	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block))
+		return vhd_io_write(&c->parent, c->buf, sec, vhd->spb);
+
+	map = NULL;
+	err = vhd_read_bitmap(vhd, block, &map);
+	if (err)
+		return err;
+
+	for (i = 0; i < vhd->spb; i++) {
+		if (!vhd_bitmap_test(vhd, map, i))
+			continue;
+
+		for (secs = 0; i + secs < vhd->spb; secs++)
+			if (!vhd_bitmap_test(vhd, map, i + secs))
+				break;
+
+		err = vhd_io_write(&c->parent,
+				   c->buf + vhd_sectors_to_bytes(i),
+				   sec + i, secs);
+		if (err)
+			break;
+
+		i += secs;
+	}
+
+	free(map);
+	return err;
+}
+
+/*
+ * One pass over the leaf: all its blocks the first time, after that the
+ * ones written during the previous pass.  The leaf's BAT is reread, as
+ * tapdisk may have allocated blocks since.
+ */
+static int
+tapdisk_coalesce_pass(struct td_coalesce *c, int first)
+{
+	int err;
+	uint64_t i;
+	vhd_context_t *vhd = &c->child;
+
+	pthread_mutex_lock(&c->lock);
+	memcpy(c->todo, c->dirty, map_size(c->blocks));
+	memset(c->dirty, 0, map_size(c->blocks));
+	c->nr_dirty = 0;
+	pthread_mutex_unlock(&c->lock);
+
+	vhd_put_bat(vhd);
+	err = vhd_get_bat(vhd);
+	if (err)
+		return err;
+
+	if (vhd_has_batmap(vhd)) {
+		vhd_put_batmap(vhd);
+		err = vhd_get_batmap(vhd);
+		if (err)
+			return err;
+	}
+
+	for (i = 0; i < c->blocks; i++) {
+		if (!first && !test_bit(c->todo, i))
+			continue;
+
+		if (c->stop)
+			return -EINTR;
+
+		err = tapdisk_coalesce_block(c, i);
+		if (err)
+			return err;
+
+		c->copied++;
+		tapdisk_coalesce_throttle(c, vhd->header.block_size);
+	}
+
+	c->passes++;
+	return 0;
+}
+
+static void *
+tapdisk_coalesce_thread(void *arg)
+{
+	int err;
+	uint64_t left;
+	struct td_coalesce *c = arg;
+
+	gettimeofday(&c->started, NULL);
+
+	do {
+		err = tapdisk_coalesce_pass(c, !c->passes);
+		if (err)
+			break;
+
+		pthread_mutex_lock(&c->lock);
+		left = c->nr_dirty;
+		pthread_mutex_unlock(&c->lock);
+	} while (left > TD_COALESCE_SWITCH_BLOCKS &&
+		 c->passes < TD_COALESCE_MAX_PASSES);
+
+	c->err = err;
+	if (write(c->pipe[1], &err, sizeof(err)) != sizeof(err))
+		c->err = -errno;
+
+	return NULL;
+}
+
+static void
+tapdisk_coalesce_free(struct td_coalesce *c)
+{
+	if (c->running) {
+		c->stop = 1;
+		pthread_join(c->thread, NULL);
+	}
+
+	if (c->event_id > 0)
+		tapdisk_server_unregister_event(c->event_id);
+	if (c->pipe[0] != -1)
+		close(c->pipe[0]);
+	if (c->pipe[1] != -1)
+		close(c->pipe[1]);
+	if (c->child.file)
+		vhd_close(&c->child);
+	if (c->parent.file)
+		vhd_close(&c->parent);
+
+	pthread_mutex_destroy(&c->lock);
+	free(c->dirty);
+	free(c->todo);
+	free(c->buf);
+	free(c->name);
+	free(c->pname);
+	free(c);
+}
+
+/* the vbd's name, with the leaf's path replaced by the parent's */
+static char *
+tapdisk_coalesce_new_name(struct td_coalesce *c)
+{
+	char *p, *name;
+	const char *old = c->vbd->name;
+
+	p = strstr(old, c->name);
+	if (!p)
+		return NULL;
+
+	if (asprintf(&name, "%.*s%s%s", (int)(p - old), old, c->pname,
+		     p + strlen(c->name)) == -1)
+		return NULL;
+
+	return name;
+}
+
+static int
+tapdisk_coalesce_reopen(td_vbd_t *vbd, char *name)
+{
+	int err;
+
+	err = tapdisk_vbd_parse_stack(vbd, name ? : vbd->name);
+	if (err)
+		return err;
+
+	return tapdisk_vbd_resume(vbd, name, -1);
+}
+
+/*
+ * The final switch, on the vbd's event loop: pause, copy what's left,
+ * and reopen the chain from the parent.  If that fails, the old chain
+ * is still good: the leaf overrides everything copied.
+ */
+static int
+tapdisk_coalesce_switch(struct td_coalesce *c)
+{
+	int err;
+	char *name;
+	td_vbd_t *vbd = c->vbd;
+
+	name = tapdisk_coalesce_new_name(c);
+	if (!name)
+		return -ENOMEM;
+
+	c->switching = 1;
+
+	do {
+		err = tapdisk_vbd_pause(vbd);
+		if (err != -EAGAIN)
+			break;
+
+		tapdisk_server_iterate();
+	} while (1);
+
+	if (err)
+		goto out;
+
+	err = tapdisk_coalesce_pass(c, 0);
+	if (err) {
+		EPRINTF("%s: final coalesce pass failed: %d\n",
+			vbd->name, err);
+		goto resume;
+	}
+
+	err = tapdisk_coalesce_reopen(vbd, name);
+	if (!err)
+		goto out;
+
+	EPRINTF("%s: reopening from %s failed: %d\n", vbd->name, name, err);
+
+resume:
+	if (tapdisk_coalesce_reopen(vbd, NULL))
+		EPRINTF("%s: reopening failed, vbd stays paused\n", vbd->name);
+
+out:
+	free(name);
+	return err;
+}
+
+static void
+tapdisk_coalesce_event(event_id_t id, char mode, void *private)
+{
+	int err, res;
+	struct td_coalesce *c = private;
+	td_vbd_t *vbd = c->vbd;
+
+	if (read(c->pipe[0], &res, sizeof(res)) != sizeof(res))
+		return;
+
+	pthread_join(c->thread, NULL);
+	c->running = 0;
+
+	err = c->err;
+	if (!err)
+		err = tapdisk_coalesce_switch(c);
+
+	if (err)
+		EPRINTF("%s: coalesce of %s into %s failed: %d\n",
+			vbd->name, c->name, c->pname, err);
+	else
+		DPRINTF("%s: coalesced %s into %s, %d passes, "
+			"%"PRIu64" blocks copied\n", vbd->name,
+			c->name, c->pname, c->passes, c->copied);
+
+	vbd->coalesce = NULL;
+	tapdisk_coalesce_free(c);
+}
+
+static td_image_t *
+tapdisk_coalesce_find_leaf(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		if (image->type != DISK_TYPE_VHD ||
+		    td_flag_test(image->flags, TD_OPEN_RDONLY))
+			continue;
+
+		if (tapdisk_vbd_is_last_image(vbd, image))
+			return NULL;
+
+		if (tapdisk_vbd_next_image(image)->type != DISK_TYPE_VHD)
+			return NULL;
+
+		return image;
+	}
+
+	return NULL;
+}
+
+int
+tapdisk_coalesce_start(td_vbd_t *vbd, int rate)
+{
+	int err;
+	td_image_t *leaf;
+	struct td_coalesce *c;
+
+	if (vbd->coalesce)
+		return -EALREADY;
+
+	if (!tapdisk_vbd_queue_ready(vbd))
+		return -EBUSY;
+
+	leaf = tapdisk_coalesce_find_leaf(vbd);
+	if (!leaf)
+		return -EINVAL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->vbd      = vbd;
+	c->rate     = (uint64_t)rate << 20;
+	c->pipe[0]  = -1;
+	c->pipe[1]  = -1;
+	c->event_id = -1;
+	pthread_mutex_init(&c->lock, NULL);
+
+	c->name = strdup(leaf->name);
+	if (!c->name || !strstr(vbd->name, c->name)) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	err = vhd_open(&c->child, c->name, VHD_OPEN_RDONLY);
+	if (err) {
+		c->child.file = NULL;
+		goto fail;
+	}
+
+	err = vhd_parent_locator_get(&c->child, &c->pname);
+	if (err)
+		goto fail;
+
+	err = vhd_open(&c->parent, c->pname, VHD_OPEN_RDWR);
+	if (err) {
+		c->parent.file = NULL;
+		goto fail;
+	}
+
+	c->blocks = c->child.header.max_bat_size;
+	c->dirty  = calloc(1, map_size(c->blocks));
+	c->todo   = calloc(1, map_size(c->blocks));
+	if (!c->dirty || !c->todo) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = posix_memalign((void **)&c->buf, 4096,
+			     c->child.header.block_size);
+	if (err) {
+		c->buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	if (pipe(c->pipe)) {
+		err = -errno;
+		goto fail;
+	}
+
+	c->event_id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						    c->pipe[0], 0,
+						    tapdisk_coalesce_event, c);
+	if (c->event_id < 0) {
+		err = c->event_id;
+		goto fail;
+	}
+
+	/* track writes before the first pass reads the BAT */
+	vbd->coalesce = c;
+
+	err = pthread_create(&c->thread, NULL, tapdisk_coalesce_thread, c);
+	if (err) {
+		err = -err;
+		vbd->coalesce = NULL;
+		goto fail;
+	}
+	c->running = 1;
+
+	DPRINTF("%s: coalescing %s into %s at %d MB/s\n",
+		vbd->name, c->name, c->pname, rate);
+
+	return 0;
+
+fail:
+	EPRINTF("%s: cannot coalesce %s: %d\n", vbd->name, leaf->name, err);
+	tapdisk_coalesce_free(c);
+	return err;
+}
+
+/* a pause or close other than our own switch: give up */
+void
+tapdisk_coalesce_cancel(td_vbd_t *vbd)
+{
+	struct td_coalesce *c = vbd->coalesce;
+
+	if (!c || c->switching)
+		return;
+
+	DPRINTF("%s: coalesce of %s cancelled\n", vbd->name, c->name);
+
+	vbd->coalesce = NULL;
+	tapdisk_coalesce_free(c);
+}
+
+void
+tapdisk_coalesce_debug(struct td_coalesce *c)
+{
+	uint64_t left;
+
+	pthread_mutex_lock(&c->lock);
+	left = c->nr_dirty;
+	pthread_mutex_unlock(&c->lock);
+
+	DBG(TLOG_WARN, "%s: coalescing into %s, pass %d, copied: 0x%08"PRIx64
+	    ", dirty: 0x%08"PRIx64"\n", c->name, c->pname, c->passes,
+	    c->copied, left);
+}
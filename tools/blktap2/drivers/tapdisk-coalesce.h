@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_COALESCE_H_
+#define _TAPDISK_COALESCE_H_
+
+#include <stdint.h>
+
+#include "tapdisk-vbd.h"
+
+/*
+ * Online coalesce of the leaf VHD of a vbd into its parent.  A helper
+ * thread copies the leaf's blocks into the parent while the vbd keeps
+ * running, then copies again whatever was written meanwhile, until
+ * little is left.  Only then is the vbd paused, the rest copied, and the
+ * chain reopened with the parent as its leaf.
+ *
+ * The parent must not be shared with other children: as with vhd-util
+ * coalesce, that is for the caller to make sure of.
+ */
+
+/* Blocks left dirty after a pass small enough to finish while paused. */
+#define TD_COALESCE_SWITCH_BLOCKS   16
+#define TD_COALESCE_MAX_PASSES      8
+
+struct td_coalesce;
+
+/* Starts copying; rate is in MB/s, 0 for no limit. */
+int tapdisk_coalesce_start(td_vbd_t *, int rate);
+void tapdisk_coalesce_cancel(td_vbd_t *);
+void tapdisk_coalesce_mark_dirty(struct td_coalesce *,
+				 uint64_t sec, uint32_t secs);
+void tapdisk_coalesce_debug(struct td_coalesce *);
+
+#endif
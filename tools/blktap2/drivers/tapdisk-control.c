@@ -44,6 +44,8 @@
 #include "blktaplib.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-utils.h"
+#include "tapdisk-blkif.h"
+#include "tapdisk-coalesce.h"
 #include "tapdisk-server.h"
 #include "tapdisk-message.h"
 #include "tapdisk-disktype.h"
@@ -218,39 +220,64 @@ static void
 tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 			    tapdisk_message_t *request)
 {
-	int i;
-	td_vbd_t *vbd;
-	struct list_head *head;
+	int count;
 	tapdisk_message_t response;
 
-	i = 0;
 	memset(&response, 0, sizeof(response));
 
 	response.type = TAPDISK_MESSAGE_LIST_MINORS_RSP;
 	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
-	list_for_each_entry(vbd, head, next) {
-		response.u.minors.list[i++] = vbd->minor;
-		if (i >= TAPDISK_MESSAGE_MAX_MINORS) {
-			response.type = TAPDISK_MESSAGE_ERROR;
-			response.u.response.error = ERANGE;
-			break;
-		}
+	count = tapdisk_server_get_minors(response.u.minors.list,
+					  TAPDISK_MESSAGE_MAX_MINORS);
+	if (count < 0) {
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = ERANGE;
+		count = TAPDISK_MESSAGE_MAX_MINORS;
 	}
 
-	response.u.minors.count = i;
+	response.u.minors.count = count;
 	tapdisk_control_write_message(connection->socket, &response, 2);
 	tapdisk_control_close_connection(connection);
 }
 
+struct tapdisk_control_list {
+	tapdisk_message_list_t *entries;
+	int                count;
+	int                max;
+};
+
+/* Runs on the thread driving vbd, which alone may look at its state. */
+static void
+tapdisk_control_list_vbd(td_vbd_t *vbd, void *private)
+{
+	struct tapdisk_control_list *list = private;
+	tapdisk_message_list_t *entry;
+
+	if (list->count >= list->max)
+		return;
+
+	entry = &list->entries[list->count++];
+	entry->minor   = vbd->minor;
+	entry->state   = vbd->state;
+	entry->path[0] = 0;
+
+	if (!list_empty(&vbd->images)) {
+		td_image_t *image = list_entry(vbd->images.next,
+					       td_image_t, next);
+		snprintf(entry->path,
+			 sizeof(entry->path),
+			 "%s:%s",
+			 tapdisk_disk_types[image->type]->name,
+			 image->name);
+	}
+}
+
 static void
 tapdisk_control_list(struct tapdisk_control_connection *connection,
 		     tapdisk_message_t *request)
 {
-	td_vbd_t *vbd;
-	struct list_head *head;
+	struct tapdisk_control_list list;
 	tapdisk_message_t response;
 	int count, i;
 
@@ -258,27 +285,24 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 	response.type = TAPDISK_MESSAGE_LIST_RSP;
 	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
-	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
-
-	list_for_each_entry(vbd, head, next) {
-		response.u.list.count   = count--;
-		response.u.list.minor   = vbd->minor;
-		response.u.list.state   = vbd->state;
-		response.u.list.path[0] = 0;
-
-		if (!list_empty(&vbd->images)) {
-			td_image_t *image = list_entry(vbd->images.next,
-						       td_image_t, next);
-			snprintf(response.u.list.path,
-				 sizeof(response.u.list.path),
-				 "%s:%s",
-				 tapdisk_disk_types[image->type]->name,
-				 image->name);
+	/* VBDs are only added by control requests, so this is an upper bound */
+	list.count   = 0;
+	list.max     = tapdisk_server_count_vbds();
+	list.entries = NULL;
+	if (list.max) {
+		list.entries = calloc(list.max, sizeof(*list.entries));
+		if (!list.entries) {
+			response.type = TAPDISK_MESSAGE_ERROR;
+			response.u.response.error = ENOMEM;
+			goto out;
 		}
+		tapdisk_server_call_each_vbd(tapdisk_control_list_vbd, &list);
+	}
+
+	count = list.count;
+	for (i = 0; i < list.count; i++) {
+		response.u.list       = list.entries[i];
+		response.u.list.count = count--;
 
 		tapdisk_control_write_message(connection->socket, &response, 2);
 	}
@@ -287,8 +311,10 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 	response.u.list.minor   = -1;
 	response.u.list.path[0] = 0;
 
+out:
 	tapdisk_control_write_message(connection->socket, &response, 2);
 	tapdisk_control_close_connection(connection);
+	free(list.entries);
 }
 
 static void
@@ -440,6 +466,9 @@ tapdisk_control_open_image(struct tapdisk_control_connection *connection,
 		flags |= TD_OPEN_VHD_INDEX;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_LOG_DIRTY)
 		flags |= TD_OPEN_LOG_DIRTY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_PCACHE ||
+	    getenv(TAPDISK_PCACHE_DIR_ENV))
+		flags |= TD_OPEN_ADD_PCACHE;
 
 	vbd->name = strndup(request->u.params.path,
 			    sizeof(request->u.params.path));
@@ -518,6 +547,11 @@ tapdisk_control_close_image(struct tapdisk_control_connection *connection,
 		goto out;
 	}
 
+	if (vbd->blkif) {
+		err = -EBUSY;
+		goto out;
+	}
+
 	tapdisk_vbd_close_vdi(vbd);
 
 	/* NB. vbd->name free should probably belong into close_vdi,
@@ -627,6 +661,180 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+static void
+tapdisk_control_connect_blkif(struct tapdisk_control_connection *connection,
+			      tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	tapdisk_message_t response;
+	tapdisk_message_blkif_t *blkif = &request->u.blkif;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	blkif->proto[sizeof(blkif->proto) - 1] = '\0';
+
+	err = tapdisk_blkif_connect(vbd, blkif->domid, blkif->devid,
+				    blkif->gref, blkif->port, blkif->proto);
+
+out:
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_BLKIF_CONNECT_RSP;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+static void
+tapdisk_control_disconnect_blkif(struct tapdisk_control_connection *connection,
+				 tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	tapdisk_message_t response;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	do {
+		err = tapdisk_blkif_disconnect(vbd, 0);
+
+		if (err != -EBUSY)
+			break;
+
+		tapdisk_server_iterate();
+	} while (1);
+
+out:
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_BLKIF_DISCONNECT_RSP;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+static void
+tapdisk_control_coalesce(struct tapdisk_control_connection *connection,
+			 tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	tapdisk_message_t response;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = tapdisk_coalesce_start(vbd, request->u.coalesce.rate);
+
+out:
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_COALESCE_RSP;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+/*
+ * aio merging and hold back are set for the whole process; the reply
+ * carries the settings in force and the counters of all queues.
+ */
+static void
+tapdisk_control_io(struct tapdisk_control_connection *connection,
+		   tapdisk_message_t *request)
+{
+	int err;
+	struct tqueue_stats stats;
+	struct tqueue_tuning tuning;
+	tapdisk_message_t response;
+	tapdisk_message_io_t *io = &request->u.io;
+
+	tapdisk_queue_get_tuning(&tuning);
+
+	if (io->flags & TAPDISK_MESSAGE_IO_SET_MERGE)
+		tuning.max_merge = (unsigned long)io->max_merge << 10;
+
+	if (io->flags & TAPDISK_MESSAGE_IO_SET_HOLD) {
+		tuning.hold_us    = io->hold_us;
+		tuning.hold_depth = io->hold_depth;
+	}
+
+	err = tapdisk_queue_set_tuning(&tuning);
+
+	memset(&response, 0, sizeof(response));
+	response.cookie = request->cookie;
+
+	if (err) {
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = -err;
+		goto out;
+	}
+
+	tapdisk_server_queue_stats(&stats);
+
+	response.type                 = TAPDISK_MESSAGE_IO_RSP;
+	response.u.io.max_merge       = tuning.max_merge >> 10;
+	response.u.io.hold_us         = tuning.hold_us;
+	response.u.io.hold_depth      = tuning.hold_depth;
+	response.u.io.submitted       = stats.submitted;
+	response.u.io.issued          = stats.issued;
+	response.u.io.holds           = stats.holds;
+
+out:
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+struct tapdisk_control_call {
+	struct tapdisk_control_connection *connection;
+	tapdisk_message_t                 *request;
+	void (*handler)(struct tapdisk_control_connection *,
+			tapdisk_message_t *);
+};
+
+static void
+tapdisk_control_run_call(void *private)
+{
+	struct tapdisk_control_call *call = private;
+
+	call->handler(call->connection, call->request);
+}
+
+/*
+ * Requests for a VBD run on the thread driving it, with the main
+ * thread waiting, so they see its event loop and aio queue.
+ */
+static void
+tapdisk_control_call_vbd(struct tapdisk_control_connection *connection,
+			 tapdisk_message_t *request,
+			 void (*handler)(struct tapdisk_control_connection *,
+					 tapdisk_message_t *))
+{
+	struct tapdisk_control_call call;
+
+	call.connection = connection;
+	call.request    = request;
+	call.handler    = handler;
+
+	tapdisk_server_call_vbd(request->cookie,
+				tapdisk_control_run_call, &call);
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -653,17 +861,34 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	case TAPDISK_MESSAGE_LIST:
 		return tapdisk_control_list(connection, &message);
 	case TAPDISK_MESSAGE_ATTACH:
-		return tapdisk_control_attach_vbd(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_attach_vbd);
 	case TAPDISK_MESSAGE_DETACH:
-		return tapdisk_control_detach_vbd(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_detach_vbd);
 	case TAPDISK_MESSAGE_OPEN:
-		return tapdisk_control_open_image(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_open_image);
 	case TAPDISK_MESSAGE_PAUSE:
-		return tapdisk_control_pause_vbd(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_pause_vbd);
 	case TAPDISK_MESSAGE_RESUME:
-		return tapdisk_control_resume_vbd(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_resume_vbd);
 	case TAPDISK_MESSAGE_CLOSE:
-		return tapdisk_control_close_image(connection, &message);
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_close_image);
+	case TAPDISK_MESSAGE_BLKIF_CONNECT:
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_connect_blkif);
+	case TAPDISK_MESSAGE_BLKIF_DISCONNECT:
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_disconnect_blkif);
+	case TAPDISK_MESSAGE_COALESCE:
+		return tapdisk_control_call_vbd(connection, &message,
+						tapdisk_control_coalesce);
+	case TAPDISK_MESSAGE_IO:
+		return tapdisk_control_io(connection, &message);
 	default: {
 		tapdisk_message_t response;
 	fail:
@@ -40,6 +40,8 @@
 #define DISK_TYPE_LOG         8
 #define DISK_TYPE_REMUS       9
 #define DISK_TYPE_VINDEX      10
+#define DISK_TYPE_PCACHE      11
+#define DISK_TYPE_MAX         12
 
 #define DISK_TYPE_NAME_MAX    32
 
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
 #ifdef MEMSHR
 #include <memshr.h>
 #endif
@@ -97,10 +98,11 @@ tapdisk_image_check_td_request(td_image_t *image, td_request_t treq)
 	info   = &driver->info;
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
-	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE)
+	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE &&
+	    treq.op != TD_OP_DISCARD)
 		goto fail;
 
-	if (treq.op == TD_OP_WRITE && rdonly)
+	if (treq.op != TD_OP_READ && rdonly)
 		goto fail;
 
 	if (treq.secs <= 0 || treq.sec + treq.secs > info->size)
@@ -134,6 +136,17 @@ tapdisk_image_check_ring_request(td_image_t *image, blkif_request_t *req)
 
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
+	if (req->operation == BLKIF_OP_DISCARD) {
+		blkif_request_discard_t *dreq = (blkif_request_discard_t *)req;
+
+		total = dreq->nr_sectors;
+		if (rdonly || !total || total > INT_MAX ||
+		    dreq->sector_number + total > info->size)
+			goto fail;
+
+		return 0;
+	}
+
 	if (req->operation != BLKIF_OP_READ &&
 	    req->operation != BLKIF_OP_WRITE)
 		goto fail;
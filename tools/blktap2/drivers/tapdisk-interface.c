@@ -139,6 +139,25 @@ td_get_parent_id(td_image_t *image, td_disk_id_t *id)
 	return driver->ops->td_get_parent_id(driver, id);
 }
 
+int
+td_get_block_map(td_image_t *image, uint32_t *block_secs,
+		 uint64_t *blocks, uint8_t **map)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -ENODEV;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (!driver->ops->td_get_block_map)
+		return -ENOSYS;
+
+	return driver->ops->td_get_block_map(driver, block_secs, blocks, map);
+}
+
 int
 td_validate_parent(td_image_t *image, td_image_t *parent)
 {
@@ -213,6 +232,39 @@ fail:
 	td_complete_request(treq, err);
 }
 
+void
+td_queue_discard(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	if (!driver->ops->td_queue_discard) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	driver->ops->td_queue_discard(driver, treq);
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
 void
 td_forward_request(td_request_t treq)
 {
@@ -33,6 +33,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <inttypes.h>
 #include <sys/time.h>
 
@@ -68,6 +69,10 @@ struct tlog {
 static struct ehandle tapdisk_err;
 static struct tlog tapdisk_log;
 
+/* Recursive: flushing logs the error summary. */
+static pthread_mutex_t tapdisk_log_lock =
+	PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
 void
 open_tlog(char *file, size_t bytes, int level, int append)
 {
@@ -118,6 +123,8 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 	if (level > tapdisk_log.level)
 		return;
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	avail = tapdisk_log.size - (tapdisk_log.p - tapdisk_log.buf);
 	if (avail < MAX_ENTRY_LEN) {
 		if (tapdisk_log.append)
@@ -141,6 +148,8 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 
 	tapdisk_log.cnt++;
 	tapdisk_log.p += len;
+
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -153,17 +162,19 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 
 	err = (err > 0 ? err : -err);
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	for (i = 0; i < tapdisk_err.cnt; i++) {
 		e = &tapdisk_err.errors[i];
 		if (e->err == err && e->func == func) {
 			e->cnt++;
-			return;
+			goto out;
 		}
 	}
 
 	if (tapdisk_err.cnt >= MAX_ERROR_MESSAGES) {
 		tapdisk_err.dropped++;
-		return;
+		goto out;
 	}
 
 	gettimeofday(&t, NULL);
@@ -184,6 +195,9 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 	e->err  = err;
 	e->func = (char *)func;
 	tapdisk_err.cnt++;
+
+out:
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -230,13 +244,15 @@ tlog_flush(void)
 	if (!tapdisk_log.buf)
 		return;
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	flags = O_CREAT | O_WRONLY | O_DIRECT | O_NONBLOCK;
 	if (!tapdisk_log.append)
 		flags |= O_TRUNC;
 
 	fd = open(tapdisk_log.file, flags, 0644);
 	if (fd == -1)
-		return;
+		goto unlock;
 
 	if (tapdisk_log.append)
 		if (lseek(fd, 0, SEEK_END) == (off_t)-1)
@@ -254,4 +270,6 @@ tlog_flush(void)
 
 out:
 	close(fd);
+unlock:
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
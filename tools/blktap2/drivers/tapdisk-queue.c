@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <libaio.h>
+#include <pthread.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
@@ -55,6 +56,16 @@
  */
 #define REQUEST_ASYNC_FD ((io_context_t)1)
 
+/* batches this long go out at once */
+#define TAPDISK_QUEUE_HOLD_BATCH 32
+
+/*
+ * set by control requests on the main thread, read by every loop: only
+ * ever copied whole, under tuning_lock.
+ */
+static struct tqueue_tuning tuning;
+static pthread_mutex_t tuning_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static inline void
 queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
@@ -237,7 +248,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
 	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
 
-	queue->queued = 0;
+	queue->stats.submitted += queue->queued;
+	queue->stats.issued    += merged;
+	queue->queued           = 0;
 
 	for (i = 0; i < merged; i++) {
 		ep      = rwio->aio_events + i;
@@ -528,9 +541,11 @@ tapdisk_lio_submit(struct tqueue *queue)
 	} else if (submitted < merged)
 		err = -EIO;
 
-	queue->iocbs_pending  += submitted;
-	queue->tiocbs_pending += queue->queued;
-	queue->queued          = 0;
+	queue->iocbs_pending   += submitted;
+	queue->tiocbs_pending  += queue->queued;
+	queue->stats.submitted += queue->queued;
+	queue->stats.issued    += submitted;
+	queue->queued           = 0;
 
 	if (err)
 		queue->tiocbs_pending -= 
@@ -660,6 +675,8 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	WARN("submitted: %"PRIu64", issued: %"PRIu64", holds: %"PRIu64"\n",
+	     queue->stats.submitted, queue->stats.issued, queue->stats.holds);
 
 	if (tiocb) {
 		WARN("deferred:\n");
@@ -706,6 +723,13 @@ tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 int
 tapdisk_submit_tiocbs(struct tqueue *queue)
 {
+	struct tqueue_tuning t;
+
+	tapdisk_queue_get_tuning(&t);
+
+	timerclear(&queue->held);
+	queue->opioctx.max_merge = t.max_merge;
+
 	return queue->tio->tio_submit(queue);
 }
 
@@ -721,6 +745,64 @@ tapdisk_submit_all_tiocbs(struct tqueue *queue)
 	return submitted;
 }
 
+/*
+ * whether to hold back what is queued for now, in the hope of merging
+ * more into it: returns the usecs left to hold for, 0 to submit now.
+ * only done while enough iocbs are in flight that one completing will
+ * likely bring us back here; the caller waits no longer than returned.
+ */
+int
+tapdisk_queue_hold(struct tqueue *queue)
+{
+	struct tqueue_tuning t;
+	struct timeval now, elapsed;
+
+	tapdisk_queue_get_tuning(&t);
+
+	if (!t.hold_us || !queue->queued ||
+	    queue->queued >= TAPDISK_QUEUE_HOLD_BATCH ||
+	    !queue->iocbs_pending ||
+	    queue->iocbs_pending < t.hold_depth ||
+	    tapdisk_queue_full(queue) || deferred_tiocbs(queue))
+		return 0;
+
+	gettimeofday(&now, NULL);
+
+	if (!timerisset(&queue->held)) {
+		queue->held = now;
+		queue->stats.holds++;
+		return t.hold_us;
+	}
+
+	timersub(&now, &queue->held, &elapsed);
+	if (elapsed.tv_sec || elapsed.tv_usec >= t.hold_us)
+		return 0;
+
+	return t.hold_us - elapsed.tv_usec;
+}
+
+void
+tapdisk_queue_get_tuning(struct tqueue_tuning *t)
+{
+	pthread_mutex_lock(&tuning_lock);
+	*t = tuning;
+	pthread_mutex_unlock(&tuning_lock);
+}
+
+int
+tapdisk_queue_set_tuning(const struct tqueue_tuning *t)
+{
+	if (t->hold_us < 0 || t->hold_us >= 1000000 ||
+	    (t->hold_us && t->hold_depth < 1))
+		return -EINVAL;
+
+	pthread_mutex_lock(&tuning_lock);
+	tuning = *t;
+	pthread_mutex_unlock(&tuning_lock);
+
+	return 0;
+}
+
 /*
  * cancel_tiocbs may queue more tiocbs
  */
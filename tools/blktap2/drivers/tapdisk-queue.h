@@ -30,6 +30,7 @@
 #define TAPDISK_QUEUE_H
 
 #include <libaio.h>
+#include <sys/time.h>
 
 #include "io-optimize.h"
 #include "scheduler.h"
@@ -53,6 +54,23 @@ struct tlist {
 	struct tiocb         *tail;
 };
 
+/*
+ * Merging and holding back of iocbs, shared by all queues.  Short
+ * batches are held back for up to hold_us, while at least hold_depth
+ * iocbs are in flight, so more can be merged into them.
+ */
+struct tqueue_tuning {
+	unsigned long         max_merge;   /* bytes, 0: no limit */
+	int                   hold_us;     /* 0: never hold back */
+	int                   hold_depth;
+};
+
+struct tqueue_stats {
+	uint64_t              submitted;   /* tiocbs */
+	uint64_t              issued;      /* iocbs, after merging */
+	uint64_t              holds;
+};
+
 struct tqueue {
 	int                   size;
 
@@ -82,6 +100,11 @@ struct tqueue {
 	struct tfilter       *filter;
 
 	uint64_t              deferrals;
+
+	/* when the iocbs queued were first held back, if they are */
+	struct timeval        held;
+
+	struct tqueue_stats   stats;
 };
 
 struct tio {
@@ -117,6 +140,9 @@ void tapdisk_debug_queue(struct tqueue *);
 void tapdisk_queue_tiocb(struct tqueue *, struct tiocb *);
 int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
+int tapdisk_queue_hold(struct tqueue *);
+void tapdisk_queue_get_tuning(struct tqueue_tuning *);
+int tapdisk_queue_set_tuning(const struct tqueue_tuning *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
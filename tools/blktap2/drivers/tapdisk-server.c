@@ -29,6 +29,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 
@@ -42,9 +45,42 @@
 
  tapdisk_server_t server;
 
+/* Walks server.vbds: hold server.vbds_lock. */
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
 	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
 
+/* The VBDs driven by the calling thread's event loop. */
+#define tapdisk_server_for_each_loop_vbd(vbd, tmp)			\
+	list_for_each_entry_safe(vbd, tmp, tapdisk_server_loop_vbds(), loop_next)
+
+#define tapdisk_server_for_each_worker(w)				\
+	for ((w) = server.workers;					\
+	     (w) < server.workers + server.nr_workers; (w)++)
+
+/* The worker running on this thread, NULL on the main thread. */
+static __thread tapdisk_worker_t *current_worker;
+
+static void tapdisk_server_call_worker(tapdisk_worker_t *,
+				       void (*)(void *), void *);
+
+static scheduler_t *
+tapdisk_server_scheduler(void)
+{
+	return current_worker ? &current_worker->scheduler : &server.scheduler;
+}
+
+static struct tqueue *
+tapdisk_server_aio_queue(void)
+{
+	return current_worker ? &current_worker->aio_queue : &server.aio_queue;
+}
+
+static struct list_head *
+tapdisk_server_loop_vbds(void)
+{
+	return current_worker ? &current_worker->vbds : &server.loop_vbds;
+}
+
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
 {
@@ -54,7 +90,8 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	if (!td_flag_test(image->flags, TD_OPEN_SHAREABLE))
 		return NULL;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
+	/* Images are not shared across event loops. */
+	tapdisk_server_for_each_loop_vbd(vbd, tmpv)
 		tapdisk_vbd_for_each_image(vbd, img, tmpi)
 			if (img->type == image->type &&
 			    !strcmp(img->name, image->name))
@@ -63,14 +100,48 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	return NULL;
 }
 
-struct list_head *
-tapdisk_server_get_all_vbds(void)
+/*
+ * server.vbds is shared by every loop: workers remove the VBDs they shut
+ * down while the main thread looks VBDs up, so it is only walked with
+ * server.vbds_lock held.  Other threads' VBDs may be looked up, but
+ * only their owner may touch them (see tapdisk_server_call_each_vbd).
+ */
+int
+tapdisk_server_count_vbds(void)
 {
-	return &server.vbds;
+	td_vbd_t *vbd, *tmp;
+	int count = 0;
+
+	pthread_mutex_lock(&server.vbds_lock);
+	tapdisk_server_for_each_vbd(vbd, tmp)
+		count++;
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	return count;
 }
 
-td_vbd_t *
-tapdisk_server_get_vbd(uint16_t uuid)
+/* Minors are fixed once a VBD exists, so anyone may read them. */
+int
+tapdisk_server_get_minors(int *minors, int max)
+{
+	td_vbd_t *vbd, *tmp;
+	int count = 0;
+
+	pthread_mutex_lock(&server.vbds_lock);
+	tapdisk_server_for_each_vbd(vbd, tmp) {
+		if (count >= max) {
+			count = -ERANGE;
+			break;
+		}
+		minors[count++] = vbd->minor;
+	}
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	return count;
+}
+
+static td_vbd_t *
+__tapdisk_server_get_vbd(td_uuid_t uuid)
 {
 	td_vbd_t *vbd, *tmp;
 
@@ -81,35 +152,83 @@ tapdisk_server_get_vbd(uint16_t uuid)
 	return NULL;
 }
 
+td_vbd_t *
+tapdisk_server_get_vbd(td_uuid_t uuid)
+{
+	td_vbd_t *vbd;
+
+	pthread_mutex_lock(&server.vbds_lock);
+	vbd = __tapdisk_server_get_vbd(uuid);
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	return vbd;
+}
+
+/*
+ * VBDs join the event loop of the thread adding them, which with workers
+ * is the one tapdisk_server_call_vbd() picked.
+ */
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
+	pthread_mutex_lock(&server.vbds_lock);
 	list_add_tail(&vbd->next, &server.vbds);
+	vbd->worker = current_worker;
+	if (current_worker)
+		current_worker->nr_vbds++;
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	list_add_tail(&vbd->loop_next, tapdisk_server_loop_vbds());
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
+	list_del(&vbd->loop_next);
+	INIT_LIST_HEAD(&vbd->loop_next);
+
+	pthread_mutex_lock(&server.vbds_lock);
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	if (vbd->worker)
+		vbd->worker->nr_vbds--;
+	vbd->worker = NULL;
+	pthread_mutex_unlock(&server.vbds_lock);
+
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(tapdisk_server_aio_queue(), tiocb);
 }
 
-void
+static void tapdisk_server_wake(char);
+
+static void
+tapdisk_server_debug_queue(void *private)
+{
+	tapdisk_debug_queue(private);
+}
+
+static void
+tapdisk_server_debug_vbd(td_vbd_t *vbd, void *private)
+{
+	tapdisk_vbd_debug(vbd);
+}
+
+static void
 tapdisk_server_debug(void)
 {
-	td_vbd_t *vbd, *tmp;
+	tapdisk_worker_t *worker;
 
 	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_server_for_each_worker(worker)
+		tapdisk_server_call_worker(worker, tapdisk_server_debug_queue,
+					   &worker->aio_queue);
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
-		tapdisk_vbd_debug(vbd);
+	tapdisk_server_call_each_vbd(tapdisk_server_debug_vbd, NULL);
 
 	tlog_flush();
 }
@@ -117,28 +236,64 @@ tapdisk_server_debug(void)
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
-		server.run = 0;
+	int empty;
+
+	pthread_mutex_lock(&server.vbds_lock);
+	empty = list_empty(&server.vbds);
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	if (!empty)
+		return;
+
+	server.run = 0;
+
+	/* Wake the main loop, if it is not the one calling. */
+	if (current_worker)
+		tapdisk_server_wake(0);
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
-					mode, fd, timeout, cb, data);
+	event_id_t id;
+
+	id = scheduler_register_event(tapdisk_server_scheduler(),
+				      mode, fd, timeout, cb, data);
+	if (id > 0 && current_worker)
+		id |= (current_worker->id + 1) << TAPDISK_EVENT_LOOP_SHIFT;
+
+	return id;
 }
 
+/*
+ * Events go back to the loop they came from.  That loop must not be
+ * running concurrently: call this on its thread, or on a worker while
+ * the main thread waits in tapdisk_server_call_vbd().
+ */
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	int loop;
+	scheduler_t *s;
+
+	if (event <= 0)
+		return;
+
+	loop = event >> TAPDISK_EVENT_LOOP_SHIFT;
+	if (loop > server.nr_workers) {
+		ERR(-EINVAL, "bad event id 0x%x\n", event);
+		return;
+	}
+
+	s = loop ? &server.workers[loop - 1].scheduler : &server.scheduler;
+	scheduler_unregister_event(s, event & SCHEDULER_EVENT_ID_MAX);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(tapdisk_server_scheduler(), seconds);
 }
 
 static void
@@ -152,7 +307,7 @@ tapdisk_server_set_retry_timeout(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_server_for_each_loop_vbd(vbd, tmp)
 		if (tapdisk_vbd_retry_needed(vbd)) {
 			tapdisk_server_set_max_timeout(TD_VBD_RETRY_INTERVAL);
 			return;
@@ -167,14 +322,44 @@ tapdisk_server_check_progress(void)
 
 	gettimeofday(&now, NULL);
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_server_for_each_loop_vbd(vbd, tmp)
 		tapdisk_vbd_check_progress(vbd);
 }
 
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	struct tqueue *queue = tapdisk_server_aio_queue();
+	int hold;
+
+	/* wake up to submit once the hold is over, if nothing else does */
+	hold = tapdisk_queue_hold(queue);
+	if (hold) {
+		scheduler_set_max_timeout_us(tapdisk_server_scheduler(), hold);
+		return;
+	}
+
+	tapdisk_submit_all_tiocbs(queue);
+}
+
+/*
+ * Totals over the aio queues of every loop.  The counters are only read
+ * here, so may be a little behind those of busy workers.
+ */
+void
+tapdisk_server_queue_stats(struct tqueue_stats *stats)
+{
+	tapdisk_worker_t *worker;
+	struct tqueue *queue;
+
+	*stats = server.aio_queue.stats;
+
+	tapdisk_server_for_each_worker(worker) {
+		queue = &worker->aio_queue;
+		stats->submitted += queue->stats.submitted;
+		stats->issued    += queue->stats.issued;
+		stats->holds     += queue->stats.holds;
+	}
 }
 
 static void
@@ -183,7 +368,7 @@ tapdisk_server_kick_responses(void)
 	int n;
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_server_for_each_loop_vbd(vbd, tmp)
 		tapdisk_vbd_kick(vbd);
 }
 
@@ -192,17 +377,20 @@ tapdisk_server_check_vbds(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_server_for_each_loop_vbd(vbd, tmp)
 		tapdisk_vbd_check_state(vbd);
 }
 
 static void
-tapdisk_server_stop_vbds(void)
+tapdisk_server_stop_vbd(td_vbd_t *vbd, void *private)
 {
-	td_vbd_t *vbd, *tmp;
+	tapdisk_vbd_kill_queue(vbd);
+}
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
-		tapdisk_vbd_kill_queue(vbd);
+static void
+tapdisk_server_stop_vbds(void)
+{
+	tapdisk_server_call_each_vbd(tapdisk_server_stop_vbd, NULL);
 }
 
 static int
@@ -218,10 +406,374 @@ tapdisk_server_close_aio(void)
 	tapdisk_free_queue(&server.aio_queue);
 }
 
+static void
+tapdisk_worker_wakeup(event_id_t id, char mode, void *private)
+{
+	tapdisk_worker_t *worker = private;
+	void (*call)(void *);
+	void *arg;
+	char c;
+
+	if (read(worker->wakeup[0], &c, 1) != 1)
+		return;
+
+	pthread_mutex_lock(&worker->lock);
+	call = worker->call;
+	arg  = worker->call_arg;
+	pthread_mutex_unlock(&worker->lock);
+
+	if (!call)
+		return;
+
+	call(arg);
+
+	pthread_mutex_lock(&worker->lock);
+	worker->call = NULL;
+	pthread_cond_signal(&worker->done);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+static void
+tapdisk_worker_kick(tapdisk_worker_t *worker)
+{
+	char c = 0;
+
+	while (write(worker->wakeup[1], &c, 1) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * Run call(arg) on worker, or on the main thread if worker is NULL, and
+ * wait for it.  Only the main thread calls this, outside of signal
+ * context, so at most one call is ever in flight and the callee may
+ * touch server-wide state.
+ */
+static void
+tapdisk_server_call_worker(tapdisk_worker_t *worker,
+			   void (*call)(void *), void *arg)
+{
+	if (!worker) {
+		call(arg);
+		return;
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	worker->call     = call;
+	worker->call_arg = arg;
+	tapdisk_worker_kick(worker);
+	while (worker->call)
+		pthread_cond_wait(&worker->done, &worker->lock);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/*
+ * Run call(arg) on the worker driving VBD uuid, or for a new VBD on the
+ * least loaded one, and wait for it.
+ */
+void
+tapdisk_server_call_vbd(td_uuid_t uuid, void (*call)(void *), void *arg)
+{
+	td_vbd_t *vbd;
+	tapdisk_worker_t *worker, *w;
+
+	worker = NULL;
+
+	pthread_mutex_lock(&server.vbds_lock);
+	vbd = __tapdisk_server_get_vbd(uuid);
+	if (vbd)
+		worker = vbd->worker;
+	else
+		tapdisk_server_for_each_worker(w)
+			if (!worker || w->nr_vbds < worker->nr_vbds)
+				worker = w;
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	tapdisk_server_call_worker(worker, call, arg);
+}
+
+struct tapdisk_server_vbd_call {
+	td_uuid_t                    uuid;
+	void                       (*fn)(td_vbd_t *, void *);
+	void                        *arg;
+	int                          done;
+};
+
+static void
+tapdisk_server_run_vbd_call(void *private)
+{
+	struct tapdisk_server_vbd_call *call = private;
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(call->uuid);
+	if (!vbd)
+		return;
+
+	call->fn(vbd, call->arg);
+	call->done = 1;
+}
+
+/*
+ * Run fn(vbd, arg) for each VBD, on the thread driving it.  VBDs that
+ * shut down meanwhile are skipped.  Returns the number fn ran on.
+ */
+int
+tapdisk_server_call_each_vbd(void (*fn)(td_vbd_t *, void *), void *arg)
+{
+	struct tapdisk_server_vbd_call call;
+	tapdisk_worker_t *worker;
+	td_uuid_t *uuids;
+	td_vbd_t *vbd, *tmp;
+	int i, count, done;
+
+	uuids = NULL;
+	count = 0;
+
+	pthread_mutex_lock(&server.vbds_lock);
+	tapdisk_server_for_each_vbd(vbd, tmp)
+		count++;
+	if (count)
+		uuids = calloc(count, sizeof(td_uuid_t));
+	if (uuids) {
+		i = 0;
+		tapdisk_server_for_each_vbd(vbd, tmp)
+			uuids[i++] = vbd->uuid;
+	}
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	if (count && !uuids) {
+		ERR(-ENOMEM, "failed to call on %d vbds\n", count);
+		return -ENOMEM;
+	}
+
+	done = 0;
+	for (i = 0; i < count; i++) {
+		call.uuid = uuids[i];
+		call.fn   = fn;
+		call.arg  = arg;
+		call.done = 0;
+
+		pthread_mutex_lock(&server.vbds_lock);
+		vbd = __tapdisk_server_get_vbd(call.uuid);
+		worker = vbd ? vbd->worker : NULL;
+		pthread_mutex_unlock(&server.vbds_lock);
+
+		if (!vbd)
+			continue;
+
+		tapdisk_server_call_worker(worker,
+					   tapdisk_server_run_vbd_call, &call);
+		done += call.done;
+	}
+
+	free(uuids);
+	return done;
+}
+
+/*
+ * Workers keep running once their last VBD is gone, and even once the
+ * main loop is done, so that calls from the main thread always find
+ * them: only tapdisk_server_stop_workers() ends them.
+ */
+static void *
+tapdisk_worker_run(void *private)
+{
+	tapdisk_worker_t *worker = private;
+
+	current_worker = worker;
+
+	while (!worker->stop)
+		tapdisk_server_iterate();
+
+	return NULL;
+}
+
+static void
+tapdisk_worker_close(tapdisk_worker_t *worker)
+{
+	current_worker = worker;
+
+	if (worker->wakeup_event > 0)
+		tapdisk_server_unregister_event(worker->wakeup_event);
+	tapdisk_free_queue(&worker->aio_queue);
+
+	current_worker = NULL;
+
+	if (worker->wakeup[0] != -1)
+		close(worker->wakeup[0]);
+	if (worker->wakeup[1] != -1)
+		close(worker->wakeup[1]);
+
+	scheduler_close(&worker->scheduler);
+	pthread_cond_destroy(&worker->done);
+	pthread_mutex_destroy(&worker->lock);
+}
+
+/*
+ * Set up the worker's loop from the main thread, as if it were the
+ * worker: events and the aio queue register with its scheduler.
+ */
+static int
+tapdisk_worker_init(tapdisk_worker_t *worker, int id)
+{
+	int err;
+
+	memset(worker, 0, sizeof(*worker));
+	worker->id           = id;
+	worker->wakeup[0]    = -1;
+	worker->wakeup[1]    = -1;
+	worker->wakeup_event = -1;
+	INIT_LIST_HEAD(&worker->vbds);
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->done, NULL);
+
+	err = scheduler_initialize(&worker->scheduler);
+	if (err)
+		goto fail;
+
+	if (pipe(worker->wakeup)) {
+		err = -errno;
+		worker->wakeup[0] = worker->wakeup[1] = -1;
+		goto fail;
+	}
+
+	current_worker = worker;
+
+	err = tapdisk_init_queue(&worker->aio_queue, TAPDISK_TIOCBS,
+				 TIO_DRV_LIO, NULL);
+	if (err)
+		goto fail;
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    worker->wakeup[0], 0,
+					    tapdisk_worker_wakeup, worker);
+	if (err < 0)
+		goto fail;
+
+	worker->wakeup_event = err;
+	current_worker = NULL;
+
+	return 0;
+
+fail:
+	current_worker = NULL;
+	ERR(err, "failed to initialize worker %d: %d\n", id, err);
+	return err;
+}
+
+static void
+tapdisk_server_stop_workers(void)
+{
+	tapdisk_worker_t *worker;
+
+	server.run = 0;
+
+	tapdisk_server_for_each_worker(worker) {
+		if (!worker->thread)
+			continue;
+		worker->stop = 1;
+		tapdisk_worker_kick(worker);
+		pthread_join(worker->thread, NULL);
+		worker->thread = 0;
+	}
+}
+
+static void
+tapdisk_server_close_workers(void)
+{
+	tapdisk_worker_t *worker;
+
+	if (!server.workers)
+		return;
+
+	tapdisk_server_stop_workers();
+
+	tapdisk_server_for_each_worker(worker)
+		tapdisk_worker_close(worker);
+
+	free(server.workers);
+	server.workers    = NULL;
+	server.nr_workers = 0;
+}
+
+static int
+tapdisk_server_init_workers(void)
+{
+	int i, err, nr;
+
+	nr = server.nr_workers;
+	if (!nr)
+		return 0;
+
+	server.nr_workers = 0;
+	server.workers    = calloc(nr, sizeof(tapdisk_worker_t));
+	if (!server.workers)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		err = tapdisk_worker_init(server.workers + i, i);
+		if (err) {
+			tapdisk_worker_close(server.workers + i);
+			return err;
+		}
+		server.nr_workers++;
+	}
+
+	return 0;
+}
+
+/*
+ * Threads are only started once the server is about to run, after
+ * tapdisk2 has daemonized.  Signals are left to the main thread.
+ */
+static int
+tapdisk_server_start_workers(void)
+{
+	int err;
+	sigset_t set, old;
+	tapdisk_worker_t *worker;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	err = 0;
+	tapdisk_server_for_each_worker(worker) {
+		err = pthread_create(&worker->thread, NULL,
+				     tapdisk_worker_run, worker);
+		if (err) {
+			err = -err;
+			worker->thread = 0;
+			ERR(err, "failed to start worker %d\n", worker->id);
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err)
+		tapdisk_server_stop_workers();
+
+	return err;
+}
+
+int
+tapdisk_server_set_workers(int nr)
+{
+	if (nr < 0 || nr > TAPDISK_MAX_WORKERS)
+		return -EINVAL;
+
+	if (server.workers)
+		return -EBUSY;
+
+	server.nr_workers = nr;
+	return 0;
+}
+
 static void
 tapdisk_server_close(void)
 {
+	tapdisk_server_close_workers();
 	tapdisk_server_close_aio();
+	scheduler_close(&server.scheduler);
 }
 
 void
@@ -233,7 +785,7 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(tapdisk_server_scheduler());
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %d\n", ret);
 
@@ -249,17 +801,45 @@ __tapdisk_server_run(void)
 		tapdisk_server_iterate();
 }
 
+static void
+tapdisk_server_close_vbd(td_vbd_t *vbd, void *private)
+{
+	tapdisk_vbd_close(vbd);
+}
+
+/* Post c to the main loop; 0 only wakes it.  Async-signal-safe. */
+static void
+tapdisk_server_wake(char c)
+{
+	int err = errno;
+
+	/* Nothing to do if it fails: the pipe is full already. */
+	if (server.sigpipe[1] != -1 && write(server.sigpipe[1], &c, 1) != 1)
+		;
+
+	errno = err;
+}
+
+/*
+ * Signals are only noted by the handler, and acted upon by the main
+ * loop: they can arrive while the main thread holds a lock or waits
+ * for a worker, and the VBDs they act on belong to the workers.
+ */
 static void
 tapdisk_server_signal_handler(int signal)
 {
-	td_vbd_t *vbd, *tmp;
+	tapdisk_server_wake(signal);
+}
+
+static void
+tapdisk_server_handle_signal(int signal)
+{
 	static int xfsz_error_sent = 0;
 
 	switch (signal) {
 	case SIGBUS:
 	case SIGINT:
-		tapdisk_server_for_each_vbd(vbd, tmp)
-			tapdisk_vbd_close(vbd);
+		tapdisk_server_call_each_vbd(tapdisk_server_close_vbd, NULL);
 		break;
 
 	case SIGXFSZ:
@@ -277,15 +857,86 @@ tapdisk_server_signal_handler(int signal)
 	}
 }
 
+static void
+tapdisk_server_signal_event(event_id_t id, char mode, void *private)
+{
+	char c;
+
+	while (read(server.sigpipe[0], &c, 1) == 1)
+		tapdisk_server_handle_signal(c);
+}
+
+static int
+tapdisk_server_init_signals(void)
+{
+	int err, i;
+
+	if (pipe(server.sigpipe)) {
+		err = -errno;
+		server.sigpipe[0] = server.sigpipe[1] = -1;
+		return err;
+	}
+
+	for (i = 0; i < 2; i++)
+		if (fcntl(server.sigpipe[i], F_SETFL, O_NONBLOCK)) {
+			err = -errno;
+			goto fail;
+		}
+
+	err = scheduler_register_event(&server.scheduler,
+				       SCHEDULER_POLL_READ_FD,
+				       server.sigpipe[0], 0,
+				       tapdisk_server_signal_event, NULL);
+	if (err < 0)
+		goto fail;
+
+	server.sig_event = err;
+
+	signal(SIGBUS, tapdisk_server_signal_handler);
+	signal(SIGINT, tapdisk_server_signal_handler);
+	signal(SIGUSR1, tapdisk_server_signal_handler);
+	signal(SIGXFSZ, tapdisk_server_signal_handler);
+
+	return 0;
+
+fail:
+	close(server.sigpipe[0]);
+	close(server.sigpipe[1]);
+	server.sigpipe[0] = server.sigpipe[1] = -1;
+	return err;
+}
+
+static void
+tapdisk_server_close_signals(void)
+{
+	if (server.sig_event > 0) {
+		signal(SIGBUS, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGUSR1, SIG_DFL);
+		signal(SIGXFSZ, SIG_DFL);
+		scheduler_unregister_event(&server.scheduler,
+					   server.sig_event);
+		server.sig_event = -1;
+	}
+
+	if (server.sigpipe[0] != -1)
+		close(server.sigpipe[0]);
+	if (server.sigpipe[1] != -1)
+		close(server.sigpipe[1]);
+	server.sigpipe[0] = server.sigpipe[1] = -1;
+}
+
 int
 tapdisk_server_init(void)
 {
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
+	INIT_LIST_HEAD(&server.loop_vbds);
+	pthread_mutex_init(&server.vbds_lock, NULL);
+	server.sigpipe[0] = server.sigpipe[1] = -1;
+	server.sig_event  = -1;
 
-	scheduler_initialize(&server.scheduler);
-
-	return 0;
+	return scheduler_initialize(&server.scheduler);
 }
 
 int
@@ -297,11 +948,16 @@ tapdisk_server_complete(void)
 	if (err)
 		goto fail;
 
+	err = tapdisk_server_init_workers();
+	if (err)
+		goto fail;
+
 	server.run = 1;
 
 	return 0;
 
 fail:
+	tapdisk_server_close_workers();
 	tapdisk_server_close_aio();
 	return err;
 }
@@ -311,7 +967,9 @@ tapdisk_server_initialize(void)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		goto fail;
 
 	err = tapdisk_server_complete();
 	if (err)
@@ -333,13 +991,19 @@ tapdisk_server_run()
 	if (err)
 		return err;
 
-	signal(SIGBUS, tapdisk_server_signal_handler);
-	signal(SIGINT, tapdisk_server_signal_handler);
-	signal(SIGUSR1, tapdisk_server_signal_handler);
-	signal(SIGXFSZ, tapdisk_server_signal_handler);
+	err = tapdisk_server_init_signals();
+	if (err)
+		goto out;
+
+	err = tapdisk_server_start_workers();
+	if (err)
+		goto out;
 
 	__tapdisk_server_run();
+
+out:
+	tapdisk_server_close_signals();
 	tapdisk_server_close();
 
-	return 0;
+	return err;
 }
@@ -28,6 +28,8 @@
 #ifndef _TAPDISK_SERVER_H_
 #define _TAPDISK_SERVER_H_
 
+#include <pthread.h>
+
 #include "list.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
@@ -36,12 +38,14 @@ struct tap_disk *tapdisk_server_find_driver_interface(int);
 
 td_image_t *tapdisk_server_get_shared_image(td_image_t *);
 
-struct list_head *tapdisk_server_get_all_vbds(void);
+int tapdisk_server_count_vbds(void);
+int tapdisk_server_get_minors(int *, int);
 td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+void tapdisk_server_queue_stats(struct tqueue_stats *);
 
 void tapdisk_server_check_state(void);
 
@@ -49,6 +53,10 @@ event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
 
+int tapdisk_server_set_workers(int);
+void tapdisk_server_call_vbd(td_uuid_t, void (*)(void *), void *);
+int tapdisk_server_call_each_vbd(void (*)(td_vbd_t *, void *), void *);
+
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(void);
 int tapdisk_server_complete(void);
@@ -57,11 +65,53 @@ void tapdisk_server_iterate(void);
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
 
+#define TAPDISK_MAX_WORKERS         64
+
+/*
+ * Event ids carry the loop they were registered on above
+ * SCHEDULER_EVENT_ID_BITS: 0 for the main thread, n + 1 for worker n.
+ */
+#define TAPDISK_EVENT_LOOP_SHIFT    SCHEDULER_EVENT_ID_BITS
+
+/*
+ * A worker is an event loop on its own thread, with its own scheduler
+ * and aio queue, driving the VBDs assigned to it.  The main thread only
+ * handles control requests and hands those for a VBD to its worker.
+ */
+typedef struct tapdisk_worker {
+	int                          id;
+	pthread_t                    thread;
+	int                          stop;
+	struct list_head             vbds;
+	int                          nr_vbds;     /* under vbds_lock */
+	scheduler_t                  scheduler;
+	struct tqueue                aio_queue;
+
+	int                          wakeup[2];
+	event_id_t                   wakeup_event;
+
+	pthread_mutex_t              lock;
+	pthread_cond_t               done;
+	void                       (*call)(void *);
+	void                        *call_arg;
+} tapdisk_worker_t;
+
 typedef struct tapdisk_server {
 	int                          run;
 	struct list_head             vbds;
+	pthread_mutex_t              vbds_lock;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+
+	/* VBDs driven by the main thread: all of them without workers. */
+	struct list_head             loop_vbds;
+
+	int                          nr_workers;
+	tapdisk_worker_t            *workers;
+
+	/* Signals noted by the handler, for the main loop. */
+	int                          sigpipe[2];
+	event_id_t                   sig_event;
 } tapdisk_server_t;
 
 #endif
@@ -37,6 +37,9 @@
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "blk.h"
 #include "tapdisk.h"
@@ -148,6 +151,49 @@ tapdisk_get_image_size(int fd, uint64_t *_sectors, uint32_t *_sector_size)
 	return 0;
 }
 
+/*
+ * test a buffer for zeroes, 64 bytes at a time: the words of each chunk
+ * are or'ed together (in vector registers, where we have them) and only
+ * the result is tested.  buf should be word aligned.
+ */
+int
+tapdisk_buffer_is_zero(const void *buf, size_t size)
+{
+	const char *p = buf;
+#ifdef __SSE2__
+	__m128i acc, zero = _mm_setzero_si128();
+
+	for (; size >= 64; size -= 64, p += 64) {
+		acc = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+				     _mm_loadu_si128((const __m128i *)(p + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+				     _mm_loadu_si128((const __m128i *)(p + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			return 0;
+	}
+#else
+	int i;
+	unsigned long acc;
+	const unsigned long *w;
+
+	for (; size >= 64; size -= 64, p += 64) {
+		w   = (const unsigned long *)p;
+		acc = 0;
+		for (i = 0; i < 64 / sizeof(unsigned long); i++)
+			acc |= w[i];
+		if (acc)
+			return 0;
+	}
+#endif
+
+	for (; size; size--, p++)
+		if (*p)
+			return 0;
+
+	return 1;
+}
+
 #ifdef __linux__
 
 int tapdisk_linux_version(void)
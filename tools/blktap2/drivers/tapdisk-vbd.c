@@ -44,6 +44,9 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-vbd.h"
+#include "tapdisk-blkif.h"
+#include "tapdisk-coalesce.h"
+#include "tapdisk-utils.h"
 #include "blktap2.h"
 
 #define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
@@ -123,6 +126,7 @@ tapdisk_vbd_create(uint16_t uuid)
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
+	INIT_LIST_HEAD(&vbd->loop_next);
 	gettimeofday(&vbd->ts, NULL);
 
 	for (i = 0; i < MAX_REQUESTS; i++)
@@ -179,11 +183,198 @@ tapdisk_vbd_validate_chain(td_vbd_t *vbd)
 	return 0;
 }
 
+static void
+tapdisk_vbd_free_block_map(td_vbd_t *vbd)
+{
+	if (!vbd->block_map)
+		return;
+
+	free(vbd->block_map->level);
+	free(vbd->block_map);
+	vbd->block_map = NULL;
+}
+
+/*
+ * merge the allocation maps of the chain, top down.  images without one
+ * are either filters (no parent of their own), which are skipped, or
+ * sinks holding every block, which end the chain as far as we're
+ * concerned.  blocks no layer holds stay at TD_VBD_MAP_LEVELS: reads of
+ * them go to the last layer, and zeroes written to them needn't go
+ * anywhere at all.
+ */
+static int
+tapdisk_vbd_build_block_map(td_vbd_t *vbd)
+{
+	int err, l, sink;
+	uint8_t *map;
+	uint32_t secs;
+	uint64_t i, n;
+	td_disk_id_t id;
+	td_vbd_block_map_t *bm;
+	td_image_t *image, *entry, *tmp;
+
+	bm = calloc(1, sizeof(td_vbd_block_map_t));
+	if (!bm)
+		return -ENOMEM;
+
+	err   = 0;
+	entry = NULL;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		if (!entry)
+			entry = image;
+
+		map = NULL;
+		err = td_get_block_map(image, &secs, &n, &map);
+		if (err == -ENOSYS &&
+		    !tapdisk_vbd_is_last_image(vbd, image)) {
+			err = td_get_parent_id(image, &id);
+			if (!err)
+				free(id.name);
+			if (err == -EINVAL)
+				continue;
+		}
+
+		if (map && !bm->level) {
+			bm->block_secs = secs;
+			bm->blocks     = (image->info.size + secs - 1) / secs;
+			bm->level      = malloc(bm->blocks);
+			if (!bm->level) {
+				free(map);
+				err = -ENOMEM;
+				goto fail;
+			}
+			memset(bm->level, TD_VBD_MAP_LEVELS, bm->blocks);
+		}
+
+		if (!bm->level || bm->levels == TD_VBD_MAP_LEVELS ||
+		    (map && secs != bm->block_secs)) {
+			free(map);
+			err = -EINVAL;
+			goto fail;
+		}
+
+		l = bm->levels++;
+		bm->entry[l] = entry;
+		entry = NULL;
+
+		sink = !map;
+		for (i = 0; i < bm->blocks; i++)
+			if (bm->level[i] == TD_VBD_MAP_LEVELS &&
+			    (sink || (i < n && map[i])))
+				bm->level[i] = l;
+
+		free(map);
+		if (sink)
+			break;
+	}
+
+	if (bm->levels < 2) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	vbd->block_map = bm;
+	DPRINTF("%s: block map of %d levels, %"PRIu64" blocks\n",
+		vbd->name, bm->levels, bm->blocks);
+	return 0;
+
+fail:
+	free(bm->level);
+	free(bm);
+	return err;
+}
+
+/*
+ * where to start a read: anywhere above the topmost layer holding the
+ * data works, so a request straddling blocks takes the highest layer.
+ */
+static td_image_t *
+tapdisk_vbd_map_read(td_vbd_t *vbd, td_request_t treq)
+{
+	int level;
+	uint64_t blk, end;
+	td_image_t *image;
+	td_vbd_block_map_t *bm;
+
+	bm = vbd->block_map;
+	if (!bm)
+		return treq.image;
+
+	blk   = treq.sec / bm->block_secs;
+	end   = (treq.sec + treq.secs - 1) / bm->block_secs;
+	level = TD_VBD_MAP_LEVELS;
+
+	for (; blk <= end; blk++) {
+		if (blk >= bm->blocks)
+			return treq.image;
+		if (bm->level[blk] < level)
+			level = bm->level[blk];
+	}
+
+	if (level >= bm->levels)
+		level = bm->levels - 1;
+	image = bm->entry[level];
+	if (!level || treq.sec + treq.secs > image->info.size)
+		return treq.image;
+
+	vbd->map_skips++;
+	return image;
+}
+
+static void
+tapdisk_vbd_map_write(td_vbd_t *vbd, td_request_t treq)
+{
+	uint64_t blk, end;
+	td_vbd_block_map_t *bm;
+
+	bm = vbd->block_map;
+	if (!bm)
+		return;
+
+	blk = treq.sec / bm->block_secs;
+	end = (treq.sec + treq.secs - 1) / bm->block_secs;
+
+	for (; blk <= end && blk < bm->blocks; blk++)
+		bm->level[blk] = 0;
+}
+
+/*
+ * a write of zeroes to blocks no layer holds changes nothing, so
+ * needn't be issued: it would only allocate them.
+ */
+static int
+tapdisk_vbd_map_zero_write(td_vbd_t *vbd, td_request_t treq)
+{
+	uint64_t blk, end;
+	td_vbd_block_map_t *bm;
+
+	bm = vbd->block_map;
+	if (!bm)
+		return 0;
+
+	blk = treq.sec / bm->block_secs;
+	end = (treq.sec + treq.secs - 1) / bm->block_secs;
+
+	for (; blk <= end; blk++)
+		if (blk >= bm->blocks || bm->level[blk] != TD_VBD_MAP_LEVELS)
+			return 0;
+
+	if (!tapdisk_buffer_is_zero(treq.buf, treq.secs << SECTOR_SHIFT))
+		return 0;
+
+	vbd->zero_skips++;
+	return 1;
+}
+
 void
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
 	td_image_t *image, *tmp;
 
+	tapdisk_coalesce_cancel(vbd);
+	tapdisk_vbd_free_block_map(vbd);
+
 	tapdisk_vbd_for_each_image(vbd, image, tmp) {
 		td_close(image);
 		tapdisk_image_free(image);
@@ -260,6 +451,60 @@ done:
 	return 0;
 }
 
+/*
+ * the persistent cache goes right above the topmost shared parent (below
+ * any block cache), and is optional: if it can't be opened, the vbd is
+ * opened without it.
+ */
+static int
+tapdisk_vbd_add_persistent_cache(td_vbd_t *vbd)
+{
+	int err;
+	td_image_t *cache, *image, *target, *tmp;
+
+	target = NULL;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (td_flag_test(image->flags, TD_OPEN_RDONLY) &&
+		    td_flag_test(image->flags, TD_OPEN_SHAREABLE) &&
+		    image->type != DISK_TYPE_BLOCK_CACHE) {
+			target = image;
+			break;
+		}
+
+	if (!target || !target->driver)
+		return 0;
+
+	cache = tapdisk_image_allocate(target->name,
+				       DISK_TYPE_PCACHE,
+				       target->storage,
+				       target->flags,
+				       target->private);
+	if (!cache)
+		return -ENOMEM;
+
+	cache->driver = tapdisk_driver_allocate(cache->type,
+						cache->name,
+						cache->flags,
+						cache->storage);
+	if (!cache->driver) {
+		tapdisk_image_free(cache);
+		return -ENOMEM;
+	}
+
+	cache->driver->info = target->driver->info;
+
+	err = td_open(cache);
+	if (err) {
+		EPRINTF("%s: no persistent cache: %d\n", target->name, err);
+		tapdisk_image_free(cache);
+		return 0;
+	}
+
+	list_add(&cache->next, target->next.prev);
+	return 0;
+}
+
 static int
 tapdisk_vbd_add_dirty_log(td_vbd_t *vbd)
 {
@@ -428,10 +673,21 @@ __tapdisk_vbd_open_vdi(td_vbd_t *vbd, td_flag_t extra_flags)
 			goto fail;
 	}
 
+	if (td_flag_test(vbd->flags, TD_OPEN_ADD_PCACHE)) {
+		err = tapdisk_vbd_add_persistent_cache(vbd);
+		if (err)
+			goto fail;
+	}
+
 	err = tapdisk_vbd_validate_chain(vbd);
 	if (err)
 		goto fail;
 
+	err = tapdisk_vbd_build_block_map(vbd);
+	if (err && err != -EINVAL)
+		EPRINTF("%s: no block map: %d\n", vbd->name, err);
+	err = 0;
+
 	td_flag_clear(vbd->state, TD_VBD_CLOSED);
 
 	return 0;
@@ -766,6 +1022,8 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 		vbd->errors, vbd->retries, vbd->received, vbd->returned,
 		vbd->kicked);
 
+	if (vbd->blkif)
+		tapdisk_blkif_disconnect(vbd, 1);
 	tapdisk_vbd_close_vdi(vbd);
 	tapdisk_vbd_detach(vbd);
 	tapdisk_server_remove_vbd(vbd);
@@ -818,11 +1076,17 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 	DBG(TLOG_WARN, "%s: state: 0x%08x, new: 0x%02x, pending: 0x%02x, "
 	    "failed: 0x%02x, completed: 0x%02x, last activity: %010ld.%06lld, "
 	    "errors: 0x%04"PRIx64", retries: 0x%04"PRIx64", received: 0x%08"PRIx64", "
-	    "returned: 0x%08"PRIx64", kicked: 0x%08"PRIx64"\n",
+	    "returned: 0x%08"PRIx64", kicked: 0x%08"PRIx64", "
+	    "map skips: 0x%08"PRIx64", zero skips: 0x%08"PRIx64"\n",
 	    vbd->name, vbd->state, new, pending, failed, completed,
 	    vbd->ts.tv_sec, (unsigned long long)vbd->ts.tv_usec,
-	    vbd->errors, vbd->retries,
-	    vbd->received, vbd->returned, vbd->kicked);
+	    vbd->errors, vbd->retries, vbd->received, vbd->returned,
+	    vbd->kicked, vbd->map_skips, vbd->zero_skips);
+
+	if (vbd->blkif)
+		tapdisk_blkif_debug(vbd->blkif);
+	if (vbd->coalesce)
+		tapdisk_coalesce_debug(vbd->coalesce);
 
 	tapdisk_vbd_for_each_image(vbd, image, tmp)
 		td_debug(image);
@@ -1015,6 +1279,9 @@ tapdisk_vbd_kick(td_vbd_t *vbd)
 
 	tapdisk_vbd_check_state(vbd);
 
+	if (vbd->blkif)
+		tapdisk_blkif_kick(vbd->blkif);
+
 	ring = &vbd->ring;
 	if (!ring->sring)
 		return 0;
@@ -1072,7 +1339,10 @@ tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		ERR(EIO, "returning BLKIF_RSP %d", rsp->status);
 
 	vbd->returned++;
-	vbd->callback(vbd->argument, rsp);
+	if (vreq->blkif)
+		tapdisk_blkif_complete_request(vreq->blkif, vreq);
+	else
+		vbd->callback(vbd->argument, rsp);
 }
 
 void
@@ -1211,7 +1481,8 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 			vbd->errors++;
 			ERR(err, "req %"PRIu64": %s 0x%04x secs to "
 			    "0x%08"PRIx64, vreq->req.id,
-			    (treq.op == TD_OP_WRITE ? "write" : "read"),
+			    (treq.op == TD_OP_WRITE   ? "write"   :
+			     treq.op == TD_OP_DISCARD ? "discard" : "read"),
 			    treq.secs, treq.sec);
 		}
 	} else {
@@ -1230,6 +1501,9 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 								sec, secs);
 		}
 #endif
+		if (vbd->coalesce && treq.op == TD_OP_WRITE)
+			tapdisk_coalesce_mark_dirty(vbd->coalesce,
+						    treq.sec, treq.secs);
 	}
 
 	tapdisk_vbd_complete_vbd_request(vbd, vreq);
@@ -1384,10 +1658,35 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	if (err)
 		goto fail;
 
+	if (req->operation == BLKIF_OP_DISCARD) {
+		blkif_request_discard_t *dreq = (blkif_request_discard_t *)req;
+
+		treq.id             = id;
+		treq.sidx           = 0;
+		treq.blocked        = 0;
+		treq.buf            = NULL;
+		treq.sec            = dreq->sector_number;
+		treq.secs           = dreq->nr_sectors;
+		treq.image          = image;
+		treq.cb             = tapdisk_vbd_complete_td_request;
+		treq.cb_data        = NULL;
+		treq.private        = vreq;
+		treq.op             = TD_OP_DISCARD;
+
+		vreq->secs_pending += treq.secs;
+		vbd->secs_pending  += treq.secs;
+
+		td_queue_discard(image, treq);
+		goto issued;
+	}
+
 	for (i = 0; i < req->nr_segments; i++) {
 		nsects = req->seg[i].last_sect - req->seg[i].first_sect + 1;
-		page   = (char *)MMAP_VADDR(ring->vstart, 
-					   (unsigned long)req->id, i);
+		if (vreq->buf)
+			page = vreq->buf + i * XC_PAGE_SIZE;
+		else
+			page = (char *)MMAP_VADDR(ring->vstart,
+						  (unsigned long)req->id, i);
 		page  += (req->seg[i].first_sect << SECTOR_SHIFT);
 
 		treq.id             = id;
@@ -1411,18 +1710,25 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		switch (req->operation)	{
 		case BLKIF_OP_WRITE:
 			treq.op = TD_OP_WRITE;
+			if (tapdisk_vbd_map_zero_write(vbd, treq)) {
+				td_complete_request(treq, 0);
+				break;
+			}
+			tapdisk_vbd_map_write(vbd, treq);
 			td_queue_write(image, treq);
 			break;
 
 		case BLKIF_OP_READ:
-			treq.op = TD_OP_READ;
-			td_queue_read(image, treq);
+			treq.op    = TD_OP_READ;
+			treq.image = tapdisk_vbd_map_read(vbd, treq);
+			td_queue_read(treq.image, treq);
 			break;
 		}
 
 		sector_nr += nsects;
 	}
 
+issued:
 	err = 0;
 
 out:
@@ -54,8 +54,12 @@ typedef struct td_ring              td_ring_t;
 typedef struct td_vbd_request       td_vbd_request_t;
 typedef struct td_vbd_driver_info   td_vbd_driver_info_t;
 typedef struct td_vbd_handle        td_vbd_t;
+typedef struct td_vbd_block_map     td_vbd_block_map_t;
 typedef void (*td_vbd_cb_t)        (void *, blkif_response_t *);
 
+struct td_blkif;
+struct td_coalesce;
+
 struct td_ring {
 	int                         fd;
 	char                       *mem;
@@ -77,6 +81,10 @@ struct td_vbd_request {
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
+
+	/* set for requests not from the blktap ring: their data pages */
+	char                       *buf;
+	struct td_blkif            *blkif;
 };
 
 struct td_vbd_driver_info {
@@ -85,6 +93,21 @@ struct td_vbd_driver_info {
 	struct list_head            next;
 };
 
+/*
+ * for each block, the layer of the chain holding it topmost.  a layer is
+ * entered at the first image below the layer above it, so filters (caches,
+ * logs) in between still see its reads.
+ */
+#define TD_VBD_MAP_LEVELS           255
+
+struct td_vbd_block_map {
+	uint32_t                    block_secs;
+	uint64_t                    blocks;
+	uint8_t                    *level;
+	int                         levels;
+	td_image_t                 *entry[TD_VBD_MAP_LEVELS];
+};
+
 struct td_vbd_handle {
 	char                       *name;
 
@@ -101,6 +124,10 @@ struct td_vbd_handle {
 	td_flag_t                   state;
 
 	struct list_head            images;
+	td_vbd_block_map_t         *block_map;
+
+	/* an online coalesce of the leaf, if running */
+	struct td_coalesce         *coalesce;
 
 	struct list_head            new_requests;
 	struct list_head            pending_requests;
@@ -112,11 +139,18 @@ struct td_vbd_handle {
 	td_ring_t                   ring;
 	event_id_t                  ring_event_id;
 
+	/* a blkfront ring served directly, if connected */
+	struct td_blkif            *blkif;
+
 	td_vbd_cb_t                 callback;
 	void                       *argument;
 
 	struct list_head            next;
 
+	/* The event loop driving this vbd: NULL for the main thread. */
+	struct tapdisk_worker      *worker;
+	struct list_head            loop_next;
+
 	struct timeval              ts;
 
 	uint64_t                    received;
@@ -125,6 +159,8 @@ struct td_vbd_handle {
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
 	uint64_t                    errors;
+	uint64_t                    map_skips;
+	uint64_t                    zero_skips;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
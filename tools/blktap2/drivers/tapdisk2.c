@@ -42,7 +42,8 @@
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-t threads] <-u uuid> "
+		"<-c control socket>\n", app);
 	exit(err);
 }
 
@@ -50,12 +51,13 @@ int
 main(int argc, char *argv[])
 {
 	char *control;
-	int c, err, nodaemon;
+	int c, err, nodaemon, workers;
 
 	control  = NULL;
 	nodaemon = 0;
+	workers  = 0;
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	while ((c = getopt(argc, argv, "s:t:Dh")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
@@ -71,6 +73,9 @@ main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 #endif
 			break;
+		case 't':
+			workers = atoi(optarg);
+			break;
 		default:
 			usage(argv[0], EINVAL);
 		}
@@ -93,6 +98,12 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
+	err = tapdisk_server_set_workers(workers);
+	if (err) {
+		DPRINTF("bad number of worker threads: %d\n", workers);
+		goto out;
+	}
+
 	if (!nodaemon) {
 		err = daemon(0, 1);
 		if (err) {
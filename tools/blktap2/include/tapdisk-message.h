@@ -32,6 +32,7 @@
 
 #define TAPDISK_MESSAGE_MAX_PATH_LENGTH  256
 #define TAPDISK_MESSAGE_STRING_LENGTH    256
+#define TAPDISK_MESSAGE_PROTO_LENGTH     32
 
 #define TAPDISK_MESSAGE_MAX_MINORS \
 	((TAPDISK_MESSAGE_MAX_PATH_LENGTH / sizeof(int)) - 1)
@@ -41,6 +42,7 @@
 #define TAPDISK_MESSAGE_FLAG_ADD_CACHE   0x04
 #define TAPDISK_MESSAGE_FLAG_VHD_INDEX   0x08
 #define TAPDISK_MESSAGE_FLAG_LOG_DIRTY   0x10
+#define TAPDISK_MESSAGE_FLAG_ADD_PCACHE  0x20
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint8_t                          tapdisk_message_flag_t;
@@ -50,6 +52,9 @@ typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
+typedef struct tapdisk_message_blkif     tapdisk_message_blkif_t;
+typedef struct tapdisk_message_coalesce  tapdisk_message_coalesce_t;
+typedef struct tapdisk_message_io        tapdisk_message_io_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -88,6 +93,31 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+struct tapdisk_message_blkif {
+	uint32_t                         domid;
+	uint32_t                         devid;
+	uint32_t                         gref;
+	uint32_t                         port;
+	char                             proto[TAPDISK_MESSAGE_PROTO_LENGTH];
+};
+
+struct tapdisk_message_coalesce {
+	uint32_t                         rate;        /* MB/s, 0: no limit */
+};
+
+#define TAPDISK_MESSAGE_IO_SET_MERGE     0x01
+#define TAPDISK_MESSAGE_IO_SET_HOLD      0x02
+
+struct tapdisk_message_io {
+	uint32_t                         flags;       /* what to set */
+	uint32_t                         max_merge;   /* KB, 0: no limit */
+	uint32_t                         hold_us;     /* 0: never hold */
+	uint32_t                         hold_depth;
+	uint64_t                         submitted;
+	uint64_t                         issued;
+	uint64_t                         holds;
+};
+
 struct tapdisk_message {
 	uint16_t                         type;
 	uint16_t                         cookie;
@@ -100,6 +130,9 @@ struct tapdisk_message {
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
+		tapdisk_message_blkif_t  blkif;
+		tapdisk_message_coalesce_t coalesce;
+		tapdisk_message_io_t     io;
 	} u;
 };
 
@@ -126,6 +159,14 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_LIST_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_BLKIF_CONNECT,
+	TAPDISK_MESSAGE_BLKIF_CONNECT_RSP,
+	TAPDISK_MESSAGE_BLKIF_DISCONNECT,
+	TAPDISK_MESSAGE_BLKIF_DISCONNECT_RSP,
+	TAPDISK_MESSAGE_COALESCE,
+	TAPDISK_MESSAGE_COALESCE_RSP,
+	TAPDISK_MESSAGE_IO,
+	TAPDISK_MESSAGE_IO_RSP,
 };
 
 static inline char *
@@ -195,6 +236,30 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_BLKIF_CONNECT:
+		return "blkif connect";
+
+	case TAPDISK_MESSAGE_BLKIF_CONNECT_RSP:
+		return "blkif connect response";
+
+	case TAPDISK_MESSAGE_BLKIF_DISCONNECT:
+		return "blkif disconnect";
+
+	case TAPDISK_MESSAGE_BLKIF_DISCONNECT_RSP:
+		return "blkif disconnect response";
+
+	case TAPDISK_MESSAGE_COALESCE:
+		return "coalesce";
+
+	case TAPDISK_MESSAGE_COALESCE_RSP:
+		return "coalesce response";
+
+	case TAPDISK_MESSAGE_IO:
+		return "io";
+
+	case TAPDISK_MESSAGE_IO_RSP:
+		return "io response";
+
 	default:
 		return "unknown";
 	}
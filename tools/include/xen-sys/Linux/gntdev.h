@@ -142,6 +142,35 @@ struct ioctl_gntdev_unmap_notify {
 	uint32_t event_channel_port;
 };
 
+/*
+ * Copies data between local memory and grant references, without mapping
+ * them.  Each segment has one local (virt) and one foreign (ref) side, as
+ * given by GNTCOPY_source_gref / GNTCOPY_dest_gref in @flags.  The result
+ * of each segment is returned in its @status (GNTST_*).
+ */
+#define IOCTL_GNTDEV_GRANT_COPY \
+_IOC(_IOC_NONE, 'G', 8, sizeof(struct ioctl_gntdev_grant_copy))
+struct gntdev_grant_copy_segment {
+	union {
+		void *virt;
+		struct {
+			uint32_t ref;
+			uint16_t offset;
+			uint16_t domid;
+		} foreign;
+	} source, dest;
+	uint16_t len;
+	uint16_t flags;
+	int16_t status;
+};
+
+struct ioctl_gntdev_grant_copy {
+	/* IN parameters */
+	uint32_t count;
+	/* Array of segments, of size @count. */
+	struct gntdev_grant_copy_segment *segments;
+};
+
 /* Clear (set to zero) the byte specified by index */
 #define UNMAP_NOTIFY_CLEAR_BYTE 0x1
 /* Send an interrupt on the indicated event channel */
@@ -39,7 +39,7 @@
 #include "xg_private.h"
 #include "xc_dom.h"
 
-/* Page Cache for Delta Compression*/
+/* Default Page Cache size for Delta Compression */
 #define DELTA_CACHE_SIZE (XC_PAGE_SIZE * 8192)
 
 /* Internal page buffer to hold dirty pages of a checkpoint,
@@ -99,7 +99,7 @@ struct compression_ctx
  *
  * We might as well sacrifice an extra 8 bytes instead of a memcpy.
  */
-#define WORST_COMP_PAGE_SIZE (XC_PAGE_SIZE + 9)
+#define WORST_COMP_PAGE_SIZE XC_COMPRESSION_PAGE_BOUND
 
 /*
  * A zero length skip indicates full page.
@@ -132,16 +132,94 @@ static int add_full_page(comp_ctx *ctx, char *srcpage, char *cache_page)
     return FULL_PAGE_SIZE;
 }
 
+/*
+ * Pages are compared a block of longs at a time: an unchanged block is
+ * skipped with a single test, and the loop over the block is simple enough
+ * for the compiler to vectorise.
+ */
+#define WORDS_PER_LONG (sizeof(unsigned long)/sizeof(uint32_t))
+#define BLOCK_LONGS 4
+#define BLOCK_WORDS (BLOCK_LONGS * WORDS_PER_LONG)
+
+/* Index of the first word at or after off that differs, or MAX_DELTAS. */
+static unsigned int next_changed(const uint32_t *old, const uint32_t *new,
+                                 unsigned int off)
+{
+    const unsigned long *o, *n;
+    unsigned long diff;
+    int i;
+
+    while ( (off % BLOCK_WORDS) && (off < MAX_DELTAS) )
+    {
+        if ( old[off] != new[off] )
+            return off;
+        off++;
+    }
+
+    for ( ; off < MAX_DELTAS; off += BLOCK_WORDS )
+    {
+        o = (const unsigned long *)&old[off];
+        n = (const unsigned long *)&new[off];
+        diff = 0;
+        for ( i = 0; i < BLOCK_LONGS; i++ )
+            diff |= o[i] ^ n[i];
+        if ( diff )
+            break;
+    }
+
+    while ( (off < MAX_DELTAS) && (old[off] == new[off]) )
+        off++;
+
+    return off;
+}
+
+/* Index of the first word at or after off that is unchanged, or MAX_DELTAS. */
+static unsigned int next_unchanged(const uint32_t *old, const uint32_t *new,
+                                   unsigned int off)
+{
+    while ( (off < MAX_DELTAS) && (old[off] != new[off]) )
+        off++;
+
+    return off;
+}
+
+/*
+ * Emit nr_words starting at word off as runs of at most LENMASK words,
+ * copying the data (and updating the cache) for RUNFLAG runs.
+ */
+static int emit_runs(char *dest, char flag, unsigned int off,
+                     unsigned int nr_words, char *srcpage, char *cache_page)
+{
+    unsigned int runlen, runbytes, pageoff;
+    int complen = 0;
+
+    while ( nr_words )
+    {
+        runlen = (nr_words > LENMASK) ? LENMASK : nr_words;
+        runbytes = runlen * sizeof(uint32_t);
+        dest[complen++] = (char)runlen | flag;
+
+        if ( flag == RUNFLAG )
+        {
+            pageoff = off * sizeof(uint32_t);
+            memcpy(dest + complen, srcpage + pageoff, runbytes);
+            memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
+            complen += runbytes;
+        }
+
+        off += runlen;
+        nr_words -= runlen;
+    }
+
+    return complen;
+}
+
 static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
 {
     char *dest = (ctx->compbuf + ctx->compbuf_pos);
     uint32_t *new, *old;
-
-    int off, runptr = 0;
-    int wascopying = 0, copying = 0, bytes_skipped = 0;
-    int complen = 0, pageoff = 0, runbytes = 0;
-
-    char runlen = 0;
+    unsigned int off = 0, changed;
+    int complen = 0;
 
     if ( (ctx->compbuf_pos + WORST_COMP_PAGE_SIZE) > ctx->compbuf_size)
         return -1;
@@ -154,51 +232,29 @@ static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
     new = (uint32_t*)srcpage;
     old = (uint32_t*)cache_page;
 
-    for (off = 0; off <= MAX_DELTAS; off++)
-    {
-        /*
-         * At (off == MAX_DELTAS), we are processing the last run
-         * in the page. Since there is no XORing, make wascopying != copying
-         * to satisfy the if-block below.
-         */
-        copying = ((off < MAX_DELTAS) ? (old[off] != new[off]) : !wascopying);
-
-        if (runlen)
-        {
-            /* switching between run types or current run is full */
-            if ( (wascopying != copying) || (runlen == LENMASK) )
-            {
-                runbytes = runlen * sizeof(uint32_t);
-                runlen |= (wascopying ? RUNFLAG : SKIPFLAG);
-                dest[complen++] = runlen;
-
-                if (wascopying) /* RUNFLAG */
-                {
-                    pageoff = runptr * sizeof(uint32_t);
-                    memcpy(dest + complen, srcpage + pageoff, runbytes);
-                    memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
-                    complen += runbytes;
-                }
-                else /* SKIPFLAG */
-                {
-                    bytes_skipped += runbytes;
-                }
-
-                runlen = 0;
-                runptr = off;
-            }
-        }
-        runlen++;
-        wascopying = copying;
-    }
-
     /*
      * Check for empty page.
      */
-    if (bytes_skipped == XC_PAGE_SIZE)
+    changed = next_changed(old, new, 0);
+    if (changed == MAX_DELTAS)
     {
-        complen = 1;
         dest[0] = EMPTY_PAGE;
+        ctx->compbuf_pos++;
+        return 1;
+    }
+
+    /* Alternate skip and copy runs until the whole page is covered. */
+    for ( ; ; )
+    {
+        complen += emit_runs(dest + complen, SKIPFLAG, off, changed - off,
+                             srcpage, cache_page);
+        if (changed == MAX_DELTAS)
+            break;
+
+        off = next_unchanged(old, new, changed);
+        complen += emit_runs(dest + complen, RUNFLAG, changed, off - changed,
+                             srcpage, cache_page);
+        changed = next_changed(old, new, off);
     }
     ctx->compbuf_pos += complen;
 
@@ -309,6 +365,37 @@ int xc_compression_add_page(xc_interface *xch, comp_ctx *ctx,
     return 0;
 }
 
+int xc_compression_zero_page(xc_interface *xch, comp_ctx *ctx,
+                             char *page, xen_pfn_t pfn)
+{
+    const unsigned long *p = (const unsigned long *)page;
+    unsigned long bits;
+    unsigned int off;
+    int i;
+
+    if (pfn >= ctx->dom_pfnlist_size)
+    {
+        ERROR("Invalid pfn passed into "
+              "xc_compression_zero_page %" PRIpfn "\n", pfn);
+        return -2;
+    }
+
+    for (off = 0; off < XC_PAGE_SIZE/sizeof(*p); off += BLOCK_LONGS)
+    {
+        bits = 0;
+        for (i = 0; i < BLOCK_LONGS; i++)
+            bits |= p[off + i];
+        if (bits)
+            return 0;
+    }
+
+    /* The receiver's copy is about to become zero; keep the cache in step. */
+    if (ctx->pfn2cache[pfn])
+        memset(ctx->pfn2cache[pfn]->page, 0, XC_PAGE_SIZE);
+
+    return 1;
+}
+
 int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
                                   char *compbuf, unsigned long compbuf_size,
                                   unsigned long *compbuf_len)
@@ -471,11 +558,23 @@ void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx)
 }
 
 comp_ctx *xc_compression_create_context(xc_interface *xch,
-                                        unsigned long p2m_size)
+                                        unsigned long p2m_size,
+                                        unsigned long cache_size)
 {
     unsigned long i;
     comp_ctx *ctx = NULL;
-    unsigned long num_cache_pages = DELTA_CACHE_SIZE/XC_PAGE_SIZE;
+    unsigned long num_cache_pages;
+
+    /* No point caching more pages than the guest has. */
+    num_cache_pages = (cache_size ? : DELTA_CACHE_SIZE)/XC_PAGE_SIZE;
+    if (num_cache_pages > p2m_size)
+        num_cache_pages = p2m_size;
+    if (!num_cache_pages)
+    {
+        ERROR("Delta cache must hold at least one page\n");
+        errno = EINVAL;
+        return NULL;
+    }
 
     ctx = (comp_ctx *)malloc(sizeof(comp_ctx));
     if (!ctx)
@@ -492,7 +591,8 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
         goto error;
     }
 
-    ctx->cache_base = xc_memalign(xch, XC_PAGE_SIZE, DELTA_CACHE_SIZE);
+    ctx->cache_base = xc_memalign(xch, XC_PAGE_SIZE,
+                                  num_cache_pages * XC_PAGE_SIZE);
     if (!ctx->cache_base)
     {
         ERROR("Failed to allocate delta cache\n");
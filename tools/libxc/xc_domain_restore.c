@@ -38,9 +38,11 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
+#include "xc_bitops.h"
 #include "xc_dom.h"
 
 #include <xen/hvm/ioreq.h>
@@ -60,6 +62,8 @@ struct restore_ctx {
     int completed; /* Set when a consistent image is available */
     int last_checkpoint; /* Set when we should commit to the current checkpoint when it completes. */
     int compressing; /* Set when sender signals that pages would be sent compressed (for Remus) */
+    pthread_mutex_t *p2m_lock; /* Held over p2m allocation while restore workers run */
+    int cancel_fd; /* Readable once a read-ahead thread should give up */
     struct domain_info_context dinfo;
 };
 
@@ -76,6 +80,21 @@ static ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
 
     while ( offset < size )
     {
+        if ( !ctx->completed && ctx->cancel_fd >= 0 ) {
+            /* wait for data, unless the read-ahead thread is cancelled */
+            FD_ZERO(&rfds);
+            FD_SET(fd, &rfds);
+            FD_SET(ctx->cancel_fd, &rfds);
+            len = select((fd > ctx->cancel_fd ? fd : ctx->cancel_fd) + 1,
+                         &rfds, NULL, NULL, NULL);
+            if ( len == -1 && errno == EINTR )
+                continue;
+            if ( FD_ISSET(ctx->cancel_fd, &rfds) ) {
+                errno = ECANCELED;
+                return -1;
+            }
+        }
+
         if ( ctx->completed ) {
             /* expect a heartbeat every HEARBEAT_MS ms maximum */
             tv.tv_sec = HEARTBEAT_MS / 1000;
@@ -122,35 +141,36 @@ static ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
 
 /*
 ** When we're restoring into a pv superpage-allocated guest, we take
-** a copy of the p2m_batch array to preserve the pfn, then allocate the
+** a copy of the batch array to preserve the pfn, then allocate the
 ** corresponding superpages.  We then fill in the p2m array using the saved
 ** pfns.
 */
 static int alloc_superpage_mfns(
-    xc_interface *xch, uint32_t dom, struct restore_ctx *ctx, int nr_mfns)
+    xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
+    xen_pfn_t *batch, int nr_mfns)
 {
     int i, j, max = 0;
     unsigned long pfn, base_pfn, mfn;
 
     for (i = 0; i < nr_mfns; i++)
     {
-        pfn = ctx->p2m_batch[i];
+        pfn = batch[i];
         base_pfn = SUPERPAGE(pfn);
         if (ctx->p2m[base_pfn] != (INVALID_P2M_ENTRY-2))
         {
             ctx->p2m_saved_batch[max] = base_pfn;
-            ctx->p2m_batch[max] = base_pfn;
+            batch[max] = base_pfn;
             max++;
             ctx->p2m[base_pfn] = INVALID_P2M_ENTRY-2;
         }
     }
     if (xc_domain_populate_physmap_exact(xch, dom, max, SUPERPAGE_PFN_SHIFT,
-                                         0, ctx->p2m_batch) != 0)
+                                         0, batch) != 0)
         return 1;
 
     for (i = 0; i < max; i++)
     {
-        mfn = ctx->p2m_batch[i];
+        mfn = batch[i];
         pfn = ctx->p2m_saved_batch[i];
         for (j = 0; j < SUPERPAGE_NR_PFNS; j++)
             ctx->p2m[pfn++] = mfn++;
@@ -164,7 +184,7 @@ static int alloc_superpage_mfns(
 ** This function inverts that operation, replacing the pfn values with
 ** the (now known) appropriate mfn values.
 */
-static int uncanonicalize_pagetable(
+static int __uncanonicalize_pagetable(
     xc_interface *xch, uint32_t dom, struct restore_ctx *ctx, void *page)
 {
     int i, rc, pte_last, nr_mfns = 0;
@@ -206,7 +226,8 @@ static int uncanonicalize_pagetable(
     if (nr_mfns)
     {
         if (!ctx->hvm && ctx->superpages)
-            rc = alloc_superpage_mfns(xch, dom, ctx, nr_mfns);
+            rc = alloc_superpage_mfns(xch, dom, ctx, ctx->p2m_batch,
+                                      nr_mfns);
         else
             rc = xc_domain_populate_physmap_exact(xch, dom, nr_mfns, 0, 0,
                                                   ctx->p2m_batch);
@@ -243,6 +264,25 @@ static int uncanonicalize_pagetable(
     return 1;
 }
 
+/*
+** Restore workers uncanonicalise pagetables concurrently with each other
+** and with the thread populating new batches, so the p2m and the
+** p2m_batch scratch array are protected by p2m_lock while they do.
+*/
+static int uncanonicalize_pagetable(
+    xc_interface *xch, uint32_t dom, struct restore_ctx *ctx, void *page)
+{
+    int rc;
+
+    if ( ctx->p2m_lock )
+        pthread_mutex_lock(ctx->p2m_lock);
+    rc = __uncanonicalize_pagetable(xch, dom, ctx, page);
+    if ( ctx->p2m_lock )
+        pthread_mutex_unlock(ctx->p2m_lock);
+
+    return rc;
+}
+
 
 /* Load the p2m frame list, plus potential extended info chunk */
 static xen_pfn_t *load_p2m_frame_list(
@@ -948,6 +988,12 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         // DPRINTF("compression flag received");
         return pagebuf_get_one(xch, ctx, buf, fd, dom);
 
+    case XC_SAVE_ID_ENABLE_DELTA:
+        /* Delta compressed pages follow each batch's pfns from now on. */
+        DPRINTF("delta compression enabled\n");
+        buf->compressing = 1;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
     case XC_SAVE_ID_COMPRESSED_DATA:
 
         /* read the length of compressed chunk coming in */
@@ -1019,7 +1065,8 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         pagetype = buf->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
         if ( pagetype == XEN_DOMCTL_PFINFO_XTAB ||
              pagetype == XEN_DOMCTL_PFINFO_BROKEN ||
-             pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+             pagetype == XEN_DOMCTL_PFINFO_XALLOC ||
+             pagetype == XC_SAVE_PFINFO_ZERO )
             --countpages;
     }
 
@@ -1073,38 +1120,25 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
     return rc;
 }
 
-static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
-                       xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
-                       struct xc_mmu* mmu,
-                       pagebuf_t* pagebuf, int curbatch)
+/*
+** First pass over a batch: work out which pfns need memory allocating.
+** Whole superpages are allocated here directly; everything else is
+** appended to alloc[] (and marked pending in the p2m) so that the caller
+** can populate it in one go.
+*/
+static int batch_collect_allocs(xc_interface *xch, uint32_t dom,
+                                struct restore_ctx *ctx,
+                                const unsigned long *pfn_types, int j,
+                                xen_pfn_t *alloc, int *nr_alloc)
 {
-    int i, j, curpage, nr_mfns;
-    int k, scount;
+    int i, k, scount = 0, nr_mfns = *nr_alloc;
     unsigned long superpage_start=INVALID_P2M_ENTRY;
-    /* used by debug verify code */
-    unsigned long buf[PAGE_SIZE/sizeof(unsigned long)];
-    /* Our mapping of the current region (batch) */
-    char *region_base;
-    /* A temporary mapping, and a copy, of one frame of guest memory. */
-    unsigned long *page = NULL;
-    int nraces = 0;
-    struct domain_info_context *dinfo = &ctx->dinfo;
-    int* pfn_err = NULL;
-    int rc = -1;
-
-    unsigned long mfn, pfn, pagetype;
-
-    j = pagebuf->nr_pages - curbatch;
-    if (j > MAX_BATCH_SIZE)
-        j = MAX_BATCH_SIZE;
 
-    /* First pass for this batch: work out how much memory to alloc, and detect superpages */
-    nr_mfns = scount = 0;
     for ( i = 0; i < j; i++ )
     {
         unsigned long pfn, pagetype;
-        pfn      = pagebuf->pfn_types[i + curbatch] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
-        pagetype = pagebuf->pfn_types[i + curbatch] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pfn      = pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = pfn_types[i] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
 
         /* For allocation purposes, treat XEN_DOMCTL_PFINFO_XALLOC as a normal page */
         if ( (pagetype != XEN_DOMCTL_PFINFO_XTAB) && 
@@ -1163,7 +1197,7 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                 DPRINTF("Falling back %d pages pfn %lx\n", scount, superpage_start);
                 for (k=0; k<scount; k++)
                 {
-                    ctx->p2m_batch[nr_mfns++] = superpage_start+k; 
+                    alloc[nr_mfns++] = superpage_start+k; 
                     ctx->p2m[superpage_start+k]--;
                 }
                 superpage_start = INVALID_P2M_ENTRY;
@@ -1179,7 +1213,7 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             else
             {
                 /* Add the current pfn to pfn_batch */
-                ctx->p2m_batch[nr_mfns++] = pfn;
+                alloc[nr_mfns++] = pfn;
                 ctx->p2m[pfn]--;
             }
         }
@@ -1191,44 +1225,64 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         DPRINTF("Falling back %d pages pfn %lx\n", scount, superpage_start);
         for (k=0; k<scount; k++)
         {
-            ctx->p2m_batch[nr_mfns++] = superpage_start+k; 
+            alloc[nr_mfns++] = superpage_start+k; 
             ctx->p2m[superpage_start+k]--;
         }
         superpage_start = INVALID_P2M_ENTRY;
     }
 
-    /* Now allocate a bunch of mfns for this batch */
-    if ( nr_mfns )
-    {
-        DPRINTF("Mapping order 0,  %d; first pfn %lx\n", nr_mfns, ctx->p2m_batch[0]);
-    
-        if (!ctx->hvm && ctx->superpages)
-            rc = alloc_superpage_mfns(xch, dom, ctx, nr_mfns);
-        else
-            rc = xc_domain_populate_physmap_exact(xch, dom, nr_mfns, 0, 0,
-                                                  ctx->p2m_batch);
+    *nr_alloc = nr_mfns;
 
-        if (rc)
-        {
-            ERROR("Failed to allocate memory for batch.!\n"); 
-            errno = ENOMEM;
-            return -1;
-        }
+    return 0;
+}
+
+/* Allocate the pfns gathered by batch_collect_allocs(). */
+static int batch_populate(xc_interface *xch, uint32_t dom,
+                          struct restore_ctx *ctx,
+                          xen_pfn_t *alloc, int nr_mfns)
+{
+    int rc;
+
+    DPRINTF("Mapping order 0,  %d; first pfn %lx\n", nr_mfns, alloc[0]);
+
+    if (!ctx->hvm && ctx->superpages)
+        rc = alloc_superpage_mfns(xch, dom, ctx, alloc, nr_mfns);
+    else
+        rc = xc_domain_populate_physmap_exact(xch, dom, nr_mfns, 0, 0,
+                                              alloc);
+
+    if (rc)
+    {
+        ERROR("Failed to allocate memory for batch.!\n"); 
+        errno = ENOMEM;
+        return -1;
     }
 
-    /* Second pass for this batch: update p2m[] and region_mfn[] */
-    nr_mfns = 0; 
+    return 0;
+}
+
+/*
+** Second pass over a batch: update p2m[] from the populated alloc[] list,
+** consuming entries from *idx onwards, and set up region_mfn[] for mapping.
+*/
+static void batch_assign_mfns(struct restore_ctx *ctx,
+                              const unsigned long *pfn_types, int j,
+                              const xen_pfn_t *alloc, int *idx,
+                              xen_pfn_t *region_mfn)
+{
+    int i, nr_mfns = *idx;
+
     for ( i = 0; i < j; i++ )
     {
         unsigned long pfn, pagetype;
-        pfn      = pagebuf->pfn_types[i + curbatch] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
-        pagetype = pagebuf->pfn_types[i + curbatch] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pfn      = pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = pfn_types[i] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
 
         if ( pagetype != XEN_DOMCTL_PFINFO_XTAB
              && ctx->p2m[pfn] == (INVALID_P2M_ENTRY-1) )
         {
             /* We just allocated a new mfn above; update p2m */
-            ctx->p2m[pfn] = ctx->p2m_batch[nr_mfns++]; 
+            ctx->p2m[pfn] = alloc[nr_mfns++]; 
             ctx->nr_pfns++; 
         }
 
@@ -1241,6 +1295,34 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             region_mfn[i] = ctx->hvm ? pfn : ctx->p2m[pfn];
     }
 
+    *idx = nr_mfns;
+}
+
+/*
+** Map a batch whose memory has been allocated, and fill it in from the
+** page buffer, uncanonicalising pagetables as we go. Returns the number of
+** pagetable races, or -1 on error.
+*/
+static int batch_load_pages(xc_interface *xch, uint32_t dom,
+                            struct restore_ctx *ctx, xen_pfn_t *region_mfn,
+                            unsigned long *pfn_type, int pae_extended_cr3,
+                            struct xc_mmu *mmu,
+                            pagebuf_t *pagebuf, int curbatch, int j)
+{
+    int i, curpage, zero;
+    /* used by debug verify code */
+    unsigned long buf[PAGE_SIZE/sizeof(unsigned long)];
+    /* Our mapping of the current region (batch) */
+    char *region_base;
+    /* A temporary mapping, and a copy, of one frame of guest memory. */
+    unsigned long *page = NULL;
+    int nraces = 0;
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    int* pfn_err = NULL;
+    int rc = -1;
+
+    unsigned long mfn, pfn, pagetype;
+
     /* Map relevant mfns */
     pfn_err = calloc(j, sizeof(*pfn_err));
     region_base = xc_map_foreign_bulk(
@@ -1281,7 +1363,12 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             goto err_mapped;
         }
 
-        ++curpage;
+        /* An all-zero page in a delta stream comes without data. */
+        zero = (pagetype == XC_SAVE_PFINFO_ZERO);
+        if ( zero )
+            pagetype = XEN_DOMCTL_PFINFO_NOTAB;
+        else
+            ++curpage;
 
         if ( pfn > dinfo->p2m_size )
         {
@@ -1296,8 +1383,10 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         /* In verify mode, we use a copy; otherwise we work in place */
         page = pagebuf->verify ? (void *)buf : (region_base + i*PAGE_SIZE);
 
+        if ( zero )
+            memset(page, 0, PAGE_SIZE);
         /* Remus - page decompression */
-        if (pagebuf->compressing)
+        else if (pagebuf->compressing)
         {
             if (xc_compression_uncompress_page(xch, pagebuf->pages,
                                                pagebuf->compbuf_size,
@@ -1391,6 +1480,536 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     return rc;
 }
 
+static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
+                       xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
+                       struct xc_mmu* mmu,
+                       pagebuf_t* pagebuf, int curbatch)
+{
+    int j, nr_mfns = 0;
+
+    j = pagebuf->nr_pages - curbatch;
+    if (j > MAX_BATCH_SIZE)
+        j = MAX_BATCH_SIZE;
+
+    /* First pass for this batch: work out how much memory to alloc, and detect superpages */
+    if ( batch_collect_allocs(xch, dom, ctx, pagebuf->pfn_types + curbatch, j,
+                              ctx->p2m_batch, &nr_mfns) )
+        return -1;
+
+    /* Now allocate a bunch of mfns for this batch */
+    if ( nr_mfns && batch_populate(xch, dom, ctx, ctx->p2m_batch, nr_mfns) )
+        return -1;
+
+    /* Second pass for this batch: update p2m[] and region_mfn[] */
+    nr_mfns = 0;
+    batch_assign_mfns(ctx, pagebuf->pfn_types + curbatch, j,
+                      ctx->p2m_batch, &nr_mfns, region_mfn);
+
+    return batch_load_pages(xch, dom, ctx, region_mfn, pfn_type,
+                            pae_extended_cr3, mmu, pagebuf, curbatch, j);
+}
+
+/*
+** Parallel restore.
+**
+** A read-ahead thread pulls batches off the stream into a ring of jobs.
+** The main thread allocates memory for every batch that has been read so
+** far with as few populate_physmap calls as possible, and then hands the
+** batches to a pool of workers which map them, copy the pages in and
+** uncanonicalise pagetables. A batch is only handed out once no batch
+** still in flight touches any of the same pfns, so a page resent in a
+** later iteration can never be overtaken by an older copy.
+**
+** Only the initial stream is handled this way. Remus checkpoints, which
+** may be compressed, continue to go through pagebuf_get()/apply_batch().
+*/
+enum restore_job_state {
+    RJOB_FREE,      /* available to the reader */
+    RJOB_READ,      /* holds a batch waiting for memory to be allocated */
+    RJOB_QUEUED,    /* allocated, waiting for or owned by a worker */
+    RJOB_DONE,      /* applied, waiting to be reaped by the main thread */
+};
+
+struct restore_job {
+    enum restore_job_state state;
+    pagebuf_t buf;          /* pfn types and pages of a single batch */
+    xen_pfn_t *region_mfn;
+    int rc;
+};
+
+struct restore_pipe;
+
+struct restore_worker {
+    struct restore_pipe *rp;
+    struct xc_mmu *mmu;
+    pthread_t thread;
+};
+
+struct restore_pipe {
+    xc_interface *xch;
+    uint32_t dom;
+    struct restore_ctx *ctx;
+    int io_fd;
+    pagebuf_t *pagebuf;     /* shared with the reader for non-page records */
+    unsigned long *pfn_type;
+    int pae_extended_cr3;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* broadcast on every job state change */
+    pthread_mutex_t p2m_lock;
+    int stop;
+    int cancel[2];          /* written to interrupt a blocked reader */
+
+    pthread_t reader;
+    int reader_started;
+    int reader_done;        /* 1 at the end of the page data, -1 on error */
+
+    struct restore_worker *workers;
+    unsigned int nr_workers;
+
+    /* Free-running counters, taken modulo nr_jobs to index jobs[]. */
+    struct restore_job *jobs;
+    unsigned int nr_jobs;
+    unsigned int rd;        /* next job for the reader to fill */
+    unsigned int disp;      /* next job to allocate and queue */
+    unsigned int work;      /* next job for a worker to pick up */
+
+    unsigned long *inflight;    /* pfns belonging to queued jobs */
+    xen_pfn_t *alloc;           /* pfns to populate for a group of jobs */
+
+    int nraces;
+    unsigned long pages;
+};
+
+static void *restore_pipe_reader(void *arg)
+{
+    struct restore_pipe *rp = arg;
+    xc_interface *xch = rp->xch;
+    pagebuf_t *pagebuf = rp->pagebuf;
+    struct restore_job *job;
+    void *ptmp;
+    unsigned long *ltmp;
+    int rc, m = 0;
+
+    for ( ; ; )
+    {
+        pthread_mutex_lock(&rp->lock);
+        job = &rp->jobs[rp->rd % rp->nr_jobs];
+        while ( !rp->stop && (job->state != RJOB_FREE) )
+            pthread_cond_wait(&rp->cond, &rp->lock);
+        if ( rp->stop )
+        {
+            pthread_mutex_unlock(&rp->lock);
+            break;
+        }
+        pthread_mutex_unlock(&rp->lock);
+
+        /* Lend the job's buffers to the shared pagebuf for this read. */
+        ptmp = pagebuf->pages;
+        pagebuf->pages = job->buf.pages;
+        job->buf.pages = ptmp;
+        ltmp = pagebuf->pfn_types;
+        pagebuf->pfn_types = job->buf.pfn_types;
+        job->buf.pfn_types = ltmp;
+        pagebuf->nr_physpages = pagebuf->nr_pages = 0;
+        pagebuf->compbuf_pos = pagebuf->compbuf_size = 0;
+
+        rc = pagebuf_get_one(xch, rp->ctx, pagebuf, rp->io_fd, rp->dom);
+
+        ptmp = pagebuf->pages;
+        pagebuf->pages = job->buf.pages;
+        job->buf.pages = ptmp;
+        ltmp = pagebuf->pfn_types;
+        pagebuf->pfn_types = job->buf.pfn_types;
+        job->buf.pfn_types = ltmp;
+        job->buf.nr_pages = pagebuf->nr_pages;
+        job->buf.nr_physpages = pagebuf->nr_physpages;
+        job->buf.verify = pagebuf->verify;
+        job->buf.compressing = pagebuf->compressing;
+        job->buf.compbuf_size = pagebuf->compbuf_size;
+        job->buf.compbuf_pos = 0;
+        pagebuf->nr_physpages = pagebuf->nr_pages = 0;
+
+        if ( rc > 0 )
+        {
+            /*
+             * Discard cache for portion of file read so far up to last
+             *  page boundary every 16MB or so.
+             */
+            m += job->buf.nr_pages;
+            if ( m > MAX_PAGECACHE_USAGE )
+            {
+                discard_file_cache(xch, rp->io_fd, 0 /* no flush */);
+                m = 0;
+            }
+        }
+
+        pthread_mutex_lock(&rp->lock);
+        if ( rc <= 0 )
+        {
+            if ( rc < 0 && !rp->stop )
+                PERROR("Error when reading batch");
+            rp->reader_done = rc < 0 ? -1 : 1;
+            pthread_cond_broadcast(&rp->cond);
+            pthread_mutex_unlock(&rp->lock);
+            break;
+        }
+        job->state = RJOB_READ;
+        rp->rd++;
+        pthread_cond_broadcast(&rp->cond);
+        pthread_mutex_unlock(&rp->lock);
+    }
+
+    return NULL;
+}
+
+static void *restore_pipe_worker(void *arg)
+{
+    struct restore_worker *worker = arg;
+    struct restore_pipe *rp = worker->rp;
+    xc_interface *xch = rp->xch;
+    struct restore_job *job;
+    int rc;
+
+    pthread_mutex_lock(&rp->lock);
+    for ( ; ; )
+    {
+        while ( !rp->stop && (rp->work == rp->disp) )
+            pthread_cond_wait(&rp->cond, &rp->lock);
+        if ( rp->stop )
+            break;
+
+        job = &rp->jobs[rp->work++ % rp->nr_jobs];
+        pthread_mutex_unlock(&rp->lock);
+
+        rc = batch_load_pages(xch, rp->dom, rp->ctx, job->region_mfn,
+                              rp->pfn_type, rp->pae_extended_cr3,
+                              worker->mmu, &job->buf, 0, job->buf.nr_pages);
+        if ( (rc >= 0) && !rp->ctx->hvm &&
+             xc_flush_mmu_updates(xch, worker->mmu) )
+        {
+            PERROR("Error doing flush_mmu_updates()");
+            rc = -1;
+        }
+
+        pthread_mutex_lock(&rp->lock);
+        job->rc = rc;
+        job->state = RJOB_DONE;
+        pthread_cond_broadcast(&rp->cond);
+    }
+    pthread_mutex_unlock(&rp->lock);
+
+    return NULL;
+}
+
+static void restore_pipe_destroy(struct restore_pipe *rp)
+{
+    unsigned int i;
+    char c = 0;
+
+    if ( !rp )
+        return;
+
+    pthread_mutex_lock(&rp->lock);
+    rp->stop = 1;
+    pthread_cond_broadcast(&rp->cond);
+    pthread_mutex_unlock(&rp->lock);
+
+    if ( rp->reader_started )
+    {
+        if ( write(rp->cancel[1], &c, 1) != 1 )
+            ; /* the reader only blocks on the stream if data is owed */
+        pthread_join(rp->reader, NULL);
+    }
+
+    for ( i = 0; i < rp->nr_workers; i++ )
+        pthread_join(rp->workers[i].thread, NULL);
+
+    rp->ctx->cancel_fd = -1;
+    rp->ctx->p2m_lock = NULL;
+
+    if ( rp->workers )
+        for ( i = 0; i < rp->nr_workers; i++ )
+            free(rp->workers[i].mmu);
+
+    if ( rp->jobs )
+        for ( i = 0; i < rp->nr_jobs; i++ )
+        {
+            pagebuf_free(&rp->jobs[i].buf);
+            free(rp->jobs[i].region_mfn);
+        }
+
+    if ( rp->cancel[0] >= 0 )
+        close(rp->cancel[0]);
+    if ( rp->cancel[1] >= 0 )
+        close(rp->cancel[1]);
+
+    pthread_mutex_destroy(&rp->p2m_lock);
+    pthread_cond_destroy(&rp->cond);
+    pthread_mutex_destroy(&rp->lock);
+
+    free(rp->inflight);
+    free(rp->alloc);
+    free(rp->jobs);
+    free(rp->workers);
+    free(rp);
+}
+
+static struct restore_pipe *restore_pipe_create(
+    xc_interface *xch, uint32_t dom, struct restore_ctx *ctx, int io_fd,
+    pagebuf_t *pagebuf, unsigned long *pfn_type, int pae_extended_cr3,
+    unsigned int nr_workers)
+{
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    struct restore_pipe *rp;
+    unsigned int i;
+
+    rp = calloc(1, sizeof(*rp));
+    if ( !rp )
+    {
+        ERROR("Couldn't allocate restore pipeline");
+        return NULL;
+    }
+
+    rp->xch = xch;
+    rp->dom = dom;
+    rp->ctx = ctx;
+    rp->io_fd = io_fd;
+    rp->pagebuf = pagebuf;
+    rp->pfn_type = pfn_type;
+    rp->pae_extended_cr3 = pae_extended_cr3;
+    rp->cancel[0] = rp->cancel[1] = -1;
+    pthread_mutex_init(&rp->lock, NULL);
+    pthread_cond_init(&rp->cond, NULL);
+    pthread_mutex_init(&rp->p2m_lock, NULL);
+
+    /* Enough batches read ahead to keep every worker busy twice over. */
+    rp->nr_jobs = nr_workers * 2;
+    rp->jobs = calloc(rp->nr_jobs, sizeof(*rp->jobs));
+    rp->workers = calloc(nr_workers, sizeof(*rp->workers));
+    rp->inflight = calloc(1, bitmap_size(dinfo->p2m_size));
+    rp->alloc = malloc(rp->nr_jobs * MAX_BATCH_SIZE * sizeof(*rp->alloc));
+    if ( !rp->jobs || !rp->workers || !rp->inflight || !rp->alloc )
+        goto err;
+
+    for ( i = 0; i < rp->nr_jobs; i++ )
+    {
+        pagebuf_init(&rp->jobs[i].buf);
+        rp->jobs[i].region_mfn =
+            malloc(MAX_BATCH_SIZE * sizeof(*rp->jobs[i].region_mfn));
+        if ( !rp->jobs[i].region_mfn )
+            goto err;
+    }
+
+    if ( pipe(rp->cancel) )
+    {
+        PERROR("Couldn't create restore pipeline cancel pipe");
+        goto err_out;
+    }
+
+    ctx->cancel_fd = rp->cancel[0];
+    ctx->p2m_lock = &rp->p2m_lock;
+
+    for ( i = 0; i < nr_workers; i++ )
+    {
+        struct restore_worker *worker = &rp->workers[i];
+
+        worker->rp = rp;
+        if ( !ctx->hvm && !(worker->mmu = xc_alloc_mmu_updates(xch, dom)) )
+            goto err;
+        if ( pthread_create(&worker->thread, NULL,
+                            restore_pipe_worker, worker) )
+        {
+            PERROR("Couldn't create restore worker");
+            free(worker->mmu);
+            goto err_out;
+        }
+        rp->nr_workers++;
+    }
+
+    if ( pthread_create(&rp->reader, NULL, restore_pipe_reader, rp) )
+    {
+        PERROR("Couldn't create restore read-ahead thread");
+        goto err_out;
+    }
+    rp->reader_started = 1;
+
+    DPRINTF("Parallel restore using %u workers\n", nr_workers);
+
+    return rp;
+
+ err:
+    ERROR("Couldn't allocate restore pipeline jobs");
+ err_out:
+    restore_pipe_destroy(rp);
+    return NULL;
+}
+
+/* Reap applied jobs. Called with rp->lock held. */
+static int restore_pipe_reap(struct restore_pipe *rp)
+{
+    xc_interface *xch = rp->xch;
+    struct domain_info_context *dinfo = &rp->ctx->dinfo;
+    struct restore_job *job;
+    unsigned int i;
+    int k, rc = 0;
+
+    for ( i = 0; i < rp->nr_jobs; i++ )
+    {
+        job = &rp->jobs[i];
+        if ( job->state != RJOB_DONE )
+            continue;
+
+        for ( k = 0; k < job->buf.nr_pages; k++ )
+            clear_bit(job->buf.pfn_types[k] & ~XEN_DOMCTL_PFINFO_LTAB_MASK,
+                      rp->inflight);
+
+        if ( job->rc < 0 )
+            rc = -1;
+        else
+            rp->nraces += job->rc;
+        rp->pages += job->buf.nr_pages;
+
+        job->state = RJOB_FREE;
+        pthread_cond_broadcast(&rp->cond);
+    }
+
+    xc_report_progress_step(xch, rp->pages, dinfo->p2m_size);
+
+    return rc;
+}
+
+/* Does any pfn of this job belong to a batch still being applied? */
+static int restore_job_conflicts(struct restore_pipe *rp,
+                                 struct restore_job *job)
+{
+    int k;
+
+    for ( k = 0; k < job->buf.nr_pages; k++ )
+        if ( test_bit(job->buf.pfn_types[k] & ~XEN_DOMCTL_PFINFO_LTAB_MASK,
+                      rp->inflight) )
+            return 1;
+
+    return 0;
+}
+
+static int restore_job_busy(struct restore_pipe *rp)
+{
+    unsigned int i;
+
+    for ( i = 0; i < rp->nr_jobs; i++ )
+        if ( (rp->jobs[i].state == RJOB_QUEUED) ||
+             (rp->jobs[i].state == RJOB_DONE) )
+            return 1;
+
+    return 0;
+}
+
+/*
+** Apply every page batch up to the end of the page data. On return the
+** shared pagebuf holds any other records read along the way.
+*/
+static int restore_pipe_run(struct restore_pipe *rp)
+{
+    xc_interface *xch = rp->xch;
+    struct restore_ctx *ctx = rp->ctx;
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    struct restore_job *job;
+    unsigned int first, last, d;
+    int k, nr_alloc, idx, rc = -1;
+
+    pthread_mutex_lock(&rp->lock);
+    for ( ; ; )
+    {
+        if ( restore_pipe_reap(rp) )
+            goto out;
+
+        if ( rp->disp == rp->rd )
+        {
+            if ( rp->reader_done < 0 )
+                goto out;
+            if ( rp->reader_done )
+                break;
+            pthread_cond_wait(&rp->cond, &rp->lock);
+            continue;
+        }
+
+        /*
+         * Everything between disp and rd has been read. PV superpage
+         * allocation works on at most one batch at a time.
+         */
+        first = rp->disp;
+        last = rp->rd;
+        if ( !ctx->hvm && ctx->superpages )
+            last = first + 1;
+        pthread_mutex_unlock(&rp->lock);
+
+        pthread_mutex_lock(&rp->p2m_lock);
+        nr_alloc = 0;
+        for ( d = first; d != last; d++ )
+        {
+            job = &rp->jobs[d % rp->nr_jobs];
+            if ( batch_collect_allocs(xch, rp->dom, ctx, job->buf.pfn_types,
+                                      job->buf.nr_pages, rp->alloc,
+                                      &nr_alloc) )
+                break;
+        }
+        if ( (d != last) ||
+             (nr_alloc &&
+              batch_populate(xch, rp->dom, ctx, rp->alloc, nr_alloc)) )
+        {
+            pthread_mutex_unlock(&rp->p2m_lock);
+            pthread_mutex_lock(&rp->lock);
+            goto out;
+        }
+        idx = 0;
+        for ( d = first; d != last; d++ )
+        {
+            job = &rp->jobs[d % rp->nr_jobs];
+            batch_assign_mfns(ctx, job->buf.pfn_types, job->buf.nr_pages,
+                              rp->alloc, &idx, job->region_mfn);
+        }
+        pthread_mutex_unlock(&rp->p2m_lock);
+
+        pthread_mutex_lock(&rp->lock);
+        for ( d = first; d != last; d++ )
+        {
+            job = &rp->jobs[d % rp->nr_jobs];
+
+            while ( restore_job_conflicts(rp, job) )
+            {
+                pthread_cond_wait(&rp->cond, &rp->lock);
+                if ( restore_pipe_reap(rp) )
+                    goto out;
+            }
+
+            for ( k = 0; k < job->buf.nr_pages; k++ )
+                set_bit(job->buf.pfn_types[k] & ~XEN_DOMCTL_PFINFO_LTAB_MASK,
+                        rp->inflight);
+
+            job->state = RJOB_QUEUED;
+            rp->disp++;
+            pthread_cond_broadcast(&rp->cond);
+        }
+    }
+
+    /* All batches have been queued; wait for the workers to finish. */
+    while ( restore_job_busy(rp) )
+    {
+        pthread_cond_wait(&rp->cond, &rp->lock);
+        if ( restore_pipe_reap(rp) )
+            goto out;
+    }
+
+    DPRINTF("Parallel restore applied %lu pages of %lu\n",
+            rp->pages, dinfo->p2m_size);
+    rc = 0;
+
+ out:
+    pthread_mutex_unlock(&rp->lock);
+    return rc;
+}
+
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int store_evtchn, unsigned long *store_mfn,
                       domid_t store_domid, unsigned int console_evtchn,
@@ -1398,7 +2017,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int hvm, unsigned int pae, int superpages,
                       int no_incr_generationid,
                       unsigned long *vm_generationid_addr,
-                      struct restore_callbacks *callbacks)
+                      struct restore_callbacks *callbacks,
+                      unsigned int nr_workers)
 {
     DECLARE_DOMCTL;
     int rc = 1, frc, i, j, n, m, pae_extended_cr3 = 0, ext_vcpucontext = 0;
@@ -1456,6 +2076,9 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     struct restore_ctx *ctx = &_ctx;
     struct domain_info_context *dinfo = &ctx->dinfo;
 
+    /* Read-ahead and workers used for the initial stream, if requested */
+    struct restore_pipe *rp = NULL;
+
     DPRINTF("%s: starting restore of new domid %u", __func__, dom);
 
     pagebuf_init(&pagebuf);
@@ -1466,6 +2089,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     memset(ctx, 0, sizeof(*ctx));
 
     ctx->superpages = superpages;
+    ctx->cancel_fd = -1;
     ctx->hvm = hvm;
 
     ctxt = xc_hypercall_buffer_alloc(xch, ctxt, sizeof(*ctxt));
@@ -1584,7 +2208,18 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
 
         xc_report_progress_step(xch, n, dinfo->p2m_size);
 
-        if ( !ctx->completed ) {
+        if ( !ctx->completed && nr_workers ) {
+            /* Read and apply every page batch, leaving just the tail. */
+            rp = restore_pipe_create(xch, dom, ctx, io_fd, &pagebuf, pfn_type,
+                                     pae_extended_cr3, nr_workers);
+            if ( !rp || restore_pipe_run(rp) )
+                goto out;
+            nraces += rp->nraces;
+            n += rp->pages;
+            restore_pipe_destroy(rp);
+            rp = NULL;
+        }
+        else if ( !ctx->completed ) {
             pagebuf.nr_physpages = pagebuf.nr_pages = 0;
             pagebuf.compbuf_pos = pagebuf.compbuf_size = 0;
             if ( pagebuf_get_one(xch, ctx, &pagebuf, io_fd, dom) < 0 ) {
@@ -1714,10 +2349,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
 
         /*
          * If sender had sent enable compression flag, switch to compressed
-         * checkpoints mode once the first checkpoint is received.
+         * checkpoints mode once the first checkpoint is received. Delta
+         * compression of the first pass, if any, ends here.
          */
-        if (ctx->compressing)
-            pagebuf.compressing = 1;
+        pagebuf.compressing = ctx->compressing;
     }
 
     if (pagebuf.viridian != 0)
@@ -2289,6 +2924,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     rc = 0;
 
  out:
+    restore_pipe_destroy(rp);
     if ( (rc != 0) && (dom != 0) )
         xc_domain_destroy(xch, dom);
     xc_hypercall_buffer_free(xch, ctxt);
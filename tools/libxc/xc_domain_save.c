@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include "xc_private.h"
 #include "xc_bitops.h"
@@ -268,6 +270,57 @@ static int write_compressed(xc_interface *xch, comp_ctx *compress_ctx,
     return 0;
 }
 
+/*
+ * Delta compress the pages of one batch into a single compressed chunk, as
+ * a receiver still in its first pass expects them straight after the
+ * batch's pfns. Returns the size of the compressed data, or -1 on error.
+ */
+static long write_delta_batch(xc_interface *xch, comp_ctx *compress_ctx,
+                              int dobuf, struct outbuf* ob, int fd,
+                              unsigned int nr_pages)
+{
+    int rc;
+    int header = sizeof(int) + sizeof(unsigned long);
+    int marker = XC_SAVE_ID_COMPRESSED_DATA;
+    unsigned long compbuf_len = 0;
+
+    /* Make room for the worst case so the batch cannot be split. */
+    if ( (ob->pos + header + nr_pages * XC_COMPRESSION_PAGE_BOUND > ob->size) &&
+         (outbuf_flush(xch, ob, fd) < 0) )
+    {
+        ERROR("Error when flushing outbuf intermediate");
+        return -1;
+    }
+
+    rc = xc_compression_compress_pages(xch, compress_ctx,
+                                       ob->buf + ob->pos + header,
+                                       ob->size - ob->pos - header,
+                                       &compbuf_len);
+    if ( rc <= 0 )
+    {
+        if ( rc < 0 )
+            ERROR("Delta compressed batch overflowed output buffer");
+        return rc;
+    }
+    xc_compression_reset_pagebuf(xch, compress_ctx);
+
+    if ( outbuf_write(xch, ob, &marker, sizeof(marker)) ||
+         outbuf_write(xch, ob, &compbuf_len, sizeof(compbuf_len)) )
+    {
+        ERROR("Error when writing compressed chunk header");
+        return -1;
+    }
+
+    ob->pos += (size_t) compbuf_len;
+    if ( !dobuf && outbuf_flush(xch, ob, fd) < 0 )
+    {
+        ERROR("Error when writing compressed chunk");
+        return -1;
+    }
+
+    return compbuf_len;
+}
+
 struct time_stats {
     struct timeval wall;
     long long d0_cpu, d1_cpu;
@@ -368,6 +421,138 @@ static int suspend_and_state(int (*suspend)(void*), void* data,
     return 0;
 }
 
+/*
+** Downtime-bounded precopy. Rather than stopping after a fixed number of
+** rounds, estimate each round how long the stop-and-copy phase would take
+** (pages dirtied since the last CLEAN over the rate we are managing to send
+** at) and suspend once that fits within the caller's budget. If the
+** estimate stops shrinking and XCFLAGS_AUTO_CONVERGE is set, cap the
+** guest's CPU time with the credit scheduler so that it dirties memory more
+** slowly than we can send it.
+*/
+#define CONVERGE_STEPS  5    /* throttle in steps of 1/5 of the vCPUs' time */
+#define CONVERGE_FLOOR 10    /* but leave each vCPU at least 10% of a pCPU */
+
+struct precopy_ctl {
+    uint64_t max_downtime;  /* target stop-and-copy time in us, 0 if none */
+    uint64_t iter_start;    /* wall time at start of the current round */
+    uint64_t last_clean;    /* wall time of the last log-dirty CLEAN */
+    uint64_t send_rate;     /* smoothed pages sent per second */
+    uint64_t dirty_rate;    /* smoothed pages dirtied per second */
+    uint64_t predicted;     /* predicted downtime in us after last round */
+    int converge;           /* may throttle the guest's vCPUs */
+    int throttled;          /* credit cap has been lowered */
+    unsigned int nr_vcpus;
+    unsigned int cap;       /* current credit cap, percent of one pCPU */
+    struct xen_domctl_sched_credit sched; /* parameters to restore */
+};
+
+/* Rate in units per second, folded into a running average. */
+static uint64_t precopy_rate(uint64_t old, uint64_t count, uint64_t us)
+{
+    uint64_t rate = (count * 1000000) / (us ? : 1);
+
+    return old ? (old + rate) / 2 : rate;
+}
+
+/*
+ * Account for the round just finished, in which @sent pages were written.
+ * Returns non-zero once the remaining dirty set is predicted to be sent
+ * within the downtime budget.
+ */
+static int precopy_update(xc_interface *xch, uint32_t dom,
+                          struct precopy_ctl *pc, unsigned int sent)
+{
+    xc_shadow_op_stats_t stats;
+    struct xen_domctl_sched_credit sdom;
+    uint64_t now, predicted;
+    unsigned int step, min_cap;
+    int sched_id;
+
+    if ( xc_shadow_control(xch, dom, XEN_DOMCTL_SHADOW_OP_PEEK,
+                           NULL, 0, NULL, 0, &stats) < 0 )
+    {
+        PERROR("Error peeking shadow stats");
+        return 1;
+    }
+
+    now = llgettimeofday();
+    pc->send_rate = precopy_rate(pc->send_rate, sent, now - pc->iter_start);
+    pc->dirty_rate = precopy_rate(pc->dirty_rate, stats.dirty_count,
+                                  now - pc->last_clean);
+
+    predicted = ((uint64_t)stats.dirty_count * 1000000) / (pc->send_rate ? : 1);
+
+    DPRINTF("precopy: %"PRIu32" pages dirty, sending %"PRIu64" pages/s, "
+            "dirtying %"PRIu64" pages/s, predicted downtime %"PRIu64"ms "
+            "(target %"PRIu64"ms)\n", stats.dirty_count, pc->send_rate,
+            pc->dirty_rate, predicted / 1000, pc->max_downtime / 1000);
+
+    if ( predicted <= pc->max_downtime )
+        return 1;
+
+    /* Still shrinking by at least a quarter a round: keep going. */
+    if ( !pc->predicted || (predicted * 4 <= pc->predicted * 3) )
+    {
+        pc->predicted = predicted;
+        return 0;
+    }
+    pc->predicted = predicted;
+
+    if ( !pc->converge )
+        return 0;
+
+    if ( !pc->throttled )
+    {
+        if ( xc_sched_id(xch, &sched_id) ||
+             (sched_id != XEN_SCHEDULER_CREDIT) )
+        {
+            DPRINTF("precopy: not converging, and cannot throttle "
+                    "without the credit scheduler\n");
+            pc->converge = 0;
+            return 0;
+        }
+
+        if ( xc_sched_credit_domain_get(xch, dom, &pc->sched) )
+        {
+            PERROR("Error getting scheduler parameters");
+            pc->converge = 0;
+            return 0;
+        }
+
+        pc->cap = pc->sched.cap ? : pc->nr_vcpus * 100;
+        pc->throttled = 1;
+    }
+
+    step = (pc->nr_vcpus * 100) / CONVERGE_STEPS;
+    min_cap = pc->nr_vcpus * CONVERGE_FLOOR;
+    if ( pc->cap <= min_cap )
+        return 0;
+    pc->cap = (pc->cap > min_cap + step) ? pc->cap - step : min_cap;
+
+    DPRINTF("precopy: not converging, capping guest at %u%%\n", pc->cap);
+
+    sdom = pc->sched;
+    sdom.cap = pc->cap;
+    if ( xc_sched_credit_domain_set(xch, dom, &sdom) )
+        PERROR("Error throttling guest vCPUs");
+
+    return 0;
+}
+
+/* Give the guest back the CPU time it had before precopy throttled it. */
+static void precopy_unthrottle(xc_interface *xch, uint32_t dom,
+                               struct precopy_ctl *pc)
+{
+    if ( !pc->throttled )
+        return;
+
+    if ( xc_sched_credit_domain_set(xch, dom, &pc->sched) )
+        PERROR("Error restoring scheduler parameters");
+
+    pc->throttled = 0;
+}
+
 /*
 ** Map the top-level page of MFNs from the guest. The guest might not have
 ** finished resuming from a previous restore operation, so we wait a while for
@@ -793,8 +978,685 @@ static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
     return 0;
 }
 
+/*
+** Work out what to send for a freshly mapped batch. The page type of each
+** entry is folded into pfn_type[] along with its pfn, and entries which
+** could not be mapped are demoted to XTAB. Returns the number of entries
+** which will appear in the batch record.
+*/
+static int classify_batch(xc_interface *xch, struct save_ctx *ctx,
+                          int hvm, int debug, int iter, unsigned int batch,
+                          const unsigned long *pfn_batch, xen_pfn_t *pfn_type,
+                          const int *pfn_err, const uint8_t *alloc_only,
+                          char *region_base)
+{
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    int j, run;
+
+    for ( run = j = 0; j < batch; j++ )
+    {
+        unsigned long gmfn = pfn_batch[j];
+
+        if ( !hvm )
+            gmfn = pfn_to_mfn(gmfn);
+
+        if ( pfn_type[j] == XEN_DOMCTL_PFINFO_BROKEN )
+        {
+            pfn_type[j] |= pfn_batch[j];
+            ++run;
+            continue;
+        }
+
+        if ( pfn_err[j] )
+        {
+            if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
+                continue;
+
+            DPRINTF("map fail: page %i mfn %08lx err %d\n",
+                    j, gmfn, pfn_err[j]);
+            pfn_type[j] = XEN_DOMCTL_PFINFO_XTAB;
+            continue;
+        }
+
+        if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
+        {
+            DPRINTF("type fail: page %i mfn %08lx\n", j, gmfn);
+            continue;
+        }
+
+        if ( alloc_only[j] )
+            pfn_type[j] = XEN_DOMCTL_PFINFO_XALLOC;
+
+        /* canonicalise mfn->pfn */
+        pfn_type[j] |= pfn_batch[j];
+        ++run;
+
+        if ( debug )
+        {
+            if ( hvm )
+                DPRINTF("%d pfn=%08lx sum=%08lx\n",
+                        iter,
+                        pfn_type[j],
+                        csum_page(region_base + (PAGE_SIZE*j)));
+            else
+                DPRINTF("%d pfn= %08lx mfn= %08lx [mfn]= %08lx"
+                        " sum= %08lx\n",
+                        iter,
+                        pfn_type[j],
+                        gmfn,
+                        mfn_to_pfn(gmfn),
+                        csum_page(region_base + (PAGE_SIZE*j)));
+        }
+    }
+
+    return run;
+}
+
+/*
+** Pipelined page sending (XCFLAGS_PIPELINE).
+**
+** The main thread still chooses which pfns go into each batch, but instead
+** of mapping and canonicalising the batch itself it queues it on a ring of
+** jobs. Worker threads map the batch, fetch its page types and
+** canonicalise any pagetables into a private buffer. The main thread then
+** retires jobs strictly in submission order and writes them out, so the
+** stream is identical to the one produced by the serial loop.
+**
+** There is one worker per online CPU besides the one the main thread runs
+** on, up to MAX_PIPELINE_WORKERS; XC_SAVE_PIPELINE_WORKERS in the
+** environment overrides that.
+*/
+#define MAX_PIPELINE_WORKERS 16
+
+struct save_job {
+    unsigned int batch;
+    unsigned long *pfn_batch;
+    xen_pfn_t *pfn_type;
+    int *pfn_err;
+    uint8_t *alloc_only;
+    char *region_base;
+    char *canon;        /* canonicalised pagetables, indexed like the batch */
+    int run;            /* entries to send, or -1 if the batch failed */
+    int race;
+    unsigned long race_pfn, race_type;
+    int done;
+
+    /* Per-stage accounting, folded into the pipe stats on retirement. */
+    unsigned int nr_pt;
+    uint64_t map_us, canon_us;
+};
+
+struct save_pipe_stats {
+    uint64_t pages_mapped, map_us;
+    uint64_t pages_canon, canon_us;
+    uint64_t bytes_written, write_us;
+    uint64_t stall_us;
+};
+
+struct save_pipe {
+    xc_interface *xch;
+    uint32_t dom;
+    int hvm;
+    struct save_ctx *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;    /* a job was queued, or the pipe is stopping */
+    pthread_cond_t done;    /* a worker finished a job */
+    int stop;
+
+    pthread_t *workers;
+    unsigned int nr_workers;
+
+    /* Free-running counters, taken modulo nr_jobs to index jobs[]. */
+    struct save_job *jobs;
+    unsigned int nr_jobs;
+    unsigned int head;      /* oldest job not yet written out */
+    unsigned int next;      /* next job for a worker to pick up */
+    unsigned int tail;      /* next free slot */
+
+    struct save_pipe_stats stats;
+};
+
+static void save_job_process(struct save_pipe *pipe, struct save_job *job)
+{
+    xc_interface *xch = pipe->xch;
+    uint64_t start, now;
+    unsigned long pagetype, pfn;
+    int j;
+
+    start = llgettimeofday();
+
+    job->race = 0;
+    job->nr_pt = 0;
+    job->region_base = xc_map_foreign_bulk(xch, pipe->dom, PROT_READ,
+                                           job->pfn_type, job->pfn_err,
+                                           job->batch);
+    if ( job->region_base == NULL )
+    {
+        PERROR("map batch failed");
+        job->run = -1;
+        return;
+    }
+
+    if ( xc_get_pfn_type_batch(xch, pipe->dom, job->batch, job->pfn_type) )
+    {
+        PERROR("get_pfn_type_batch failed");
+        job->run = -1;
+        return;
+    }
+
+    job->run = classify_batch(xch, pipe->ctx, pipe->hvm, 0, 0, job->batch,
+                              job->pfn_batch, job->pfn_type, job->pfn_err,
+                              job->alloc_only, job->region_base);
+
+    now = llgettimeofday();
+    job->map_us = now - start;
+    start = now;
+
+    for ( j = 0; job->run && j < job->batch; j++ )
+    {
+        pfn      = job->pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = job->pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+            || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+            || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        if ( (pagetype < XEN_DOMCTL_PFINFO_L1TAB) ||
+             (pagetype > XEN_DOMCTL_PFINFO_L4TAB) )
+            continue;
+
+        if ( canonicalize_pagetable(pipe->ctx, pagetype, pfn,
+                                    job->region_base + (PAGE_SIZE*j),
+                                    job->canon + (PAGE_SIZE*j)) &&
+             !job->race )
+        {
+            job->race = 1;
+            job->race_pfn = pfn;
+            job->race_type = pagetype;
+        }
+        job->nr_pt++;
+    }
+
+    job->canon_us = llgettimeofday() - start;
+}
+
+static void *save_pipe_worker(void *arg)
+{
+    struct save_pipe *pipe = arg;
+    struct save_job *job;
+
+    pthread_mutex_lock(&pipe->lock);
+    for ( ; ; )
+    {
+        while ( !pipe->stop && (pipe->next == pipe->tail) )
+            pthread_cond_wait(&pipe->work, &pipe->lock);
+        if ( pipe->stop )
+            break;
+
+        job = &pipe->jobs[pipe->next++ % pipe->nr_jobs];
+        pthread_mutex_unlock(&pipe->lock);
+
+        save_job_process(pipe, job);
+
+        pthread_mutex_lock(&pipe->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pipe->done);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+static void save_pipe_destroy(struct save_pipe *pipe)
+{
+    unsigned int i;
+
+    if ( !pipe )
+        return;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->stop = 1;
+    pthread_cond_broadcast(&pipe->work);
+    pthread_mutex_unlock(&pipe->lock);
+
+    for ( i = 0; i < pipe->nr_workers; i++ )
+        pthread_join(pipe->workers[i], NULL);
+
+    for ( i = 0; i < pipe->nr_jobs; i++ )
+    {
+        struct save_job *job = &pipe->jobs[i];
+
+        if ( job->region_base )
+            munmap(job->region_base, job->batch * PAGE_SIZE);
+        free(job->pfn_batch);
+        free(job->pfn_type);
+        free(job->pfn_err);
+        free(job->alloc_only);
+        free(job->canon);
+    }
+
+    pthread_cond_destroy(&pipe->done);
+    pthread_cond_destroy(&pipe->work);
+    pthread_mutex_destroy(&pipe->lock);
+
+    free(pipe->jobs);
+    free(pipe->workers);
+    free(pipe);
+}
+
+static unsigned int save_pipe_nr_workers(xc_interface *xch)
+{
+    const char *env = getenv("XC_SAVE_PIPELINE_WORKERS");
+    long nr;
+
+    if ( env )
+    {
+        char *end;
+
+        nr = strtol(env, &end, 0);
+        if ( *env && !*end && nr >= 1 && nr <= MAX_PIPELINE_WORKERS )
+            return nr;
+        ERROR("Ignoring bad XC_SAVE_PIPELINE_WORKERS=%s", env);
+    }
+
+    nr = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if ( nr < 1 )
+        nr = 1;
+    if ( nr > MAX_PIPELINE_WORKERS )
+        nr = MAX_PIPELINE_WORKERS;
+
+    return nr;
+}
+
+static struct save_pipe *save_pipe_create(xc_interface *xch, uint32_t dom,
+                                          int hvm, struct save_ctx *ctx,
+                                          unsigned int nr_workers)
+{
+    struct save_pipe *pipe;
+    unsigned int i;
+
+    pipe = calloc(1, sizeof(*pipe));
+    if ( !pipe )
+    {
+        ERROR("Couldn't allocate save pipeline");
+        return NULL;
+    }
+
+    pipe->xch = xch;
+    pipe->dom = dom;
+    pipe->hvm = hvm;
+    pipe->ctx = ctx;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->work, NULL);
+    pthread_cond_init(&pipe->done, NULL);
+
+    /* Two jobs per worker lets the writer drain one while the next maps. */
+    pipe->nr_jobs = nr_workers * 2;
+    pipe->jobs = calloc(pipe->nr_jobs, sizeof(*pipe->jobs));
+    pipe->workers = calloc(nr_workers, sizeof(*pipe->workers));
+    if ( !pipe->jobs || !pipe->workers )
+        goto err;
+
+    for ( i = 0; i < pipe->nr_jobs; i++ )
+    {
+        struct save_job *job = &pipe->jobs[i];
+
+        job->pfn_batch  = calloc(MAX_BATCH_SIZE, sizeof(*job->pfn_batch));
+        job->pfn_type   = calloc(MAX_BATCH_SIZE, sizeof(*job->pfn_type));
+        job->pfn_err    = calloc(MAX_BATCH_SIZE, sizeof(*job->pfn_err));
+        job->alloc_only = calloc(MAX_BATCH_SIZE, sizeof(*job->alloc_only));
+        job->canon      = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+        if ( !job->pfn_batch || !job->pfn_type || !job->pfn_err ||
+             !job->alloc_only || !job->canon )
+            goto err;
+    }
+
+    for ( i = 0; i < nr_workers; i++ )
+    {
+        if ( pthread_create(&pipe->workers[i], NULL,
+                            save_pipe_worker, pipe) )
+        {
+            PERROR("Couldn't create save pipeline worker");
+            pipe->nr_workers = i;
+            save_pipe_destroy(pipe);
+            return NULL;
+        }
+    }
+    pipe->nr_workers = nr_workers;
+
+    DPRINTF("Pipelined save using %u workers\n", nr_workers);
+
+    return pipe;
+
+ err:
+    ERROR("Couldn't allocate save pipeline jobs");
+    save_pipe_destroy(pipe);
+    return NULL;
+}
+
+static inline int save_pipe_full(struct save_pipe *pipe)
+{
+    return (pipe->tail - pipe->head) == pipe->nr_jobs;
+}
+
+/* Queue a batch. The caller must make sure that the pipe is not full. */
+static void save_pipe_submit(struct save_pipe *pipe, unsigned int batch,
+                             const unsigned long *pfn_batch,
+                             const xen_pfn_t *pfn_type,
+                             const uint8_t *alloc_only)
+{
+    struct save_job *job = &pipe->jobs[pipe->tail % pipe->nr_jobs];
+
+    job->batch = batch;
+    memcpy(job->pfn_batch, pfn_batch, batch * sizeof(*pfn_batch));
+    memcpy(job->pfn_type, pfn_type, batch * sizeof(*pfn_type));
+    memcpy(job->alloc_only, alloc_only, batch * sizeof(*alloc_only));
+    job->done = 0;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->tail++;
+    pthread_cond_signal(&pipe->work);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/*
+** Wait for the oldest queued batch and write it out. Returns the number of
+** pages accounted as sent, or -1 on error.
+*/
+static int save_pipe_retire(struct save_pipe *pipe, int dobuf,
+                            struct outbuf *ob, int io_fd, int live)
+{
+    xc_interface *xch = pipe->xch;
+    struct save_job *job = &pipe->jobs[pipe->head % pipe->nr_jobs];
+    uint64_t start, now;
+    unsigned long pagetype;
+    int j, run, rc = -1;
+
+    start = llgettimeofday();
+    pthread_mutex_lock(&pipe->lock);
+    while ( !job->done )
+        pthread_cond_wait(&pipe->done, &pipe->lock);
+    pthread_mutex_unlock(&pipe->lock);
+    now = llgettimeofday();
+    pipe->stats.stall_us += now - start;
+    start = now;
+
+    pipe->head++;
+
+    if ( job->run < 0 )
+        goto out;
+
+    pipe->stats.pages_mapped += job->batch;
+    pipe->stats.map_us += job->map_us;
+    pipe->stats.pages_canon += job->nr_pt;
+    pipe->stats.canon_us += job->canon_us;
+
+    if ( !job->run )
+    {
+        rc = 0;
+        goto out;
+    }
+
+    if ( job->race && !live )
+    {
+        ERROR("Fatal PT race (pfn %lx, type %08lx)", job->race_pfn,
+              job->race_type);
+        goto out;
+    }
+
+    if ( write_buffer(xch, dobuf, ob, io_fd, &job->batch,
+                      sizeof(unsigned int)) )
+    {
+        PERROR("Error when writing to state file (2)");
+        goto out;
+    }
+
+    if ( sizeof(unsigned long) < sizeof(*job->pfn_type) )
+        for ( j = 0; j < job->batch; j++ )
+            ((unsigned long *)job->pfn_type)[j] = job->pfn_type[j];
+    if ( write_buffer(xch, dobuf, ob, io_fd, job->pfn_type,
+                      sizeof(unsigned long) * job->batch) )
+    {
+        PERROR("Error when writing to state file (3)");
+        goto out;
+    }
+    if ( sizeof(unsigned long) < sizeof(*job->pfn_type) )
+        while ( --j >= 0 )
+            job->pfn_type[j] = ((unsigned long *)job->pfn_type)[j];
+
+    for ( run = j = 0; j < job->batch; j++ )
+    {
+        pagetype = job->pfn_type[j] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( pagetype != 0 && run )
+        {
+            /* Flush the run of normal pages preceding this one. */
+            if ( write_uncached(xch, dobuf, ob, io_fd,
+                                job->region_base + (PAGE_SIZE*(j-run)),
+                                PAGE_SIZE*run) != PAGE_SIZE*run )
+            {
+                PERROR("Error when writing to state file (4a)"
+                       " (errno %d)", errno);
+                goto out;
+            }
+            pipe->stats.bytes_written += PAGE_SIZE*run;
+            run = 0;
+        }
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+            || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+            || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
+             (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
+        {
+            if ( write_uncached(xch, dobuf, ob, io_fd,
+                                job->canon + (PAGE_SIZE*j),
+                                PAGE_SIZE) != PAGE_SIZE )
+            {
+                PERROR("Error when writing to state file (4b)"
+                       " (errno %d)", errno);
+                goto out;
+            }
+            pipe->stats.bytes_written += PAGE_SIZE;
+        }
+        else
+            run++;
+    }
+
+    if ( run )
+    {
+        if ( write_uncached(xch, dobuf, ob, io_fd,
+                            job->region_base + (PAGE_SIZE*(j-run)),
+                            PAGE_SIZE*run) != PAGE_SIZE*run )
+        {
+            PERROR("Error when writing to state file (4c)"
+                   " (errno %d)", errno);
+            goto out;
+        }
+        pipe->stats.bytes_written += PAGE_SIZE*run;
+    }
+
+    rc = job->batch;
+
+ out:
+    if ( job->region_base )
+    {
+        munmap(job->region_base, job->batch * PAGE_SIZE);
+        job->region_base = NULL;
+    }
+    pipe->stats.write_us += llgettimeofday() - start;
+
+    return rc;
+}
+
+/* Retire every queued batch. Returns pages sent, or -1 on error. */
+static int save_pipe_drain(struct save_pipe *pipe, int dobuf,
+                           struct outbuf *ob, int io_fd, int live)
+{
+    int sent = 0, rc;
+
+    while ( pipe->head != pipe->tail )
+    {
+        rc = save_pipe_retire(pipe, dobuf, ob, io_fd, live);
+        if ( rc < 0 )
+            return -1;
+        sent += rc;
+    }
+
+    return sent;
+}
+
+/* Bytes per microsecond is MB/s. */
+#define PIPE_RATE(_bytes, _us) ((_us) ? (_bytes) / (_us) : 0)
+
+static void save_pipe_print_stats(struct save_pipe *pipe, int iter)
+{
+    xc_interface *xch = pipe->xch;
+    struct save_pipe_stats *s = &pipe->stats;
+
+    DPRINTF("pipeline iter %d: map %"PRIu64" pages %"PRIu64"MB/s, "
+            "canonicalise %"PRIu64" pages %"PRIu64"MB/s, "
+            "write %"PRIu64"MB %"PRIu64"MB/s, writer stalled %"PRIu64"ms\n",
+            iter,
+            s->pages_mapped, PIPE_RATE(s->pages_mapped * PAGE_SIZE, s->map_us),
+            s->pages_canon, PIPE_RATE(s->pages_canon * PAGE_SIZE, s->canon_us),
+            s->bytes_written >> 20, PIPE_RATE(s->bytes_written, s->write_us),
+            s->stall_us / 1000);
+
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+** Post-copy (XCFLAGS_POSTCOPY, HVM only).
+**
+** The save stream carries the device and vcpu state plus the frames named
+** by HVM params, which Xen, qemu and the restore code touch before the
+** guest runs, and the XALLOC (populate-on-demand) pfns, which need no
+** data.  All other memory stays here and is served afterwards by
+** xc_domain_postcopy_send() while the guest runs on the target.
+*/
+#define POSTCOPY_BATCH    64  /* background pages between demand checks */
+#define POSTCOPY_REC_SIZE (sizeof(uint64_t) + PAGE_SIZE)
+
+static void postcopy_special_pfns(xc_interface *xch, uint32_t dom,
+                                  unsigned long p2m_size,
+                                  unsigned long *bitmap)
+{
+    static const struct {
+        int param;
+        int shift;      /* params holding an address rather than a pfn */
+    } special[] = {
+        { HVM_PARAM_IOREQ_PFN,         0 },
+        { HVM_PARAM_BUFIOREQ_PFN,      0 },
+        { HVM_PARAM_STORE_PFN,         0 },
+        { HVM_PARAM_CONSOLE_PFN,       0 },
+        { HVM_PARAM_PAGING_RING_PFN,   0 },
+        { HVM_PARAM_ACCESS_RING_PFN,   0 },
+        { HVM_PARAM_SHARING_RING_PFN,  0 },
+        { HVM_PARAM_IDENT_PT,          PAGE_SHIFT },
+        { HVM_PARAM_VM86_TSS,          PAGE_SHIFT },
+    };
+    unsigned long val;
+    int i;
+
+    for ( i = 0; i < sizeof(special) / sizeof(special[0]); i++ )
+    {
+        if ( xc_get_hvm_param(xch, dom, special[i].param, &val) || !val )
+            continue;
+        val >>= special[i].shift;
+        if ( val < p2m_size )
+            set_bit(val, bitmap);
+    }
+}
+
+/*
+ * Add the pfns Xen types XALLOC (populate-on-demand entries) to bitmap.
+ * They have no data to serve later, so the save stream carries them and
+ * the restore side allocates them, like any other XALLOC pfn.
+ */
+static int postcopy_alloc_pfns(xc_interface *xch, uint32_t dom,
+                               unsigned long p2m_size,
+                               unsigned long *bitmap)
+{
+    xen_pfn_t pfns[MAX_BATCH_SIZE];
+    unsigned long pfn;
+    unsigned int j, n;
+
+    for ( pfn = 0; pfn < p2m_size; pfn += n )
+    {
+        n = MIN(MAX_BATCH_SIZE, p2m_size - pfn);
+        for ( j = 0; j < n; j++ )
+            pfns[j] = pfn + j;
+
+        if ( xc_get_pfn_type_batch(xch, dom, n, pfns) )
+        {
+            PERROR("get_pfn_type_batch failed");
+            return -1;
+        }
+
+        for ( j = 0; j < n; j++ )
+            if ( (pfns[j] & XEN_DOMCTL_PFINFO_LTAB_MASK) ==
+                 XEN_DOMCTL_PFINFO_XALLOC )
+                set_bit(pfn + j, bitmap);
+    }
+
+    return 0;
+}
+
+/* Send one record (pfn, page) per entry of pfns[] in a single write. */
+static int postcopy_send_pages(xc_interface *xch, int io_fd, uint32_t dom,
+                               xen_pfn_t *pfns, int *errs, unsigned int nr,
+                               char *rec)
+{
+    char *region, *p = rec;
+    uint64_t pfn;
+    unsigned int i;
+    int rc = -1;
+
+    region = xc_map_foreign_bulk(xch, dom, PROT_READ, pfns, errs, nr);
+    if ( region == NULL )
+    {
+        PERROR("Failed to map post-copy batch");
+        return -1;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        pfn = pfns[i];
+        if ( errs[i] )
+        {
+            ERROR("Post-copy pfn %#"PRIx64" vanished (err %d)", pfn, errs[i]);
+            goto out;
+        }
+        memcpy(p, &pfn, sizeof(pfn));
+        memcpy(p + sizeof(pfn), region + i * PAGE_SIZE, PAGE_SIZE);
+        p += POSTCOPY_REC_SIZE;
+    }
+
+    if ( write_exact(io_fd, rec, p - rec) )
+    {
+        PERROR("Error when writing post-copy pages");
+        goto out;
+    }
+
+    rc = 0;
+
+ out:
+    munmap(region, nr * PAGE_SIZE);
+    return rc;
+}
+
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
-                   uint32_t max_factor, uint32_t flags,
+                   uint32_t max_factor, uint32_t max_downtime,
+                   unsigned long delta_cache_size, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
                    unsigned long vm_generationid_addr)
 {
@@ -802,7 +1664,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     DECLARE_DOMCTL;
 
     int rc = 1, frc, i, j, last_iter = 0, iter = 0;
-    int live  = (flags & XCFLAGS_LIVE);
+    int postcopy = !!(flags & XCFLAGS_POSTCOPY);
+    int live  = (flags & XCFLAGS_LIVE) && !postcopy;
     int debug = (flags & XCFLAGS_DEBUG);
     int superpages = !!hvm;
     int race = 0, sent_last_iter, skip_this_iter = 0;
@@ -819,6 +1682,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     xen_pfn_t *pfn_type = NULL;
     unsigned long *pfn_batch = NULL;
     int *pfn_err = NULL;
+    uint8_t *alloc_only = NULL;
 
     /* A copy of one frame of guest memory. */
     char page[PAGE_SIZE];
@@ -886,8 +1750,23 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
      */
     int compressing = 0;
 
+    /* XCFLAGS_DELTA_COMPRESS: precopy pages sent as deltas (Format C) */
+    int delta = live && !debug && (flags & XCFLAGS_DELTA_COMPRESS);
+    unsigned long delta_zero = 0, delta_bytes = 0;
+    long dlen;
+
     int completed = 0;
 
+    /* Worker threads for XCFLAGS_PIPELINE, and whether this round uses them */
+    struct save_pipe *pipe = NULL;
+    int pipelined = 0;
+
+    /* Downtime-bounded precopy termination, if max_downtime was given */
+    struct precopy_ctl precopy;
+
+    /* XCFLAGS_POSTCOPY: the only pages this stream carries */
+    unsigned long *postcopy_special = NULL;
+
     DPRINTF("%s: starting save of domid %u", __func__, dom);
 
     if ( hvm && !callbacks->switch_qemu_logdirty )
@@ -897,6 +1776,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         return 1;
     }
 
+    if ( postcopy && (!hvm || callbacks->checkpoint) )
+    {
+        ERROR("Post-copy is only supported for a single HVM save");
+        errno = EINVAL;
+        return 1;
+    }
+
     outbuf_init(xch, &ob_pagebuf, OUTBUF_SIZE);
 
     memset(ctx, 0, sizeof(*ctx));
@@ -905,6 +1791,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     max_iters  = max_iters  ? : DEF_MAX_ITERS;
     max_factor = max_factor ? : DEF_MAX_FACTOR;
 
+    memset(&precopy, 0, sizeof(precopy));
+    precopy.max_downtime = (uint64_t)max_downtime * 1000;
+    precopy.converge = !!(flags & XCFLAGS_AUTO_CONVERGE);
+
     if ( !get_platform_info(xch, dom,
                             &ctx->max_mfn, &ctx->hvirt_start, &ctx->pt_levels, &dinfo->guest_width) )
     {
@@ -919,6 +1809,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     }
 
     shared_info_frame = info.shared_info_frame;
+    precopy.nr_vcpus = info.max_vcpu_id + 1;
 
     /* Map the shared info frame */
     if ( !hvm )
@@ -985,14 +1876,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         }
     }
 
-    if ( flags & XCFLAGS_CHECKPOINT_COMPRESS )
+    if ( (flags & XCFLAGS_CHECKPOINT_COMPRESS) || delta )
     {
-        if (!(compress_ctx = xc_compression_create_context(xch, dinfo->p2m_size)))
+        if (!(compress_ctx = xc_compression_create_context(xch, dinfo->p2m_size,
+                                                           delta_cache_size)))
         {
             ERROR("Failed to create compression context");
             goto out;
         }
-        outbuf_init(xch, &ob_tailbuf, OUTBUF_SIZE/4);
+        if ( flags & XCFLAGS_CHECKPOINT_COMPRESS )
+            outbuf_init(xch, &ob_tailbuf, OUTBUF_SIZE/4);
     }
 
     last_iter = !live;
@@ -1000,6 +1893,20 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     /* pretend we sent all the pages last iteration */
     sent_last_iter = dinfo->p2m_size;
 
+    if ( postcopy )
+    {
+        postcopy_special = calloc(1, bitmap_size(dinfo->p2m_size));
+        if ( !postcopy_special )
+        {
+            ERROR("Couldn't allocate post-copy bitmap");
+            errno = ENOMEM;
+            goto out;
+        }
+        postcopy_special_pfns(xch, dom, dinfo->p2m_size, postcopy_special);
+        if ( postcopy_alloc_pfns(xch, dom, dinfo->p2m_size, postcopy_special) )
+            goto out;
+    }
+
     /* Setup to_send / to_fix and to_skip bitmaps */
     to_send = xc_hypercall_buffer_alloc_pages(xch, to_send, NRPAGES(bitmap_size(dinfo->p2m_size)));
     to_skip = xc_hypercall_buffer_alloc_pages(xch, to_skip, NRPAGES(bitmap_size(dinfo->p2m_size)));
@@ -1035,7 +1942,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     pfn_type   = malloc(ROUNDUP(MAX_BATCH_SIZE * sizeof(*pfn_type), PAGE_SHIFT));
     pfn_batch  = calloc(MAX_BATCH_SIZE, sizeof(*pfn_batch));
     pfn_err    = malloc(MAX_BATCH_SIZE * sizeof(*pfn_err));
-    if ( (pfn_type == NULL) || (pfn_batch == NULL) || (pfn_err == NULL) )
+    alloc_only = calloc(MAX_BATCH_SIZE, sizeof(*alloc_only));
+    if ( (pfn_type == NULL) || (pfn_batch == NULL) || (pfn_err == NULL) ||
+         (alloc_only == NULL) )
     {
         ERROR("failed to alloc memory for pfn_type and/or pfn_batch arrays");
         errno = ENOMEM;
@@ -1087,7 +1996,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         DPRINTF("Had %d unexplained entries in p2m table\n", err);
     }
 
+    if ( (flags & XCFLAGS_PIPELINE) &&
+         !(pipe = save_pipe_create(xch, dom, hvm, ctx,
+                                   save_pipe_nr_workers(xch))) )
+    {
+        ERROR("Failed to start save pipeline");
+        goto out;
+    }
+
     print_stats(xch, dom, 0, &time_stats, &shadow_stats, 0);
+    precopy.last_clean = llgettimeofday();
 
     tmem_saved = xc_tmem_save(xch, dom, io_fd, live, XC_SAVE_ID_TMEM);
     if ( tmem_saved == -1 )
@@ -1102,6 +2020,17 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto out;
     }
 
+    if ( delta )
+    {
+        int id = XC_SAVE_ID_ENABLE_DELTA;
+
+        if ( write_exact(io_fd, &id, sizeof(id)) )
+        {
+            PERROR("Error when writing enable_delta marker");
+            goto out;
+        }
+    }
+
   copypages:
 #define wrexact(fd, buf, len) write_buffer(xch, last_iter, ob, (fd), (buf), (len))
 #define wruncached(fd, live, buf, len) write_uncached(xch, last_iter, ob, (fd), (buf), (len))
@@ -1124,11 +2053,23 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         sent_this_iter = 0;
         skip_this_iter = 0;
         N = 0;
+        precopy.iter_start = llgettimeofday();
+
+        /* Checkpoint compression and debug output stay on the serial path. */
+        pipelined = pipe && !compressing && !delta && !debug;
 
         while ( N < dinfo->p2m_size )
         {
             xc_report_progress_step(xch, N, dinfo->p2m_size);
 
+            if ( pipelined && save_pipe_full(pipe) )
+            {
+                frc = save_pipe_retire(pipe, last_iter, ob, io_fd, live);
+                if ( frc < 0 )
+                    goto out;
+                sent_this_iter += frc;
+            }
+
             if ( !last_iter )
             {
                 /* Slightly wasteful to peek the whole array every time,
@@ -1186,6 +2127,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 {
                     int dont_skip = (last_iter || (superpages && iter==1));
 
+                    /* Post-copy: the target pages in the rest on demand */
+                    if ( postcopy_special && !test_bit(n, postcopy_special) )
+                        continue;
+
                     if ( !dont_skip &&
                          test_bit(n, to_send) &&
                          test_bit(n, to_skip) )
@@ -1241,13 +2186,21 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
                     clear_bit(n, to_fix);
                 }
-                
+
+                alloc_only[batch] = superpages && iter == 1 &&
+                    test_bit(pfn_type[batch], to_skip);
                 batch++;
             }
 
             if ( batch == 0 )
                 goto skip; /* vanishingly unlikely... */
 
+            if ( pipelined )
+            {
+                save_pipe_submit(pipe, batch, pfn_batch, pfn_type, alloc_only);
+                continue;
+            }
+
             region_base = xc_map_foreign_bulk(
                 xch, dom, PROT_READ, pfn_type, pfn_err, batch);
             if ( region_base == NULL )
@@ -1263,68 +2216,39 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 goto out;
             }
 
-            for ( run = j = 0; j < batch; j++ )
-            {
-                unsigned long gmfn = pfn_batch[j];
-
-                if ( !hvm )
-                    gmfn = pfn_to_mfn(gmfn);
-
-                if ( pfn_type[j] == XEN_DOMCTL_PFINFO_BROKEN )
-                {
-                    pfn_type[j] |= pfn_batch[j];
-                    ++run;
-                    continue;
-                }
+            run = classify_batch(xch, ctx, hvm, debug, iter, batch,
+                                 pfn_batch, pfn_type, pfn_err, alloc_only,
+                                 (char *)region_base);
 
-                if ( pfn_err[j] )
-                {
-                    if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
-                        continue;
+            if ( !run )
+            {
+                munmap(region_base, batch*PAGE_SIZE);
+                continue; /* bail on this batch: no valid pages */
+            }
 
-                    DPRINTF("map fail: page %i mfn %08lx err %d\n",
-                            j, gmfn, pfn_err[j]);
-                    pfn_type[j] = XEN_DOMCTL_PFINFO_XTAB;
+            /* Zero pages go as a bare pfn entry in delta streams. */
+            for ( j = 0; delta && (j < batch); j++ )
+            {
+                if ( (pfn_type[j] & XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+                     XEN_DOMCTL_PFINFO_NOTAB )
                     continue;
-                }
 
-                if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
+                frc = xc_compression_zero_page(xch, compress_ctx,
+                                               (char *)region_base + PAGE_SIZE*j,
+                                               pfn_type[j]);
+                if ( frc < 0 )
                 {
-                    DPRINTF("type fail: page %i mfn %08lx\n", j, gmfn);
-                    continue;
+                    ERROR("Could not check page (pfn:%" PRIpfn ") for zeroes",
+                          pfn_type[j]);
+                    goto out;
                 }
-
-                if ( superpages && iter==1 && test_bit(gmfn, to_skip))
-                    pfn_type[j] = XEN_DOMCTL_PFINFO_XALLOC;
-
-                /* canonicalise mfn->pfn */
-                pfn_type[j] |= pfn_batch[j];
-                ++run;
-
-                if ( debug )
+                if ( frc )
                 {
-                    if ( hvm )
-                        DPRINTF("%d pfn=%08lx sum=%08lx\n",
-                                iter,
-                                pfn_type[j],
-                                csum_page(region_base + (PAGE_SIZE*j)));
-                    else
-                        DPRINTF("%d pfn= %08lx mfn= %08lx [mfn]= %08lx"
-                                " sum= %08lx\n",
-                                iter,
-                                pfn_type[j],
-                                gmfn,
-                                mfn_to_pfn(gmfn),
-                                csum_page(region_base + (PAGE_SIZE*j)));
+                    pfn_type[j] |= XC_SAVE_PFINFO_ZERO;
+                    delta_zero++;
                 }
             }
 
-            if ( !run )
-            {
-                munmap(region_base, batch*PAGE_SIZE);
-                continue; /* bail on this batch: no valid pages */
-            }
-
             if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
             {
                 PERROR("Error when writing to state file (2)");
@@ -1373,11 +2297,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
                 /*
                  * skip pages that aren't present,
-                 * or are broken, or are alloc-only
+                 * or are broken, or are alloc-only, or are zero
                  */
                 if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
                     || pagetype == XEN_DOMCTL_PFINFO_BROKEN
-                    || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+                    || pagetype == XEN_DOMCTL_PFINFO_XALLOC
+                    || pagetype == XC_SAVE_PFINFO_ZERO )
                     continue;
 
                 pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
@@ -1396,7 +2321,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                         goto out;
                     }
 
-                    if (compressing)
+                    if (compressing || delta)
                     {
                         int c_err;
                         /* Mark pagetable page to be sent uncompressed */
@@ -1440,7 +2365,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 else
                 {
                     /* We have a normal page: accumulate it for writing. */
-                    if (compressing)
+                    if (compressing || delta)
                     {
                         int c_err;
                         /* For checkpoint compression, accumulate the page in the
@@ -1471,6 +2396,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 }
             } /* end of the write out for this batch */
 
+            if ( delta )
+            {
+                dlen = write_delta_batch(xch, compress_ctx, last_iter, ob,
+                                         io_fd, batch);
+                if ( dlen < 0 )
+                {
+                    ERROR("Error when writing delta compressed data");
+                    goto out;
+                }
+                delta_bytes += dlen;
+            }
+
             if ( run )
             {
                 /* write out the last accumulated run of pages */
@@ -1492,10 +2429,26 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
       skip:
 
+        if ( pipelined )
+        {
+            frc = save_pipe_drain(pipe, last_iter, ob, io_fd, live);
+            if ( frc < 0 )
+                goto out;
+            sent_this_iter += frc;
+            save_pipe_print_stats(pipe, iter);
+        }
+
         xc_report_progress_step(xch, dinfo->p2m_size, dinfo->p2m_size);
 
         total_sent += sent_this_iter;
 
+        if ( delta )
+        {
+            DPRINTF("delta iter %d: %u pages, %lu zero, %luKB compressed\n",
+                    iter, sent_this_iter, delta_zero, delta_bytes >> 10);
+            delta_zero = delta_bytes = 0;
+        }
+
         if ( last_iter )
         {
             print_stats( xch, dom, sent_this_iter, &time_stats, &shadow_stats, 1);
@@ -1527,9 +2480,23 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
         if ( live )
         {
-            if ( (iter >= max_iters) ||
-                 (sent_this_iter+skip_this_iter < 50) ||
-                 (total_sent > dinfo->p2m_size*max_factor) )
+            int stop;
+
+            if ( precopy.max_downtime )
+                stop = precopy_update(xch, dom, &precopy, sent_this_iter);
+            else
+                stop = (sent_this_iter+skip_this_iter < 50);
+
+            if ( !stop && ((iter >= max_iters) ||
+                           (total_sent > dinfo->p2m_size*max_factor)) )
+            {
+                if ( precopy.max_downtime )
+                    DPRINTF("precopy: downtime target missed after %d "
+                            "iterations\n", iter);
+                stop = 1;
+            }
+
+            if ( stop )
             {
                 DPRINTF("Start last iteration\n");
                 last_iter = 1;
@@ -1565,6 +2532,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 PERROR("Error flushing shadow PT");
                 goto out;
             }
+            precopy.last_clean = llgettimeofday();
 
             sent_last_iter = sent_this_iter;
 
@@ -1575,6 +2543,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     DPRINTF("All memory is saved\n");
 
+    /* Any further checkpoints use the plain or Remus compressed formats. */
+    delta = 0;
+
+    /* The guest is suspended; lift any cap before it next runs. */
+    precopy_unthrottle(xch, dom, &precopy);
+
     /* After last_iter, buffer the rest of pagebuf & tailbuf data into a
      * separate output buffer and flush it after the compressed page chunks.
      */
@@ -2103,6 +3077,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             DPRINTF("Warning - couldn't disable qemu log-dirty mode");
     }
 
+    precopy_unthrottle(xch, dom, &precopy);
+
+    save_pipe_destroy(pipe);
+
     if (compress_ctx)
         xc_compression_free_context(xch, compress_ctx);
 
@@ -2121,13 +3099,167 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     free(pfn_type);
     free(pfn_batch);
     free(pfn_err);
+    free(alloc_only);
     free(to_fix);
+    free(postcopy_special);
 
     DPRINTF("Save exit of domid %u with rc=%d\n", dom, rc);
 
     return !!rc;
 }
 
+int xc_domain_postcopy_send(xc_interface *xch, int io_fd, uint32_t dom)
+{
+    unsigned long p2m_size, pfn, cursor = 0;
+    unsigned long nr_pending = 0, nr_demand = 0, nr_sent = 0;
+    unsigned long *pending = NULL;
+    xen_pfn_t pfns[MAX_BATCH_SIZE];
+    int errs[POSTCOPY_BATCH];
+    char *rec = NULL;
+    uint64_t hdr[2], req, start = llgettimeofday();
+    unsigned int j, n, nr;
+    struct pollfd pfd;
+    int frc, rc = -1;
+
+    p2m_size = xc_domain_maximum_gpfn(xch, dom) + 1;
+
+    pending = calloc(1, bitmap_size(p2m_size));
+    rec = malloc(POSTCOPY_BATCH * POSTCOPY_REC_SIZE);
+    if ( !pending || !rec )
+    {
+        ERROR("Couldn't allocate post-copy state");
+        errno = ENOMEM;
+        goto out;
+    }
+
+    /*
+     * Everything populated that xc_domain_save() left behind.  Special
+     * pfns are marked first so that the scan can tell them apart.
+     */
+    postcopy_special_pfns(xch, dom, p2m_size, pending);
+    for ( pfn = 0; pfn < p2m_size; pfn += n )
+    {
+        n = MIN(MAX_BATCH_SIZE, p2m_size - pfn);
+        for ( j = 0; j < n; j++ )
+            pfns[j] = pfn + j;
+
+        if ( xc_get_pfn_type_batch(xch, dom, n, pfns) )
+        {
+            PERROR("get_pfn_type_batch failed");
+            goto out;
+        }
+
+        for ( j = 0; j < n; j++ )
+        {
+            unsigned long type = pfns[j] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+            if ( test_and_clear_bit(pfn + j, pending) ||
+                 type == XEN_DOMCTL_PFINFO_XTAB ||
+                 type == XEN_DOMCTL_PFINFO_XALLOC ||
+                 type == XEN_DOMCTL_PFINFO_BROKEN )
+                continue;
+
+            set_bit(pfn + j, pending);
+            nr_pending++;
+        }
+    }
+
+    DPRINTF("Post-copy of domid %u: %lu pages to send\n", dom, nr_pending);
+
+    hdr[0] = p2m_size;
+    hdr[1] = nr_pending;
+    if ( write_exact(io_fd, hdr, sizeof(hdr)) ||
+         write_exact(io_fd, pending, bitmap_size(p2m_size)) )
+    {
+        PERROR("Error when writing post-copy header");
+        goto out;
+    }
+
+    pfd.fd = io_fd;
+    pfd.events = POLLIN;
+
+    while ( nr_pending )
+    {
+        /* Pages the guest is blocked on go ahead of the background stream */
+        frc = poll(&pfd, 1, 0);
+        if ( frc < 0 && errno != EINTR )
+        {
+            PERROR("Poll on post-copy channel failed");
+            goto out;
+        }
+
+        if ( frc > 0 )
+        {
+            if ( read_exact(io_fd, &req, sizeof(req)) )
+            {
+                PERROR("Error when reading post-copy request");
+                goto out;
+            }
+            if ( req == XC_POSTCOPY_END )
+            {
+                ERROR("Target ended post-copy with %lu pages outstanding",
+                      nr_pending);
+                goto out;
+            }
+
+            /* Already streamed, and possibly still in flight */
+            if ( req >= p2m_size || !test_and_clear_bit(req, pending) )
+                continue;
+
+            pfns[0] = req;
+            if ( postcopy_send_pages(xch, io_fd, dom, pfns, errs, 1, rec) )
+                goto out;
+            nr_pending--;
+            nr_demand++;
+            continue;
+        }
+
+        /* Nothing demanded: stream the next pending pages in pfn order */
+        for ( nr = 0; (nr < POSTCOPY_BATCH) && (cursor < p2m_size); cursor++ )
+        {
+            /* for sparse bitmaps, word-by-word may save time */
+            if ( !(cursor % BITS_PER_LONG) && !pending[cursor / BITS_PER_LONG] )
+            {
+                cursor += BITS_PER_LONG - 1;
+                continue;
+            }
+            if ( test_and_clear_bit(cursor, pending) )
+                pfns[nr++] = cursor;
+        }
+
+        if ( nr && postcopy_send_pages(xch, io_fd, dom, pfns, errs, nr, rec) )
+            goto out;
+        nr_pending -= nr;
+        nr_sent += nr;
+    }
+
+    /* Tell the target we are done and wait for its last stale requests */
+    req = XC_POSTCOPY_END;
+    if ( write_exact(io_fd, &req, sizeof(req)) )
+    {
+        PERROR("Error when writing post-copy end marker");
+        goto out;
+    }
+    do {
+        if ( read_exact(io_fd, &req, sizeof(req)) )
+        {
+            PERROR("Error when waiting for post-copy completion");
+            goto out;
+        }
+    } while ( req != XC_POSTCOPY_END );
+
+    DPRINTF("Post-copy of domid %u done in %"PRIu64"ms: "
+            "%lu pages streamed, %lu on demand\n", dom,
+            (llgettimeofday() - start) / 1000, nr_sent, nr_demand);
+
+    rc = 0;
+
+ out:
+    free(rec);
+    free(pending);
+    return rc;
+}
+
 /*
  * Local variables:
  * mode: C
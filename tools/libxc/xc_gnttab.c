@@ -203,6 +203,17 @@ int xc_gnttab_set_max_grants(xc_gnttab *xcg, uint32_t count)
 	return xcg->ops->u.gnttab.set_max_grants(xcg, xcg->ops_handle, count);
 }
 
+int xc_gnttab_grant_copy(xc_gnttab *xcg, uint32_t count,
+			 xc_gnttab_grant_copy_segment_t *segs)
+{
+	if (!xcg->ops->u.gnttab.grant_copy) {
+		errno = ENOSYS;
+		return -1;
+	}
+	return xcg->ops->u.gnttab.grant_copy(xcg, xcg->ops_handle,
+					     count, segs);
+}
+
 void *xc_gntshr_share_pages(xc_gntshr *xcg, uint32_t domid,
                             int count, uint32_t *refs, int writable)
 {
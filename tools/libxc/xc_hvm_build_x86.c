@@ -38,6 +38,10 @@
 #define SUPERPAGE_1GB_SHIFT   18
 #define SUPERPAGE_1GB_NR_PFNS (1UL << SUPERPAGE_1GB_SHIFT)
 
+/* Superpage extents requested per populate_physmap call. */
+#define SUPERPAGE_1GB_BATCH   32
+#define SUPERPAGE_2MB_BATCH   512
+
 #define SPECIALPAGE_PAGING   0
 #define SPECIALPAGE_ACCESS   1
 #define SPECIALPAGE_SHARING  2
@@ -321,9 +325,11 @@ static int setup_guest(xc_interface *xch,
      * We attempt to allocate 1GB pages if possible. It falls back on 2MB
      * pages if 1GB allocation fails. 4KB pages will be used eventually if
      * both fail.
-     * 
-     * Under 2MB mode, we allocate pages in batches of no more than 8MB to 
-     * ensure that we can be preempted and hence dom0 remains responsive.
+     *
+     * Superpages are requested in batches of up to 32GB (1GB pages) or 1GB
+     * (2MB pages) per call.  populate_physmap preempts itself between
+     * extents, so dom0 remains responsive and is not held up by the round
+     * trip per extent.
      */
     rc = xc_domain_populate_physmap_exact(
         xch, dom, 0xa0, 0, pod_mode, &page_array[0x00]);
@@ -331,15 +337,20 @@ static int setup_guest(xc_interface *xch,
     stat_normal_pages = 0xc0;
     while ( (rc == 0) && (nr_pages > cur_pages) )
     {
-        /* Clip count to maximum 1GB extent. */
+        /* Clip count to maximum 1GB extent batch. */
         unsigned long count = nr_pages - cur_pages;
-        unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS;
+        unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS * SUPERPAGE_1GB_BATCH;
 
         if ( count > max_pages )
             count = max_pages;
 
         cur_pfn = page_array[cur_pages];
 
+        /* A batch must not run across the MMIO hole in page_array. */
+        if ( (cur_pages < (mmio_start >> PAGE_SHIFT)) &&
+             (cur_pages + count > (mmio_start >> PAGE_SHIFT)) )
+            count = (mmio_start >> PAGE_SHIFT) - cur_pages;
+
         /* Take care the corner cases of super page tails */
         if ( ((cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
              (count > (-cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1))) )
@@ -348,13 +359,13 @@ static int setup_guest(xc_interface *xch,
                   (count > SUPERPAGE_1GB_NR_PFNS) )
             count &= ~(SUPERPAGE_1GB_NR_PFNS - 1);
 
-        /* Attemp to allocate 1GB super page. Because in each pass we only
-         * allocate at most 1GB, we don't have to clip super page boundaries.
+        /* Attempt to allocate 1GB super pages. count is a multiple of 1GB
+         * here, so we don't have to clip super page boundaries.
          */
         if ( ((count | cur_pfn) & (SUPERPAGE_1GB_NR_PFNS - 1)) == 0 &&
-             /* Check if there exists MMIO hole in the 1GB memory range */
+             /* Check if there exists MMIO hole in the memory range */
              !check_mmio_hole(cur_pfn << PAGE_SHIFT,
-                              SUPERPAGE_1GB_NR_PFNS << PAGE_SHIFT,
+                              count << PAGE_SHIFT,
                               mmio_start, mmio_size) )
         {
             long done;
@@ -378,8 +389,10 @@ static int setup_guest(xc_interface *xch,
 
         if ( count != 0 )
         {
-            /* Clip count to maximum 8MB extent. */
-            max_pages = SUPERPAGE_2MB_NR_PFNS * 4;
+            cur_pfn = page_array[cur_pages];
+
+            /* Clip count to maximum 2MB extent batch. */
+            max_pages = SUPERPAGE_2MB_NR_PFNS * SUPERPAGE_2MB_BATCH;
             if ( count > max_pages )
                 count = max_pages;
             
@@ -729,6 +729,23 @@ static int linux_gnttab_munmap(xc_gnttab *xcg, xc_osdep_handle h,
     return 0;
 }
 
+/*
+ * The library's segment is laid out as gntdev's, so the array is handed to
+ * the kernel as is.
+ */
+static int linux_gnttab_grant_copy(xc_gnttab *xcg, xc_osdep_handle h,
+                                   uint32_t count,
+                                   xc_gnttab_grant_copy_segment_t *segs)
+{
+    int fd = (int)h;
+    struct ioctl_gntdev_grant_copy copy;
+
+    copy.count = count;
+    copy.segments = (struct gntdev_grant_copy_segment *)segs;
+
+    return ioctl(fd, IOCTL_GNTDEV_GRANT_COPY, &copy);
+}
+
 static struct xc_osdep_ops linux_gnttab_ops = {
     .open = &linux_gnttab_open,
     .close = &linux_gnttab_close,
@@ -737,6 +754,7 @@ static struct xc_osdep_ops linux_gnttab_ops = {
         .set_max_grants = linux_gnttab_set_max_grants,
         .grant_map = &linux_gnttab_grant_map,
         .munmap = &linux_gnttab_munmap,
+        .grant_copy = &linux_gnttab_grant_copy,
     },
 };
 
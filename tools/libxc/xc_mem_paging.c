@@ -63,6 +63,29 @@ int xc_mem_paging_evict(xc_interface *xch, domid_t domain_id, unsigned long gfn)
                                 gfn, NULL);
 }
 
+int xc_mem_paging_absent(xc_interface *xch, domid_t domain_id, unsigned long gfn)
+{
+    return xc_mem_event_memop(xch, domain_id,
+                                XENMEM_paging_op_absent,
+                                XENMEM_paging_op,
+                                gfn, NULL);
+}
+
+int xc_mem_paging_absent_range(xc_interface *xch, domid_t domain_id,
+                               unsigned long gfn, unsigned long nr)
+{
+    xen_mem_event_op_t meo;
+
+    memset(&meo, 0, sizeof(meo));
+
+    meo.op      = XENMEM_paging_op_absent_range;
+    meo.domain  = domain_id;
+    meo.gfn     = gfn;
+    meo.buffer  = nr;
+
+    return do_memory_op(xch, XENMEM_paging_op, &meo, sizeof(meo));
+}
+
 int xc_mem_paging_prep(xc_interface *xch, domid_t domain_id, unsigned long gfn)
 {
     return xc_mem_event_memop(xch, domain_id,
@@ -22,7 +22,8 @@
 #include <xenguest.h>
 
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
-                   uint32_t max_factor, uint32_t flags,
+                   uint32_t max_factor, uint32_t max_downtime,
+                   unsigned long delta_cache_size, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
                    unsigned long vm_generationid_addr)
 {
@@ -30,6 +31,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     return -1;
 }
 
+int xc_domain_postcopy_send(xc_interface *xch, int io_fd, uint32_t dom)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int store_evtchn, unsigned long *store_mfn,
                       domid_t store_domid, unsigned int console_evtchn,
@@ -37,7 +44,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int hvm, unsigned int pae, int superpages,
                       int no_incr_generationid,
                       unsigned long *vm_generationid_addr,
-                      struct restore_callbacks *callbacks)
+                      struct restore_callbacks *callbacks,
+                      unsigned int nr_workers)
 {
     errno = ENOSYS;
     return -1;
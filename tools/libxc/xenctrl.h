@@ -1467,6 +1467,31 @@ int xc_gnttab_munmap(xc_gnttab *xcg,
 int xc_gnttab_set_max_grants(xc_gnttab *xcg,
 			     uint32_t count);
 
+typedef struct xc_gnttab_grant_copy_segment {
+    union xc_gnttab_copy_ptr {
+        void *virt;
+        struct {
+            uint32_t ref;
+            uint16_t offset;
+            uint16_t domid;
+        } foreign;
+    } source, dest;
+    uint16_t len;
+    uint16_t flags;  /* GNTCOPY_source_gref, GNTCOPY_dest_gref */
+    int16_t status;  /* GNTST_*, per segment */
+} xc_gnttab_grant_copy_segment_t;
+
+/*
+ * Copies @count segments between local memory and foreign grant references
+ * in one go, without mapping them.  Each segment has exactly one foreign
+ * side, named by its flags, and must not cross a page on either side.
+ * Returns 0 if the copy was issued (check each segment's status), or -1
+ * with errno set (ENOSYS if not supported here).  Never logs.
+ */
+int xc_gnttab_grant_copy(xc_gnttab *xcg,
+                         uint32_t count,
+                         xc_gnttab_grant_copy_segment_t *segs);
+
 int xc_gnttab_op(xc_interface *xch, int cmd,
                  void * op, int op_size, int count);
 /* Logs iff hypercall bounce fails, otherwise doesn't. */
@@ -1915,6 +1940,12 @@ int xc_mem_paging_disable(xc_interface *xch, domid_t domain_id);
 int xc_mem_paging_nominate(xc_interface *xch, domid_t domain_id,
                            unsigned long gfn);
 int xc_mem_paging_evict(xc_interface *xch, domid_t domain_id, unsigned long gfn);
+/* Mark an unpopulated gfn as paged out, e.g. for post-copy migration. */
+int xc_mem_paging_absent(xc_interface *xch, domid_t domain_id,
+                         unsigned long gfn);
+/* The same for the nr gfns from gfn on, in one hypercall. */
+int xc_mem_paging_absent_range(xc_interface *xch, domid_t domain_id,
+                               unsigned long gfn, unsigned long nr);
 int xc_mem_paging_prep(xc_interface *xch, domid_t domain_id, unsigned long gfn);
 int xc_mem_paging_load(xc_interface *xch, domid_t domain_id, 
                         unsigned long gfn, void *buffer);
@@ -1955,6 +1986,17 @@ int xc_memshr_control(xc_interface *xch,
                       domid_t domid,
                       int enable);
 
+/* Turn on/off the hypervisor's content scanner for the domid. While on,
+ * Xen hashes the domain's memory in the background and shares pages
+ * that are identical to pages of this or any other scanned domain.
+ *
+ * Returns EINVAL if trying to enable and sharing is not enabled for the
+ * domain. Pages already shared by the scanner stay shared when it is
+ * turned off. */
+int xc_memshr_scan_control(xc_interface *xch,
+                           domid_t domid,
+                           int enable);
+
 /* Create a communication ring in which the hypervisor will place ENOMEM
  * notifications.
  *
@@ -2178,12 +2220,19 @@ void xc_elf_set_logfile(xc_interface *xch, struct elf_binary *elf,
 
 /**
  * Checkpoint Compression
+ *
+ * cache_size is the number of bytes of guest pages kept in the LRU cache
+ * that deltas are computed against, or 0 for the default.
  */
 typedef struct compression_ctx comp_ctx;
 comp_ctx *xc_compression_create_context(xc_interface *xch,
-					unsigned long p2m_size);
+					unsigned long p2m_size,
+					unsigned long cache_size);
 void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx);
 
+/* Largest amount of compressed data a single page can produce. */
+#define XC_COMPRESSION_PAGE_BOUND (XC_PAGE_SIZE + 9)
+
 /**
  * Add a page to compression page buffer, to be compressed later.
  *
@@ -2200,6 +2249,18 @@ void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx);
 int xc_compression_add_page(xc_interface *xch, comp_ctx *ctx, char *page,
 			    unsigned long pfn, int israw);
 
+/**
+ * Check whether a page about to be sent is all zeroes, so that it can be
+ * sent without any data. If so, the cached copy of the page (if any) is
+ * cleared to match what the receiver will hold. The pfn must not have a
+ * page waiting in the page buffer.
+ *
+ * returns 1 if the page is all zeroes, 0 if not.
+ * returns -2 if the pfn is out of bounds.
+ */
+int xc_compression_zero_page(xc_interface *xch, comp_ctx *ctx, char *page,
+			     unsigned long pfn);
+
 /**
  * Delta compress pages in the compression buffer and inserts the
  * compressed data into the supplied compression buffer compbuf, whose
@@ -116,6 +116,9 @@ struct xc_osdep_ops
                           void *start_address,
                           uint32_t count);
             int (*set_max_grants)(xc_gnttab *xcg, xc_osdep_handle h, uint32_t count);
+            int (*grant_copy)(xc_gnttab *xcg, xc_osdep_handle h,
+                              uint32_t count,
+                              xc_gnttab_grant_copy_segment_t *segs);
         } gnttab;
         struct {
             void *(*share_pages)(xc_gntshr *xcg, xc_osdep_handle h,
@@ -28,6 +28,14 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+/* Overlap page mapping, canonicalisation and writing on worker threads. */
+#define XCFLAGS_PIPELINE  (1 << 5)
+/* Throttle the guest's vCPUs if precopy cannot meet max_downtime. */
+#define XCFLAGS_AUTO_CONVERGE (1 << 6)
+/* Send precopy pages as deltas against the copy sent in an earlier round. */
+#define XCFLAGS_DELTA_COMPRESS (1 << 7)
+/* Stop at once and leave guest memory to xc_domain_postcopy_send (HVM). */
+#define XCFLAGS_POSTCOPY  (1 << 8)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -82,13 +90,44 @@ struct save_callbacks {
  * @parm xch a handle to an open hypervisor interface
  * @parm fd the file descriptor to save a domain to
  * @parm dom the id of the domain
+ * @parm max_downtime target stop-and-copy time in ms; when non-zero, precopy
+ *                    ends as soon as the remaining dirty pages are predicted
+ *                    to be sent within it, with max_iters and max_factor
+ *                    only as a backstop
+ * @parm delta_cache_size bytes of previously sent pages to keep for
+ *                        XCFLAGS_DELTA_COMPRESS, or 0 for the default
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
-                   uint32_t max_factor, uint32_t flags /* XCFLAGS_xxx */,
+                   uint32_t max_factor, uint32_t max_downtime,
+                   unsigned long delta_cache_size,
+                   uint32_t flags /* XCFLAGS_xxx */,
                    struct save_callbacks* callbacks, int hvm,
                    unsigned long vm_generationid_addr);
 
+/**
+ * This function serves the memory of a domain saved with XCFLAGS_POSTCOPY.
+ *
+ * The domain must still be suspended on this host.  The peer on the
+ * bidirectional fd is the pager of the restored domain (xenpaging -p).
+ *
+ * The stream sent to the peer is:
+ *   uint64_t p2m_size, uint64_t nr_pages,
+ *   bitmap of bitmap_size(p2m_size) bytes with a bit set per pfn to follow,
+ *   nr_pages records of uint64_t pfn and one page of data, in any order,
+ *   uint64_t XC_POSTCOPY_END.
+ * The peer sends a uint64_t pfn to have that page sent next, and
+ * XC_POSTCOPY_END once it has seen the end marker.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm fd the page channel to the target host
+ * @parm dom the id of the suspended domain
+ * @return 0 once every page has been sent, -1 on failure
+ */
+int xc_domain_postcopy_send(xc_interface *xch, int io_fd, uint32_t dom);
+
+#define XC_POSTCOPY_END (~0ULL)
+
 
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
@@ -117,6 +156,8 @@ struct restore_callbacks {
  * @parm vm_generationid_addr returned with the address of the generation id buffer
  * @parm callbacks non-NULL to receive a callback to restore toolstack
  *       specific data
+ * @parm nr_workers number of threads applying pages in parallel while the
+ *       stream is read ahead, or 0 to restore from a single thread
  * @return 0 on success, -1 on failure
  */
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
@@ -126,7 +167,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int hvm, unsigned int pae, int superpages,
                       int no_incr_generationid,
                       unsigned long *vm_generationid_addr,
-                      struct restore_callbacks *callbacks);
+                      struct restore_callbacks *callbacks,
+                      unsigned int nr_workers);
 /**
  * xc_domain_restore writes a file to disk that contains the device
  * model saved state.
@@ -203,6 +203,21 @@
  *   always holds true until the end of BODY PHASE:
  *    num(PFN entries +ve chunks) >= num(pages received in compressed form)
  *
+ *
+ * BODY PHASE - Format C (for live migration with delta compression)
+ * ----------
+ *
+ * Sent after a XC_SAVE_ID_ENABLE_DELTA chunk, until the end of the first
+ * body phase. Each +ve chunk is the PFN array of Format B, immediately
+ * followed by one XC_SAVE_ID_COMPRESSED_DATA chunk holding exactly the
+ * pages of that batch, each a delta against the copy the sender last sent.
+ *
+ * In addition, a PFN entry may have type XC_SAVE_PFINFO_ZERO: the page is
+ * all zeroes and has no data in the compressed chunk. The receiver stores
+ * it as a XEN_DOMCTL_PFINFO_NOTAB page.
+ *
+ * Later checkpoints (Remus) revert to Format A or B.
+ *
  * TAIL PHASE
  * ----------
  *
@@ -259,6 +274,10 @@
 #define XC_SAVE_ID_HVM_ACCESS_RING_PFN  -16
 #define XC_SAVE_ID_HVM_SHARING_RING_PFN -17
 #define XC_SAVE_ID_TOOLSTACK          -18 /* Optional toolstack specific info */
+#define XC_SAVE_ID_ENABLE_DELTA       -19 /* Switch to Format C for this body phase */
+
+/* Stream-only page type for an all-zero page in Format C (no data sent). */
+#define XC_SAVE_PFINFO_ZERO (0x7U<<28)
 
 /*
 ** We process save/restore/migrate in batches of pages; the below
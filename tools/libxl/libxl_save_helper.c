@@ -235,7 +235,7 @@ int main(int argc, char **argv)
         helper_setcallbacks_save(&helper_save_callbacks, cbflags);
 
         startup("save");
-        r = xc_domain_save(xch, io_fd, dom, max_iters, max_factor, flags,
+        r = xc_domain_save(xch, io_fd, dom, max_iters, max_factor, 0, 0, flags,
                            &helper_save_callbacks, hvm, genidad);
         complete(r);
 
@@ -265,7 +265,7 @@ int main(int argc, char **argv)
                               store_domid, console_evtchn, &console_mfn,
                               console_domid, hvm, pae, superpages,
                               no_incr_genidad, &genidad,
-                              &helper_restore_callbacks);
+                              &helper_restore_callbacks, 0);
         helper_stub_restore_results(store_mfn,console_mfn,genidad,0);
         complete(r);
 
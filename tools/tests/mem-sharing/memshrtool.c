@@ -20,6 +20,8 @@ static int usage(const char* prog)
     printf("  info                    - Display total sharing info.\n");
     printf("  enable                  - Enable sharing on a domain.\n");
     printf("  disable                 - Disable sharing on a domain.\n");
+    printf("  scan-enable <domid>     - Let Xen find and share identical pages.\n");
+    printf("  scan-disable <domid>    - Stop Xen scanning a domain.\n");
     printf("  nominate <domid> <gfn>  - Nominate a page for sharing.\n");
     printf("  share <domid> <gfn> <handle> <source> <source-gfn> <source-handle>\n");
     printf("                          - Share two pages.\n");
@@ -81,6 +83,26 @@ int main(int argc, const char** argv)
         domid = strtol(argv[2], NULL, 0);
         R(xc_memshr_control(xch, domid, 0));
     }
+    else if( !strcasecmp(cmd, "scan-enable") )
+    {
+        domid_t domid;
+
+        if( argc != 3 )
+            return usage(argv[0]);
+
+        domid = strtol(argv[2], NULL, 0);
+        R(xc_memshr_scan_control(xch, domid, 1));
+    }
+    else if( !strcasecmp(cmd, "scan-disable") )
+    {
+        domid_t domid;
+
+        if( argc != 3 )
+            return usage(argv[0]);
+
+        domid = strtol(argv[2], NULL, 0);
+        R(xc_memshr_scan_control(xch, domid, 0));
+    }
     else if( !strcasecmp(cmd, "nominate") )
     {
         domid_t domid;
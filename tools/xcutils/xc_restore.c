@@ -11,10 +11,84 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
+#include <xenstore.h>
 #include <xenctrl.h>
 #include <xenguest.h>
 
+/*
+ * Hand the rest of a post-copy domain's memory to xenpaging, which fetches
+ * it from the source on page_fd.  Returns once the guest may be unpaused.
+ */
+static int postcopy_start(unsigned int domid, int page_fd)
+{
+    struct xs_handle *xsh;
+    char path[80], pagefile[80], dom[16], fd[16];
+    char *state = NULL;
+    unsigned int len;
+    pid_t pid;
+    int status, ret = -1;
+
+    xsh = xs_daemon_open();
+    if ( !xsh )
+    {
+        warnx("failed to open xenstore");
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/local/domain/0/xenpaging/%u/postcopy",
+             domid);
+    xs_rm(xsh, XBT_NULL, path);
+
+    snprintf(pagefile, sizeof(pagefile), XEN_PAGING_DIR "/postcopy-%u",
+             domid);
+    snprintf(dom, sizeof(dom), "%u", domid);
+    snprintf(fd, sizeof(fd), "%d", page_fd);
+
+    pid = fork();
+    if ( pid < 0 )
+    {
+        warn("fork");
+        goto out;
+    }
+    if ( pid == 0 )
+    {
+        /* Outlive xc_restore: xenpaging runs until the copy is complete */
+        setsid();
+        execl(XENPAGING_PATH, "xenpaging", "-d", dom, "-f", pagefile,
+              "-p", fd, NULL);
+        _exit(127);
+    }
+
+    /* xenpaging reports "ready" once every missing gfn is paged out */
+    for ( ; ; )
+    {
+        state = xs_read(xsh, XBT_NULL, path, &len);
+        if ( state && !strcmp(state, "ready") )
+            break;
+        free(state);
+        state = NULL;
+
+        if ( waitpid(pid, &status, WNOHANG) == pid )
+        {
+            warnx("xenpaging for domain %u exited before post-copy began",
+                  domid);
+            goto out;
+        }
+        usleep(10000);
+    }
+    ret = 0;
+
+ out:
+    free(state);
+    xs_daemon_close(xsh);
+    return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -22,14 +96,16 @@ main(int argc, char **argv)
     unsigned int hvm, pae, apic, lflags;
     xc_interface *xch;
     int io_fd, ret;
-    int superpages;
+    int superpages, page_fd = -1;
+    unsigned int workers = 0;
     unsigned long store_mfn, console_mfn;
     xentoollog_level lvl;
     xentoollog_logger *l;
 
-    if ( (argc != 8) && (argc != 9) )
+    if ( (argc < 8) || (argc > 11) )
         errx(1, "usage: %s iofd domid store_evtchn "
-             "console_evtchn hvm pae apic [superpages]", argv[0]);
+             "console_evtchn hvm pae apic [superpages [workers [pagefd]]]",
+             argv[0]);
 
     lvl = XTL_DETAIL;
     lflags = XTL_STDIOSTREAM_SHOW_PID | XTL_STDIOSTREAM_HIDE_PROGRESS;
@@ -45,14 +121,25 @@ main(int argc, char **argv)
     hvm  = atoi(argv[5]);
     pae  = atoi(argv[6]);
     apic = atoi(argv[7]);
-    if ( argc == 9 )
+    if ( argc >= 9 )
 	    superpages = atoi(argv[8]);
     else
 	    superpages = !!hvm;
+    if ( argc >= 10 )
+        workers = atoi(argv[9]);
+    if ( argc == 11 )
+        page_fd = atoi(argv[10]);
+
+    /* Only HVM streams are ever saved post-copy */
+    if ( page_fd >= 0 && !hvm )
+        errx(1, "post-copy restore needs an HVM domain");
 
     ret = xc_domain_restore(xch, io_fd, domid, store_evtchn, &store_mfn, 0,
                             console_evtchn, &console_mfn, 0, hvm, pae, superpages,
-                            0, NULL, NULL);
+                            0, NULL, NULL, workers);
+
+    if ( ret == 0 && page_fd >= 0 && postcopy_start(domid, page_fd) )
+        ret = 1;
 
     if ( ret == 0 )
     {
@@ -166,20 +166,32 @@ static int switch_qemu_logdirty(int domid, unsigned int enable, void *data)
 int
 main(int argc, char **argv)
 {
-    unsigned int maxit, max_f, lflags;
-    int io_fd, ret, port;
+    unsigned int maxit, max_f, max_downtime = 0, lflags;
+    unsigned long delta_cache = 0;
+    int io_fd, page_fd = -1, ret, port;
     struct save_callbacks callbacks;
     xentoollog_level lvl;
     xentoollog_logger *l;
 
-    if (argc != 6)
-        errx(1, "usage: %s iofd domid maxit maxf flags", argv[0]);
+    if (argc < 6 || argc > 9)
+        errx(1, "usage: %s iofd domid maxit maxf flags "
+             "[maxdowntime [deltacache [pagefd]]]", argv[0]);
 
     io_fd = atoi(argv[1]);
     si.domid = atoi(argv[2]);
     maxit = atoi(argv[3]);
     max_f = atoi(argv[4]);
     si.flags = atoi(argv[5]);
+    if (argc >= 7)
+        max_downtime = atoi(argv[6]);
+    if (argc >= 8)
+        delta_cache = strtoul(argv[7], NULL, 0);
+    if (argc == 9)
+        page_fd = atoi(argv[8]);
+
+    /* Post-copy serves the guest's memory on pagefd after the save */
+    if ((si.flags & XCFLAGS_POSTCOPY) && page_fd < 0)
+        errx(1, "post-copy save needs a pagefd");
 
     si.suspend_evtchn = -1;
 
@@ -212,8 +224,12 @@ main(int argc, char **argv)
     memset(&callbacks, 0, sizeof(callbacks));
     callbacks.suspend = suspend;
     callbacks.switch_qemu_logdirty = switch_qemu_logdirty;
-    ret = xc_domain_save(si.xch, io_fd, si.domid, maxit, max_f, si.flags, 
-                         &callbacks, !!(si.flags & XCFLAGS_HVM), 0);
+    ret = xc_domain_save(si.xch, io_fd, si.domid, maxit, max_f, max_downtime,
+                         delta_cache, si.flags, &callbacks, !!(si.flags & XCFLAGS_HVM), 0);
+
+    if (ret == 0 && (si.flags & XCFLAGS_POSTCOPY) &&
+        xc_domain_postcopy_send(si.xch, page_fd, si.domid))
+        ret = 1;
 
     if (si.suspend_evtchn > 0)
 	 xc_suspend_evtchn_release(si.xch, si.xce, si.domid, si.suspend_evtchn);
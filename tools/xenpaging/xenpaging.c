@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <poll.h>
 #include <xc_private.h>
+#include <xenguest.h>
 #include <xenstore.h>
 #include <getopt.h>
 
@@ -45,6 +46,8 @@ static char watch_token[16];
 static char *filename;
 static int interrupted;
 
+static int xenpaging_postcopy_receive(struct xenpaging *paging);
+
 static void unlink_pagefile(void)
 {
     if ( filename && filename[0] )
@@ -71,13 +74,26 @@ static void xenpaging_mem_paging_flush_ioemu_cache(struct xenpaging *paging)
     xs_write(xsh, XBT_NULL, path, "flush-cache", strlen("flush-cache")); 
 }
 
+/* Let the toolstack know when the guest may run, and when it is complete */
+static void xenpaging_postcopy_state(struct xenpaging *paging, const char *state)
+{
+    struct xs_handle *xsh = paging->xs_handle;
+    domid_t domain_id = paging->mem_event.domain_id;
+    char path[80];
+
+    sprintf(path, "/local/domain/0/xenpaging/%u/postcopy", domain_id);
+
+    xs_write(xsh, XBT_NULL, path, state, strlen(state));
+}
+
 static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
 {
     xc_interface *xch = paging->xc_handle;
     xc_evtchn *xce = paging->mem_event.xce_handle;
     char **vec, *val;
     unsigned int num;
-    struct pollfd fd[2];
+    struct pollfd fd[3];
+    int nfds = 2;
     int port;
     int rc;
     int timeout;
@@ -88,9 +104,17 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
     fd[1].fd = xs_fileno(paging->xs_handle);
     fd[1].events = POLLIN | POLLERR;
 
+    /* And for pages from the post-copy source */
+    if ( paging->postcopy.fd >= 0 )
+    {
+        fd[2].fd = paging->postcopy.fd;
+        fd[2].events = POLLIN | POLLERR;
+        nfds = 3;
+    }
+
     /* No timeout while page-out is still in progress */
     timeout = paging->use_poll_timeout ? 100 : 0;
-    rc = poll(fd, 2, timeout);
+    rc = poll(fd, nfds, timeout);
     if ( rc < 0 )
     {
         if (errno == EINTR)
@@ -161,6 +185,15 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
             PERROR("Failed to unmask event channel port");
         }
     }
+
+    if ( rc && nfds > 2 && fd[2].revents & (POLLIN | POLLERR | POLLHUP) )
+    {
+        if ( xenpaging_postcopy_receive(paging) < 0 )
+        {
+            rc = -1;
+            goto err;
+        }
+    }
 err:
     return rc;
 }
@@ -210,6 +243,7 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -p <fd>        --postcopy=<fd>          fetch guest memory from a post-copy source on fd.\n");
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -217,13 +251,14 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvd:f:m:r:p:";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
         {"mru_size", 1, NULL, 'm'},
+        {"postcopy", 1, NULL, 'p'},
         { }
     };
 
@@ -243,6 +278,9 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'r':
             paging->policy_mru_size = atoi(optarg);
             break;
+        case 'p':
+            paging->postcopy.fd = atoi(optarg);
+            break;
         case 'v':
             paging->debug = 1;
             break;
@@ -287,6 +325,7 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
     paging = calloc(1, sizeof(struct xenpaging));
     if ( !paging )
         goto err;
+    paging->postcopy.fd = -1;
 
     /* Get cmdline options and domain_id */
     if ( xenpaging_getopts(paging, argc, argv) )
@@ -696,22 +735,13 @@ static int xenpaging_resume_page(struct xenpaging *paging, mem_event_response_t
     return xc_evtchn_notify(paging->mem_event.xce_handle, paging->mem_event.port);
 }
 
-static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn, int i)
+/* Hand the contents of paging_buffer to Xen as the new page for gfn */
+static int xenpaging_load_page(struct xenpaging *paging, unsigned long gfn)
 {
     xc_interface *xch = paging->xc_handle;
     int ret;
     unsigned char oom = 0;
 
-    DPRINTF("populate_page < gfn %lx pageslot %d\n", gfn, i);
-
-    /* Read page */
-    ret = read_page(paging->fd, paging->paging_buffer, i);
-    if ( ret != 0 )
-    {
-        PERROR("Error reading page");
-        goto out;
-    }
-
     do
     {
         /* Tell Xen to allocate a page for the domain */
@@ -725,13 +755,33 @@ static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn,
                 sleep(1);
                 continue;
             }
-            PERROR("Error loading %lx during page-in", gfn);
             ret = -1;
             break;
         }
     }
     while ( ret && !interrupted );
 
+    return ret;
+}
+
+static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn, int i)
+{
+    xc_interface *xch = paging->xc_handle;
+    int ret;
+
+    DPRINTF("populate_page < gfn %lx pageslot %d\n", gfn, i);
+
+    /* Read page */
+    ret = read_page(paging->fd, paging->paging_buffer, i);
+    if ( ret != 0 )
+    {
+        PERROR("Error reading page");
+        goto out;
+    }
+
+    ret = xenpaging_load_page(paging, gfn);
+    if ( ret < 0 )
+        PERROR("Error loading %lx during page-in", gfn);
 
  out:
     return ret;
@@ -853,6 +903,238 @@ static int evict_pages(struct xenpaging *paging, int num_pages)
     return num;
 }
 
+/* Take over the gfns still held by xc_domain_postcopy_send() on the source
+ * Returns < 0 on fatal error
+ * Returns 0 once the guest can be unpaused
+ */
+static int xenpaging_postcopy_init(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct postcopy *pc = &paging->postcopy;
+    uint64_t hdr[2];
+    unsigned long gfn, end, num = 0;
+
+    if ( read_exact(pc->fd, hdr, sizeof(hdr)) )
+    {
+        PERROR("Error reading post-copy header");
+        return -1;
+    }
+    if ( hdr[0] > ~XEN_DOMCTL_PFINFO_LTAB_MASK || hdr[1] > hdr[0] )
+    {
+        ERROR("Bad post-copy header: p2m_size %"PRIx64" pages %"PRIx64"\n",
+              hdr[0], hdr[1]);
+        return -1;
+    }
+    pc->p2m_size = hdr[0];
+    pc->nr_pending = hdr[1];
+
+    pc->pending = bitmap_alloc(pc->p2m_size);
+    pc->requested = bitmap_alloc(pc->p2m_size);
+    if ( !pc->pending || !pc->requested )
+    {
+        PERROR("Error allocating post-copy bitmaps");
+        return -1;
+    }
+    if ( read_exact(pc->fd, pc->pending, bitmap_size(pc->p2m_size)) )
+    {
+        PERROR("Error reading post-copy bitmap");
+        return -1;
+    }
+
+    /*
+     * Any access to these gfns now ends up on the ring.  This runs while
+     * the guest is down, so mark each run of pending gfns in one go.
+     */
+    for ( gfn = 0; gfn < pc->p2m_size; gfn = end )
+    {
+        if ( !test_bit(gfn, pc->pending) )
+        {
+            end = gfn + 1;
+            continue;
+        }
+
+        for ( end = gfn + 1; end < pc->p2m_size; end++ )
+            if ( !test_bit(end, pc->pending) )
+                break;
+
+        if ( xc_mem_paging_absent_range(xch, paging->mem_event.domain_id,
+                                        gfn, end - gfn) < 0 )
+        {
+            PERROR("Error marking gfns %lx-%lx absent", gfn, end - 1);
+            return -1;
+        }
+        num += end - gfn;
+    }
+    if ( num != pc->nr_pending )
+    {
+        ERROR("Post-copy bitmap has %lu gfns, expected %lu\n",
+              num, pc->nr_pending);
+        return -1;
+    }
+
+    DPRINTF("postcopy: %lu gfns on the source\n", pc->nr_pending);
+    xenpaging_postcopy_state(paging, "ready");
+
+    return 0;
+}
+
+/* Park a request for a gfn still on the source, and ask for it first */
+static int xenpaging_postcopy_fault(struct xenpaging *paging, mem_event_request_t *req)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct postcopy *pc = &paging->postcopy;
+    mem_event_request_t *waiting;
+    mem_event_response_t rsp;
+    uint64_t gfn = req->gfn;
+
+    /* The guest released the gfn, whatever arrives for it is discarded */
+    if ( req->flags & MEM_EVENT_FLAG_DROP_PAGE )
+    {
+        DPRINTF("postcopy: drop_page ^ gfn %"PRIx64"\n", gfn);
+        memset(&rsp, 0, sizeof(rsp));
+        rsp.gfn = req->gfn;
+        rsp.vcpu_id = req->vcpu_id;
+        rsp.flags = req->flags;
+        return xenpaging_resume_page(paging, &rsp, 0);
+    }
+
+    if ( !test_and_set_bit(gfn, pc->requested) &&
+         write_exact(pc->fd, &gfn, sizeof(gfn)) )
+    {
+        PERROR("Error requesting gfn %"PRIx64" from the source", gfn);
+        return -1;
+    }
+
+    if ( pc->nr_waiting == pc->max_waiting )
+    {
+        waiting = realloc(pc->waiting, (pc->max_waiting + XENPAGING_PAGEIN_QUEUE_SIZE) *
+                          sizeof(*waiting));
+        if ( !waiting )
+        {
+            PERROR("Error allocating post-copy wait list");
+            return -1;
+        }
+        pc->waiting = waiting;
+        pc->max_waiting += XENPAGING_PAGEIN_QUEUE_SIZE;
+    }
+    pc->waiting[pc->nr_waiting++] = *req;
+
+    return 0;
+}
+
+/* Complete the post-copy once the source has sent everything */
+static int xenpaging_postcopy_finish(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct postcopy *pc = &paging->postcopy;
+    uint64_t end = XC_POSTCOPY_END;
+
+    if ( pc->nr_pending || pc->nr_waiting )
+    {
+        ERROR("Post-copy source finished with %lu gfns, %u faults outstanding\n",
+              pc->nr_pending, pc->nr_waiting);
+        return -1;
+    }
+
+    if ( write_exact(pc->fd, &end, sizeof(end)) )
+    {
+        PERROR("Error acknowledging post-copy end");
+        return -1;
+    }
+
+    DPRINTF("postcopy: complete\n");
+    xenpaging_postcopy_state(paging, "done");
+
+    close(pc->fd);
+    pc->fd = -1;
+    free(pc->pending);
+    free(pc->requested);
+    free(pc->waiting);
+    pc->pending = pc->requested = NULL;
+    pc->waiting = NULL;
+
+    return 0;
+}
+
+/* Load pages sent by the source and resume the vcpus waiting on them
+ * Returns < 0 on fatal error
+ */
+static int xenpaging_postcopy_receive(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct postcopy *pc = &paging->postcopy;
+    mem_event_request_t *req;
+    mem_event_response_t rsp;
+    struct pollfd fd;
+    uint64_t gfn;
+    unsigned int i;
+    int num = 0;
+
+    do
+    {
+        if ( read_exact(pc->fd, &gfn, sizeof(gfn)) )
+        {
+            PERROR("Error reading from post-copy source");
+            return -1;
+        }
+
+        if ( gfn == XC_POSTCOPY_END )
+            return xenpaging_postcopy_finish(paging);
+
+        if ( gfn >= pc->p2m_size || !test_bit(gfn, pc->pending) )
+        {
+            ERROR("Unexpected gfn %"PRIx64" from post-copy source\n", gfn);
+            return -1;
+        }
+
+        if ( read_exact(pc->fd, paging->paging_buffer, PAGE_SIZE) )
+        {
+            PERROR("Error reading gfn %"PRIx64" from post-copy source", gfn);
+            return -1;
+        }
+
+        /* ENOENT: the guest dropped the gfn while it was in flight */
+        if ( xenpaging_load_page(paging, gfn) < 0 && errno != ENOENT )
+        {
+            PERROR("Error loading %"PRIx64" during post-copy", gfn);
+            return -1;
+        }
+
+        clear_bit(gfn, pc->pending);
+        clear_bit(gfn, pc->requested);
+        pc->nr_pending--;
+
+        for ( i = 0; i < pc->nr_waiting; )
+        {
+            req = &pc->waiting[i];
+            if ( req->gfn != gfn )
+            {
+                i++;
+                continue;
+            }
+
+            memset(&rsp, 0, sizeof(rsp));
+            rsp.gfn = req->gfn;
+            rsp.vcpu_id = req->vcpu_id;
+            rsp.flags = req->flags;
+            if ( xenpaging_resume_page(paging, &rsp, 0) < 0 )
+            {
+                PERROR("Error resuming page %"PRIx64"", gfn);
+                return -1;
+            }
+
+            *req = pc->waiting[--pc->nr_waiting];
+        }
+
+        /* Keep going while the source has more queued up */
+        fd.fd = pc->fd;
+        fd.events = POLLIN;
+    }
+    while ( ++num < XENPAGING_PAGEIN_QUEUE_SIZE && poll(&fd, 1, 0) > 0 );
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     struct sigaction act;
@@ -885,6 +1167,11 @@ int main(int argc, char *argv[])
     sigaction(SIGINT,  &act, NULL);
     sigaction(SIGALRM, &act, NULL);
 
+    /* Mark the gfns left on a post-copy source before the guest runs */
+    rc = 1;
+    if ( paging->postcopy.fd >= 0 && xenpaging_postcopy_init(paging) < 0 )
+        goto out;
+
     /* listen for page-in events to stop pager */
     create_page_in_thread(paging);
 
@@ -910,14 +1197,33 @@ int main(int argc, char *argv[])
 
             get_request(&paging->mem_event, &req);
 
-            if ( req.gfn > paging->max_pages )
+            /*
+             * Post-copy gfns may lie beyond max_pages, check them first.
+             * One that has arrived meanwhile, e.g. when several vcpus
+             * faulted on it, is resumed below as already populated.
+             */
+            if ( req.gfn < paging->postcopy.p2m_size )
+            {
+                if ( paging->postcopy.pending &&
+                     test_bit(req.gfn, paging->postcopy.pending) )
+                {
+                    if ( xenpaging_postcopy_fault(paging, &req) < 0 )
+                    {
+                        ERROR("Error handling post-copy gfn %"PRIx64"", req.gfn);
+                        goto out;
+                    }
+                    continue;
+                }
+            }
+            else if ( req.gfn > paging->max_pages )
             {
                 ERROR("Requested gfn %"PRIx64" higher than max_pages %lx\n", req.gfn, paging->max_pages);
                 goto out;
             }
 
             /* Check if the page has already been paged in */
-            if ( test_and_clear_bit(req.gfn, paging->bitmap) )
+            if ( req.gfn <= paging->max_pages &&
+                 test_and_clear_bit(req.gfn, paging->bitmap) )
             {
                 /* Find where in the paging file to read from */
                 slot = paging->gfn_to_slot[req.gfn];
@@ -992,7 +1298,7 @@ int main(int argc, char *argv[])
         if ( interrupted == SIGTERM || interrupted == SIGINT )
         {
             /* If no more pages to process, exit loop. */
-            if ( !paging->num_paged_out )
+            if ( !paging->num_paged_out && paging->postcopy.fd < 0 )
                 break;
             
             /* One more round if there are still pages to process. */
@@ -1063,6 +1369,9 @@ int main(int argc, char *argv[])
     DPRINTF("xenpaging got signal %d\n", interrupted);
 
  out:
+    if ( paging->postcopy.fd >= 0 )
+        xenpaging_postcopy_state(paging, "failed");
+
     close(paging->fd);
     unlink_pagefile();
 
@@ -40,6 +40,18 @@ struct mem_event {
     void *ring_page;
 };
 
+/* Post-copy migration: guest memory still on the source host */
+struct postcopy {
+    int fd;                         /* channel to the source, or -1 */
+    unsigned long p2m_size;
+    unsigned long *pending;         /* gfns not received yet */
+    unsigned long *requested;       /* gfns asked for out of order */
+    unsigned long nr_pending;
+    mem_event_request_t *waiting;   /* faults parked until the gfn arrives */
+    unsigned int nr_waiting;
+    unsigned int max_waiting;
+};
+
 struct xenpaging {
     xc_interface *xc_handle;
     struct xs_handle *xs_handle;
@@ -63,6 +75,7 @@ struct xenpaging {
     int stack_count;
     int *free_slot_stack;
     unsigned long pagein_queue[XENPAGING_PAGEIN_QUEUE_SIZE];
+    struct postcopy postcopy;
 };
 
 extern void create_page_in_thread(struct xenpaging *paging);
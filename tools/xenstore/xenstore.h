@@ -197,6 +197,26 @@ xs_transaction_t xs_transaction_start(struct xs_handle *h);
 bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t,
 			bool abort);
 
+/* One operation of a batch: type is XS_WRITE (path, data, len), XS_MKDIR
+ * or XS_RM (path), or XS_SET_PERMS (path, perms, num_perms).
+ */
+struct xs_batch_op {
+	enum xsd_sockmsg_type type;
+	const char *path;
+	const void *data;
+	unsigned int len;
+	struct xs_permissions *perms;
+	unsigned int num_perms;
+};
+
+/* Apply a list of operations in as few round trips as possible.
+ * Outside a transaction (t == XBT_NULL) they are applied atomically: all
+ * or none.  Within one, they become part of it.
+ * Returns false on failure, with errno from the first failing operation.
+ */
+bool xs_batch(struct xs_handle *h, xs_transaction_t t,
+	      const struct xs_batch_op *ops, unsigned int num_ops);
+
 /* Introduce a new domain.
  * This tells the store daemon about a shared memory page, event channel and
  * store path associated with a domain: the domain uses these to communicate.
@@ -9,14 +9,17 @@ int main(int argc, char **argv)
 {
   struct xs_handle * xsh;
 
+  char *ret;
+
   if (argc < 2 ||
-      strcmp(argv[1], "check"))
+      (strcmp(argv[1], "check") && strcmp(argv[1], "watches")))
   {
     fprintf(stderr,
             "Usage:\n"
             "\n"
             "       %s check\n"
-            "\n", argv[0]);
+            "       %s watches\n"
+            "\n", argv[0], argv[0]);
     return 2;
   }
 
@@ -27,7 +30,10 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  xs_debug_command(xsh, argv[1], NULL, 0);
+  ret = xs_debug_command(xsh, argv[1], NULL, 0);
+  if (ret && !strcmp(argv[1], "watches"))
+    fputs(ret, stdout);
+  free(ret);
 
   xs_daemon_close(xsh);
 
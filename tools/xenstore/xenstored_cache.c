@@ -0,0 +1,375 @@
+/*
+    In-memory node cache for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * The cache holds every record of the store, indexed by node name.  All
+ * reads are served from it; the tdb is only written, in batches, from the
+ * main loop when it has nothing else to do (or too much is pending).
+ * Deleted records stay in the cache as tombstones until written back.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "utils.h"
+#include "talloc.h"
+#include "list.h"
+#include "hashtable.h"
+#include "xenstore_lib.h"
+#include "xenstored_core.h"
+#include "xenstored_cache.h"
+
+struct cache_entry
+{
+	/* All entries, in insertion order, for traversal. */
+	struct list_head list;
+
+	/* Entries to write back; empty if clean. */
+	struct list_head dirty;
+
+	/* Entries with a staged update; empty if none. */
+	struct list_head stage;
+
+	char *name;
+
+	/* The record: NULL dptr means deleted. */
+	TDB_DATA data;
+
+	/* Staged update, installed by cache_commit_staged(). */
+	TDB_DATA staged;
+
+	/* The last write back failed (and was logged). */
+	bool failed;
+};
+
+static TDB_CONTEXT *cache_tdb;
+static struct hashtable *cache_index;
+static LIST_HEAD(cache_entries);
+static LIST_HEAD(cache_dirty_list);
+static LIST_HEAD(cache_staged_list);
+static unsigned int cache_nr_dirty;
+static void *cache_ctx;
+
+static struct cache_entry *cache_find(const char *name)
+{
+	return hashtable_search(cache_index, (void *)name);
+}
+
+static struct cache_entry *cache_new(const char *name)
+{
+	struct cache_entry *e;
+	char *key;
+
+	e = talloc_zero(cache_ctx, struct cache_entry);
+	if (!e)
+		return NULL;
+	e->name = talloc_strdup(e, name);
+	/* The hashtable owns (and free()s) its keys. */
+	key = strdup(name);
+	if (!e->name || !key || !hashtable_insert(cache_index, key, e)) {
+		free(key);
+		talloc_free(e);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&e->dirty);
+	INIT_LIST_HEAD(&e->stage);
+	list_add_tail(&e->list, &cache_entries);
+	return e;
+}
+
+static void cache_remove(struct cache_entry *e)
+{
+	hashtable_remove(cache_index, e->name);
+	list_del(&e->list);
+	if (!list_empty(&e->dirty)) {
+		list_del(&e->dirty);
+		cache_nr_dirty--;
+	}
+	talloc_free(e);
+}
+
+static void cache_mark_dirty(struct cache_entry *e)
+{
+	if (!list_empty(&e->dirty))
+		return;
+	list_add_tail(&e->dirty, &cache_dirty_list);
+	cache_nr_dirty++;
+}
+
+static int cache_load(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+		      void *private)
+{
+	struct cache_entry *e;
+	char *name;
+
+	name = talloc_strndup(NULL, (char *)key.dptr, key.dsize);
+	if (!name)
+		barf_perror("Could not load store");
+
+	e = cache_new(name);
+	if (!e)
+		barf_perror("Could not cache %s", name);
+	e->data.dptr = talloc_memdup(e, val.dptr, val.dsize);
+	if (!e->data.dptr)
+		barf_perror("Could not cache %s", name);
+	e->data.dsize = val.dsize;
+
+	talloc_free(name);
+	return 0;
+}
+
+void cache_init(TDB_CONTEXT *tdb)
+{
+	cache_ctx = talloc_named_const(talloc_autofree_context(), 0,
+				       "node cache");
+	cache_index = create_hashtable(1024, hash_from_key_fn, keys_equal_fn);
+	if (!cache_ctx || !cache_index)
+		barf_perror("Could not create node cache");
+
+	cache_tdb = tdb;
+	if (cache_tdb)
+		tdb_traverse(cache_tdb, cache_load, NULL);
+}
+
+TDB_DATA cache_fetch(const char *name)
+{
+	struct cache_entry *e;
+	TDB_DATA data = { NULL, 0 };
+
+	e = cache_find(name);
+	if (!e || !e->data.dptr) {
+		errno = ENOENT;
+		return data;
+	}
+
+	data.dptr = talloc_memdup(NULL, e->data.dptr, e->data.dsize);
+	if (!data.dptr) {
+		errno = ENOMEM;
+		return data;
+	}
+	data.dsize = e->data.dsize;
+	return data;
+}
+
+bool cache_generation(const char *name, uint64_t *generation)
+{
+	struct cache_entry *e;
+
+	e = cache_find(name);
+	if (!e || !e->data.dptr)
+		return false;
+
+	*generation = ((struct xs_tdb_record_hdr *)e->data.dptr)->generation;
+	return true;
+}
+
+bool cache_store(const char *name, TDB_DATA data)
+{
+	struct cache_entry *e;
+	void *copy;
+
+	e = cache_find(name);
+	if (!e) {
+		e = cache_new(name);
+		if (!e)
+			return false;
+	}
+
+	copy = talloc_memdup(e, data.dptr, data.dsize);
+	if (!copy) {
+		if (!e->data.dptr && list_empty(&e->dirty))
+			cache_remove(e);
+		return false;
+	}
+
+	talloc_free(e->data.dptr);
+	e->data.dptr = copy;
+	e->data.dsize = data.dsize;
+
+	if (cache_tdb)
+		cache_mark_dirty(e);
+	return true;
+}
+
+static void cache_remove_record(struct cache_entry *e)
+{
+	if (!cache_tdb) {
+		cache_remove(e);
+		return;
+	}
+
+	talloc_free(e->data.dptr);
+	e->data.dptr = NULL;
+	e->data.dsize = 0;
+	cache_mark_dirty(e);
+}
+
+bool cache_delete(const char *name)
+{
+	struct cache_entry *e;
+
+	e = cache_find(name);
+	if (e)
+		cache_remove_record(e);
+	return true;
+}
+
+bool cache_stage(const char *name, TDB_DATA data)
+{
+	struct cache_entry *e;
+	void *copy = NULL;
+
+	e = cache_find(name);
+	if (!e) {
+		if (!data.dptr)
+			return true;
+		e = cache_new(name);
+		if (!e)
+			return false;
+	}
+
+	if (data.dptr) {
+		copy = talloc_memdup(e, data.dptr, data.dsize);
+		if (!copy) {
+			if (!e->data.dptr && list_empty(&e->dirty) &&
+			    list_empty(&e->stage))
+				cache_remove(e);
+			return false;
+		}
+	}
+
+	talloc_free(e->staged.dptr);
+	e->staged.dptr = copy;
+	e->staged.dsize = data.dsize;
+	if (list_empty(&e->stage))
+		list_add_tail(&e->stage, &cache_staged_list);
+	return true;
+}
+
+void cache_commit_staged(void)
+{
+	struct cache_entry *e, *next;
+
+	list_for_each_entry_safe(e, next, &cache_staged_list, stage) {
+		list_del_init(&e->stage);
+
+		if (!e->staged.dptr) {
+			cache_remove_record(e);
+			continue;
+		}
+
+		talloc_free(e->data.dptr);
+		e->data = e->staged;
+		e->staged.dptr = NULL;
+		e->staged.dsize = 0;
+		if (cache_tdb)
+			cache_mark_dirty(e);
+	}
+}
+
+void cache_abort_staged(void)
+{
+	struct cache_entry *e, *next;
+
+	list_for_each_entry_safe(e, next, &cache_staged_list, stage) {
+		list_del_init(&e->stage);
+		talloc_free(e->staged.dptr);
+		e->staged.dptr = NULL;
+		e->staged.dsize = 0;
+
+		/* Drop entries that only existed for the staged record. */
+		if (!e->data.dptr && list_empty(&e->dirty))
+			cache_remove(e);
+	}
+}
+
+void cache_traverse(cache_traverse_fn *fn, void *priv)
+{
+	struct cache_entry *e, *next;
+
+	list_for_each_entry_safe(e, next, &cache_entries, list) {
+		if (e->data.dptr)
+			fn(e->name, e->data, priv);
+	}
+}
+
+unsigned int cache_dirty(void)
+{
+	return cache_nr_dirty;
+}
+
+/* Write one dirty record back; true if the tdb has it now. */
+static bool cache_write_back(struct cache_entry *e)
+{
+	TDB_DATA key;
+
+	key.dptr = (void *)e->name;
+	key.dsize = strlen(e->name);
+
+	if (e->data.dptr)
+		return tdb_store(cache_tdb, key, e->data, TDB_REPLACE) == 0;
+
+	return tdb_delete(cache_tdb, key) == 0 ||
+	       tdb_error(cache_tdb) == TDB_ERR_NOEXIST;
+}
+
+bool cache_flush(void)
+{
+	struct cache_entry *e;
+	LIST_HEAD(failed);
+
+	while (!list_empty(&cache_dirty_list)) {
+		e = list_entry(cache_dirty_list.next, struct cache_entry,
+			       dirty);
+
+		/* Keep what could not be written dirty, to retry later. */
+		if (!cache_write_back(e)) {
+			if (!e->failed)
+				syslog(LOG_ERR, "Write back of %s%s failed: %s",
+				       e->data.dptr ? "" : "rm ", e->name,
+				       tdb_errorstr(cache_tdb));
+			e->failed = true;
+			list_move_tail(&e->dirty, &failed);
+			continue;
+		}
+
+		e->failed = false;
+		list_del_init(&e->dirty);
+		cache_nr_dirty--;
+		if (!e->data.dptr)
+			cache_remove(e);
+	}
+
+	list_splice(&failed, &cache_dirty_list);
+	return cache_nr_dirty == 0;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
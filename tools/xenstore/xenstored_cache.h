@@ -0,0 +1,58 @@
+/*
+    In-memory node cache for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_CACHE_H
+#define _XENSTORED_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "tdb.h"
+
+/* Write back once this many records are dirty, even if busy. */
+#define CACHE_FLUSH_BATCH 256
+
+/* Load every record of tdb into the cache.  tdb may be NULL: memory only. */
+void cache_init(TDB_CONTEXT *tdb);
+
+/* Copy of a node's record, talloc'ed off NULL.  Sets errno on failure. */
+TDB_DATA cache_fetch(const char *name);
+
+/* Generation of a node's record: false if there is none. */
+bool cache_generation(const char *name, uint64_t *generation);
+
+bool cache_store(const char *name, TDB_DATA data);
+bool cache_delete(const char *name);
+
+/* Updates that must land together: cache_stage() does everything that can
+ * fail (a NULL dptr stages a delete), without changing what is visible.
+ * cache_commit_staged() then installs all staged updates and cannot fail;
+ * cache_abort_staged() drops them. */
+bool cache_stage(const char *name, TDB_DATA data);
+void cache_commit_staged(void);
+void cache_abort_staged(void);
+
+/* Call fn on each record: fn may delete the record it is given. */
+typedef void cache_traverse_fn(const char *name, TDB_DATA data, void *priv);
+void cache_traverse(cache_traverse_fn *fn, void *priv);
+
+/* Number of records not yet written back, and write them back.  Records
+ * the tdb refuses stay dirty for the next flush: false if any are left. */
+unsigned int cache_dirty(void);
+bool cache_flush(void);
+
+#endif /* _XENSTORED_CACHE_H */
@@ -49,15 +49,23 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
+#include "xenstored_cache.h"
 #include "xenctrl.h"
 #include "tdb.h"
 
 #include "hashtable.h"
 
+#if defined(__linux__) && !defined(__MINIOS__)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
 extern xc_evtchn *xce_handle; /* in xenstored_domain.c */
 
 static bool verbose = false;
 LIST_HEAD(connections);
+/* Connections the main loop should service without waiting. */
+static LIST_HEAD(ready_conns);
 static int tracefd = -1;
 static bool recovery = true;
 static bool remove_local = true;
@@ -65,7 +73,6 @@ static int reopen_log_pipe[2];
 static char *tracefile = NULL;
 static TDB_CONTEXT *tdb_ctx = NULL;
 
-static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 
 #define log(...)							\
@@ -82,22 +89,10 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+/* conn = NULL used in manual_node at setup. */
+static struct transaction *conn_transaction(struct connection *conn)
 {
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
+	return conn ? conn->transaction : NULL;
 }
 
 static char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -124,6 +119,7 @@ static char *sockmsg_string(enum xsd_sockmsg_type type)
 	case XS_RESUME: return "RESUME";
 	case XS_SET_TARGET: return "SET_TARGET";
 	case XS_RESET_WATCHES: return "RESET_WATCHES";
+	case XS_BATCH: return "BATCH";
 	default:
 		return "**UNKNOWN**";
 	}
@@ -199,7 +195,7 @@ void trace_destroy(const void *data, const char *type)
 /**
  * Signal handler for SIGHUP, which requests that the trace log is reopened
  * (in the main loop).  A single byte is written to reopen_log_pipe, to awaken
- * the select() in the main loop.
+ * the main loop.
  */
 static void trigger_reopen_log(int signal __attribute__((unused)))
 {
@@ -224,6 +220,100 @@ static void reopen_log(void)
 	}
 }
 
+void conn_mark_ready(struct connection *conn)
+{
+	if (list_empty(&conn->ready_list))
+		list_add_tail(&conn->ready_list, &ready_conns);
+}
+
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+
+/* Socket connections indexed by fd, to map epoll events back. */
+static struct connection **fd_conns;
+static unsigned int nr_fd_conns;
+
+static void poll_init(void)
+{
+	epoll_fd = epoll_create(64);
+	if (epoll_fd < 0)
+		barf_perror("Could not create epoll fd");
+}
+
+/*
+ * Connections are edge-triggered: the main loop remembers readiness in
+ * conn->pollin/pollout until a read or write returns EAGAIN.  The
+ * listening sockets, the log pipe and the event channel (conn == NULL)
+ * are level-triggered.
+ */
+static int poll_add(int fd, struct connection *conn)
+{
+	struct epoll_event ev;
+	struct connection **conns;
+	unsigned int nr;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	ev.events = EPOLLIN;
+
+	if (conn) {
+		if (fd >= nr_fd_conns) {
+			nr = fd + 64;
+			conns = talloc_realloc(talloc_autofree_context(),
+					       fd_conns, struct connection *,
+					       nr);
+			if (!conns)
+				return -1;
+			memset(conns + nr_fd_conns, 0,
+			       (nr - nr_fd_conns) * sizeof(*conns));
+			fd_conns = conns;
+			nr_fd_conns = nr;
+		}
+		fd_conns[fd] = conn;
+		ev.events |= EPOLLOUT | EPOLLET;
+	}
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		if (conn)
+			fd_conns[fd] = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void poll_del(int fd)
+{
+	if (fd < 0)
+		return;
+	if (fd < nr_fd_conns)
+		fd_conns[fd] = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+#else
+static void poll_init(void)
+{
+}
+
+static int poll_add(int fd, struct connection *conn)
+{
+	return 0;
+}
+
+static void poll_del(int fd)
+{
+}
+
+static void set_fd(int fd, fd_set *set, int *max)
+{
+	if (fd < 0)
+		return;
+	FD_SET(fd, set);
+	if (fd > *max)
+		*max = fd;
+}
+#endif
+
 static bool write_messages(struct connection *conn)
 {
 	int ret;
@@ -279,75 +369,21 @@ static int destroy_conn(void *_conn)
 
 	/* Flush outgoing if possible, but don't block. */
 	if (!conn->domain) {
-		fd_set set;
-		struct timeval none;
-
-		FD_ZERO(&set);
-		FD_SET(conn->fd, &set);
-		none.tv_sec = none.tv_usec = 0;
-
-		while (!list_empty(&conn->out_list)
-		       && select(conn->fd+1, NULL, &set, NULL, &none) == 1)
+		while (!list_empty(&conn->out_list) && conn->pollout)
 			if (!write_messages(conn))
 				break;
+		poll_del(conn->fd);
 		close(conn->fd);
 	}
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
+	list_del(&conn->ready_list);
 	trace_destroy(conn, "connection");
 	return 0;
 }
 
 
-static void set_fd(int fd, fd_set *set, int *max)
-{
-	if (fd < 0)
-		return;
-	FD_SET(fd, set);
-	if (fd > *max)
-		*max = fd;
-}
-
-
-static int initialize_set(fd_set *inset, fd_set *outset, int sock, int ro_sock,
-			  struct timeval **ptimeout)
-{
-	static struct timeval zero_timeout = { 0 };
-	struct connection *conn;
-	int max = -1;
-
-	*ptimeout = NULL;
-
-	FD_ZERO(inset);
-	FD_ZERO(outset);
-
-	if (sock != -1)
-		set_fd(sock, inset, &max);
-	if (ro_sock != -1)
-		set_fd(ro_sock, inset, &max);
-	if (reopen_log_pipe[0] != -1)
-		set_fd(reopen_log_pipe[0], inset, &max);
-
-	if (xce_handle != NULL)
-		set_fd(xc_evtchn_fd(xce_handle), inset, &max);
-
-	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = &zero_timeout;
-		} else {
-			set_fd(conn->fd, inset, &max);
-			if (!list_empty(&conn->out_list))
-				FD_SET(conn->fd, outset);
-		}
-	}
-
-	return max;
-}
-
 /* Is child a subnode of parent, or equal? */
 bool is_child(const char *child, const char *parent)
 {
@@ -368,38 +404,29 @@ bool is_child(const char *child, const char *parent)
 static struct node *read_node(struct connection *conn, const char *name)
 {
 	TDB_DATA key, data;
-	uint32_t *p;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
 
 	key.dptr = (void *)name;
 	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
-
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
+	data = transaction_fetch(conn_transaction(conn), key);
+	if (data.dptr == NULL)
 		return NULL;
-	}
 
 	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	talloc_steal(node, data.dptr);
 
 	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	hdr = (void *)data.dptr;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
 	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
@@ -412,16 +439,17 @@ static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * conn_transaction copes with this.
 	 */
 
 	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
 	void *p;
 
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	data.dsize = 3*sizeof(uint32_t)
+	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
@@ -429,10 +457,12 @@ static bool write_node(struct connection *conn, const struct node *node)
 		goto error;
 
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	hdr->generation = 0; /* stamped when it reaches the store */
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -441,7 +471,7 @@ static bool write_node(struct connection *conn, const struct node *node)
 	memcpy(p, node->children, node->childlen);
 
 	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
+	if (!transaction_store(conn_transaction(conn), key, data)) {
 		corrupt(conn, "Write of %s failed", key.dptr);
 		goto error;
 	}
@@ -599,6 +629,10 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 {
 	struct buffered_data *bdata;
 
+	/* Operations inside a batch are answered by the batch. */
+	if (conn->in_batch && type != XS_WATCH_EVENT)
+		return;
+
 	/* Message is a child of the connection context for auto-cleanup. */
 	bdata = new_buffer(conn);
 	bdata->buffer = talloc_array(bdata, char, len);
@@ -618,6 +652,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	conn_mark_ready(conn);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -630,6 +665,12 @@ void send_error(struct connection *conn, int error)
 {
 	unsigned int i;
 
+	if (conn->in_batch) {
+		if (!conn->batch_error)
+			conn->batch_error = error;
+		return;
+	}
+
 	for (i = 0; error != xsd_errors[i].errnum; i++) {
 		if (i == ARRAY_SIZE(xsd_errors) - 1) {
 			eprintf("xenstored: error %i untranslatable", error);
@@ -756,7 +797,7 @@ static void delete_node_single(struct connection *conn, struct node *node)
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	if (!transaction_delete(conn_transaction(conn), key)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -797,7 +838,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -826,7 +867,7 @@ static int destroy_node(void *_node)
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	tdb_delete(node->tdb, key);
+	transaction_delete(node->trans, key);
 	return 0;
 }
 
@@ -1127,6 +1168,95 @@ static void do_set_perms(struct connection *conn, struct buffered_data *in)
 	send_ack(conn, XS_SET_PERMS);
 }
 
+/*
+ * Each operation in a batch is a struct xsd_sockmsg (only type and len
+ * are used) followed by its payload.  Outside a transaction the batch
+ * runs in one of its own, so it is applied all or nothing; inside one it
+ * simply becomes part of it.  The reply is the first error, or an ack.
+ */
+static void do_batch(struct connection *conn, struct buffered_data *in)
+{
+	struct transaction *trans = NULL;
+	struct buffered_data *op;
+	struct xsd_sockmsg hdr;
+	unsigned int off = 0;
+	int err = 0;
+
+	if (!conn->transaction) {
+		trans = transaction_create(in);
+		if (!trans) {
+			send_error(conn, ENOMEM);
+			return;
+		}
+		conn->transaction = trans;
+	}
+
+	conn->in_batch = true;
+	conn->batch_error = 0;
+
+	while (!err && off < in->used) {
+		if (in->used - off < sizeof(hdr)) {
+			err = EINVAL;
+			break;
+		}
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		off += sizeof(hdr);
+		if (hdr.len > in->used - off) {
+			err = EINVAL;
+			break;
+		}
+
+		op = new_buffer(in);
+		if (op)
+			op->buffer = talloc_memdup(op, in->buffer + off,
+						   hdr.len);
+		if (!op || !op->buffer) {
+			err = ENOMEM;
+			break;
+		}
+		op->hdr.msg = hdr;
+		op->used = hdr.len;
+		op->inhdr = false;
+		off += hdr.len;
+
+		switch (hdr.type) {
+		case XS_WRITE:
+			do_write(conn, op);
+			break;
+		case XS_MKDIR:
+			do_mkdir(conn, onearg(op));
+			break;
+		case XS_RM:
+			do_rm(conn, onearg(op));
+			break;
+		case XS_SET_PERMS:
+			do_set_perms(conn, op);
+			break;
+		default:
+			err = EINVAL;
+			break;
+		}
+
+		talloc_free(op);
+		if (conn->batch_error)
+			err = conn->batch_error;
+	}
+
+	conn->in_batch = false;
+
+	if (trans) {
+		conn->transaction = NULL;
+		if (!err)
+			err = transaction_commit(conn, trans);
+		talloc_free(trans);
+	}
+
+	if (err)
+		send_error(conn, err);
+	else
+		send_ack(conn, XS_BATCH);
+}
+
 static void do_debug(struct connection *conn, struct buffered_data *in)
 {
 	int num;
@@ -1149,6 +1279,11 @@ static void do_debug(struct connection *conn, struct buffered_data *in)
 	if (streq(in->buffer, "check"))
 		check_store();
 
+	if (streq(in->buffer, "watches")) {
+		dump_watches(conn);
+		return;
+	}
+
 	send_ack(conn, XS_DEBUG);
 }
 
@@ -1245,6 +1380,10 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 		do_reset_watches(conn);
 		break;
 
+	case XS_BATCH:
+		do_batch(conn, in);
+		break;
+
 	default:
 		eprintf("Client unknown operation %i", in->hdr.msg.type);
 		send_error(conn, ENOSYS);
@@ -1334,6 +1473,7 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 	new->read = read;
 	new->can_write = true;
 	new->transaction_started = 0;
+	INIT_LIST_HEAD(&new->ready_list);
 	INIT_LIST_HEAD(&new->out_list);
 	INIT_LIST_HEAD(&new->watches);
 	INIT_LIST_HEAD(&new->transaction_list);
@@ -1361,6 +1501,7 @@ static int writefd(struct connection *conn, const void *data, unsigned int len)
 
 	while ((rc = write(conn->fd, data, len)) < 0) {
 		if (errno == EAGAIN) {
+			conn->pollout = false;
 			rc = 0;
 			break;
 		}
@@ -1377,8 +1518,8 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 
 	while ((rc = read(conn->fd, data, len)) < 0) {
 		if (errno == EAGAIN) {
-			rc = 0;
-			break;
+			conn->pollin = false;
+			return 0;
 		}
 		if (errno != EINTR)
 			break;
@@ -1395,22 +1536,199 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 
 static void accept_connection(int sock, bool canwrite)
 {
-	int fd;
+	int fd, flags;
 	struct connection *conn;
 
 	fd = accept(sock, NULL, NULL);
 	if (fd < 0)
 		return;
 
+	/* Readiness is tracked until EAGAIN, so never block on a client. */
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		close(fd);
+		return;
+	}
+
 	conn = new_connection(writefd, readfd);
 	if (conn) {
 		conn->fd = fd;
 		conn->can_write = canwrite;
+		conn->pollout = true;
+		if (poll_add(fd, conn) != 0)
+			talloc_free(conn);
 	} else
 		close(fd);
 }
 #endif
 
+/* Messages read from one connection before the others get a turn. */
+#define CONN_BATCH 16
+
+static bool conn_can_read(struct connection *conn)
+{
+	if (conn->domain)
+		return domain_can_read(conn);
+	return conn->pollin;
+}
+
+static bool conn_can_write(struct connection *conn)
+{
+	if (list_empty(&conn->out_list))
+		return false;
+	if (conn->domain)
+		return domain_can_write(conn);
+	return conn->pollout;
+}
+
+static void handle_reopen_log(void)
+{
+	char c;
+
+	if (read(reopen_log_pipe[0], &c, 1) != 1)
+		barf_perror("read failed");
+	reopen_log();
+}
+
+#ifdef USE_EPOLL
+static void wait_for_events(int sock, int ro_sock, int evtchn_fd)
+{
+	struct epoll_event events[64];
+	struct connection *conn;
+	int i, n, fd;
+
+	n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events),
+		       list_empty(&ready_conns) ? -1 : 0);
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		barf_perror("epoll_wait failed");
+	}
+
+	for (i = 0; i < n; i++) {
+		fd = events[i].data.fd;
+
+		if (fd == reopen_log_pipe[0])
+			handle_reopen_log();
+		else if (fd == sock)
+			accept_connection(sock, true);
+		else if (fd == ro_sock)
+			accept_connection(ro_sock, false);
+		else if (fd == evtchn_fd)
+			handle_event();
+		else if (fd < nr_fd_conns && (conn = fd_conns[fd])) {
+			/* Errors and hangups show up when we next read. */
+			if (events[i].events & ~EPOLLOUT)
+				conn->pollin = true;
+			if (events[i].events & EPOLLOUT)
+				conn->pollout = true;
+			conn_mark_ready(conn);
+		}
+	}
+}
+#else
+static void wait_for_events(int sock, int ro_sock, int evtchn_fd)
+{
+	static struct timeval zero_timeout = { 0 };
+	fd_set inset, outset;
+	struct connection *conn;
+	int max = -1;
+
+	FD_ZERO(&inset);
+	FD_ZERO(&outset);
+
+	set_fd(sock, &inset, &max);
+	set_fd(ro_sock, &inset, &max);
+	set_fd(reopen_log_pipe[0], &inset, &max);
+	set_fd(evtchn_fd, &inset, &max);
+
+	list_for_each_entry(conn, &connections, list) {
+		if (conn->domain)
+			continue;
+		set_fd(conn->fd, &inset, &max);
+		if (!list_empty(&conn->out_list))
+			set_fd(conn->fd, &outset, &max);
+	}
+
+	if (select(max+1, &inset, &outset, NULL,
+		   list_empty(&ready_conns) ? NULL : &zero_timeout) < 0) {
+		if (errno == EINTR)
+			return;
+		barf_perror("Select failed");
+	}
+
+	list_for_each_entry(conn, &connections, list) {
+		if (conn->domain || conn->fd < 0)
+			continue;
+		if (FD_ISSET(conn->fd, &inset))
+			conn->pollin = true;
+		if (FD_ISSET(conn->fd, &outset))
+			conn->pollout = true;
+		if (conn->pollin || conn->pollout)
+			conn_mark_ready(conn);
+	}
+
+	if (reopen_log_pipe[0] != -1 && FD_ISSET(reopen_log_pipe[0], &inset))
+		handle_reopen_log();
+
+	if (sock != -1 && FD_ISSET(sock, &inset))
+		accept_connection(sock, true);
+
+	if (ro_sock != -1 && FD_ISSET(ro_sock, &inset))
+		accept_connection(ro_sock, false);
+
+	if (evtchn_fd != -1 && FD_ISSET(evtchn_fd, &inset))
+		handle_event();
+}
+#endif
+
+/*
+ * Give one connection a bounded turn.  Anything left over (more input,
+ * or output the other end has room for) puts it back on the ready list,
+ * which keeps the next wait from sleeping.
+ */
+static void service_connection(struct connection *conn)
+{
+	unsigned int budget = CONN_BATCH;
+
+	talloc_increase_ref_count(conn);
+
+	while (budget && conn_can_read(conn)) {
+		handle_input(conn);
+		if (talloc_free(conn) == 0)
+			return;
+		talloc_increase_ref_count(conn);
+		budget--;
+	}
+
+	while (budget && conn_can_write(conn)) {
+		handle_output(conn);
+		if (talloc_free(conn) == 0)
+			return;
+		talloc_increase_ref_count(conn);
+		budget--;
+	}
+
+	if (conn_can_read(conn) || conn_can_write(conn))
+		conn_mark_ready(conn);
+
+	talloc_free(conn);
+}
+
+static void handle_ready_connections(void)
+{
+	LIST_HEAD(pending);
+	struct connection *conn;
+
+	/* Connections destroyed meanwhile unlink themselves from pending. */
+	list_splice_init(&ready_conns, &pending);
+	while (!list_empty(&pending)) {
+		conn = list_entry(pending.next, struct connection, ready_list);
+		list_del_init(&conn->ready_list);
+		service_connection(conn);
+	}
+}
+
 static int tdb_flags;
 
 /* We create initial nodes manually. */
@@ -1457,6 +1775,8 @@ static void setup_structure(void)
 		*/
 		char *tlocal = talloc_strdup(NULL, "/local");
 
+		cache_init(tdb_ctx);
+		transaction_init_generation();
 		check_store();
 
 		if (remove_local) {
@@ -1469,10 +1789,16 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
+		/* With --internal-db the store lives in the cache alone. */
+		if (!(tdb_flags & TDB_INTERNAL)) {
+			tdb_ctx = tdb_open(tdbname, 7919, tdb_flags,
+					   O_RDWR|O_CREAT, 0640);
+			if (!tdb_ctx)
+				barf_perror("Could not create tdb file %s",
+					    tdbname);
+		}
+		cache_init(tdb_ctx);
+		transaction_init_generation();
 
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
@@ -1483,7 +1809,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1496,7 +1822,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1600,22 +1926,16 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static void clean_store_(const char *name, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
 
-	if (!hashtable_search(reachable, name)) {
+	if (!hashtable_search(reachable, (void *)name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			cache_delete(name);
 		}
 	}
-
-	talloc_free(name);
-
-	return 0;
 }
 
 
@@ -1625,7 +1945,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	cache_traverse(&clean_store_, reachable);
 }
 
 
@@ -1647,7 +1967,7 @@ static void check_store(void)
 
 
 /* Something is horribly wrong: check the store. */
-static void corrupt(struct connection *conn, const char *fmt, ...)
+void corrupt(struct connection *conn, const char *fmt, ...)
 {
 	va_list arglist;
 	char *str;
@@ -1770,14 +2090,12 @@ int priv_domid = 0;
 
 int main(int argc, char *argv[])
 {
-	int opt, *sock, *ro_sock, max;
-	fd_set inset, outset;
+	int opt, *sock, *ro_sock;
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
 	int evtchn_fd = -1;
-	struct timeval *timeout;
 
 	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
 				  NULL)) != -1) {
@@ -1884,76 +2202,26 @@ int main(int argc, char *argv[])
 		evtchn_fd = xc_evtchn_fd(xce_handle);
 
 	/* Get ready to listen to the tools. */
-	max = initialize_set(&inset, &outset, *sock, *ro_sock, &timeout);
+	poll_init();
+	if ((*sock != -1 && poll_add(*sock, NULL) != 0) ||
+	    (*ro_sock != -1 && poll_add(*ro_sock, NULL) != 0) ||
+	    (reopen_log_pipe[0] != -1 &&
+	     poll_add(reopen_log_pipe[0], NULL) != 0) ||
+	    (evtchn_fd != -1 && poll_add(evtchn_fd, NULL) != 0))
+		barf_perror("Could not poll listening fds");
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
 
 	/* Main loop. */
 	for (;;) {
-		struct connection *conn, *next;
-
-		if (select(max+1, &inset, &outset, NULL, timeout) < 0) {
-			if (errno == EINTR)
-				continue;
-			barf_perror("Select failed");
-		}
-
-		if (reopen_log_pipe[0] != -1 && FD_ISSET(reopen_log_pipe[0], &inset)) {
-			char c;
-			if (read(reopen_log_pipe[0], &c, 1) != 1)
-				barf_perror("read failed");
-			reopen_log();
-		}
-
-		if (*sock != -1 && FD_ISSET(*sock, &inset))
-			accept_connection(*sock, true);
-
-		if (*ro_sock != -1 && FD_ISSET(*ro_sock, &inset))
-			accept_connection(*ro_sock, false);
-
-		if (evtchn_fd != -1 && FD_ISSET(evtchn_fd, &inset))
-			handle_event();
-
-		next = list_entry(connections.next, typeof(*conn), list);
-		if (&next->list != &connections)
-			talloc_increase_ref_count(next);
-		while (&next->list != &connections) {
-			conn = next;
-
-			next = list_entry(conn->list.next,
-					  typeof(*conn), list);
-			if (&next->list != &connections)
-				talloc_increase_ref_count(next);
-
-			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (domain_can_write(conn) &&
-				    !list_empty(&conn->out_list))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			} else {
-				if (FD_ISSET(conn->fd, &inset))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (FD_ISSET(conn->fd, &outset))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			}
-		}
+		/* Write the store back before sleeping, or if far behind. */
+		if (list_empty(&ready_conns) ||
+		    cache_dirty() >= CACHE_FLUSH_BATCH)
+			cache_flush();
 
-		max = initialize_set(&inset, &outset, *sock, *ro_sock,
-				     &timeout);
+		wait_for_events(*sock, *ro_sock, evtchn_fd);
+		handle_ready_connections();
 	}
 }
 
@@ -58,9 +58,17 @@ struct connection
 {
 	struct list_head list;
 
+	/* On the ready list while there may be work to do without blocking. */
+	struct list_head ready_list;
+
 	/* The file descriptor we came in on. */
 	int fd;
 
+	/* Can fd be read/written without blocking?  Set by the main loop
+	 * when the fd becomes ready, cleared when an operation would block. */
+	bool pollin;
+	bool pollout;
+
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
 
@@ -90,6 +98,11 @@ struct connection
 	/* My watches. */
 	struct list_head watches;
 
+	/* Running the operations of an XS_BATCH: their replies are
+	 * swallowed, and the first error kept. */
+	bool in_batch;
+	int batch_error;
+
 	/* Methods for communicating over this connection: write can be NULL */
 	connwritefn_t *write;
 	connreadfn_t *read;
@@ -99,8 +112,8 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from, NULL for the store itself */
+	struct transaction *trans;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -145,17 +158,18 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* Hash functions for hashtables keyed by strings */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
 
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
-
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Report (and try to repair) an inconsistent store */
+void corrupt(struct connection *conn, const char *fmt, ...);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
+/* Have the main loop service this connection on its next pass. */
+void conn_mark_ready(struct connection *conn);
+
 
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <fcntl.h>
 #include <xenctrl.h>
 
 #include "utils.h"
@@ -37,6 +38,8 @@
 static xc_interface **xc_handle;
 xc_gnttab **xcg_handle;
 static evtchn_port_t virq_port;
+/* Is the event channel fd non-blocking, so it can be drained? */
+static bool evtchn_drain;
 
 xc_evtchn *xce_handle = NULL;
 
@@ -236,19 +239,38 @@ static void domain_cleanup(void)
 		fire_watches(NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
+static struct domain *find_domain_by_port(evtchn_port_t port)
+{
+	struct domain *i;
+
+	list_for_each_entry(i, &domains, list) {
+		if (i->port == port)
+			return i;
+	}
+	return NULL;
+}
+
+/* Hand each pending port to the main loop as a ready connection. */
 void handle_event(void)
 {
 	evtchn_port_t port;
+	struct domain *domain;
 
-	if ((port = xc_evtchn_pending(xce_handle)) == -1)
-		barf_perror("Failed to read from event fd");
+	do {
+		if ((port = xc_evtchn_pending(xce_handle)) == -1) {
+			if (evtchn_drain && errno == EAGAIN)
+				return;
+			barf_perror("Failed to read from event fd");
+		}
 
-	if (port == virq_port)
-		domain_cleanup();
+		if (port == virq_port)
+			domain_cleanup();
+		else if ((domain = find_domain_by_port(port)) != NULL)
+			conn_mark_ready(domain->conn);
 
-	if (xc_evtchn_unmask(xce_handle, port) == -1)
-		barf_perror("Failed to write to event fd");
+		if (xc_evtchn_unmask(xce_handle, port) == -1)
+			barf_perror("Failed to write to event fd");
+	} while (evtchn_drain);
 }
 
 bool domain_can_read(struct connection *conn)
@@ -404,6 +426,7 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 	}
 
 	domain_conn_reset(domain);
+	conn_mark_ready(domain->conn);
 
 	send_ack(conn, XS_INTRODUCE);
 }
@@ -615,6 +638,7 @@ static int dom0_init(void)
 		return -1;
 
 	talloc_steal(dom0->conn, dom0); 
+	conn_mark_ready(dom0->conn);
 
 	xc_evtchn_notify(xce_handle, dom0->port); 
 
@@ -623,7 +647,7 @@ static int dom0_init(void)
 
 void domain_init(void)
 {
-	int rc;
+	int rc, fd, flags;
 
 	xc_handle = talloc(talloc_autofree_context(), xc_interface*);
 	if (!xc_handle)
@@ -650,6 +674,13 @@ void domain_init(void)
 	if (xce_handle == NULL)
 		barf_perror("Failed to open evtchn device");
 
+	/* The main loop polls this level-triggered; making it non-blocking
+	 * lets handle_event() drain every pending port per wakeup. */
+	fd = xc_evtchn_fd(xce_handle);
+	flags = fcntl(fd, F_GETFL);
+	evtchn_drain = flags != -1 &&
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+
 	if (dom0_init() != 0) 
 		barf_perror("Failed to initialize dom0 state"); 
 
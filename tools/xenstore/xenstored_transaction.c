@@ -26,13 +26,16 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_cache.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
@@ -48,6 +51,23 @@ struct changed_node
 	bool recurse;
 };
 
+struct accessed_node
+{
+	/* List of all nodes read or written by this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Generation of the node in the store when first accessed. */
+	uint64_t generation;
+
+	/* Transaction-local record: what was first read, unless modified.
+	 * A NULL dptr means the node does not exist (or was deleted). */
+	bool modified;
+	TDB_DATA data;
+};
+
 struct changed_domain
 {
 	/* List of all changed domains in the context of this transaction. */
@@ -68,12 +88,11 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
+	/* Overlay of nodes accessed, on top of the store. */
+	struct list_head accessed;
 
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* The same nodes, indexed by name. */
+	struct hashtable *accessed_index;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -83,12 +102,168 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/* Stamped on every record written to the store; never goes backwards. */
+static uint64_t generation;
+
+#define NO_GENERATION ~((uint64_t)0)
+
+/*
+ * Keys are node names: the store itself is the node cache, which wants
+ * them nul-terminated.
+ */
+
+/* Generation of a record in the store, NO_GENERATION if there is none. */
+static uint64_t store_generation(TDB_DATA key)
 {
-	return trans->tdb;
+	uint64_t gen;
+
+	if (!cache_generation((char *)key.dptr, &gen))
+		return NO_GENERATION;
+	return gen;
+}
+
+static bool store_record(TDB_DATA key, TDB_DATA data)
+{
+	((struct xs_tdb_record_hdr *)data.dptr)->generation = ++generation;
+
+	return cache_store((char *)key.dptr, data);
+}
+
+static bool delete_record(TDB_DATA key)
+{
+	return cache_delete((char *)key.dptr);
+}
+
+static void max_generation(const char *name, TDB_DATA data, void *priv)
+{
+	uint64_t *max = priv;
+	uint64_t gen = ((struct xs_tdb_record_hdr *)data.dptr)->generation;
+
+	if (gen > *max)
+		*max = gen;
+}
+
+void transaction_init_generation(void)
+{
+	generation = 0;
+	cache_traverse(max_generation, &generation);
+}
+
+static struct accessed_node *find_accessed(struct transaction *trans,
+					   TDB_DATA key)
+{
+	return hashtable_search(trans->accessed_index, key.dptr);
+}
+
+/* Note the node's generation the first time the transaction touches it.
+ * If snapshot, also keep the record as it is now, for later reads. */
+static struct accessed_node *get_accessed(struct transaction *trans,
+					  TDB_DATA key, bool snapshot)
+{
+	struct accessed_node *i;
+	char *name;
+
+	i = find_accessed(trans, key);
+	if (i)
+		return i;
+
+	i = talloc_zero(trans, struct accessed_node);
+	if (!i)
+		return NULL;
+	i->node = talloc_strndup(i, (char *)key.dptr, key.dsize);
+	if (!i->node)
+		goto nomem;
+
+	if (snapshot) {
+		i->data = cache_fetch(i->node);
+		if (!i->data.dptr && errno != ENOENT)
+			goto nomem;
+		talloc_steal(i, i->data.dptr);
+		i->generation = i->data.dptr ?
+			((struct xs_tdb_record_hdr *)i->data.dptr)->generation :
+			NO_GENERATION;
+	} else
+		i->generation = store_generation(key);
+
+	/* The hashtable owns (and free()s) its keys. */
+	name = strdup(i->node);
+	if (!name || !hashtable_insert(trans->accessed_index, name, i)) {
+		free(name);
+		goto nomem;
+	}
+
+	list_add_tail(&i->list, &trans->accessed);
+	return i;
+
+ nomem:
+	talloc_free(i);
+	return NULL;
+}
+
+TDB_DATA transaction_fetch(struct transaction *trans, TDB_DATA key)
+{
+	struct accessed_node *i;
+	TDB_DATA data = { NULL, 0 };
+
+	if (!trans)
+		return cache_fetch((char *)key.dptr);
+
+	/* Every read sees the node as the transaction first found it. */
+	i = get_accessed(trans, key, true);
+	if (!i) {
+		errno = ENOMEM;
+		return data;
+	}
+
+	if (i->data.dptr) {
+		data.dptr = talloc_memdup(NULL, i->data.dptr, i->data.dsize);
+		data.dsize = i->data.dsize;
+	}
+	if (!data.dptr)
+		errno = i->data.dptr ? ENOMEM : ENOENT;
+	return data;
+}
+
+bool transaction_store(struct transaction *trans, TDB_DATA key, TDB_DATA data)
+{
+	struct accessed_node *i;
+	void *copy;
+
+	if (!trans)
+		return store_record(key, data);
+
+	i = get_accessed(trans, key, false);
+	if (!i)
+		return false;
+
+	copy = talloc_memdup(i, data.dptr, data.dsize);
+	if (!copy)
+		return false;
+
+	talloc_free(i->data.dptr);
+	i->data.dptr = copy;
+	i->data.dsize = data.dsize;
+	i->modified = true;
+	return true;
+}
+
+bool transaction_delete(struct transaction *trans, TDB_DATA key)
+{
+	struct accessed_node *i;
+
+	if (!trans)
+		return delete_record(key);
+
+	i = get_accessed(trans, key, false);
+	if (!i)
+		return false;
+
+	talloc_free(i->data.dptr);
+	i->data.dptr = NULL;
+	i->data.dsize = 0;
+	i->modified = true;
+	return true;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -97,11 +272,9 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	/* Changes to the global database are visible straight away. */
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -117,13 +290,49 @@ static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
 
+	hashtable_destroy(trans->accessed_index, 0);
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
 	return 0;
 }
 
+/* Has anything the transaction looked at changed since? */
+static bool transaction_conflicts(struct transaction *trans)
+{
+	struct accessed_node *i;
+	TDB_DATA key;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		key.dptr = (void *)i->node;
+		key.dsize = strlen(i->node);
+		if (store_generation(key) != i->generation)
+			return true;
+	}
+
+	return false;
+}
+
+/* Write the overlay through to the store: all of it, or nothing. */
+static bool transaction_apply(struct transaction *trans)
+{
+	struct accessed_node *i;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+
+		if (i->data.dptr)
+			((struct xs_tdb_record_hdr *)i->data.dptr)->generation =
+				++generation;
+		if (!cache_stage(i->node, i->data)) {
+			cache_abort_staged();
+			return false;
+		}
+	}
+
+	cache_commit_staged();
+	return true;
+}
+
 struct transaction *transaction_lookup(struct connection *conn, uint32_t id)
 {
 	struct transaction *trans;
@@ -138,6 +347,49 @@ struct transaction *transaction_lookup(struct connection *conn, uint32_t id)
 	return ERR_PTR(-ENOENT);
 }
 
+struct transaction *transaction_create(const void *ctx)
+{
+	struct transaction *trans;
+
+	trans = talloc(ctx, struct transaction);
+	if (!trans)
+		return NULL;
+	trans->id = 0;
+	trans->accessed_index = create_hashtable(16, hash_from_key_fn,
+						 keys_equal_fn);
+	if (!trans->accessed_index) {
+		talloc_free(trans);
+		return NULL;
+	}
+	talloc_set_destructor(trans, destroy_transaction);
+	INIT_LIST_HEAD(&trans->accessed);
+	INIT_LIST_HEAD(&trans->changes);
+	INIT_LIST_HEAD(&trans->changed_domains);
+	return trans;
+}
+
+int transaction_commit(struct connection *conn, struct transaction *trans)
+{
+	struct changed_node *i;
+	struct changed_domain *d;
+
+	/* FIXME: Merge, rather failing on any change. */
+	if (transaction_conflicts(trans))
+		return EAGAIN;
+	if (!transaction_apply(trans))
+		return ENOMEM;
+
+	/* fix domain entry for each changed domain */
+	list_for_each_entry(d, &trans->changed_domains, list)
+		domain_entry_fix(d->domid, d->nbentry);
+
+	/* Fire off the watches for everything that changed. */
+	list_for_each_entry(i, &trans->changes, list)
+		fire_watches(conn, i->node, i->recurse);
+
+	return 0;
+}
+
 void do_transaction_start(struct connection *conn, struct buffered_data *in)
 {
 	struct transaction *trans, *exists;
@@ -155,19 +407,11 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	}
 
 	/* Attach transaction to input for autofree until it's complete */
-	trans = talloc(in, struct transaction);
-	INIT_LIST_HEAD(&trans->changes);
-	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans = transaction_create(in);
+	if (!trans) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -178,7 +422,6 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
 	talloc_steal(conn, trans);
-	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
@@ -187,9 +430,8 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 void do_transaction_end(struct connection *conn, const char *arg)
 {
-	struct changed_node *i;
-	struct changed_domain *d;
 	struct transaction *trans;
+	int err;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F"))) {
 		send_error(conn, EINVAL);
@@ -209,26 +451,13 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
-			send_error(conn, EAGAIN);
-			return;
-		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
-			send_error(conn, errno);
+		err = transaction_commit(conn, trans);
+		if (err) {
+			send_error(conn, err);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
-
-		/* fix domain entry for each changed domain */
-		list_for_each_entry(d, &trans->changed_domains, list)
-			domain_entry_fix(d->domid, d->nbentry);
-
-		/* Fire off the watches for everything that changed. */
-		list_for_each_entry(i, &trans->changes, list)
-			fire_watches(conn, i->node, i->recurse);
-		generation++;
+		/* Only acknowledge what the tdb has too, if it can take it. */
+		cache_flush();
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 }
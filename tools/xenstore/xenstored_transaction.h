@@ -27,6 +27,13 @@ void do_transaction_end(struct connection *conn, const char *arg);
 
 struct transaction *transaction_lookup(struct connection *conn, uint32_t id);
 
+/* A transaction private to the daemon: not on any connection's list. */
+struct transaction *transaction_create(const void *ctx);
+
+/* Write trans through to the store and fire its watches: 0 or an errno
+ * (EAGAIN if it conflicts).  conn->transaction must not be trans. */
+int transaction_commit(struct connection *conn, struct transaction *trans);
+
 /* inc/dec entry number local to trans while changing a node */
 void transaction_entry_inc(struct transaction *trans, unsigned int domid);
 void transaction_entry_dec(struct transaction *trans, unsigned int domid);
@@ -35,9 +42,17 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Node records as seen by trans, or the store itself if trans is NULL.
+ * trans reads each node as it was when trans first touched it.
+ * On failure the dptr is NULL / false is returned, and errno is set. */
+TDB_DATA transaction_fetch(struct transaction *trans, TDB_DATA key);
+bool transaction_store(struct transaction *trans, TDB_DATA key, TDB_DATA data);
+bool transaction_delete(struct transaction *trans, TDB_DATA key);
 
 void conn_delete_all_transactions(struct connection *conn);
 
+/* Carry on stamping from the newest record in a freshly loaded store, so
+ * that generations never repeat. */
+void transaction_init_generation(void);
+
 #endif /* _XENSTORED_TRANSACTION_H */
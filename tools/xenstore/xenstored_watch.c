@@ -26,6 +26,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -33,11 +34,35 @@
 
 extern int quota_nb_watch_per_domain;
 
+/* One path component in the index of watches: firing a watch for a node
+ * only visits the watches on its ancestors (and descendants, for rm). */
+struct watch_node
+{
+	/* Children of my parent. */
+	struct list_head list;
+	struct watch_node *parent;
+
+	/* Path component, or the whole name for @ events. */
+	char *name;
+
+	/* Child components, indexed by name once there are any. */
+	struct list_head children;
+	struct hashtable *index;
+
+	/* Watches on exactly this path, from any connection. */
+	struct list_head watches;
+};
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path, and where they hang in the index */
+	struct list_head node_list;
+	struct watch_node *wnode;
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -48,6 +73,18 @@ struct watch
 	char *node;
 };
 
+/* Roots of the index: "/" itself, and a parent for the @ events. */
+static struct watch_node *path_root, *event_root;
+
+static struct {
+	unsigned int watches;
+	unsigned int nodes;
+	unsigned long long fires;
+	unsigned long long visited;
+	unsigned long long events;
+	unsigned int max_events;
+} watch_stats;
+
 static void add_event(struct connection *conn,
 		      struct watch *watch,
 		      const char *name)
@@ -86,29 +123,221 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
-void fire_watches(struct connection *conn, const char *name, bool recurse)
+static int destroy_watch_node(void *_node)
+{
+	struct watch_node *node = _node;
+
+	if (node->index)
+		hashtable_destroy(node->index, 0);
+	watch_stats.nodes--;
+	return 0;
+}
+
+static struct watch_node *new_watch_node(struct watch_node *parent,
+					 const char *name)
+{
+	struct watch_node *node;
+	char *key;
+
+	node = talloc_zero(parent ? (void *)parent : talloc_autofree_context(),
+			   struct watch_node);
+	if (!node)
+		return NULL;
+	node->name = talloc_strdup(node, name);
+	if (!node->name) {
+		talloc_free(node);
+		return NULL;
+	}
+	INIT_LIST_HEAD(&node->children);
+	INIT_LIST_HEAD(&node->watches);
+	talloc_set_destructor(node, destroy_watch_node);
+	watch_stats.nodes++;
+
+	node->parent = parent;
+	if (!parent)
+		return node;
+
+	/* Without an index lookups fall back to the list, so this may fail. */
+	if (!parent->index && list_empty(&parent->children))
+		parent->index = create_hashtable(16, hash_from_key_fn,
+						 keys_equal_fn);
+	if (parent->index) {
+		key = strdup(name);
+		if (!key || !hashtable_insert(parent->index, key, node)) {
+			free(key);
+			hashtable_destroy(parent->index, 0);
+			parent->index = NULL;
+		}
+	}
+	list_add_tail(&node->list, &parent->children);
+	return node;
+}
+
+static struct watch_node *find_child(struct watch_node *parent,
+				     const char *name)
+{
+	struct watch_node *node;
+
+	if (parent->index)
+		return hashtable_search(parent->index, (void *)name);
+
+	list_for_each_entry(node, &parent->children, list)
+		if (streq(node->name, name))
+			return node;
+	return NULL;
+}
+
+/* Drop index nodes which no longer lead to any watch. */
+static void put_watch_node(struct watch_node *node)
+{
+	struct watch_node *parent;
+
+	while ((parent = node->parent) &&
+	       list_empty(&node->watches) && list_empty(&node->children)) {
+		if (parent->index)
+			hashtable_remove(parent->index, node->name);
+		list_del(&node->list);
+		talloc_free(node);
+		node = parent;
+	}
+}
+
+/* Find (or create) the index node for a watch path. */
+static struct watch_node *get_watch_node(const char *path, bool create)
+{
+	struct watch_node *node, *child;
+	char *copy, *p, *slash;
+
+	if (!path_root && create) {
+		path_root = new_watch_node(NULL, "/");
+		event_root = new_watch_node(NULL, "@");
+	}
+	if (!path_root || !event_root)
+		return NULL;
+
+	if (path[0] == '@') {
+		node = find_child(event_root, path);
+		if (!node && create)
+			node = new_watch_node(event_root, path);
+		return node;
+	}
+
+	copy = talloc_strdup(NULL, path);
+	if (!copy)
+		return NULL;
+
+	node = path_root;
+	for (p = copy + 1; node && *p; p = slash + 1) {
+		slash = strchr(p, '/');
+		if (slash)
+			*slash = '\0';
+		child = find_child(node, p);
+		if (!child && create) {
+			child = new_watch_node(node, p);
+			/* Don't leave a dead end behind */
+			if (!child)
+				put_watch_node(node);
+		}
+		node = child;
+		if (!slash)
+			break;
+	}
+
+	talloc_free(copy);
+	return node;
+}
+
+static unsigned int fire_node(struct watch_node *node, const char *name)
 {
-	struct connection *i;
 	struct watch *watch;
+	unsigned int events = 0;
+
+	watch_stats.visited++;
+	list_for_each_entry(watch, &node->watches, node_list) {
+		add_event(watch->conn, watch, name ? name : watch->node);
+		events++;
+	}
+	return events;
+}
+
+/* Watches below a removed node fire with their own path. */
+static unsigned int fire_subtree(struct watch_node *node)
+{
+	struct watch_node *child;
+	unsigned int events = 0;
+
+	list_for_each_entry(child, &node->children, list) {
+		events += fire_node(child, NULL);
+		events += fire_subtree(child);
+	}
+	return events;
+}
+
+void fire_watches(struct connection *conn, const char *name, bool recurse)
+{
+	struct watch_node *node;
+	char *path, *p, *slash;
+	unsigned int events;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	/* Nobody ever watched anything. */
+	if (!path_root)
+		return;
+
+	watch_stats.fires++;
+
+	/* Watches on / see every event, @ ones included. */
+	events = fire_node(path_root, name);
+
+	if (name[0] == '@') {
+		node = find_child(event_root, name);
+		if (node)
+			events += fire_node(node, name);
+		goto out;
 	}
+
+	/* Create an event for each watch on the way down to the node. */
+	path = talloc_strdup(NULL, name);
+	if (!path)
+		goto out;
+
+	node = path_root;
+	for (p = path + 1; node && *p; p = slash + 1) {
+		slash = strchr(p, '/');
+		if (slash)
+			*slash = '\0';
+		node = find_child(node, p);
+		if (node)
+			events += fire_node(node, name);
+		if (!slash)
+			break;
+	}
+
+	if (node && recurse)
+		events += fire_subtree(node);
+	/* Everything is below / */
+	if (node == path_root && recurse)
+		events += fire_subtree(event_root);
+
+	talloc_free(path);
+
+ out:
+	watch_stats.events += events;
+	if (events > watch_stats.max_events)
+		watch_stats.max_events = events;
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
 	trace_destroy(_watch, "watch");
+	list_del(&watch->node_list);
+	put_watch_node(watch->wnode);
+	watch_stats.watches--;
 	return 0;
 }
 
@@ -161,6 +390,16 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	else
 		watch->relative_path = NULL;
 
+	watch->wnode = get_watch_node(watch->node, true);
+	if (!watch->wnode) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+	watch->conn = conn;
+	list_add_tail(&watch->node_list, &watch->wnode->watches);
+	watch_stats.watches++;
+
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
@@ -196,6 +435,25 @@ void do_unwatch(struct connection *conn, struct buffered_data *in)
 	send_error(conn, ENOENT);
 }
 
+void dump_watches(struct connection *conn)
+{
+	char *stats;
+
+	stats = talloc_asprintf(conn,
+		"watches %u index-nodes %u\n"
+		"fires %llu visited %llu events %llu max-fanout %u\n",
+		watch_stats.watches, watch_stats.nodes,
+		watch_stats.fires, watch_stats.visited,
+		watch_stats.events, watch_stats.max_events);
+	if (!stats) {
+		send_error(conn, ENOMEM);
+		return;
+	}
+
+	send_reply(conn, XS_DEBUG, stats, strlen(stats) + 1);
+	talloc_free(stats);
+}
+
 void conn_delete_all_watches(struct connection *conn)
 {
 	struct watch *watch;
@@ -28,6 +28,7 @@ void do_unwatch(struct connection *conn, struct buffered_data *in);
 /* Fire all watches: recurse means all the children are affected (ie. rm). */
 void fire_watches(struct connection *conn, const char *name, bool recurse);
 
+/* Reply with watch index and fan-out statistics. */
 void dump_watches(struct connection *conn);
 
 void conn_delete_all_watches(struct connection *conn);
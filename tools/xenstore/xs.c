@@ -970,6 +970,138 @@ bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t,
 	return xs_bool(xs_single(h, t, XS_TRANSACTION_END, abortstr, NULL));
 }
 
+/* Bytes op takes up in an XS_BATCH payload, or 0 if it is invalid. */
+static unsigned int batch_op_size(const struct xs_batch_op *op)
+{
+	char buffer[MAX_STRLEN(unsigned int)+1];
+	unsigned int i, len;
+
+	len = sizeof(struct xsd_sockmsg) + strlen(op->path) + 1;
+
+	switch (op->type) {
+	case XS_WRITE:
+		return len + op->len;
+	case XS_MKDIR:
+	case XS_RM:
+		return len;
+	case XS_SET_PERMS:
+		for (i = 0; i < op->num_perms; i++) {
+			if (!xs_perm_to_string(&op->perms[i], buffer,
+					       sizeof(buffer)))
+				return 0;
+			len += strlen(buffer) + 1;
+		}
+		return len;
+	default:
+		errno = EINVAL;
+		return 0;
+	}
+}
+
+/* Encode op (of batch_op_size() bytes) at buf. */
+static void batch_op_encode(char *buf, const struct xs_batch_op *op,
+			    unsigned int size)
+{
+	struct xsd_sockmsg msg;
+	unsigned int i, len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = op->type;
+	msg.len = size - sizeof(msg);
+	memcpy(buf, &msg, sizeof(msg));
+	buf += sizeof(msg);
+
+	len = strlen(op->path) + 1;
+	memcpy(buf, op->path, len);
+	buf += len;
+
+	if (op->type == XS_WRITE)
+		memcpy(buf, op->data, op->len);
+	else if (op->type == XS_SET_PERMS)
+		for (i = 0; i < op->num_perms; i++) {
+			xs_perm_to_string(&op->perms[i], buf,
+					  MAX_STRLEN(unsigned int)+1);
+			buf += strlen(buf) + 1;
+		}
+}
+
+/* Send ops in as many XS_BATCH messages as they take. */
+static bool batch_send(struct xs_handle *h, xs_transaction_t t,
+		       const struct xs_batch_op *ops, unsigned int num_ops,
+		       char *buf)
+{
+	struct iovec iov;
+	unsigned int i, size, used = 0;
+
+	for (i = 0; i <= num_ops; i++) {
+		size = i < num_ops ? batch_op_size(&ops[i]) : 0;
+		if (used && (i == num_ops ||
+			     used + size > XENSTORE_PAYLOAD_MAX)) {
+			iov.iov_base = buf;
+			iov.iov_len = used;
+			if (!xs_bool(xs_talkv(h, t, XS_BATCH, &iov, 1, NULL)))
+				return false;
+			used = 0;
+		}
+		if (i < num_ops) {
+			batch_op_encode(buf + used, &ops[i], size);
+			used += size;
+		}
+	}
+
+	return true;
+}
+
+bool xs_batch(struct xs_handle *h, xs_transaction_t t,
+	      const struct xs_batch_op *ops, unsigned int num_ops)
+{
+	xs_transaction_t own;
+	unsigned int i, size, total = 0;
+	int saved_errno;
+	char *buf;
+	bool ret = false;
+
+	for (i = 0; i < num_ops; i++) {
+		size = batch_op_size(&ops[i]);
+		if (!size)
+			return false;
+		if (size > XENSTORE_PAYLOAD_MAX) {
+			errno = E2BIG;
+			return false;
+		}
+		total += size;
+	}
+
+	buf = malloc(XENSTORE_PAYLOAD_MAX);
+	if (!buf)
+		return false;
+
+	/* Too big for one message: keep it atomic with a transaction. */
+	if (t == XBT_NULL && total > XENSTORE_PAYLOAD_MAX) {
+		for (;;) {
+			own = xs_transaction_start(h);
+			if (own == XBT_NULL)
+				break;
+			if (!batch_send(h, own, ops, num_ops, buf)) {
+				saved_errno = errno;
+				xs_transaction_end(h, own, true);
+				errno = saved_errno;
+				break;
+			}
+			if (xs_transaction_end(h, own, false)) {
+				ret = true;
+				break;
+			}
+			if (errno != EAGAIN)
+				break;
+		}
+	} else
+		ret = batch_send(h, t, ops, num_ops, buf);
+
+	free_no_errno(buf);
+	return ret;
+}
+
 /* Introduce a new domain.
  * This tells the store daemon about a shared memory page and event channel
  * associated with a domain: the domain uses these to communicate.
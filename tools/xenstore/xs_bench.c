@@ -0,0 +1,308 @@
+/*
+ * Simple benchmark for xenstored: times the kind of traffic a toolstack
+ * generates (building domain directories in transactions or batches,
+ * polling reads, listing directories, watches on device state) and
+ * prints operations per second for each.
+ *
+ * Runs under a scratch path (default /bench) which it removes again.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "xenstore.h"
+
+/* Keys written per domain, relative to its directory. */
+static const char *domain_keys[] = {
+	"name", "vm", "memory/target", "memory/static-max",
+	"cpu/0/availability", "cpu/1/availability",
+	"device/vbd/51712/backend", "device/vbd/51712/backend-id",
+	"device/vbd/51712/state", "device/vbd/51712/virtual-device",
+	"device/vbd/51712/device-type", "device/vbd/51712/ring-ref",
+	"device/vbd/51712/event-channel",
+	"device/vif/0/backend", "device/vif/0/backend-id",
+	"device/vif/0/state", "device/vif/0/handle", "device/vif/0/mac",
+	"device/vif/0/tx-ring-ref", "device/vif/0/rx-ring-ref",
+	"device/vif/0/event-channel",
+	"control/shutdown", "data/updated", "console/ring-ref",
+	"console/port", "console/limit", "console/type",
+	"store/ring-ref", "store/port",
+};
+#define NR_KEYS (sizeof(domain_keys) / sizeof(domain_keys[0]))
+
+static struct xs_handle *xsh;
+static const char *root = "/bench";
+static unsigned int nr_domains = 64;
+static unsigned int nr_rounds = 10;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report(const char *what, unsigned long ops, double start)
+{
+	double secs = now() - start;
+
+	printf("%-12s %9lu ops %8.3f s %11.0f ops/s\n",
+	       what, ops, secs, secs > 0 ? ops / secs : 0.0);
+}
+
+static char *path(unsigned int dom, const char *key)
+{
+	static char buf[256];
+
+	snprintf(buf, sizeof(buf), "%s/%u%s%s", root, dom,
+		 key ? "/" : "", key ? key : "");
+	return buf;
+}
+
+static void write_key(xs_transaction_t t, const char *p, const char *val)
+{
+	if (!xs_write(xsh, t, p, val, strlen(val)))
+		err(1, "write %s", p);
+}
+
+/* One transaction per domain, retried on EAGAIN, as a toolstack would. */
+static void bench_create(void)
+{
+	unsigned long ops = 0;
+	unsigned int dom, i;
+	xs_transaction_t t;
+	double start = now();
+
+	for (dom = 0; dom < nr_domains; dom++) {
+		for (;;) {
+			t = xs_transaction_start(xsh);
+			if (t == XBT_NULL)
+				err(1, "transaction start");
+			for (i = 0; i < NR_KEYS; i++)
+				write_key(t, path(dom, domain_keys[i]),
+					  "1");
+			ops += NR_KEYS;
+			if (xs_transaction_end(xsh, t, false))
+				break;
+			if (errno != EAGAIN)
+				err(1, "transaction end");
+		}
+	}
+
+	report("create", ops, start);
+}
+
+/* The same, each domain in a single XS_BATCH round trip. */
+static void bench_batch(void)
+{
+	struct xs_batch_op ops[NR_KEYS];
+	unsigned long ops_done = 0;
+	unsigned int dom, i;
+	char *paths[NR_KEYS];
+	double start = now();
+
+	for (i = 0; i < NR_KEYS; i++) {
+		paths[i] = malloc(256);
+		if (!paths[i])
+			err(1, "malloc");
+		memset(&ops[i], 0, sizeof(ops[i]));
+		ops[i].type = XS_WRITE;
+		ops[i].path = paths[i];
+		ops[i].data = "2";
+		ops[i].len = 1;
+	}
+
+	for (dom = 0; dom < nr_domains; dom++) {
+		for (i = 0; i < NR_KEYS; i++)
+			strcpy(paths[i], path(dom, domain_keys[i]));
+		if (!xs_batch(xsh, XBT_NULL, ops, NR_KEYS))
+			err(1, "batch");
+		ops_done += NR_KEYS;
+	}
+
+	report("batch", ops_done, start);
+
+	for (i = 0; i < NR_KEYS; i++)
+		free(paths[i]);
+}
+
+static void bench_read(void)
+{
+	unsigned long ops = 0;
+	unsigned int dom, i, r, len;
+	double start = now();
+	void *val;
+
+	for (r = 0; r < nr_rounds; r++)
+		for (dom = 0; dom < nr_domains; dom++)
+			for (i = 0; i < NR_KEYS; i++) {
+				val = xs_read(xsh, XBT_NULL,
+					      path(dom, domain_keys[i]), &len);
+				if (!val)
+					err(1, "read %s",
+					    path(dom, domain_keys[i]));
+				free(val);
+				ops++;
+			}
+
+	report("read", ops, start);
+}
+
+static void bench_write(void)
+{
+	unsigned long ops = 0;
+	unsigned int dom, r;
+	char val[16];
+	double start = now();
+
+	for (r = 0; r < nr_rounds; r++)
+		for (dom = 0; dom < nr_domains; dom++) {
+			snprintf(val, sizeof(val), "%u", r);
+			write_key(XBT_NULL, path(dom, "memory/target"), val);
+			write_key(XBT_NULL, path(dom, "data/updated"), val);
+			ops += 2;
+		}
+
+	report("write", ops, start);
+}
+
+static void bench_directory(void)
+{
+	unsigned long ops = 0;
+	unsigned int dom, r, num;
+	double start = now();
+	char **ents;
+
+	for (r = 0; r < nr_rounds; r++) {
+		ents = xs_directory(xsh, XBT_NULL, root, &num);
+		if (!ents)
+			err(1, "directory %s", root);
+		free(ents);
+		ops++;
+
+		for (dom = 0; dom < nr_domains; dom++) {
+			ents = xs_directory(xsh, XBT_NULL,
+					    path(dom, "device/vif/0"), &num);
+			if (!ents)
+				err(1, "directory %s",
+				    path(dom, "device/vif/0"));
+			free(ents);
+			ops++;
+		}
+	}
+
+	report("directory", ops, start);
+}
+
+/* Backend-style state changes, each waited for on a watch. */
+static void bench_watch(void)
+{
+	unsigned long ops = 0;
+	unsigned int dom, r, num;
+	char **vec;
+	char token[16];
+	double start;
+
+	for (dom = 0; dom < nr_domains; dom++) {
+		snprintf(token, sizeof(token), "%u", dom);
+		if (!xs_watch(xsh, path(dom, "device/vif/0/state"), token))
+			err(1, "watch");
+		/* Swallow the initial event. */
+		vec = xs_read_watch(xsh, &num);
+		free(vec);
+	}
+
+	start = now();
+	for (r = 0; r < nr_rounds; r++)
+		for (dom = 0; dom < nr_domains; dom++) {
+			write_key(XBT_NULL, path(dom, "device/vif/0/state"),
+				  r & 1 ? "4" : "3");
+			vec = xs_read_watch(xsh, &num);
+			if (!vec)
+				err(1, "read watch");
+			free(vec);
+			ops++;
+		}
+	report("watch", ops, start);
+
+	for (dom = 0; dom < nr_domains; dom++) {
+		snprintf(token, sizeof(token), "%u", dom);
+		xs_unwatch(xsh, path(dom, "device/vif/0/state"), token);
+	}
+}
+
+static void bench_destroy(void)
+{
+	unsigned int dom;
+	double start = now();
+
+	for (dom = 0; dom < nr_domains; dom++)
+		if (!xs_rm(xsh, XBT_NULL, path(dom, NULL)))
+			err(1, "rm %s", path(dom, NULL));
+
+	report("destroy", nr_domains, start);
+	xs_rm(xsh, XBT_NULL, root);
+}
+
+static void usage(const char *progname)
+{
+	errx(1, "Usage: %s [-d domains] [-r rounds] [-p path]", progname);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:r:p:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			nr_domains = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			nr_rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			root = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || !nr_domains || !nr_rounds || root[0] != '/')
+		usage(argv[0]);
+
+	xsh = xs_open(0);
+	if (!xsh)
+		err(1, "xs_open");
+
+	printf("%u domains, %u keys each, %u rounds under %s\n",
+	       nr_domains, (unsigned int)NR_KEYS, nr_rounds, root);
+
+	bench_create();
+	bench_batch();
+	bench_read();
+	bench_write();
+	bench_directory();
+	bench_watch();
+	bench_destroy();
+
+	xs_close(xsh);
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
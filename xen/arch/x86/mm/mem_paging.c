@@ -21,6 +21,7 @@
  */
 
 
+#include <xen/event.h>
 #include <asm/p2m.h>
 #include <asm/mem_event.h>
 
@@ -53,6 +54,34 @@ int mem_paging_memop(struct domain *d, xen_mem_event_op_t *mec)
     }
     break;
 
+    case XENMEM_paging_op_absent:
+    {
+        unsigned long gfn = mec->gfn;
+        return p2m_mem_paging_absent(d, gfn);
+    }
+    break;
+
+    case XENMEM_paging_op_absent_range:
+    {
+        int rc;
+
+        while ( mec->buffer > 0 )
+        {
+            rc = p2m_mem_paging_absent(d, mec->gfn);
+            if ( rc )
+                return rc;
+
+            mec->gfn++;
+            mec->buffer--;
+
+            /* Check for continuation if it's not the last iteration */
+            if ( mec->buffer > 0 && hypercall_preempt_check() )
+                return -EAGAIN;
+        }
+        return 0;
+    }
+    break;
+
     default:
         return -ENOSYS;
         break;
@@ -27,6 +27,10 @@
 #include <xen/mm.h>
 #include <xen/grant_table.h>
 #include <xen/sched.h>
+#include <xen/rbtree.h>
+#include <xen/tasklet.h>
+#include <xen/timer.h>
+#include <xen/perfc.h>
 #include <asm/page.h>
 #include <asm/string.h>
 #include <asm/p2m.h>
@@ -1301,6 +1305,437 @@ int relinquish_shared_pages(struct domain *d)
     return rc;
 }
 
+/** Content scanner **/
+/* A KSM-like scanner that finds identical pages in domains that opted in
+ * (XEN_DOMCTL_MEM_SHARING_SCAN) and shares them without help from dom0.
+ * It runs as a tasklet, re-armed by a timer so that at most
+ * memshr_scan_batch pages are hashed every memshr_scan_interval ms.
+ *
+ * Two trees keyed by a 64-bit hash of the page contents are kept:
+ *  - the stable tree holds pages that are already shared. Their contents
+ *    cannot change while the handle stays valid, so a hash match only
+ *    needs a final compare before merging the candidate into them.
+ *  - the unstable tree holds private pages seen once during this pass.
+ *    They may have been written since they were hashed, so on a match
+ *    both pages are nominated (write protecting them) before comparing.
+ * The unstable tree is thrown away at the end of every pass. Both trees
+ * are only ever touched from the tasklet, so they need no locking. */
+
+static unsigned int __read_mostly memshr_scan_batch = 256;
+integer_param("memshr_scan_batch", memshr_scan_batch);
+static unsigned int __read_mostly memshr_scan_interval = 20;
+integer_param("memshr_scan_interval", memshr_scan_interval);
+static unsigned int __read_mostly memshr_scan_entries = 1 << 17;
+integer_param("memshr_scan_entries", memshr_scan_entries);
+
+/* Holes and non-RAM gfns are cheap to skip, but bound them too. */
+#define SCAN_VISITS_PER_PAGE    16
+
+struct scan_entry {
+    struct rb_node node;
+    uint64_t hash;
+    unsigned long gfn;
+    shr_handle_t handle;    /* Stable tree only. */
+    domid_t domain;
+};
+
+static struct rb_root scan_stable, scan_unstable;
+static unsigned int scan_nr_entries;
+static domid_t scan_domid;
+static unsigned long scan_gfn;
+static struct tasklet scan_tasklet;
+static struct timer scan_timer;
+
+#define scan_enabled(d) \
+    (mem_sharing_enabled(d) && (d)->arch.hvm_domain.mem_sharing_scan && \
+     !(d)->is_dying)
+
+static uint64_t scan_page_hash(const void *p)
+{
+    const uint64_t *w = p;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*w); i++ )
+        h = (h ^ w[i]) * 0x100000001b3ULL;
+
+    return h ^ (h >> 29);
+}
+
+static struct scan_entry *scan_tree_search(struct rb_root *root,
+                                           uint64_t hash)
+{
+    struct rb_node *n = root->rb_node;
+
+    while ( n )
+    {
+        struct scan_entry *e = rb_entry(n, struct scan_entry, node);
+
+        if ( hash < e->hash )
+            n = n->rb_left;
+        else if ( hash > e->hash )
+            n = n->rb_right;
+        else
+            return e;
+    }
+
+    return NULL;
+}
+
+static int scan_tree_insert(struct rb_root *root, struct scan_entry *new)
+{
+    struct rb_node **link = &root->rb_node, *parent = NULL;
+
+    while ( *link )
+    {
+        struct scan_entry *e = rb_entry(*link, struct scan_entry, node);
+
+        parent = *link;
+        if ( new->hash < e->hash )
+            link = &(*link)->rb_left;
+        else if ( new->hash > e->hash )
+            link = &(*link)->rb_right;
+        else
+            return -EEXIST;
+    }
+
+    rb_link_node(&new->node, parent, link);
+    rb_insert_color(&new->node, root);
+    return 0;
+}
+
+static void scan_drop(struct rb_root *root, struct scan_entry *e)
+{
+    rb_erase(&e->node, root);
+    xfree(e);
+    scan_nr_entries--;
+}
+
+static void scan_tree_flush(struct rb_root *root)
+{
+    struct rb_node *n;
+
+    while ( (n = rb_first(root)) != NULL )
+        scan_drop(root, rb_entry(n, struct scan_entry, node));
+}
+
+/* Hash a private, sharable gfn. Returns 0 if the gfn is not a candidate. */
+static int scan_hash_gfn(struct domain *d, unsigned long gfn, uint64_t *hash)
+{
+    p2m_type_t t;
+    mfn_t mfn = get_gfn_query_unlocked(d, gfn, &t);
+    struct page_info *pg;
+    void *p;
+
+    if ( !p2m_is_sharable(t) || !mfn_valid(mfn) )
+        return 0;
+
+    pg = mfn_to_page(mfn);
+    if ( !get_page(pg, d) )
+        return 0;
+
+    p = map_domain_page(mfn_x(mfn));
+    *hash = scan_page_hash(p);
+    unmap_domain_page(p);
+    put_page(pg);
+
+    return 1;
+}
+
+/* Compare two nominated gfns. Shared pages are read-only, so the result
+ * holds for as long as their handles stay valid. */
+static int scan_same_content(struct domain *sd, unsigned long sgfn,
+                             struct domain *cd, unsigned long cgfn)
+{
+    p2m_type_t st, ct;
+    mfn_t smfn = get_gfn_query_unlocked(sd, sgfn, &st);
+    mfn_t cmfn = get_gfn_query_unlocked(cd, cgfn, &ct);
+    struct page_info *spg, *cpg;
+    void *s, *c;
+    int same;
+
+    if ( !p2m_is_shared(st) || !p2m_is_shared(ct) ||
+         !mfn_valid(smfn) || !mfn_valid(cmfn) )
+        return 0;
+
+    spg = mfn_to_page(smfn);
+    cpg = mfn_to_page(cmfn);
+    if ( !get_page(spg, dom_cow) )
+        return 0;
+    if ( !get_page(cpg, dom_cow) )
+    {
+        put_page(spg);
+        return 0;
+    }
+
+    s = map_domain_page(mfn_x(smfn));
+    c = map_domain_page(mfn_x(cmfn));
+    same = !memcmp(s, c, PAGE_SIZE);
+    unmap_domain_page(c);
+    unmap_domain_page(s);
+
+    put_page(cpg);
+    put_page(spg);
+
+    return same;
+}
+
+/* Undo a nomination made by the scanner that did not lead to a merge.
+ * Only pages backing just this gfn are made private again: that needs no
+ * copy, and leaves sharing set up by anybody else alone. */
+static void scan_unnominate(struct domain *d, unsigned long gfn)
+{
+    p2m_type_t t;
+    mfn_t mfn = get_gfn(d, gfn, &t);
+    int single = 0;
+
+    if ( p2m_is_shared(t) )
+    {
+        struct page_info *pg = __grab_shared_page(mfn);
+
+        if ( pg )
+        {
+            single = rmap_has_one_entry(pg);
+            mem_sharing_page_unlock(pg);
+        }
+    }
+    put_gfn(d, gfn);
+
+    if ( single )
+        mem_sharing_unshare_page(d, gfn, 0);
+}
+
+/* Nominate the candidate, check it against the shared source and merge. */
+static int scan_merge(struct domain *sd, unsigned long sgfn, shr_handle_t sh,
+                      struct domain *cd, unsigned long cgfn)
+{
+    p2m_type_t t;
+    shr_handle_t ch;
+    int rc;
+
+    get_gfn_query_unlocked(sd, sgfn, &t);
+    if ( !p2m_is_shared(t) )
+        return XENMEM_SHARING_OP_S_HANDLE_INVALID;
+
+    rc = mem_sharing_nominate_page(cd, cgfn, 0, &ch);
+    if ( rc )
+        return rc;
+
+    if ( !scan_same_content(sd, sgfn, cd, cgfn) )
+    {
+        perfc_incr(mshr_scan_mismatch);
+        rc = -EILSEQ;
+    }
+    else
+        rc = mem_sharing_share_pages(sd, sgfn, sh, cd, cgfn, ch);
+
+    if ( rc )
+        scan_unnominate(cd, cgfn);
+    else
+        perfc_incr(mshr_scan_merges);
+
+    return rc;
+}
+
+/* Returns 0 if the candidate was dealt with, -ESRCH if e went stale and
+ * was dropped. */
+static int scan_merge_stable(struct scan_entry *e,
+                             struct domain *d, unsigned long gfn)
+{
+    struct domain *sd = rcu_lock_domain_by_id(e->domain);
+    int rc = XENMEM_SHARING_OP_S_HANDLE_INVALID;
+
+    if ( sd != NULL )
+    {
+        if ( mem_sharing_enabled(sd) && !sd->is_dying )
+            rc = scan_merge(sd, e->gfn, e->handle, d, gfn);
+        rcu_unlock_domain(sd);
+    }
+
+    if ( rc != XENMEM_SHARING_OP_S_HANDLE_INVALID )
+        return 0;
+
+    scan_drop(&scan_stable, e);
+    return -ESRCH;
+}
+
+static void scan_merge_unstable(struct scan_entry *e,
+                                struct domain *d, unsigned long gfn)
+{
+    struct domain *ud = rcu_lock_domain_by_id(e->domain);
+    shr_handle_t sh = 0;
+    int rc = -ESRCH;
+
+    if ( ud != NULL )
+    {
+        if ( scan_enabled(ud) &&
+             !mem_sharing_nominate_page(ud, e->gfn, 0, &sh) )
+        {
+            rc = scan_merge(ud, e->gfn, sh, d, gfn);
+            if ( rc )
+                scan_unnominate(ud, e->gfn);
+        }
+        rcu_unlock_domain(ud);
+    }
+
+    if ( rc == 0 )
+    {
+        /* The unstable page now backs both gfns: promote it. */
+        rb_erase(&e->node, &scan_unstable);
+        e->handle = sh;
+        if ( scan_tree_insert(&scan_stable, e) )
+        {
+            xfree(e);
+            scan_nr_entries--;
+        }
+        return;
+    }
+
+    /* Whatever e pointed at has changed or gone; the candidate is the
+     * fresher page for this hash, so let it take over the slot. */
+    e->domain = d->domain_id;
+    e->gfn = gfn;
+}
+
+static void scan_one(struct domain *d, unsigned long gfn, uint64_t hash)
+{
+    struct scan_entry *e;
+
+    e = scan_tree_search(&scan_stable, hash);
+    if ( e && scan_merge_stable(e, d, gfn) == 0 )
+        return;
+
+    e = scan_tree_search(&scan_unstable, hash);
+    if ( e )
+    {
+        if ( e->domain != d->domain_id || e->gfn != gfn )
+            scan_merge_unstable(e, d, gfn);
+        return;
+    }
+
+    if ( scan_nr_entries >= memshr_scan_entries ||
+         (e = xmalloc(struct scan_entry)) == NULL )
+        return;
+
+    e->hash = hash;
+    e->domain = d->domain_id;
+    e->gfn = gfn;
+    e->handle = 0;
+    BUG_ON(scan_tree_insert(&scan_unstable, e));
+    scan_nr_entries++;
+}
+
+/* End of a full pass over all scanned domains. */
+static void scan_end_pass(void)
+{
+    struct rb_node *n, *next;
+
+    scan_tree_flush(&scan_unstable);
+
+    /* Drop stable entries whose page has since been unshared. */
+    for ( n = rb_first(&scan_stable); n; n = next )
+    {
+        struct scan_entry *e = rb_entry(n, struct scan_entry, node);
+        struct domain *d = rcu_lock_domain_by_id(e->domain);
+        p2m_type_t t = p2m_invalid;
+
+        next = rb_next(n);
+        if ( d != NULL )
+        {
+            if ( mem_sharing_enabled(d) && !d->is_dying )
+                get_gfn_query_unlocked(d, e->gfn, &t);
+            rcu_unlock_domain(d);
+        }
+        if ( !p2m_is_shared(t) )
+            scan_drop(&scan_stable, e);
+    }
+}
+
+/* Returns a reference to the first scanned domain with id >= domid. */
+static struct domain *scan_next_domain(domid_t domid)
+{
+    struct domain *d;
+
+    rcu_read_lock(&domlist_read_lock);
+    for_each_domain ( d )
+        if ( d->domain_id >= domid && scan_enabled(d) && get_domain(d) )
+            break;
+    rcu_read_unlock(&domlist_read_lock);
+
+    return d;
+}
+
+static void mem_sharing_scan_worker(unsigned long unused)
+{
+    unsigned int pages = memshr_scan_batch;
+    unsigned int visits = memshr_scan_batch * SCAN_VISITS_PER_PAGE;
+    struct domain *d = scan_next_domain(scan_domid);
+
+    if ( d == NULL && scan_domid != 0 )
+    {
+        scan_end_pass();
+        scan_domid = 0;
+        scan_gfn = 0;
+        d = scan_next_domain(0);
+    }
+
+    if ( d == NULL )
+    {
+        /* Nobody left to scan: go idle until the next domain opts in. */
+        scan_tree_flush(&scan_unstable);
+        scan_tree_flush(&scan_stable);
+        return;
+    }
+
+    while ( d != NULL )
+    {
+        unsigned long end = p2m_get_hostp2m(d)->max_mapped_pfn;
+
+        if ( d->domain_id != scan_domid )
+        {
+            scan_domid = d->domain_id;
+            scan_gfn = 0;
+        }
+
+        for ( ; pages && visits && scan_gfn <= end; scan_gfn++, visits-- )
+        {
+            uint64_t hash;
+
+            if ( !scan_enabled(d) )
+                break;
+            if ( !scan_hash_gfn(d, scan_gfn, &hash) )
+                continue;
+
+            perfc_incr(mshr_scan_pages);
+            scan_one(d, scan_gfn, hash);
+            pages--;
+        }
+
+        if ( scan_gfn > end || !scan_enabled(d) )
+        {
+            scan_domid = d->domain_id + 1;
+            scan_gfn = 0;
+        }
+        put_domain(d);
+
+        if ( !pages || !visits )
+            break;
+        d = scan_next_domain(scan_domid);
+    }
+
+    set_timer(&scan_timer, NOW() + MILLISECS(memshr_scan_interval));
+}
+
+static void mem_sharing_scan_timer_fn(void *unused)
+{
+    tasklet_schedule(&scan_tasklet);
+}
+
+static void mem_sharing_scan_kick(void)
+{
+    set_timer(&scan_timer, NOW());
+}
+
 int mem_sharing_memop(struct domain *d, xen_mem_sharing_op_t *mec)
 {
     int rc = 0;
@@ -1495,6 +1930,20 @@ int mem_sharing_domctl(struct domain *d, xen_domctl_mem_sharing_op_t *mec)
         }
         break;
 
+        case XEN_DOMCTL_MEM_SHARING_SCAN:
+        {
+            rc = 0;
+            if ( mec->u.enable && !d->arch.hvm_domain.mem_sharing_enabled )
+                rc = -EINVAL;
+            else
+            {
+                d->arch.hvm_domain.mem_sharing_scan = mec->u.enable;
+                if ( mec->u.enable )
+                    mem_sharing_scan_kick();
+            }
+        }
+        break;
+
         default:
             rc = -ENOSYS;
     }
@@ -1509,5 +1958,7 @@ void __init mem_sharing_init(void)
     spin_lock_init(&shr_audit_lock);
     INIT_LIST_HEAD(&shr_audit_list);
 #endif
+    tasklet_init(&scan_tasklet, mem_sharing_scan_worker, 0);
+    init_timer(&scan_timer, mem_sharing_scan_timer_fn, NULL, 0);
 }
 
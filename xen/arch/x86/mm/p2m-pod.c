@@ -382,6 +382,7 @@ p2m_pod_empty_cache(struct domain *d)
 
     /* After this barrier no new PoD activities can happen. */
     BUG_ON(!d->is_dying);
+    tasklet_kill(&p2m->pod.reclaim_tasklet);
     spin_barrier(&p2m->pod.lock.lock);
 
     lock_page_alloc(p2m);
@@ -638,6 +639,26 @@ void p2m_pod_dump_data(struct domain *d)
 }
 
 
+/* Number of leading words looked at by the quick zero-checks. */
+#define POD_QUICK_CHECK_WORDS 16
+
+/* Check whether the first @nr words of a mapped page are all zero.  Eight
+ * words are ORed together per iteration, so the loads can overlap and
+ * there is one branch per cache line; SIMD registers are off limits in
+ * Xen, so this is as wide as it gets. */
+static bool_t
+p2m_pod_words_zero(const unsigned long *map, unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr; i += 8 )
+        if ( map[i] | map[i + 1] | map[i + 2] | map[i + 3] |
+             map[i + 4] | map[i + 5] | map[i + 6] | map[i + 7] )
+            return 0;
+
+    return 1;
+}
+
 /* Search for all-zero superpages to be reclaimed as superpages for the
  * PoD cache. Must be called w/ pod lock held, must lock the superpage
  * in the p2m */
@@ -648,8 +669,9 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     p2m_type_t type, type0 = 0;
     unsigned long * map = NULL;
     int ret=0, reset = 0;
-    int i, j;
+    int i;
     int max_ref = 1;
+    bool_t zero;
     struct domain *d = p2m->domain;
 
     ASSERT(pod_locked_by_me(p2m));
@@ -706,13 +728,11 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
         /* Quick zero-check */
         map = map_domain_page(mfn_x(mfn0) + i);
 
-        for ( j=0; j<16; j++ )
-            if( *(map+j) != 0 )
-                break;
+        zero = p2m_pod_words_zero(map, POD_QUICK_CHECK_WORDS);
 
         unmap_domain_page(map);
 
-        if ( j < 16 )
+        if ( !zero )
             goto out;
 
     }
@@ -739,12 +759,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     {
         map = map_domain_page(mfn_x(mfn0) + i);
 
-        for ( j=0; j<PAGE_SIZE/sizeof(*map); j++ )
-            if( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
+        reset = !p2m_pod_words_zero(map, PAGE_SIZE / sizeof(*map));
 
         unmap_domain_page(map);
 
@@ -790,8 +805,9 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
     p2m_type_t types[count];
     unsigned long * map[count];
     struct domain *d = p2m->domain;
+    bool_t zero;
 
-    int i, j;
+    int i;
     int max_ref = 1;
 
     /* Allow an extra refcount for one shadow pt mapping in shadowed domains */
@@ -822,11 +838,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
             continue;
 
         /* Quick zero-check */
-        for ( j=0; j<16; j++ )
-            if( *(map[i]+j) != 0 )
-                break;
-
-        if ( j < 16 )
+        if ( !p2m_pod_words_zero(map[i], POD_QUICK_CHECK_WORDS) )
         {
             unmap_domain_page(map[i]);
             map[i] = NULL;
@@ -857,15 +869,13 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
         if(!map[i])
             continue;
 
-        for ( j=0; j<PAGE_SIZE/sizeof(*map[i]); j++ )
-            if( *(map[i]+j) != 0 )
-                break;
+        zero = p2m_pod_words_zero(map[i], PAGE_SIZE / sizeof(*map[i]));
 
         unmap_domain_page(map[i]);
 
         /* See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.  */
-        if ( j < PAGE_SIZE/sizeof(*map[i]) )
+        if ( !zero )
         {
             set_p2m_entry(p2m, gfns[i], mfns[i], PAGE_ORDER_4K,
                 types[i], p2m->default_access);
@@ -919,30 +929,55 @@ p2m_pod_check_last_super(struct p2m_domain *p2m, unsigned long gfn_aligned)
 
 
 #define POD_SWEEP_STRIDE  16
+
+/* Scan down from reclaim_single for zeroed guest memory to give back to
+ * the PoD cache.  Superpage mappings are checked, and reclaimed, as a
+ * whole first.  An asynchronous sweep then skips over them, so it never
+ * shatters them; a synchronous one falls back to checking their 4k pages,
+ * as zero pages inside partly used superpages may be all there is.  4k
+ * mappings are checked POD_SWEEP_STRIDE at a time.  The scan stops once
+ * the cache holds @target pages, or after @limit gfns -- for a synchronous
+ * sweep only once it has found *something*.  Called with the p2m and pod
+ * locks held. */
 static void
-p2m_pod_emergency_sweep(struct p2m_domain *p2m)
+p2m_pod_sweep(struct p2m_domain *p2m, unsigned long limit, long target,
+              bool_t async)
 {
     unsigned long gfns[POD_SWEEP_STRIDE];
-    unsigned long i, j=0, start, limit;
+    unsigned long i, j=0, gfn_aligned, scanned = 0;
+    /* gfns from here up are checked 4k at a time, superpage or not. */
+    unsigned long split_base = ~0UL;
+    long start_count = p2m->pod.count;
+    s_time_t start_time = NOW();
+    unsigned int order;
     p2m_type_t t;
+    p2m_access_t a;
 
+    ASSERT(p2m_locked_by_me(p2m));
+    ASSERT(pod_locked_by_me(p2m));
 
     if ( p2m->pod.reclaim_single == 0 )
         p2m->pod.reclaim_single = p2m->pod.max_guest;
 
-    start = p2m->pod.reclaim_single;
-    limit = (start > POD_SWEEP_LIMIT) ? (start - POD_SWEEP_LIMIT) : 0;
-
-    /* FIXME: Figure out how to avoid superpages */
-    /* NOTE: Promote to globally locking the p2m. This will get complicated
-     * in a fine-grained scenario. If we lock each gfn individually we must be
-     * careful about spinlock recursion limits and POD_SWEEP_STRIDE. */
-    p2m_lock(p2m);
     for ( i=p2m->pod.reclaim_single; i > 0 ; i-- )
     {
-        p2m_access_t a;
-        (void)p2m->get_entry(p2m, i, &t, &a, 0, NULL);
-        if ( p2m_is_ram(t) )
+        order = PAGE_ORDER_4K;
+        (void)p2m->get_entry(p2m, i, &t, &a, 0, &order);
+        if ( p2m_is_ram(t) && order >= PAGE_ORDER_2M && i < split_base )
+        {
+            gfn_aligned = i & ~(SUPERPAGE_PAGES - 1);
+            if ( !p2m_pod_zero_check_superpage(p2m, gfn_aligned) && !async )
+                split_base = gfn_aligned;
+            else
+            {
+                scanned += i - gfn_aligned;
+                i = gfn_aligned;
+                if ( i == 0 )
+                    break;
+            }
+        }
+
+        if ( p2m_is_ram(t) && (order < PAGE_ORDER_2M || i >= split_base) )
         {
             gfns[j] = i;
             j++;
@@ -953,21 +988,101 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
                 j = 0;
             }
         }
-        /* Stop if we're past our limit and we have found *something*.
-         *
-         * NB that this is a zero-sum game; we're increasing our cache size
+        scanned++;
+
+        /* NB that this is a zero-sum game; we're increasing our cache size
          * by re-increasing our 'debt'.  Since we hold the pod lock,
          * (entry_count - count) must remain the same. */
-        if ( p2m->pod.count > 0 && i < limit )
+        if ( p2m->pod.count >= target ||
+             (scanned >= limit && (async || p2m->pod.count > 0)) )
             break;
     }
 
     if ( j )
         p2m_pod_zero_check(p2m, gfns, j);
 
-    p2m_unlock(p2m);
     p2m->pod.reclaim_single = i ? i - 1 : i;
 
+    if ( tb_init_done )
+    {
+        struct {
+            u32 d:16, async:16;
+            u32 scanned, reclaimed, ns;
+        } t;
+
+        t.d = p2m->domain->domain_id;
+        t.async = async;
+        t.scanned = scanned;
+        t.reclaimed = p2m->pod.count - start_count;
+        t.ns = NOW() - start_time;
+
+        __trace_var(TRC_MEM_POD_SWEEP, 0, sizeof(t), &t);
+    }
+}
+
+/* Last resort when the cache is empty: sweep until something turns up. */
+static void
+p2m_pod_emergency_sweep(struct p2m_domain *p2m)
+{
+    /* NOTE: Promote to globally locking the p2m. This will get complicated
+     * in a fine-grained scenario. If we lock each gfn individually we must be
+     * careful about spinlock recursion limits and POD_SWEEP_STRIDE. */
+    p2m_lock(p2m);
+    p2m_pod_sweep(p2m, POD_SWEEP_LIMIT, LONG_MAX, 0);
+    p2m_unlock(p2m);
+}
+
+/* The reclaim tasklet is kicked when a demand-populate leaves fewer than
+ * POD_RECLAIM_LOW pages in the cache, and sweeps at most POD_RECLAIM_BUDGET
+ * gfns per run until the cache is back at POD_RECLAIM_HIGH, so that guest
+ * faults rarely have to wait for an emergency sweep. */
+#define POD_RECLAIM_LOW     (SUPERPAGE_PAGES * 4)
+#define POD_RECLAIM_HIGH    (SUPERPAGE_PAGES * 16)
+#define POD_RECLAIM_BUDGET  (SUPERPAGE_PAGES * 16)
+
+static inline int
+p2m_pod_reclaim_wanted(struct p2m_domain *p2m, long level)
+{
+    return p2m->pod.count < level && p2m->pod.entry_count > p2m->pod.count;
+}
+
+static void
+p2m_pod_reclaim_worker(unsigned long data)
+{
+    struct p2m_domain *p2m = (struct p2m_domain *)data;
+    long before;
+    int again = 0;
+
+    p2m_lock(p2m);
+    pod_lock(p2m);
+
+    /* Checked under the pod lock; see p2m_pod_demand_populate(). */
+    if ( !p2m->domain->is_dying &&
+         p2m_pod_reclaim_wanted(p2m, POD_RECLAIM_HIGH) )
+    {
+        before = p2m->pod.count;
+        p2m_pod_sweep(p2m, POD_RECLAIM_BUDGET, POD_RECLAIM_HIGH, 1);
+
+        /* Carry on for as long as it pays off. */
+        again = p2m->pod.count > before &&
+                p2m_pod_reclaim_wanted(p2m, POD_RECLAIM_HIGH);
+    }
+
+    pod_unlock(p2m);
+    p2m_unlock(p2m);
+
+    if ( again )
+        tasklet_schedule(&p2m->pod.reclaim_tasklet);
+}
+
+void
+p2m_pod_init(struct p2m_domain *p2m)
+{
+    mm_lock_init(&p2m->pod.lock);
+    INIT_PAGE_LIST_HEAD(&p2m->pod.super);
+    INIT_PAGE_LIST_HEAD(&p2m->pod.single);
+    tasklet_init(&p2m->pod.reclaim_tasklet, p2m_pod_reclaim_worker,
+                 (unsigned long)p2m);
 }
 
 int
@@ -1060,6 +1175,10 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
         __trace_var(TRC_MEM_POD_POPULATE, 0, sizeof(t), &t);
     }
 
+    /* Top the cache back up in the background before it runs dry. */
+    if ( p2m_pod_reclaim_wanted(p2m, POD_RECLAIM_LOW) )
+        tasklet_schedule(&p2m->pod.reclaim_tasklet);
+
     /* Check the last guest demand-populate */
     if ( p2m->pod.entry_count > p2m->pod.count 
          && (order == PAGE_ORDER_2M)
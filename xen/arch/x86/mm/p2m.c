@@ -62,11 +62,9 @@ static int p2m_initialise(struct domain *d, struct p2m_domain *p2m)
     int ret = 0;
 
     mm_rwlock_init(&p2m->lock);
-    mm_lock_init(&p2m->pod.lock);
     INIT_LIST_HEAD(&p2m->np2m_list);
     INIT_PAGE_LIST_HEAD(&p2m->pages);
-    INIT_PAGE_LIST_HEAD(&p2m->pod.super);
-    INIT_PAGE_LIST_HEAD(&p2m->pod.single);
+    p2m_pod_init(p2m);
 
     p2m->domain = d;
     p2m->default_access = p2m_access_rwx;
@@ -553,6 +551,8 @@ guest_physmap_add_entry(struct domain *d, unsigned long gfn,
     p2m_type_t ot;
     p2m_access_t a;
     mfn_t omfn;
+    unsigned long j, n;
+    unsigned int cur_order;
     int pod_count = 0;
     int rc = 0;
 
@@ -579,10 +579,20 @@ guest_physmap_add_entry(struct domain *d, unsigned long gfn,
 
     P2M_DEBUG("adding gfn=%#lx mfn=%#lx\n", gfn, mfn);
 
-    /* First, remove m->p mappings for existing p->m mappings */
-    for ( i = 0; i < (1UL << page_order); i++ )
+    /*
+     * First, remove m->p mappings for existing p->m mappings.  Nothing has
+     * ever been mapped above max_mapped_pfn, which saves a walk per page
+     * when populating fresh memory, and a RAM superpage is dealt with in
+     * one step rather than one walk per 4k page.
+     */
+    for ( i = 0; i < (1UL << page_order); i += n )
     {
-        omfn = p2m->get_entry(p2m, gfn + i, &ot, &a, 0, NULL);
+        if ( gfn + i > p2m->max_mapped_pfn )
+            break;
+
+        n = 1;
+        cur_order = PAGE_ORDER_4K;
+        omfn = p2m->get_entry(p2m, gfn + i, &ot, &a, 0, &cur_order);
         if ( p2m_is_shared(ot) )
         {
             /* Do an unshare to cleanly take care of all corner 
@@ -620,7 +630,11 @@ guest_physmap_add_entry(struct domain *d, unsigned long gfn,
         else if ( p2m_is_ram(ot) && !p2m_is_paged(ot) )
         {
             ASSERT(mfn_valid(omfn));
-            set_gpfn_from_mfn(mfn_x(omfn), INVALID_M2P_ENTRY);
+            /* Rest of the superpage that falls within our range. */
+            n = min((1UL << cur_order) - ((gfn + i) & ((1UL << cur_order) - 1)),
+                    (1UL << page_order) - i);
+            for ( j = 0; j < n; j++ )
+                set_gpfn_from_mfn(mfn_x(omfn) + j, INVALID_M2P_ENTRY);
         }
         else if ( ot == p2m_populate_on_demand )
         {
@@ -997,6 +1011,53 @@ int p2m_mem_paging_evict(struct domain *d, unsigned long gfn)
     return ret;
 }
 
+/**
+ * p2m_mem_paging_absent - Mark an unpopulated guest page as paged-out
+ * @d: guest domain
+ * @gfn: guest page which has no backing mfn yet
+ *
+ * Returns 0 for success or negative errno values if the gfn is populated.
+ *
+ * p2m_mem_paging_absent() is called by the pager for gfns whose contents live
+ * outside the host, e.g. on the source host of a post-copy migration.  The
+ * gfn must not be backed by a mfn.  Afterwards it is in the same state as an
+ * evicted gfn: any access is reported to the pager via
+ * p2m_mem_paging_populate(), and the pager supplies the contents with
+ * p2m_mem_paging_prep().
+ */
+int p2m_mem_paging_absent(struct domain *d, unsigned long gfn)
+{
+    p2m_type_t p2mt;
+    p2m_access_t a;
+    mfn_t mfn;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    int ret = -EBUSY;
+
+    gfn_lock(p2m, gfn, 0);
+
+    mfn = p2m->get_entry(p2m, gfn, &p2mt, &a, 0, NULL);
+
+    /* Allow only holes in the physmap */
+    if ( mfn_valid(mfn) )
+        goto out;
+    if ( (p2mt != p2m_invalid) && (p2mt != p2m_mmio_dm) )
+        goto out;
+
+    ret = -ENOMEM;
+    if ( !set_p2m_entry(p2m, gfn, _mfn(INVALID_MFN), PAGE_ORDER_4K,
+                        p2m_ram_paged, p2m->default_access) )
+        goto out;
+
+    /* Track number of paged gfns */
+    atomic_inc(&d->paged_pages);
+
+    ret = 0;
+
+ out:
+    gfn_unlock(p2m, gfn, 0);
+    return ret;
+}
+
 /**
  * p2m_mem_paging_drop_page - Tell pager to drop its reference to a paged page
  * @d: guest domain
@@ -1098,8 +1098,11 @@ long subarch_memory_op(int op, XEN_GUEST_HANDLE_PARAM(void) arg)
         if ( copy_from_guest(&meo, arg, 1) )
             return -EFAULT;
         rc = do_mem_event_op(op, meo.domain, (void *) &meo);
-        if ( !rc && __copy_to_guest(arg, &meo, 1) )
+        if ( (!rc || rc == -EAGAIN) && __copy_to_guest(arg, &meo, 1) )
             return -EFAULT;
+        if ( rc == -EAGAIN )
+            rc = hypercall_create_continuation(
+                    __HYPERVISOR_memory_op, "ih", op, arg);
         break;
     }
     case XENMEM_sharing_op:
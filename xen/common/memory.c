@@ -16,6 +16,7 @@
 #include <xen/event.h>
 #include <xen/paging.h>
 #include <xen/iocap.h>
+#include <xen/iommu.h>
 #include <xen/guest_access.h>
 #include <xen/hypercall.h>
 #include <xen/errno.h>
@@ -94,6 +95,8 @@ static void populate_physmap(struct memop_args *a)
     unsigned long i, j;
     xen_pfn_t gpfn, mfn;
     struct domain *d = a->domain;
+    unsigned int memflags = a->memflags;
+    bool_t paused = 0;
 
     if ( !guest_handle_subrange_okay(a->extent_list, a->nr_done,
                                      a->nr_extents-1) )
@@ -103,6 +106,28 @@ static void populate_physmap(struct memop_args *a)
          !multipage_allocation_permitted(current->domain, a->extent_order) )
         return;
 
+    /*
+     * Another domain paused by its controller, whether since creation or
+     * later, cannot touch its new memory before we return, so the TLB
+     * flushes owed for reused pages can be issued once for the whole batch.
+     * Our own pause reference, taken before checking, keeps an unpause
+     * racing with us from letting its vCPUs run before that.  IOTLB flushes
+     * are batched the same way for any domain.
+     */
+    if ( d->is_paused_by_controller && d != current->domain )
+    {
+        atomic_inc(&d->pause_count);
+        if ( d->is_paused_by_controller )
+        {
+            memflags |= MEMF_no_tlbflush;
+            paused = 1;
+        }
+        else
+            domain_unpause(d);
+    }
+    if ( need_iommu(d) )
+        this_cpu(iommu_dont_flush_iotlb) = 1;
+
     for ( i = a->nr_done; i < a->nr_extents; i++ )
     {
         if ( hypercall_preempt_check() )
@@ -122,7 +147,7 @@ static void populate_physmap(struct memop_args *a)
         }
         else
         {
-            page = alloc_domheap_pages(d, a->extent_order, a->memflags);
+            page = alloc_domheap_pages(d, a->extent_order, memflags);
             if ( unlikely(page == NULL) ) 
             {
                 if ( !opt_tmem || (a->extent_order != 0) )
@@ -149,6 +174,16 @@ static void populate_physmap(struct memop_args *a)
     }
 
 out:
+    if ( need_iommu(d) )
+    {
+        this_cpu(iommu_dont_flush_iotlb) = 0;
+        if ( i != a->nr_done )
+            iommu_iotlb_flush_all(d);
+    }
+    flush_deferred_alloc_tlb();
+    if ( paused )
+        domain_unpause(d);
+
     a->nr_done = i;
 }
 
@@ -23,6 +23,7 @@
 
 #include <xen/config.h>
 #include <xen/init.h>
+#include <xen/cpu.h>
 #include <xen/types.h>
 #include <xen/lib.h>
 #include <xen/sched.h>
@@ -30,6 +31,7 @@
 #include <xen/mm.h>
 #include <xen/irq.h>
 #include <xen/softirq.h>
+#include <xen/stop_machine.h>
 #include <xen/domain_page.h>
 #include <xen/keyhandler.h>
 #include <xen/perfc.h>
@@ -244,8 +246,33 @@ typedef struct page_list_head heap_by_zone_and_order_t[NR_ZONES][MAX_ORDER+1];
 static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 #define heap(node, zone, order) ((*_heap[node])[zone][order])
 
+#define SCRUB_MAX_ORDER 7
+
+/*
+ * Each node's free lists, avail[] counters and page total are protected by
+ * that node's heap lock, so allocations on different nodes do not contend.
+ * heap_lock covers only the offlined/broken page lists, the low-memory virq
+ * thresholds and calls into tmem; it nests inside a node's heap lock.
+ */
+struct heap_node {
+    spinlock_t lock;
+    long avail_pages;
+    /*
+     * Freed blocks awaiting scrubbing, by order; counted in avail_pages and
+     * avail[]. The list a block is on gives its order: these pages are
+     * still in use, so PFN_ORDER() would clobber their (NULL) owner.
+     */
+    struct page_list_head dirty[SCRUB_MAX_ORDER + 1];
+    unsigned long dirty_pages;
+#ifdef PERF_COUNTERS
+    s_time_t locked_at;
+#endif
+} __cacheline_aligned;
+
+static struct heap_node heap_nodes[MAX_NUMNODES] = {
+    [0 ... MAX_NUMNODES - 1] = { .lock = SPIN_LOCK_UNLOCKED }
+};
 static unsigned long *avail[MAX_NUMNODES];
-static long total_avail_pages;
 
 /* TMEM: Reserve a fraction of memory for mid-size (0<order<9) allocations.*/
 static long midsize_alloc_zone_pages;
@@ -253,6 +280,72 @@ static long midsize_alloc_zone_pages;
 
 static DEFINE_SPINLOCK(heap_lock);
 
+#ifdef PERF_COUNTERS
+/* Bucket of the 2^n ns histograms kept for heap lock holds and allocations. */
+static inline unsigned int ns_bucket(s_time_t ns)
+{
+    return (ns >= (1L << 19)) ? 19 : (ns <= 0) ? 0 : fls((unsigned int)ns);
+}
+#endif
+
+static inline void heap_lock_node(unsigned int node)
+{
+    struct heap_node *hn = &heap_nodes[node];
+
+    if ( !spin_trylock(&hn->lock) )
+    {
+        perfc_incr(heap_lock_contended);
+        spin_lock(&hn->lock);
+    }
+#ifdef PERF_COUNTERS
+    hn->locked_at = NOW();
+#endif
+}
+
+static inline void heap_unlock_node(unsigned int node)
+{
+#ifdef PERF_COUNTERS
+    s_time_t held = NOW() - heap_nodes[node].locked_at;
+
+    perfc_incra(heap_lock_hold, ns_bucket(held));
+#endif
+    spin_unlock(&heap_nodes[node].lock);
+}
+
+static long total_avail_pages(void)
+{
+    unsigned int node;
+    long total = 0;
+
+    for_each_online_node ( node )
+        total += heap_nodes[node].avail_pages;
+
+    return total;
+}
+
+/*
+ * Per-CPU caches of free blocks of order 0 to HEAP_CACHE_MAX_ORDER, taken
+ * from and returned to the CPU's own node in batches so that most small
+ * allocations and frees do not touch a heap lock at all. Cached pages count
+ * as allocated in the heap totals and stay in PGC_state_inuse, with no
+ * owner, so the buddy allocator never tries to merge with them; their
+ * free-time TLB stamp is kept in u.free until they are handed out again.
+ */
+#define HEAP_CACHE_MAX_ORDER 2
+#define HEAP_CACHE_PAGES     32  /* per CPU and order */
+#define HEAP_CACHE_BATCH     8   /* pages moved by one refill or drain */
+
+struct heap_cache {
+    struct page_list_head list[HEAP_CACHE_MAX_ORDER + 1];
+    unsigned int count[HEAP_CACHE_MAX_ORDER + 1];
+};
+
+static DEFINE_PER_CPU(struct heap_cache, heap_cache);
+static bool_t __read_mostly heap_cache_enabled;
+
+static bool_t __read_mostly opt_heap_cache = 1;
+boolean_param("heapcache", opt_heap_cache);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     ASSERT(spin_is_locked(&d->page_alloc_lock));
@@ -321,6 +414,9 @@ static unsigned long init_node_heap(int node, unsigned long mfn,
         for ( j = 0; j <= MAX_ORDER; j++ )
             INIT_PAGE_LIST_HEAD(&(*_heap[node])[i][j]);
 
+    for ( j = 0; j <= SCRUB_MAX_ORDER; j++ )
+        INIT_PAGE_LIST_HEAD(&heap_nodes[node].dirty[j]);
+
     return needed;
 }
 
@@ -364,7 +460,7 @@ static void __init setup_low_mem_virq(void)
     /* Dom0 has already been allocated by now. So check we won't be
      * complaining immediately with whatever's left of the heap. */
     threshold = min(threshold,
-                    ((paddr_t) total_avail_pages) << PAGE_SHIFT);
+                    ((paddr_t) total_avail_pages()) << PAGE_SHIFT);
 
     /* Then, cap to some predefined maximum */
     threshold = min(threshold, MAX_LOW_MEM_VIRQ);
@@ -372,7 +468,7 @@ static void __init setup_low_mem_virq(void)
     /* If the user specified no knob, and we are at the current available
      * level, halve the threshold. */
     if ( halve &&
-         (threshold == (((paddr_t) total_avail_pages) << PAGE_SHIFT)) )
+         (threshold == (((paddr_t) total_avail_pages()) << PAGE_SHIFT)) )
         threshold >>= 1;
 
     /* Zero? Have to fire immediately */
@@ -396,9 +492,16 @@ static void __init setup_low_mem_virq(void)
 
 static void check_low_mem_virq(void)
 {
-    unsigned long avail_pages = total_avail_pages +
+    unsigned long avail_pages = total_avail_pages() +
         (opt_tmem ? tmem_freeable_pages() : 0);
 
+    /* Unlocked fast check; the thresholds only move under heap_lock. */
+    if ( likely(avail_pages > low_mem_virq_th) &&
+         likely(avail_pages < low_mem_virq_high) )
+        return;
+
+    spin_lock(&heap_lock);
+
     if ( unlikely(avail_pages <= low_mem_virq_th) )
     {
         send_global_virq(VIRQ_ENOMEM);
@@ -410,37 +513,650 @@ static void check_low_mem_virq(void)
         if ( low_mem_virq_th_order > 0 )
             low_mem_virq_th_order--;
         low_mem_virq_th     = 1UL << low_mem_virq_th_order;
+    }
+    else if ( unlikely(avail_pages >= low_mem_virq_high) )
+    {
+        /* Reset hysteresis. Bring threshold up one order.
+         * If we are back where originally set, set high
+         * threshold to -1 to avoid further growth of
+         * virq threshold. */
+        low_mem_virq_th_order++;
+        low_mem_virq_th = 1UL << low_mem_virq_th_order;
+        if ( low_mem_virq_th == low_mem_virq_orig )
+            low_mem_virq_high = -1UL;
+        else
+            low_mem_virq_high = 1UL << (low_mem_virq_th_order + 2);
+    }
+
+    spin_unlock(&heap_lock);
+}
+
+/*
+ * Take a 2^@order block from @node's free lists and mark it in use.
+ * Called with the node's heap lock held.
+ */
+static struct page_info *take_heap_block(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order)
+{
+    unsigned int i, j, zone = zone_hi;
+    unsigned long request = 1UL << order;
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&heap_nodes[node].lock));
+
+    do {
+        /* Check if target node can support the allocation. */
+        if ( !avail[node] || (avail[node][zone] < request) )
+            continue;
+
+        /* Find smallest order which can satisfy the request. */
+        for ( j = order; j <= MAX_ORDER; j++ )
+            if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
+                goto found;
+    } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+
+    return NULL;
+
+ found: 
+    /* We may have to halve the chunk a number of times. */
+    while ( j != order )
+    {
+        PFN_ORDER(pg) = --j;
+        page_list_add_tail(pg, &heap(node, zone, j));
+        pg += 1 << j;
+    }
+
+    ASSERT(avail[node][zone] >= request);
+    avail[node][zone] -= request;
+    heap_nodes[node].avail_pages -= request;
+    ASSERT(heap_nodes[node].avail_pages >= 0);
+
+    for ( i = 0; i < request; i++ )
+    {
+        /* Reference count must continuously be zero for free pages. */
+        BUG_ON(pg[i].count_info != PGC_state_free);
+        pg[i].count_info = PGC_state_inuse;
+    }
+
+    return pg;
+}
+
+/* Ready a page for its new user, noting the TLB flush it may still need. */
+static void prepare_alloc_page(
+    struct page_info *pg, bool_t *need_tlbflush, uint32_t *tlbflush_timestamp)
+{
+    if ( pg->u.free.need_tlbflush &&
+         (pg->tlbflush_timestamp <= tlbflush_current_time()) &&
+         (!*need_tlbflush ||
+          (pg->tlbflush_timestamp > *tlbflush_timestamp)) )
+    {
+        *need_tlbflush = 1;
+        *tlbflush_timestamp = pg->tlbflush_timestamp;
+    }
+
+    /* Initialise fields which have other uses for free pages. */
+    pg->u.inuse.type_info = 0;
+    page_set_owner(pg, NULL);
+}
+
+/* TLB flush owed by this CPU's MEMF_no_tlbflush allocations. */
+static DEFINE_PER_CPU(bool_t, alloc_tlbflush_deferred);
+static DEFINE_PER_CPU(uint32_t, alloc_tlbflush_timestamp);
+
+static void flush_alloc_tlb(
+    unsigned int memflags, bool_t need_tlbflush, uint32_t tlbflush_timestamp)
+{
+    cpumask_t mask = cpu_online_map;
+
+    if ( !need_tlbflush )
+        return;
+
+    if ( memflags & MEMF_no_tlbflush )
+    {
+        if ( !this_cpu(alloc_tlbflush_deferred) ||
+             (tlbflush_timestamp > this_cpu(alloc_tlbflush_timestamp)) )
+            this_cpu(alloc_tlbflush_timestamp) = tlbflush_timestamp;
+        this_cpu(alloc_tlbflush_deferred) = 1;
+        return;
+    }
+
+    tlbflush_filter(mask, tlbflush_timestamp);
+    if ( !cpumask_empty(&mask) )
+    {
+        perfc_incr(need_flush_tlb_flush);
+        flush_tlb_mask(&mask);
+    }
+}
+
+/*
+ * Issue the TLB flush put off by MEMF_no_tlbflush allocations. Must happen
+ * before anything but the allocating context can reach the new pages.
+ */
+void flush_deferred_alloc_tlb(void)
+{
+    if ( !this_cpu(alloc_tlbflush_deferred) )
+        return;
+
+    this_cpu(alloc_tlbflush_deferred) = 0;
+    flush_alloc_tlb(0, 1, this_cpu(alloc_tlbflush_timestamp));
+}
+
+/* Remove any offlined page in the buddy pointed to by head. */
+static int reserve_offlined_page(struct page_info *head)
+{
+    unsigned int node = phys_to_nid(page_to_maddr(head));
+    int zone = page_to_zone(head), i, head_order = PFN_ORDER(head), count = 0;
+    struct page_info *cur_head;
+    int cur_order;
+
+    ASSERT(spin_is_locked(&heap_nodes[node].lock));
+    ASSERT(spin_is_locked(&heap_lock));
+
+    cur_head = head;
+
+    page_list_del(head, &heap(node, zone, head_order));
+
+    while ( cur_head < (head + (1 << head_order)) )
+    {
+        struct page_info *pg;
+        int next_order;
+
+        if ( page_state_is(cur_head, offlined) )
+        {
+            cur_head++;
+            continue;
+        }
+
+        next_order = cur_order = 0;
+
+        while ( cur_order < head_order )
+        {
+            next_order = cur_order + 1;
+
+            if ( (cur_head + (1 << next_order)) >= (head + ( 1 << head_order)) )
+                goto merge;
+
+            for ( i = (1 << cur_order), pg = cur_head + (1 << cur_order );
+                  i < (1 << next_order);
+                  i++, pg++ )
+                if ( page_state_is(pg, offlined) )
+                    break;
+            if ( i == ( 1 << next_order) )
+            {
+                cur_order = next_order;
+                continue;
+            }
+            else
+            {
+            merge:
+                /* We don't consider merging outside the head_order. */
+                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
+                PFN_ORDER(cur_head) = cur_order;
+                cur_head += (1 << cur_order);
+                break;
+            }
+        }
+    }
+
+    for ( cur_head = head; cur_head < head + ( 1UL << head_order); cur_head++ )
+    {
+        if ( !page_state_is(cur_head, offlined) )
+            continue;
+
+        avail[node][zone]--;
+        heap_nodes[node].avail_pages--;
+        ASSERT(heap_nodes[node].avail_pages >= 0);
+
+        page_list_add_tail(cur_head,
+                           test_bit(_PGC_broken, &cur_head->count_info) ?
+                           &page_broken_list : &page_offlined_list);
+
+        count++;
+    }
+
+    return count;
+}
+
+/* Strip a page being freed of its owner, recording any TLB flush it needs. */
+static void retire_heap_page(struct page_info *pg)
+{
+    /* If a page has no owner it will need no safety TLB flush. */
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        pg->tlbflush_timestamp = tlbflush_current_time();
+
+    /* This page is not a guest frame any more. */
+    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
+    set_gpfn_from_mfn(page_to_mfn(pg), INVALID_M2P_ENTRY);
+}
+
+/*
+ * Put a block of retired pages back on the free lists, merging it with its
+ * buddies as far as possible. Called with the node's heap lock held.
+ */
+static void merge_free_block(struct page_info *pg, unsigned int order)
+{
+    unsigned long mask;
+    unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
+    unsigned int zone = page_to_zone(pg);
+
+    ASSERT(order <= MAX_ORDER);
+    ASSERT(node >= 0);
+    ASSERT(spin_is_locked(&heap_nodes[node].lock));
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /*
+         * Cannot assume that count_info == 0, as there are some corner cases
+         * where it isn't the case and yet it isn't a bug:
+         *  1. page_get_owner() is NULL
+         *  2. page_get_owner() is a domain that was never accessible by
+         *     its domid (e.g., failed to fully construct the domain).
+         *  3. page was never addressable by the guest (e.g., it's an
+         *     auto-translate-physmap guest and the page was never included
+         *     in its pseudophysical address space).
+         * In all the above cases there can be no guest mappings of this page.
+         */
+        ASSERT(!page_state_is(&pg[i], offlined));
+        pg[i].count_info =
+            ((pg[i].count_info & PGC_broken) |
+             (page_state_is(&pg[i], offlining)
+              ? PGC_state_offlined : PGC_state_free));
+        if ( page_state_is(&pg[i], offlined) )
+            tainted = 1;
+    }
+
+    avail[node][zone] += 1 << order;
+    heap_nodes[node].avail_pages += 1 << order;
+
+    if ( opt_tmem )
+        midsize_alloc_zone_pages = max(
+            midsize_alloc_zone_pages, total_avail_pages() / MIDSIZE_ALLOC_FRAC);
+
+    /* Merge chunks as far as possible. */
+    while ( order < MAX_ORDER )
+    {
+        mask = 1UL << order;
+
+        if ( (page_to_mfn(pg) & mask) )
+        {
+            /* Merge with predecessor block? */
+            if ( !mfn_valid(page_to_mfn(pg-mask)) ||
+                 !page_state_is(pg-mask, free) ||
+                 (PFN_ORDER(pg-mask) != order) ||
+                 (phys_to_nid(page_to_maddr(pg-mask)) != node) )
+                break;
+            pg -= mask;
+            page_list_del(pg, &heap(node, zone, order));
+        }
+        else
+        {
+            /* Merge with successor block? */
+            if ( !mfn_valid(page_to_mfn(pg+mask)) ||
+                 !page_state_is(pg+mask, free) ||
+                 (PFN_ORDER(pg+mask) != order) ||
+                 (phys_to_nid(page_to_maddr(pg+mask)) != node) )
+                break;
+            page_list_del(pg + mask, &heap(node, zone, order));
+        }
+
+        order++;
+    }
+
+    PFN_ORDER(pg) = order;
+    page_list_add_tail(pg, &heap(node, zone, order));
+
+    if ( tainted )
+    {
+        spin_lock(&heap_lock);
+        reserve_offlined_page(pg);
+        spin_unlock(&heap_lock);
+    }
+}
+
+/*
+ * Freed pages whose old contents must not leak are parked, retired but
+ * still in use, on their node's dirty lists in blocks of at most
+ * 2^SCRUB_MAX_ORDER pages. Idle CPUs scrub them in the background, and an
+ * allocation which finds no clean block scrubs only what it needs, up to
+ * SCRUB_ALLOC_MAX pages: scrubbing runs without preemption, so beyond that
+ * it looks on other nodes or fails, and leaves the rest to idle CPUs.
+ */
+#define SCRUB_BATCH     (1UL << SCRUB_MAX_ORDER) /* pages per scrub pass */
+#define SCRUB_ALLOC_MAX (SCRUB_BATCH << 2)       /* a superpage */
+
+typedef struct page_list_head dirty_lists_t[SCRUB_MAX_ORDER + 1];
+
+static void init_dirty_lists(dirty_lists_t lists)
+{
+    unsigned int order;
+
+    for ( order = 0; order <= SCRUB_MAX_ORDER; order++ )
+        INIT_PAGE_LIST_HEAD(&lists[order]);
+}
+
+/* Queue a retired block for scrubbing. Called with the node's lock held. */
+static void add_dirty_block(struct page_info *pg, unsigned int order)
+{
+    unsigned int node = phys_to_nid(page_to_maddr(pg));
+    unsigned int zone = page_to_zone(pg);
+    unsigned int chunk = min_t(unsigned int, order, SCRUB_MAX_ORDER);
+    unsigned long i, nr = 1UL << order;
+
+    ASSERT(spin_is_locked(&heap_nodes[node].lock));
+
+    for ( i = 0; i < nr; i += 1UL << chunk )
+        page_list_add_tail(&pg[i], &heap_nodes[node].dirty[chunk]);
+
+    avail[node][zone] += nr;
+    heap_nodes[node].avail_pages += nr;
+    heap_nodes[node].dirty_pages += nr;
+}
+
+/*
+ * Move dirty blocks of @node in zones @zone_lo to @zone_hi onto @lists,
+ * largest first, until at least @nr pages are taken. Called with the
+ * node's heap lock held.
+ */
+static unsigned long take_dirty_blocks(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned long nr, dirty_lists_t lists)
+{
+    struct heap_node *hn = &heap_nodes[node];
+    struct page_info *pg, *tmp;
+    unsigned long taken = 0, request;
+    unsigned int zone;
+    int order;
+
+    ASSERT(spin_is_locked(&hn->lock));
+
+    for ( order = SCRUB_MAX_ORDER; (order >= 0) && (taken < nr); order-- )
+    {
+        request = 1UL << order;
+
+        page_list_for_each_safe ( pg, tmp, &hn->dirty[order] )
+        {
+            zone = page_to_zone(pg);
+            if ( (zone < zone_lo) || (zone > zone_hi) )
+                continue;
+
+            page_list_del(pg, &hn->dirty[order]);
+            page_list_add_tail(pg, &lists[order]);
+
+            /* merge_free_block() accounts for the pages again. */
+            avail[node][zone] -= request;
+            hn->avail_pages -= request;
+            hn->dirty_pages -= request;
+
+            if ( (taken += request) >= nr )
+                break;
+        }
+    }
+
+    return taken;
+}
+
+/* Scrub the blocks on @lists and free them into @node's heap. */
+static void scrub_dirty_blocks(unsigned int node, dirty_lists_t lists)
+{
+    struct page_info *pg;
+    unsigned int i, order;
+
+    for ( order = 0; order <= SCRUB_MAX_ORDER; order++ )
+        page_list_for_each ( pg, &lists[order] )
+            for ( i = 0; i < (1U << order); i++ )
+                scrub_one_page(&pg[i]);
+
+    heap_lock_node(node);
+    for ( order = 0; order <= SCRUB_MAX_ORDER; order++ )
+        while ( (pg = page_list_remove_head(&lists[order])) != NULL )
+            merge_free_block(pg, order);
+    heap_unlock_node(node);
+}
+
+/*
+ * Scrub @nr dirty pages of @node in the given zones, give or take a block,
+ * for an allocation that found no clean block. Returns the number scrubbed.
+ */
+static unsigned long scrub_dirty_pages(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned long nr)
+{
+    dirty_lists_t lists;
+    unsigned long n;
+
+    if ( !nr || !heap_nodes[node].dirty_pages )
+        return 0;
+
+    init_dirty_lists(lists);
+    heap_lock_node(node);
+    n = take_dirty_blocks(node, zone_lo, zone_hi, nr, lists);
+    heap_unlock_node(node);
+
+    if ( n )
+    {
+        scrub_dirty_blocks(node, lists);
+        perfc_add(scrub_alloc_pages, n);
+    }
+
+    return n;
+}
+
+/*
+ * Scrub a batch of dirty pages from the idle loop, preferring the local
+ * node. Returns non-zero if work was done, so the caller should not sleep.
+ */
+bool_t scrub_free_pages(void)
+{
+    unsigned int cpu = smp_processor_id(), node = cpu_to_node(cpu), i;
+    dirty_lists_t lists;
+    unsigned long n;
+
+    if ( softirq_pending(cpu) )
+        return 0;
+
+    if ( !heap_nodes[node].dirty_pages )
+    {
+        for_each_online_node ( i )
+            if ( heap_nodes[i].dirty_pages )
+                break;
+        if ( i >= MAX_NUMNODES )
+            return 0;
+        node = i;
+    }
+
+    init_dirty_lists(lists);
+    heap_lock_node(node);
+    n = take_dirty_blocks(node, 0, NR_ZONES - 1, SCRUB_BATCH, lists);
+    heap_unlock_node(node);
+
+    if ( !n )
+        return 0;
+
+    scrub_dirty_blocks(node, lists);
+    perfc_add(scrub_idle_pages, n);
+
+    return 1;
+}
+
+static unsigned int heap_cache_batch(unsigned int order)
+{
+    return max_t(unsigned int, HEAP_CACHE_BATCH >> order, 1);
+}
+
+/* Return up to @nr cached blocks of 2^@order pages to the buddy lists. */
+static void heap_cache_drain(
+    struct heap_cache *hc, unsigned int order, unsigned int nr)
+{
+    struct page_info *pg;
+    unsigned int node;
+
+    if ( !nr || page_list_empty(&hc->list[order]) )
         return;
+
+    /* Everything in a CPU's cache comes from and goes to its own node. */
+    node = phys_to_nid(page_to_maddr(page_list_first(&hc->list[order])));
+
+    heap_lock_node(node);
+    while ( nr-- && (pg = page_list_remove_head(&hc->list[order])) )
+    {
+        ASSERT(phys_to_nid(page_to_maddr(pg)) == node);
+        hc->count[order]--;
+        merge_free_block(pg, order);
     }
+    heap_unlock_node(node);
+
+    perfc_incr(heap_cache_drain);
+}
+
+static bool_t heap_cache_drain_all(struct heap_cache *hc)
+{
+    unsigned int order;
+    bool_t drained = 0;
 
-    if ( unlikely(avail_pages >= low_mem_virq_high) )
+    for ( order = 0; order <= HEAP_CACHE_MAX_ORDER; order++ )
+    {
+        drained |= !!hc->count[order];
+        heap_cache_drain(hc, order, hc->count[order]);
+    }
+
+    return drained;
+}
+
+static unsigned int heap_cache_refill(
+    struct heap_cache *hc, unsigned int node,
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int order)
+{
+    unsigned int n = 0, batch = heap_cache_batch(order);
+    struct page_info *pg;
+
+    heap_lock_node(node);
+    while ( (n < batch) &&
+            (pg = take_heap_block(node, zone_lo, zone_hi, order)) )
+    {
+        page_list_add_tail(pg, &hc->list[order]);
+        n++;
+    }
+    heap_unlock_node(node);
+
+    if ( n )
+    {
+        hc->count[order] += n;
+        perfc_incr(heap_cache_refill);
+        check_low_mem_virq();
+    }
+
+    return n;
+}
+
+/* Allocate 2^@order pages of @node from this CPU's cache, if it can serve. */
+static struct page_info *heap_cache_alloc(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags)
+{
+    struct heap_cache *hc = &this_cpu(heap_cache);
+    struct page_info *pg;
+    unsigned int i, zone;
+    bool_t need_tlbflush = 0;
+    uint32_t tlbflush_timestamp = 0;
+
+    if ( !heap_cache_enabled || (order > HEAP_CACHE_MAX_ORDER) ||
+         (node != cpu_to_node(smp_processor_id())) )
+        return NULL;
+
+    for ( ; ; )
+    {
+        if ( page_list_empty(&hc->list[order]) &&
+             !heap_cache_refill(hc, node, zone_lo, zone_hi, order) )
+            return NULL;
+
+        pg = page_list_first(&hc->list[order]);
+        zone = page_to_zone(pg);
+        if ( (zone < zone_lo) || (zone > zone_hi) )
+            return NULL;
+
+        page_list_del(pg, &hc->list[order]);
+        hc->count[order]--;
+
+        /* Pages offlined or broken while cached go back to the heap. */
+        for ( i = 0; i < (1 << order); i++ )
+            if ( pg[i].count_info != PGC_state_inuse )
+                break;
+        if ( i == (1 << order) )
+            break;
+
+        heap_lock_node(node);
+        merge_free_block(pg, order);
+        heap_unlock_node(node);
+    }
+
+    for ( i = 0; i < (1 << order); i++ )
+        prepare_alloc_page(&pg[i], &need_tlbflush, &tlbflush_timestamp);
+
+    flush_alloc_tlb(memflags, need_tlbflush, tlbflush_timestamp);
+
+    perfc_incr(page_alloc_fast);
+
+    return pg;
+}
+
+/* Free 2^@order pages into this CPU's cache, if they belong there. */
+static bool_t heap_cache_free(struct page_info *pg, unsigned int order)
+{
+    struct heap_cache *hc = &this_cpu(heap_cache);
+    unsigned long x, y;
+    unsigned int i, node;
+
+    if ( !heap_cache_enabled || (order > HEAP_CACHE_MAX_ORDER) )
+        return 0;
+
+    node = cpu_to_node(smp_processor_id());
+    if ( phys_to_nid(page_to_maddr(pg)) != node )
+        return 0;
+
+    /*
+     * Offlining and broken pages take the slow path, which retires them.
+     * The state is switched atomically as offline_page() does not take our
+     * locks; pages already switched are simply freed by the slow path.
+     */
+    for ( i = 0; i < (1 << order); i++ )
     {
-        /* Reset hysteresis. Bring threshold up one order.
-         * If we are back where originally set, set high
-         * threshold to -1 to avoid further growth of
-         * virq threshold. */
-        low_mem_virq_th_order++;
-        low_mem_virq_th = 1UL << low_mem_virq_th_order;
-        if ( low_mem_virq_th == low_mem_virq_orig )
-            low_mem_virq_high = -1UL;
-        else
-            low_mem_virq_high = 1UL << (low_mem_virq_th_order + 2);
+        y = pg[i].count_info;
+        do {
+            x = y;
+            if ( (x & PGC_broken) || ((x & PGC_state) != PGC_state_inuse) )
+                return 0;
+        } while ( (y = cmpxchg(&pg[i].count_info, x, PGC_state_inuse)) != x );
     }
+
+    for ( i = 0; i < (1 << order); i++ )
+        retire_heap_page(&pg[i]);
+
+    if ( hc->count[order] >= (HEAP_CACHE_PAGES >> order) )
+        heap_cache_drain(hc, order, heap_cache_batch(order));
+
+    page_list_add(pg, &hc->list[order]);
+    hc->count[order]++;
+
+    perfc_incr(page_free_fast);
+
+    return 1;
 }
 
 /* Allocate 2^@order contiguous pages. */
-static struct page_info *alloc_heap_pages(
+static struct page_info *__alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
     struct domain *d)
 {
-    unsigned int first_node, i, j, zone = 0, nodemask_retry = 0;
+    unsigned int first_node, i, nodemask_retry = 0;
     unsigned int node = (uint8_t)((memflags >> _MEMF_node) - 1);
-    unsigned long request = 1UL << order;
     struct page_info *pg;
     nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
     bool_t need_tlbflush = 0;
     uint32_t tlbflush_timestamp = 0;
+    unsigned long n, scrub_budget = SCRUB_ALLOC_MAX;
 
     if ( node == NUMA_NO_NODE )
     {
@@ -463,7 +1179,13 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
-    spin_lock(&heap_lock);
+    if ( (pg = heap_cache_alloc(node, zone_lo, zone_hi, order,
+                               memflags)) != NULL )
+    {
+        if ( d != NULL )
+            d->last_alloc_node = node;
+        return pg;
+    }
 
     /*
      * TMEM: When available memory is scarce due to tmem absorbing it, allow
@@ -472,7 +1194,7 @@ static struct page_info *alloc_heap_pages(
      * post-dom0-creation-multi-page allocations can be eliminated.
      */
     if ( opt_tmem && ((order == 0) || (order >= 9)) &&
-         (total_avail_pages <= midsize_alloc_zone_pages) &&
+         (total_avail_pages() <= midsize_alloc_zone_pages) &&
          tmem_freeable_pages() )
         goto try_tmem;
 
@@ -483,17 +1205,20 @@ static struct page_info *alloc_heap_pages(
      */
     for ( ; ; )
     {
-        zone = zone_hi;
-        do {
-            /* Check if target node can support the allocation. */
-            if ( !avail[node] || (avail[node][zone] < request) )
-                continue;
-
-            /* Find smallest order which can satisfy the request. */
-            for ( j = order; j <= MAX_ORDER; j++ )
-                if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
-                    goto found;
-        } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+        heap_lock_node(node);
+        if ( (pg = take_heap_block(node, zone_lo, zone_hi, order)) != NULL )
+            goto found;
+        heap_unlock_node(node);
+
+        /* Only dirty memory left here: scrub some of it and try again. */
+        if ( scrub_budget >= (1UL << order) &&
+             (n = scrub_dirty_pages(node, zone_lo, zone_hi,
+                                    min(max(1UL << order, SCRUB_BATCH),
+                                        scrub_budget))) != 0 )
+        {
+            scrub_budget -= min(n, scrub_budget);
+            continue;
+        }
 
         if ( memflags & MEMF_exact_node )
             goto not_found;
@@ -523,236 +1248,124 @@ static struct page_info *alloc_heap_pages(
 
  try_tmem:
     /* Try to free memory from tmem */
-    if ( (pg = tmem_relinquish_pages(order, memflags)) != NULL )
-    {
-        /* reassigning an already allocated anonymous heap page */
-        spin_unlock(&heap_lock);
-        return pg;
-    }
+    spin_lock(&heap_lock);
+    pg = tmem_relinquish_pages(order, memflags);
+    spin_unlock(&heap_lock);
+    /* reassigning an already allocated anonymous heap page */
+    return pg;
 
  not_found:
     /* No suitable memory blocks. Fail the request. */
-    spin_unlock(&heap_lock);
     return NULL;
 
  found: 
-    /* We may have to halve the chunk a number of times. */
-    while ( j != order )
-    {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
-        pg += 1 << j;
-    }
-
-    ASSERT(avail[node][zone] >= request);
-    avail[node][zone] -= request;
-    total_avail_pages -= request;
-    ASSERT(total_avail_pages >= 0);
-
-    check_low_mem_virq();
-
     if ( d != NULL )
         d->last_alloc_node = node;
 
     for ( i = 0; i < (1 << order); i++ )
-    {
-        /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        prepare_alloc_page(&pg[i], &need_tlbflush, &tlbflush_timestamp);
 
-        if ( pg[i].u.free.need_tlbflush &&
-             (pg[i].tlbflush_timestamp <= tlbflush_current_time()) &&
-             (!need_tlbflush ||
-              (pg[i].tlbflush_timestamp > tlbflush_timestamp)) )
-        {
-            need_tlbflush = 1;
-            tlbflush_timestamp = pg[i].tlbflush_timestamp;
-        }
-
-        /* Initialise fields which have other uses for free pages. */
-        pg[i].u.inuse.type_info = 0;
-        page_set_owner(&pg[i], NULL);
-    }
+    heap_unlock_node(node);
 
-    spin_unlock(&heap_lock);
+    check_low_mem_virq();
 
-    if ( need_tlbflush )
-    {
-        cpumask_t mask = cpu_online_map;
-        tlbflush_filter(mask, tlbflush_timestamp);
-        if ( !cpumask_empty(&mask) )
-        {
-            perfc_incr(need_flush_tlb_flush);
-            flush_tlb_mask(&mask);
-        }
-    }
+    flush_alloc_tlb(memflags, need_tlbflush, tlbflush_timestamp);
 
     return pg;
 }
 
-/* Remove any offlined page in the buddy pointed to by head. */
-static int reserve_offlined_page(struct page_info *head)
+static struct page_info *alloc_heap_pages(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
 {
-    unsigned int node = phys_to_nid(page_to_maddr(head));
-    int zone = page_to_zone(head), i, head_order = PFN_ORDER(head), count = 0;
-    struct page_info *cur_head;
-    int cur_order;
-
-    ASSERT(spin_is_locked(&heap_lock));
-
-    cur_head = head;
-
-    page_list_del(head, &heap(node, zone, head_order));
-
-    while ( cur_head < (head + (1 << head_order)) )
-    {
-        struct page_info *pg;
-        int next_order;
-
-        if ( page_state_is(cur_head, offlined) )
-        {
-            cur_head++;
-            continue;
-        }
-
-        next_order = cur_order = 0;
-
-        while ( cur_order < head_order )
-        {
-            next_order = cur_order + 1;
-
-            if ( (cur_head + (1 << next_order)) >= (head + ( 1 << head_order)) )
-                goto merge;
-
-            for ( i = (1 << cur_order), pg = cur_head + (1 << cur_order );
-                  i < (1 << next_order);
-                  i++, pg++ )
-                if ( page_state_is(pg, offlined) )
-                    break;
-            if ( i == ( 1 << next_order) )
-            {
-                cur_order = next_order;
-                continue;
-            }
-            else
-            {
-            merge:
-                /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
-                cur_head += (1 << cur_order);
-                break;
-            }
-        }
-    }
-
-    for ( cur_head = head; cur_head < head + ( 1UL << head_order); cur_head++ )
-    {
-        if ( !page_state_is(cur_head, offlined) )
-            continue;
+    struct page_info *pg;
+#ifdef PERF_COUNTERS
+    s_time_t start = NOW();
+#endif
 
-        avail[node][zone]--;
-        total_avail_pages--;
-        ASSERT(total_avail_pages >= 0);
+    pg = __alloc_heap_pages(zone_lo, zone_hi, order, memflags, d);
 
-        page_list_add_tail(cur_head,
-                           test_bit(_PGC_broken, &cur_head->count_info) ?
-                           &page_broken_list : &page_offlined_list);
+    /* Pages parked in our own cache may be what it takes to succeed. */
+    if ( unlikely(pg == NULL) && heap_cache_enabled &&
+         heap_cache_drain_all(&this_cpu(heap_cache)) )
+        pg = __alloc_heap_pages(zone_lo, zone_hi, order, memflags, d);
 
-        count++;
-    }
+#ifdef PERF_COUNTERS
+    perfc_incra(page_alloc_latency, ns_bucket(NOW() - start));
+#endif
 
-    return count;
+    return pg;
 }
 
-/* Free 2^@order set of pages. */
+/* Free 2^@order set of pages, leaving them to be scrubbed if @need_scrub. */
 static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
 {
-    unsigned long mask, mfn = page_to_mfn(pg);
-    unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
-    unsigned int zone = page_to_zone(pg);
+    unsigned int i, node = phys_to_nid(page_to_maddr(pg));
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
 
-    spin_lock(&heap_lock);
+    if ( !need_scrub && heap_cache_free(pg, order) )
+        return;
 
     for ( i = 0; i < (1 << order); i++ )
-    {
-        /*
-         * Cannot assume that count_info == 0, as there are some corner cases
-         * where it isn't the case and yet it isn't a bug:
-         *  1. page_get_owner() is NULL
-         *  2. page_get_owner() is a domain that was never accessible by
-         *     its domid (e.g., failed to fully construct the domain).
-         *  3. page was never addressable by the guest (e.g., it's an
-         *     auto-translate-physmap guest and the page was never included
-         *     in its pseudophysical address space).
-         * In all the above cases there can be no guest mappings of this page.
-         */
-        ASSERT(!page_state_is(&pg[i], offlined));
-        pg[i].count_info =
-            ((pg[i].count_info & PGC_broken) |
-             (page_state_is(&pg[i], offlining)
-              ? PGC_state_offlined : PGC_state_free));
-        if ( page_state_is(&pg[i], offlined) )
-            tainted = 1;
+        retire_heap_page(&pg[i]);
 
-        /* If a page has no owner it will need no safety TLB flush. */
-        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
-        if ( pg[i].u.free.need_tlbflush )
-            pg[i].tlbflush_timestamp = tlbflush_current_time();
-
-        /* This page is not a guest frame any more. */
-        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
-        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
-    }
-
-    avail[node][zone] += 1 << order;
-    total_avail_pages += 1 << order;
+    heap_lock_node(node);
+    if ( need_scrub )
+        add_dirty_block(pg, order);
+    else
+        merge_free_block(pg, order);
+    heap_unlock_node(node);
+}
 
-    if ( opt_tmem )
-        midsize_alloc_zone_pages = max(
-            midsize_alloc_zone_pages, total_avail_pages / MIDSIZE_ALLOC_FRAC);
+static int cpu_heap_cache_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu, order;
+    struct heap_cache *hc = &per_cpu(heap_cache, cpu);
 
-    /* Merge chunks as far as possible. */
-    while ( order < MAX_ORDER )
+    switch ( action )
     {
-        mask = 1UL << order;
-
-        if ( (page_to_mfn(pg) & mask) )
-        {
-            /* Merge with predecessor block? */
-            if ( !mfn_valid(page_to_mfn(pg-mask)) ||
-                 !page_state_is(pg-mask, free) ||
-                 (PFN_ORDER(pg-mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg-mask)) != node) )
-                break;
-            pg -= mask;
-            page_list_del(pg, &heap(node, zone, order));
-        }
-        else
+    case CPU_UP_PREPARE:
+        for ( order = 0; order <= HEAP_CACHE_MAX_ORDER; order++ )
         {
-            /* Merge with successor block? */
-            if ( !mfn_valid(page_to_mfn(pg+mask)) ||
-                 !page_state_is(pg+mask, free) ||
-                 (PFN_ORDER(pg+mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg+mask)) != node) )
-                break;
-            page_list_del(pg + mask, &heap(node, zone, order));
+            INIT_PAGE_LIST_HEAD(&hc->list[order]);
+            hc->count[order] = 0;
         }
-
-        order++;
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        heap_cache_drain_all(hc);
+        break;
+    default:
+        break;
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    return NOTIFY_DONE;
+}
 
-    if ( tainted )
-        reserve_offlined_page(pg);
+static struct notifier_block cpu_heap_cache_nfb = {
+    .notifier_call = cpu_heap_cache_callback
+};
 
-    spin_unlock(&heap_lock);
+static int __init heap_cache_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    cpu_heap_cache_callback(&cpu_heap_cache_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_heap_cache_nfb);
+
+    return 0;
+}
+presmp_initcall(heap_cache_init);
+
+/* Called once boot scrubbing is done, so no unscrubbed page gets cached. */
+static void __init heap_cache_enable(void)
+{
+    heap_cache_enabled = opt_heap_cache && !opt_tmem;
 }
 
 
@@ -820,6 +1433,7 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
     unsigned long old_info = 0;
     struct domain *owner;
     int ret = 0;
+    unsigned int node;
     struct page_info *pg;
 
     if ( !mfn_valid(mfn) )
@@ -862,6 +1476,8 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
         return 0;
     }
 
+    node = phys_to_nid(page_to_maddr(pg));
+    heap_lock_node(node);
     spin_lock(&heap_lock);
 
     old_info = mark_page_offline(pg, broken);
@@ -906,12 +1522,14 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
         *status |= PG_OFFLINE_BROKEN;
 
     spin_unlock(&heap_lock);
+    heap_unlock_node(node);
 
     return ret;
 
 pod_replace:
     put_page(pg);
     spin_unlock(&heap_lock);
+    heap_unlock_node(node);
 
     p2m_pod_offline_or_broken_replace(pg);
     *status = PG_OFFLINE_OFFLINED;
@@ -931,6 +1549,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
 {
     unsigned long x, nx, y;
     struct page_info *pg;
+    unsigned int node;
     int ret;
 
     if ( !mfn_valid(mfn) )
@@ -940,7 +1559,9 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     }
 
     pg = mfn_to_page(mfn);
+    node = phys_to_nid(page_to_maddr(pg));
 
+    heap_lock_node(node);
     spin_lock(&heap_lock);
 
     y = pg->count_info;
@@ -973,9 +1594,10 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     } while ( (y = cmpxchg(&pg->count_info, x, nx)) != x );
 
     spin_unlock(&heap_lock);
+    heap_unlock_node(node);
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 0);
 
     return ret;
 }
@@ -991,10 +1613,11 @@ int query_page_offline(unsigned long mfn, uint32_t *status)
     }
 
     *status = 0;
-    spin_lock(&heap_lock);
-
     pg = mfn_to_page(mfn);
 
+    heap_lock_node(phys_to_nid(page_to_maddr(pg)));
+    spin_lock(&heap_lock);
+
     if ( page_state_is(pg, offlining) )
         *status |= PG_OFFLINE_STATUS_OFFLINE_PENDING;
     if ( pg->count_info & PGC_broken )
@@ -1003,6 +1626,7 @@ int query_page_offline(unsigned long mfn, uint32_t *status)
         *status |= PG_OFFLINE_STATUS_OFFLINED;
 
     spin_unlock(&heap_lock);
+    heap_unlock_node(phys_to_nid(page_to_maddr(pg)));
 
     return 0;
 }
@@ -1044,7 +1668,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, 0);
     }
 }
 
@@ -1071,7 +1695,7 @@ static unsigned long avail_heap_pages(
 
 unsigned long total_free_pages(void)
 {
-    return total_avail_pages - midsize_alloc_zone_pages;
+    return total_avail_pages() - midsize_alloc_zone_pages;
 }
 
 void __init end_boot_allocator(void)
@@ -1117,48 +1741,109 @@ void __init end_boot_allocator(void)
 }
 
 /*
- * Scrub all unallocated pages in all heap zones. This function is more
- * convoluted than appears necessary because we do not want to continuously
- * hold the lock while scrubbing very large memory areas.
+ * Boot scrubbing deals free RAM out in chunks to all online CPUs, each of
+ * which takes chunks of its own node first and then helps with whatever is
+ * left, so that nodes without CPUs get scrubbed too. Every round runs under
+ * stop_machine_run(), with interrupts off everywhere, so chunks are kept
+ * small.
  */
-void __init scrub_heap_pages(void)
+#define BOOTSCRUB_CHUNK_PAGES ((32UL << 20) >> PAGE_SHIFT)
+
+static unsigned long *__initdata bootscrub_claimed;
+static u8 *__initdata bootscrub_node;
+static unsigned int __initdata bootscrub_chunks;
+
+static int __init smp_scrub_heap_pages(void *unused)
 {
-    unsigned long mfn;
+    unsigned int node = cpu_to_node(smp_processor_id()), chunk;
+    unsigned long mfn, end;
     struct page_info *pg;
 
-    if ( !opt_bootscrub )
-        return;
+    for ( chunk = find_first_zero_bit(bootscrub_claimed, bootscrub_chunks);
+          chunk < bootscrub_chunks;
+          chunk = find_next_zero_bit(bootscrub_claimed, bootscrub_chunks,
+                                     chunk + 1) )
+        if ( (bootscrub_node[chunk] == node) &&
+             !test_and_set_bit(chunk, bootscrub_claimed) )
+            goto found;
+
+    for ( chunk = find_first_zero_bit(bootscrub_claimed, bootscrub_chunks);
+          chunk < bootscrub_chunks;
+          chunk = find_next_zero_bit(bootscrub_claimed, bootscrub_chunks,
+                                     chunk + 1) )
+        if ( !test_and_set_bit(chunk, bootscrub_claimed) )
+            goto found;
 
-    printk("Scrubbing Free RAM: ");
+    return 0;
 
-    for ( mfn = first_valid_mfn; mfn < max_page; mfn++ )
-    {
-        process_pending_softirqs();
+ found:
+    mfn = first_valid_mfn + (unsigned long)chunk * BOOTSCRUB_CHUNK_PAGES;
+    end = min(mfn + BOOTSCRUB_CHUNK_PAGES, max_page);
 
+    for ( ; mfn < end; mfn++ )
+    {
         pg = mfn_to_page(mfn);
 
-        /* Quick lock-free check. */
-        if ( !mfn_valid(mfn) || !page_state_is(pg, free) )
-            continue;
+        /*
+         * No locking: stop_machine_run() has every online CPU in here with
+         * interrupts off, so nothing can allocate or free pages under our
+         * feet.
+         */
+        if ( mfn_valid(mfn) && page_state_is(pg, free) )
+            scrub_one_page(pg);
+    }
 
-        /* Every 100MB, print a progress dot. */
-        if ( (mfn % ((100*1024*1024)/PAGE_SIZE)) == 0 )
-            printk(".");
+    return 0;
+}
 
-        spin_lock(&heap_lock);
+/* Scrub all unallocated pages in all heap zones, using every online CPU. */
+void __init scrub_heap_pages(void)
+{
+    unsigned long mfn;
+    unsigned int chunk;
 
-        /* Re-check page status with lock held. */
-        if ( page_state_is(pg, free) )
-            scrub_one_page(pg);
+    if ( !opt_bootscrub )
+    {
+        heap_cache_enable();
+        return;
+    }
 
-        spin_unlock(&heap_lock);
+    bootscrub_chunks = DIV_ROUND_UP(max_page - first_valid_mfn,
+                                    BOOTSCRUB_CHUNK_PAGES);
+    bootscrub_claimed = xzalloc_array(unsigned long,
+                                      BITS_TO_LONGS(bootscrub_chunks));
+    bootscrub_node = xmalloc_array(u8, bootscrub_chunks);
+    BUG_ON(!bootscrub_claimed || !bootscrub_node);
+
+    for ( chunk = 0; chunk < bootscrub_chunks; chunk++ )
+    {
+        mfn = first_valid_mfn + (unsigned long)chunk * BOOTSCRUB_CHUNK_PAGES;
+        bootscrub_node[chunk] = mfn_valid(mfn) ?
+            phys_to_nid(pfn_to_paddr(mfn)) : NUMA_NO_NODE;
+    }
+
+    printk("Scrubbing Free RAM on %u CPUs: ", num_online_cpus());
+
+    /* Each round scrubs one chunk per CPU; softirqs get to run in between. */
+    while ( find_first_zero_bit(bootscrub_claimed, bootscrub_chunks) <
+            bootscrub_chunks )
+    {
+        if ( stop_machine_run(smp_scrub_heap_pages, NULL, NR_CPUS) )
+            BUG();
+        process_pending_softirqs();
+        printk(".");
     }
 
+    xfree(bootscrub_node);
+    xfree(bootscrub_claimed);
+
     printk("done.\n");
 
     /* Now that the heap is initialized, run checks and set bounds
      * for the low mem virq algorithm. */
     setup_low_mem_virq();
+
+    heap_cache_enable();
 }
 
 
@@ -1217,7 +1902,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1271,7 +1956,7 @@ void free_xenheap_pages(void *v, unsigned int order)
     for ( i = 0; i < (1u << order); i++ )
         pg[i].count_info &= ~PGC_xen_heap;
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 0);
 }
 
 #endif
@@ -1372,7 +2057,7 @@ struct page_info *alloc_domheap_pages(
 
     if ( (d != NULL) && assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1418,25 +2103,22 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
         /*
          * Normally we expect a domain to clear pages before freeing them, if 
          * it cares about the secrecy of their contents. However, after a 
-         * domain has died we assume responsibility for erasure.
+         * domain has died we assume responsibility for erasure, which is
+         * left to idle CPUs or to whoever allocates the pages next.
          */
-        if ( unlikely(d->is_dying) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, d->is_dying != DOMDYING_alive);
     }
     else if ( unlikely(d == dom_cow) )
     {
         ASSERT(order == 0); 
         scrub_one_page(pg);
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 0);
         drop_dom_ref = 0;
     }
     else
     {
         /* Freeing anonymous domain-heap pages. */
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         drop_dom_ref = 0;
     }
 
@@ -1534,6 +2216,7 @@ static void dump_heap(unsigned char key)
 {
     s_time_t      now = NOW();
     int           i, j;
+    unsigned int  cpu;
 
     printk("'%c' pressed -> dumping heap info (now-0x%X:%08X)\n", key,
            (u32)(now>>32), (u32)now);
@@ -1545,7 +2228,17 @@ static void dump_heap(unsigned char key)
         for ( j = 0; j < NR_ZONES; j++ )
             printk("heap[node=%d][zone=%d] -> %lu pages\n",
                    i, j, avail[i][j]);
+        printk("heap[node=%d] -> %lu pages to scrub\n",
+               i, heap_nodes[i].dirty_pages);
     }
+
+    if ( !heap_cache_enabled )
+        return;
+    for_each_online_cpu ( cpu )
+        for ( j = 0; j <= HEAP_CACHE_MAX_ORDER; j++ )
+            if ( per_cpu(heap_cache, cpu).count[j] )
+                printk("heap_cache[cpu=%u][order=%d] -> %u blocks\n",
+                       cpu, j, per_cpu(heap_cache, cpu).count[j]);
 }
 
 static struct keyhandler dump_heap_keyhandler = {
@@ -93,6 +93,7 @@ struct hvm_domain {
 
     bool_t                 hap_enabled;
     bool_t                 mem_sharing_enabled;
+    bool_t                 mem_sharing_scan;
     bool_t                 qemu_mapcache_invalidate;
     bool_t                 is_s3_suspended;
 
@@ -29,6 +29,7 @@
 
 #include <xen/config.h>
 #include <xen/paging.h>
+#include <xen/tasklet.h>
 #include <asm/mem_sharing.h>
 #include <asm/page.h>    /* for pagetable_t */
 
@@ -276,6 +277,8 @@ struct p2m_domain {
         unsigned int     last_populated_index;
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
+        struct tasklet   reclaim_tasklet; /* Tops the cache up ahead of    *
+                                           * demand.                       */
     } pod;
     union {
         struct ept_data ept;
@@ -515,6 +518,9 @@ int clear_mmio_p2m_entry(struct domain *d, unsigned long gfn);
  * Populate-on-demand
  */
 
+/* Initialise the populate-on-demand state of a p2m */
+void p2m_pod_init(struct p2m_domain *p2m);
+
 /* Dump PoD information about the domain */
 void p2m_pod_dump_data(struct domain *d);
 
@@ -553,6 +559,8 @@ int set_shared_p2m_entry(struct domain *d, unsigned long gfn, mfn_t mfn);
 int p2m_mem_paging_nominate(struct domain *d, unsigned long gfn);
 /* Evict a frame */
 int p2m_mem_paging_evict(struct domain *d, unsigned long gfn);
+/* Mark an unpopulated gfn as paged out */
+int p2m_mem_paging_absent(struct domain *d, unsigned long gfn);
 /* Tell xenpaging to drop a paged out frame */
 void p2m_mem_paging_drop_page(struct domain *d, unsigned long gfn, 
                                 p2m_type_t p2mt);
@@ -136,4 +136,8 @@ PERFCOUNTER(realmode_exits,      "vmexits from realmode")
 
 PERFCOUNTER(pauseloop_exits, "vmexits from Pause-Loop Detection")
 
+PERFCOUNTER(mshr_scan_pages,    "mem_sharing: pages hashed by scanner")
+PERFCOUNTER(mshr_scan_merges,   "mem_sharing: pages merged by scanner")
+PERFCOUNTER(mshr_scan_mismatch, "mem_sharing: scanner hash false matches")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
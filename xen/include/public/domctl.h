@@ -772,14 +772,17 @@ DEFINE_XEN_GUEST_HANDLE(xen_domctl_mem_event_op_t);
  * Memory sharing operations
  */
 /* XEN_DOMCTL_mem_sharing_op.
- * The CONTROL sub-domctl is used for bringup/teardown. */
+ * The CONTROL sub-domctl is used for bringup/teardown.
+ * The SCAN sub-domctl has Xen look for pages with identical contents in
+ * the domain and share them automatically; sharing must be enabled. */
 #define XEN_DOMCTL_MEM_SHARING_CONTROL          0
+#define XEN_DOMCTL_MEM_SHARING_SCAN             1
 
 struct xen_domctl_mem_sharing_op {
     uint8_t op; /* XEN_DOMCTL_MEM_SHARING_* */
 
     union {
-        uint8_t enable;                   /* CONTROL */
+        uint8_t enable;                   /* CONTROL, SCAN */
     } u;
 };
 typedef struct xen_domctl_mem_sharing_op xen_domctl_mem_sharing_op_t;
@@ -354,6 +354,8 @@ typedef struct xen_pod_target xen_pod_target_t;
 #define XENMEM_paging_op_nominate           0
 #define XENMEM_paging_op_evict              1
 #define XENMEM_paging_op_prep               2
+#define XENMEM_paging_op_absent             3
+#define XENMEM_paging_op_absent_range       4
 
 #define XENMEM_access_op                    21
 #define XENMEM_access_op_resume             0
@@ -364,6 +366,7 @@ struct xen_mem_event_op {
     
 
     /* PAGING_PREP IN: buffer to immediately fill page in */
+    /* PAGING_ABSENT_RANGE IN/OUT: number of gfns from gfn on, left to do */
     uint64_aligned_t    buffer;
     /* Other OPs */
     uint64_aligned_t    gfn;           /* IN:  gfn of page being operated on */
@@ -53,4 +53,14 @@ PERFCOUNTER(vcpu_hot,               "csched: vcpu_hot")
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+PERFCOUNTER(page_alloc_fast,        "page_alloc: allocs from cpu cache")
+PERFCOUNTER(page_free_fast,         "page_alloc: frees to cpu cache")
+PERFCOUNTER(heap_cache_refill,      "page_alloc: cpu cache refills")
+PERFCOUNTER(heap_cache_drain,       "page_alloc: cpu cache drains")
+PERFCOUNTER(scrub_idle_pages,       "page_alloc: pages scrubbed when idle")
+PERFCOUNTER(scrub_alloc_pages,      "page_alloc: pages scrubbed on alloc")
+PERFCOUNTER(heap_lock_contended,    "page_alloc: heap lock contended")
+PERFCOUNTER_ARRAY(heap_lock_hold,   "page_alloc: heap lock hold (2^n ns)", 20)
+PERFCOUNTER_ARRAY(page_alloc_latency, "page_alloc: alloc latency (2^n ns)", 20)
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */